@@ -63,6 +63,12 @@ static int coroutine_fn raw_co_discard(BlockDriverState *bs,
     return bdrv_co_discard(bs->file, sector_num, nb_sectors);
 }
 
+static int coroutine_fn raw_co_write_zeroes(BlockDriverState *bs,
+                                            int64_t sector_num, int nb_sectors)
+{
+    return bdrv_co_write_zeroes(bs->file, sector_num, nb_sectors);
+}
+
 static int raw_is_inserted(BlockDriverState *bs)
 {
     return bdrv_is_inserted(bs->file);
@@ -129,6 +135,7 @@ static BlockDriver bdrv_raw = {
     .bdrv_co_writev         = raw_co_writev,
     .bdrv_co_is_allocated   = raw_co_is_allocated,
     .bdrv_co_discard        = raw_co_discard,
+    .bdrv_co_write_zeroes   = raw_co_write_zeroes,
 
     .bdrv_probe         = raw_probe,
     .bdrv_getlength     = raw_getlength,
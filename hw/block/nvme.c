@@ -20,6 +20,11 @@
  *      -drive file=<file>,if=none,id=<drive_id>
  *      -device nvme,drive=<drive_id>,serial=<serial>,id=<id[optional]>
  *
+ * or, to give every namespace a backing drive of its own:
+ *      -device nvme,serial=<serial>,id=<id>
+ *      -drive file=<file>,if=none,id=<drive_id>
+ *      -device nvme-ns,drive=<drive_id>,bus=<id>.0,nsid=<int[optional]>
+ *
  * Advanced optional options:
  *
  *  namespaces=<int> : Namespaces to make out of the backing storage, Default:1
@@ -46,6 +51,26 @@
  *  meta=<int>       : Meta-data size, Default:0
  *  num_msi=<int>    : Number of msi vectors to allocate (power of 2), Default:32 
  *  num_msix=<int>   : Number of msix vectors to allocate, Default, number of queues 
+ *  ioeventfd=<int>  : Use ioeventfd for shadowed SQ doorbells, Default:1
+ *  sgl=<int>        : Scatter gather list data pointers supported, Default:1
+ *  statefile=<file> : Keep the namespace block maps here, Default:none
+ *  cmb_size_mb=<int>: Controller memory buffer size in MB (power of 2), Default:0
+ *  flash_model=<int>: Time reads and writes with the flash model, Default:0
+ *  flash_channels=<int>: Flash channels, Default:8
+ *  flash_dies=<int>  : Dies per channel, Default:4
+ *  flash_page_kb=<int>: Flash page size in KB, Default:16
+ *  flash_ppb=<int>   : Pages per erase block, Default:256
+ *  flash_read_us=<int>: Page read latency, Default:50
+ *  flash_prog_us=<int>: Page program latency, Default:500
+ *  flash_erase_us=<int>: Block erase latency, Default:3000
+ *  flash_chan_mbps=<int>: Channel transfer rate in MB/s, Default:400
+ *  flash_wbuf_kb=<int>: Write buffer size in KB, Default:4096
+ *  flash_op=<int>    : Over-provisioning in percent, Default:7
+ *  zoned=<int>       : Make the namespaces zoned, Default:0
+ *  zone_size_mb=<int>: Zone size in MB, Default:128
+ *  zone_max_open=<int>: Open zones per namespace, 0 for any, Default:0
+ *  zone_max_active=<int>: Active zones per namespace, 0 for any, Default:0
+ *  zasl=<int>        : Zone append size limit, as mdts, Default:0
  *
  * The logical block formats all start at 512 byte blocks and double for the
  * next index. If meta-data is non-zero, half the logical block formats will
@@ -53,6 +78,93 @@
  * with the meta-data size set accordingly. Multiple meta-data sizes are not
  * supported.
  *
+ * When the host configures a doorbell buffer (Doorbell Buffer Config, OACS
+ * bit 8), I/O queue tails and heads are read from the shadow doorbells in
+ * guest memory and the device publishes its EventIdx values there, so the
+ * guest only rings the real doorbell when the device has gone idle. With
+ * KVM, shadowed SQ doorbell registers are then backed by ioeventfds.
+ *
+ * With sgl=1, I/O commands may describe their data with an SGL instead of
+ * PRPs (PSDT 01b). Data Block, Segment and Last Segment descriptors are
+ * accepted everywhere, Bit Bucket descriptors only for reads of namespaces
+ * without meta-data.
+ *
+ * I/O submission queues are served by one arbiter per controller. With
+ * weighted round robin selected in CC.AMS, the queue priority given at
+ * Create I/O SQ picks the arbitration class: urgent queues are always served
+ * before high, medium and low priority queues, which share the remaining
+ * fetches in proportion to the weights from the Arbitration feature. Each
+ * queue gets at most one arbitration burst per turn.
+ *
+ * The controller tracks which blocks were written and which were marked
+ * uncorrectable as sparse extent sets, so memory use follows how fragmented
+ * the namespace is rather than its size. With statefile set, the maps are
+ * saved on controller shutdown and when QEMU exits, and reloaded at startup,
+ * so protection information checks keep working across restarts.
+ *
+ * Dataset Management deallocate merges the ranges it is given and erases
+ * them, meta-data included, in a coroutine on the namespace's drive. Blocks
+ * are only marked deallocated once that succeeded; from then on they read
+ * back as zeroes (DLFEAT) without the drive being read, until written.
+ *
+ * Write Zeroes is passed down as bdrv_co_write_zeroes, so image formats and
+ * raw files that can zero a range without writing data (qcow2 and qed zero
+ * clusters, fallocate on raw files) do so; others get zeroed buffers written
+ * by the block layer.
+ *
+ * Format NVM with a secure erase setting zeroes (SES=1) or discards (SES=2)
+ * the namespace in the background and completes when done; I/O to the
+ * namespaces being formatted fails with Format In Progress meanwhile, while
+ * other namespaces keep running. Vendor log page 0xc1 reports its progress.
+ *
+ * Physically contiguous PRP entries are merged into one scatter-gather
+ * element. Vendor log page 0xc0 reports how many PRP entries were mapped,
+ * how many elements they became, and the ratio of the two in hundredths.
+ *
+ * Each nvme-ns device adds one namespace sized to its drive, so namespaces
+ * may use different image formats and the drive's own I/O throttling
+ * settings. Namespace IDs must be contiguous: nsid defaults to the next free
+ * one, after any namespaces carved out of the controller's drive (if it has
+ * one). The logical block formats are the controller's, as described above.
+ *
+ * Every completed read, write and flush is timed from the moment it is
+ * fetched to the moment its completion entry is posted, and counted in log2
+ * latency histograms per submission queue, per namespace and for the whole
+ * controller, along with doorbell writes, interrupts and the queue depth
+ * seen at each fetch. The guest reads them in vendor log page 0xc2 (for the
+ * namespace given in the command, or the controller if none is), and the
+ * query-nvme-stats QMP command returns them for every controller.
+ *
+ * With cmb_size_mb set, BAR 2 exposes a controller memory buffer of that
+ * size. The host may place submission queues, PRP and SGL lists and data
+ * buffers there; the controller reads commands and lists straight out of it
+ * instead of going through DMA translation.
+ *
+ * With flash_model=1, reads and writes complete at the time a simple NAND
+ * model says they would rather than as soon as the backing drive is done.
+ * Flash pages are striped over channels and dies that each serve one
+ * operation at a time; writes are acknowledged once in the write buffer,
+ * and wait for a slot when it is full; flush waits for the buffer to drain.
+ * Once every die has been written over, filling an erase block costs a
+ * garbage collection pass of reading and programming its valid pages and
+ * erasing it, with the valid share taken from how much of the namespace is
+ * in use. Completions are held back until their modeled finish time, so
+ * queue depth and tail latency behave like the modeled drive's.
+ *
+ * The controller can be live migrated. Queues, feature values, the error
+ * log and outstanding Asynchronous Event Requests are part of the device
+ * state, as are completions still waiting for room in their CQ; other
+ * commands finish before the VM stops. The block maps are streamed while
+ * the guest runs, and only the ranges it changed since are resent once it
+ * has stopped, so they add little to downtime.
+ *
+ * With zoned=1, every namespace is split into zones that must be written
+ * sequentially at their write pointer, with Zone Management Send and Receive
+ * to open, close, finish, reset and report them and Zone Append to write
+ * wherever the write pointer is. The zone table holds one write pointer and
+ * state per zone; it is kept in statefile next to the block maps and is part
+ * of the migrated device state. Zones left open come back closed.
+ *
  * Parameters will be verified against conflicting capabilities and
  * attributes and fail to load if there is a conflict or a configuration
  * the emulated device is unable to handle.
@@ -65,9 +177,20 @@
 #include <hw/pci/msi.h>
 #include <hw/pci/pci.h>
 #include <qemu/bitops.h>
-#include <qemu/bitmap.h>
+#include <qemu/host-utils.h>
+#include <qemu/crc-t10dif.h>
+#include <qemu/event_notifier.h>
+#include <qemu/iov.h>
+#include <qemu/error-report.h>
+#include <qemu/main-loop.h>
+#include <qemu/range-set.h>
+#include <qemu/thread.h>
+#include <block/coroutine.h>
+#include <sysemu/kvm.h>
+#include <sysemu/sysemu.h>
 
 #include "nvme.h"
+#include "qmp-commands.h"
 
 #define NVME_MAX_QS PCI_MSIX_FLAGS_QSIZE
 #define NVME_MAX_QUEUE_ENTRIES  0xffff
@@ -79,8 +202,52 @@
 #define NVME_SPARE_THRESHOLD    20
 #define NVME_TEMPERATURE        0x143
 #define NVME_OP_ABORTED         0xff
+#define NVME_SGL_SEGMENT_DESCRS 256
+#define NVME_BIT_BUCKET_SIZE    0x10000
+#define NVME_ARB_BUDGET         1024
+#define NVME_DISCARD_SECTORS    (1 << 30)
+#define NVME_ZERO_SECTORS       (4 << (20 - BDRV_SECTOR_BITS))
+#define NVME_CMB_BIR            2
+#define NVME_MIG_CHUNK          (1 << 16)
+#define NVME_CMP_CHUNK          (1 << 16)
+
+static void nvme_sq_notifier(EventNotifier *e);
+static void nvme_del_sq_done(NvmeCtrl *n, NvmeSQueue *sq);
+
+static QLIST_HEAD(, NvmeCtrl) nvme_ctrls = QLIST_HEAD_INITIALIZER(nvme_ctrls);
+
+/* Queue the SQ for the arbiter unless it is already waiting its turn */
+static void nvme_kick_sq(NvmeSQueue *sq)
+{
+    NvmeCtrl *n = sq->ctrl;
+
+    if (sq->del_req) {
+        /* being deleted: nothing more is fetched */
+        return;
+    }
+    if (!sq->arb_queued) {
+        QTAILQ_INSERT_TAIL(&n->arb_list[sq->arb_class], sq, arb_entry);
+        sq->arb_queued = 1;
+    }
+    qemu_bh_schedule(n->arb_bh);
+}
+
+static void nvme_arb_dequeue(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    if (sq->arb_queued) {
+        QTAILQ_REMOVE(&n->arb_list[sq->arb_class], sq, arb_entry);
+        sq->arb_queued = 0;
+    }
+}
+
+static void nvme_arb_reset_credits(NvmeCtrl *n)
+{
+    uint32_t arb = n->features.arbitration;
 
-static void nvme_process_sq(void *opaque);
+    n->arb_credit[NVME_ARB_HIGH] = NVME_ARB_HPW(arb) + 1;
+    n->arb_credit[NVME_ARB_MEDIUM] = NVME_ARB_MPW(arb) + 1;
+    n->arb_credit[NVME_ARB_LOW] = NVME_ARB_LPW(arb) + 1;
+}
 
 static int nvme_check_sqid(NvmeCtrl *n, uint16_t sqid)
 {
@@ -119,6 +286,8 @@ static uint8_t nvme_sq_empty(NvmeSQueue *sq)
 static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
 {
     if (cq->irq_enabled) {
+        cq->interrupts++;
+        n->stats.interrupts++;
         if (msix_enabled(&(n->parent_obj))) {
             msix_notify(&(n->parent_obj), cq->vector);
         } else if (msi_enabled(&(n->parent_obj))) {
@@ -131,6 +300,105 @@ static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
     }
 }
 
+static bool nvme_addr_is_cmb(NvmeCtrl *n, hwaddr addr, hwaddr size)
+{
+    hwaddr lo = n->parent_obj.io_regions[NVME_CMB_BIR].addr;
+    hwaddr cmb_size = (hwaddr)n->cmb_size_mb << 20;
+
+    return n->cmbuf && lo != PCI_BAR_UNMAPPED && addr >= lo &&
+        addr - lo < cmb_size && size <= cmb_size - (addr - lo);
+}
+
+/* Reads from the controller memory buffer skip DMA translation entirely */
+static void nvme_addr_read(NvmeCtrl *n, hwaddr addr, void *buf, int size)
+{
+    if (nvme_addr_is_cmb(n, addr, size)) {
+        memcpy(buf, n->cmbuf + addr - n->parent_obj.io_regions[
+            NVME_CMB_BIR].addr, size);
+        return;
+    }
+    pci_dma_read(&n->parent_obj, addr, buf, size);
+}
+
+static void nvme_update_sq_tail(NvmeSQueue *sq)
+{
+    uint32_t tail;
+
+    pci_dma_read(&sq->ctrl->parent_obj, sq->db_addr, &tail, sizeof(tail));
+    tail = le32_to_cpu(tail);
+    if (tail < sq->size) {
+        sq->tail = tail;
+    }
+}
+
+static void nvme_update_sq_eventidx(NvmeSQueue *sq)
+{
+    uint32_t ei = cpu_to_le32(sq->tail);
+
+    pci_dma_write(&sq->ctrl->parent_obj, sq->ei_addr, &ei, sizeof(ei));
+}
+
+static void nvme_update_cq_head(NvmeCQueue *cq)
+{
+    uint32_t head;
+
+    pci_dma_read(&cq->ctrl->parent_obj, cq->db_addr, &head, sizeof(head));
+    head = le32_to_cpu(head);
+    if (head < cq->size) {
+        cq->head = head;
+    }
+}
+
+static void nvme_update_cq_eventidx(NvmeCQueue *cq)
+{
+    uint32_t ei = cpu_to_le32(cq->head);
+
+    pci_dma_write(&cq->ctrl->parent_obj, cq->ei_addr, &ei, sizeof(ei));
+}
+
+static hwaddr nvme_sq_db_offset(NvmeCtrl *n, uint16_t sqid)
+{
+    return (2 * sqid) << (2 + n->db_stride);
+}
+
+static hwaddr nvme_cq_db_offset(NvmeCtrl *n, uint16_t cqid)
+{
+    return (2 * cqid + 1) << (2 + n->db_stride);
+}
+
+static void nvme_start_sq_ioeventfd(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    if (!n->ioeventfd || sq->ioeventfd_enabled || !kvm_has_many_ioeventfds()) {
+        return;
+    }
+    memory_region_add_eventfd(&n->iomem, 0x1000 + nvme_sq_db_offset(n,
+        sq->sqid), 4, false, 0, &sq->notifier);
+    sq->ioeventfd_enabled = 1;
+}
+
+static void nvme_stop_sq_ioeventfd(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    if (!sq->ioeventfd_enabled) {
+        return;
+    }
+    memory_region_del_eventfd(&n->iomem, 0x1000 + nvme_sq_db_offset(n,
+        sq->sqid), 4, false, 0, &sq->notifier);
+    sq->ioeventfd_enabled = 0;
+}
+
+static void nvme_sq_init_dbbuf(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    sq->db_addr = n->dbbuf_dbs + nvme_sq_db_offset(n, sq->sqid);
+    sq->ei_addr = n->dbbuf_eis + nvme_sq_db_offset(n, sq->sqid);
+    nvme_start_sq_ioeventfd(n, sq);
+}
+
+static void nvme_cq_init_dbbuf(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    cq->db_addr = n->dbbuf_dbs + nvme_cq_db_offset(n, cq->cqid);
+    cq->ei_addr = n->dbbuf_eis + nvme_cq_db_offset(n, cq->cqid);
+}
+
 static uint64_t *nvme_setup_discontig(NvmeCtrl *n, uint64_t prp_addr,
     uint16_t queue_depth, uint16_t entry_size)
 {
@@ -139,18 +407,24 @@ static uint64_t *nvme_setup_discontig(NvmeCtrl *n, uint64_t prp_addr,
     uint64_t prp[prps_per_page];
     uint16_t total_prps = DIV_ROUND_UP(queue_depth * entry_size, n->page_size);
     uint64_t *prp_list = g_malloc0(total_prps * sizeof(*prp_list));
+    uint16_t idx = prps_per_page;
 
     for (i = 0; i < total_prps; i++) {
-        if (i % prps_per_page == 0 && i < total_prps - 1) {
+        /* the last entry of a full list page chains to the next one */
+        if (idx == prps_per_page - 1 && i < total_prps - 1) {
+            prp_addr = le64_to_cpu(prp[idx]);
+            idx = prps_per_page;
+        }
+        if (idx == prps_per_page) {
             if (!prp_addr || prp_addr & (n->page_size - 1)) {
                 g_free(prp_list);
                 return NULL;
             }
-            pci_dma_write(&n->parent_obj, prp_addr, (uint8_t *)&prp,
+            pci_dma_read(&n->parent_obj, prp_addr, (uint8_t *)&prp,
                 sizeof(prp));
-            prp_addr = le64_to_cpu(prp[prps_per_page - 1]);
+            idx = 0;
         }
-        prp_list[i] = le64_to_cpu(prp[i % prps_per_page]);
+        prp_list[i] = le64_to_cpu(prp[idx++]);
         if (!prp_list[i] || prp_list[i] & (n->page_size - 1)) {
             g_free(prp_list);
             return NULL;
@@ -169,12 +443,39 @@ static hwaddr nvme_discontig(uint64_t *dma_addr, uint16_t page_size,
     return dma_addr[prp_index] + index_in_prp * entry_size;
 }
 
+/*
+ * Append to a scatter-gather list, extending the last element instead when
+ * the new range continues it in guest physical memory.
+ */
+static void nvme_sglist_add(QEMUSGList *qsg, dma_addr_t base, dma_addr_t len)
+{
+    ScatterGatherEntry *last;
+
+    if (qsg->nsg) {
+        last = &qsg->sg[qsg->nsg - 1];
+        if (last->base + last->len == base) {
+            last->len += len;
+            qsg->size += len;
+            return;
+        }
+    }
+    qemu_sglist_add(qsg, base, len);
+}
+
+/*
+ * PRP list pages are read into the submission queue's scratch list, and
+ * only as many entries as the remaining transfer needs. A list may start
+ * part way into a page, in which case the last slot of that page is the
+ * first to chain to the next list page.
+ */
 static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
-    uint32_t len, NvmeCtrl *n)
+    uint32_t len, NvmeSQueue *sq)
 {
+    NvmeCtrl *n = sq->ctrl;
     hwaddr trans_len = n->page_size - (prp1 % n->page_size);
     trans_len = MIN(len, trans_len);
     int num_prps = (len >> n->page_bits) + 1;
+    uint32_t entries = 1;
 
     if (!prp1) {
         return NVME_INVALID_FIELD | NVME_DNR;
@@ -188,45 +489,48 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
             goto unmap;
         }
         if (len > n->page_size) {
-            uint64_t prp_list[n->max_prp_ents];
-            uint32_t nents, prp_trans;
-            int i = 0;
+            uint64_t *prp_list = sq->prp_scratch;
+            uint32_t nents, slots, i;
 
-            nents = (len + n->page_size - 1) >> n->page_bits;
-            prp_trans = MIN(n->max_prp_ents, nents) * sizeof(uint64_t);
-            pci_dma_read(&n->parent_obj, prp2, (void *)prp_list, prp_trans);
-            while (len != 0) {
-                uint64_t prp_ent = le64_to_cpu(prp_list[i]);
+            if (prp2 & (sizeof(uint64_t) - 1)) {
+                goto unmap;
+            }
+            slots = (n->page_size - (prp2 & (n->page_size - 1))) >> 3;
+            while (len) {
+                nents = (len + n->page_size - 1) >> n->page_bits;
+                nents = nents > slots ? slots : nents;
+                nvme_addr_read(n, prp2, (void *)prp_list,
+                    nents * sizeof(uint64_t));
+
+                for (i = 0; i < nents; i++) {
+                    uint64_t prp_ent = le64_to_cpu(prp_list[i]);
 
-                if (i == n->max_prp_ents - 1 && len > n->page_size) {
                     if (!prp_ent || prp_ent & (n->page_size - 1)) {
                         goto unmap;
                     }
+                    if (i == slots - 1 && len > n->page_size) {
+                        prp2 = prp_ent;
+                        break;
+                    }
 
-                    i = 0;
-                    nents = (len + n->page_size - 1) >> n->page_bits;
-                    prp_trans = MIN(n->max_prp_ents, nents) * sizeof(uint64_t);
-                    pci_dma_read(&n->parent_obj, prp_ent, (void *)prp_list,
-                        prp_trans);
-                    prp_ent = le64_to_cpu(prp_list[i]);
-                }
-
-                if (!prp_ent || prp_ent & (n->page_size - 1)) {
-                    goto unmap;
+                    trans_len = MIN(len, n->page_size);
+                    nvme_sglist_add(qsg, prp_ent, trans_len);
+                    len -= trans_len;
+                    entries++;
                 }
-
-                trans_len = MIN(len, n->page_size);
-                qemu_sglist_add(qsg, prp_ent, trans_len);
-                len -= trans_len;
-                i++;
+                slots = n->max_prp_ents;
             }
         } else {
             if (prp2 & (n->page_size - 1)) {
                 goto unmap;
             }
-            qemu_sglist_add(qsg, prp2, len);
+            nvme_sglist_add(qsg, prp2, len);
+            entries++;
         }
     }
+
+    n->prp_entries += entries;
+    n->prp_sg_elems += qsg->nsg;
     return NVME_SUCCESS;
 
  unmap:
@@ -234,14 +538,171 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
     return NVME_INVALID_FIELD | NVME_DNR;
 }
 
+static void nvme_add_bit_bucket(NvmeRequest *req, uint32_t offset,
+    uint32_t len)
+{
+    NvmeBitBucket *last;
+
+    if (req->nr_bit_buckets) {
+        last = &req->bit_buckets[req->nr_bit_buckets - 1];
+        if (last->offset + last->len == offset) {
+            last->len += len;
+            return;
+        }
+    }
+    req->bit_buckets = g_renew(NvmeBitBucket, req->bit_buckets,
+        req->nr_bit_buckets + 1);
+    req->bit_buckets[req->nr_bit_buckets].offset = offset;
+    req->bit_buckets[req->nr_bit_buckets].len = len;
+    req->nr_bit_buckets++;
+}
+
+static void nvme_free_bit_buckets(NvmeRequest *req)
+{
+    g_free(req->bit_buckets);
+    req->bit_buckets = NULL;
+    req->nr_bit_buckets = 0;
+}
+
+/*
+ * Build the QEMUSGList for an SGL data pointer. Segments are fetched from
+ * the host a chunk of NVME_SGL_SEGMENT_DESCRS descriptors at a time, which
+ * covers a whole segment in a single read for hosts that size their
+ * segments to a page. Bit Bucket descriptors are only accepted when the
+ * caller passes a read request; they are not part of @qsg but recorded in
+ * the request's bit_buckets by their offset in the transfer.
+ */
+static uint16_t nvme_map_sgl(QEMUSGList *qsg, NvmeSglDescriptor *sgl,
+    uint32_t len, NvmeRequest *req, NvmeCtrl *n)
+{
+    NvmeSglDescriptor segment[NVME_SGL_SEGMENT_DESCRS];
+    NvmeSglDescriptor *desc = sgl;
+    uint32_t nsgld = 1, seg_left = 0, offset = 0;
+    uint64_t seg_addr = 0;
+    uint8_t last = 0;
+    uint16_t status;
+
+    qemu_sglist_init(qsg, 1, pci_dma_context(&n->parent_obj));
+    while (len) {
+        uint64_t addr;
+        uint32_t dlen, trans_len;
+        uint8_t type;
+
+        if (!nsgld) {
+            if (!seg_left) {
+                status = NVME_DATA_SGL_LEN_INVALID | NVME_DNR;
+                goto unmap;
+            }
+            nsgld = MIN(seg_left, NVME_SGL_SEGMENT_DESCRS);
+            nvme_addr_read(n, seg_addr, segment, nsgld * sizeof(*desc));
+            seg_addr += nsgld * sizeof(*desc);
+            seg_left -= nsgld;
+            desc = segment;
+        }
+
+        addr = le64_to_cpu(desc->addr);
+        dlen = le32_to_cpu(desc->len);
+        type = NVME_SGL_TYPE(desc->type);
+        if (NVME_SGL_SUBTYPE(desc->type) != NVME_SGL_DESCR_SUBTYPE_ADDRESS) {
+            status = NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR;
+            goto unmap;
+        }
+
+        switch (type) {
+        case NVME_SGL_DESCR_TYPE_DATA_BLOCK:
+            trans_len = MIN(len, dlen);
+            if (trans_len) {
+                nvme_sglist_add(qsg, addr, trans_len);
+                offset += trans_len;
+                len -= trans_len;
+            }
+            break;
+        case NVME_SGL_DESCR_TYPE_BIT_BUCKET:
+            if (!req) {
+                status = NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR;
+                goto unmap;
+            }
+            trans_len = MIN(len, dlen);
+            if (trans_len) {
+                nvme_add_bit_bucket(req, offset, trans_len);
+                offset += trans_len;
+                len -= trans_len;
+            }
+            break;
+        case NVME_SGL_DESCR_TYPE_SEGMENT:
+        case NVME_SGL_DESCR_TYPE_LAST_SEGMENT:
+            /* only valid as the final descriptor of a non-last segment */
+            if (last || nsgld != 1 || seg_left || !dlen ||
+                    dlen % sizeof(*desc)) {
+                status = NVME_INVALID_SGL_SEG_DESCR | NVME_DNR;
+                goto unmap;
+            }
+            last = type == NVME_SGL_DESCR_TYPE_LAST_SEGMENT;
+            seg_addr = addr;
+            seg_left = dlen / sizeof(*desc);
+            nsgld = 0;
+            continue;
+        default:
+            status = NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR;
+            goto unmap;
+        }
+        desc++;
+        nsgld--;
+    }
+    return NVME_SUCCESS;
+
+ unmap:
+    if (req) {
+        nvme_free_bit_buckets(req);
+    }
+    qemu_sglist_destroy(qsg);
+    return status;
+}
+
+static uint16_t nvme_map_dptr(QEMUSGList *qsg, NvmeCmd *cmd, uint32_t len,
+    NvmeRequest *req, NvmeSQueue *sq)
+{
+    switch (NVME_CMD_FLAGS_PSDT(cmd->fuse)) {
+    case NVME_PSDT_PRP:
+        return nvme_map_prp(qsg, le64_to_cpu(cmd->prp1),
+            le64_to_cpu(cmd->prp2), len, sq);
+    case NVME_PSDT_SGL_MPTR_CONTIGUOUS:
+        if (sq->ctrl->sgl) {
+            return nvme_map_sgl(qsg, (NvmeSglDescriptor *)&cmd->prp1, len,
+                req, sq->ctrl);
+        }
+        /* fall through */
+    default:
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+}
+
 static uint16_t nvme_dma_write_prp(NvmeCtrl *n, uint8_t *ptr, uint32_t len,
     uint64_t prp1, uint64_t prp2)
 {
     QEMUSGList qsg;
 
-    if (nvme_map_prp(&qsg, prp1, prp2, len, n)) {
+    if (nvme_map_prp(&qsg, prp1, prp2, len, &n->admin_sq)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    if (dma_buf_write(ptr, len, &qsg)) {
+        qemu_sglist_destroy(&qsg);
         return NVME_INVALID_FIELD | NVME_DNR;
     }
+    qemu_sglist_destroy(&qsg);
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_dma_write_dptr(NvmeSQueue *sq, uint8_t *ptr,
+    uint32_t len, NvmeCmd *cmd)
+{
+    QEMUSGList qsg;
+    uint16_t status;
+
+    status = nvme_map_dptr(&qsg, cmd, len, NULL, sq);
+    if (status) {
+        return status;
+    }
     if (dma_buf_write(ptr, len, &qsg)) {
         qemu_sglist_destroy(&qsg);
         return NVME_INVALID_FIELD | NVME_DNR;
@@ -250,12 +711,30 @@ static uint16_t nvme_dma_write_prp(NvmeCtrl *n, uint8_t *ptr, uint32_t len,
     return NVME_SUCCESS;
 }
 
+static uint16_t nvme_dma_read_dptr(NvmeSQueue *sq, uint8_t *ptr,
+    uint32_t len, NvmeCmd *cmd)
+{
+    QEMUSGList qsg;
+    uint16_t status;
+
+    status = nvme_map_dptr(&qsg, cmd, len, NULL, sq);
+    if (status) {
+        return status;
+    }
+    if (dma_buf_read(ptr, len, &qsg)) {
+        qemu_sglist_destroy(&qsg);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    qemu_sglist_destroy(&qsg);
+    return NVME_SUCCESS;
+}
+
 static uint16_t nvme_dma_read_prp(NvmeCtrl *n, uint8_t *ptr, uint32_t len,
     uint64_t prp1, uint64_t prp2)
 {
     QEMUSGList qsg;
 
-    if (nvme_map_prp(&qsg, prp1, prp2, len, n)) {
+    if (nvme_map_prp(&qsg, prp1, prp2, len, &n->admin_sq)) {
         return NVME_INVALID_FIELD | NVME_DNR;
     }
     if (dma_buf_read(ptr, len, &qsg)) {
@@ -265,20 +744,144 @@ static uint16_t nvme_dma_read_prp(NvmeCtrl *n, uint8_t *ptr, uint32_t len,
     return NVME_SUCCESS;
 }
 
+static void nvme_intc_timer(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+
+    if (cq->pending) {
+        cq->pending = 0;
+        nvme_isr_notify(cq->ctrl, cq);
+    }
+}
+
+/*
+ * Interrupt coalescing: the vector fires once the aggregation threshold of
+ * completions has been posted, or when the aggregation time has passed
+ * since the first unsignalled one, whichever comes first. The admin queue
+ * and vectors with coalescing off are signalled straight away, as are all
+ * vectors while the aggregation time is zero.
+ */
+static void nvme_cq_notify(NvmeCtrl *n, NvmeCQueue *cq, uint32_t posted)
+{
+    uint32_t intc = n->features.int_coalescing;
+    int coalesce = cq->cqid &&
+        (n->features.int_vector_config[cq->vector] >> 16) & 1;
+
+    cq->pending += posted;
+    if (!coalesce || !NVME_INTC_TIME(intc) ||
+            cq->pending >= NVME_INTC_THR(intc) + 1) {
+        qemu_del_timer(cq->intc_timer);
+        cq->pending = 0;
+        nvme_isr_notify(n, cq);
+    } else if (!qemu_timer_pending(cq->intc_timer)) {
+        qemu_mod_timer(cq->intc_timer, qemu_get_clock_ns(vm_clock) +
+            NVME_INTC_TIME(intc) * 100 * SCALE_US);
+    }
+}
+
+/* Write count staged entries to the ring, starting at slot start */
+static void nvme_write_cqes(NvmeCtrl *n, NvmeCQueue *cq, uint32_t start,
+    uint32_t count)
+{
+    hwaddr addr;
+
+    if (cq->phys_contig) {
+        addr = cq->dma_addr + start * n->cqe_size;
+    } else {
+        addr = nvme_discontig(cq->prp_list, n->page_size, start,
+            n->cqe_size);
+    }
+    pci_dma_write(&n->parent_obj, addr, cq->cqe_buf, count * n->cqe_size);
+}
+
+static void nvme_lat_record(NvmeLatStats *lat, uint64_t ns)
+{
+    lat->count++;
+    lat->total_ns += ns;
+    lat->hist[MIN(63 - clz64(ns | 1), NVME_LAT_BUCKETS - 1)]++;
+}
+
+static void nvme_stats_complete(NvmeCtrl *n, NvmeRequest *req, int64_t now)
+{
+    NvmeSQueue *sq = req->sq;
+    uint64_t ns = now - req->fetch_ns;
+
+    sq->inflight--;
+    if (req->stats_op == NVME_STATS_OPS) {
+        return;
+    }
+    nvme_lat_record(&sq->stats.lat[req->stats_op], ns);
+    nvme_lat_record(&n->stats.lat[req->stats_op], ns);
+    if (req->stats_ns) {
+        nvme_lat_record(&req->stats_ns->lat[req->stats_op], ns);
+    }
+}
+
+static void nvme_stats_fetch(NvmeCtrl *n, NvmeSQueue *sq, NvmeRequest *req,
+    NvmeCmd *cmd)
+{
+    uint32_t nsid = le32_to_cpu(cmd->nsid);
+
+    req->fetch_ns = get_clock();
+    req->stats_op = NVME_STATS_OPS;
+    req->stats_ns = NULL;
+    if (sq->sqid) {
+        switch (cmd->opcode) {
+        case NVME_CMD_READ:
+            req->stats_op = NVME_STATS_READ;
+            break;
+        case NVME_CMD_WRITE:
+        case NVME_CMD_ZONE_APPEND:
+            req->stats_op = NVME_STATS_WRITE;
+            break;
+        case NVME_CMD_FLUSH:
+            req->stats_op = NVME_STATS_FLUSH;
+            break;
+        }
+        if (nsid && nsid <= n->num_namespaces) {
+            req->stats_ns = &n->namespaces[nsid - 1];
+        }
+    }
+
+    sq->inflight++;
+    sq->stats.qd_samples++;
+    sq->stats.qd_total += sq->inflight;
+    sq->stats.qd_max = MAX(sq->stats.qd_max, sq->inflight);
+    n->stats.qd_samples++;
+    n->stats.qd_total += sq->inflight;
+    n->stats.qd_max = MAX(n->stats.qd_max, sq->inflight);
+}
+
+/*
+ * Completion entries are staged in the queue's buffer and written to the
+ * ring with one DMA per contiguous run: a run ends where the ring wraps,
+ * where the staging buffer is full, or for non-contiguous queues at a page
+ * boundary.
+ */
 static void nvme_post_cqes(void *opaque)
 {
     NvmeCQueue *cq = opaque;
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
 
-    int processed = 0;
-    int coalesce = (n->features.int_vector_config[cq->vector] >> 16) & 1;
-    int thresh = NVME_INTC_THR(n->features.int_coalescing) + 1;
+    const uint32_t batch = n->page_size / n->cqe_size;
+    uint32_t start = cq->tail;
+    uint32_t staged = 0;
+    uint32_t processed = 0;
+    int64_t now = get_clock();
+
+    if (cq->db_addr) {
+        nvme_update_cq_head(cq);
+    }
 
     QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
         NvmeSQueue *sq;
-        hwaddr addr;
 
+        if (nvme_cq_full(cq) && cq->db_addr) {
+            /* ask for a head doorbell, then recheck for a racing update */
+            nvme_update_cq_eventidx(cq);
+            nvme_update_cq_head(cq);
+        }
         if (nvme_cq_full(cq)) {
             break;
         }
@@ -289,43 +892,205 @@ static void nvme_post_cqes(void *opaque)
         req->cqe.sq_id = cpu_to_le16(sq->sqid);
         req->cqe.sq_head = cpu_to_le16(sq->head);
 
-        if (cq->phys_contig) {
-            addr = cq->dma_addr + cq->tail * n->cqe_size;
-        } else {
-            addr = nvme_discontig(cq->prp_list, cq->tail, n->page_size,
-                n->cqe_size);
-        }
-
-        nvme_inc_cq_tail(cq);
-        pci_dma_write(&n->parent_obj, addr, (void *)&req->cqe,
+        memcpy(cq->cqe_buf + staged * n->cqe_size, &req->cqe,
             sizeof(req->cqe));
-        QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
+        nvme_stats_complete(n, req, now);
+        staged++;
+        nvme_inc_cq_tail(cq);
+        if (!cq->tail || staged == batch || (!cq->phys_contig &&
+                !((cq->tail * n->cqe_size) & (n->page_size - 1)))) {
+            nvme_write_cqes(n, cq, start, staged);
+            start = cq->tail;
+            staged = 0;
+        }
 
-        ++processed;
-        if (coalesce && processed % thresh == 0) {
-            nvme_isr_notify(n, cq);
-            processed = 0;
+        if (QTAILQ_EMPTY(&sq->req_list) && !nvme_sq_empty(sq)) {
+            nvme_kick_sq(sq);
         }
+        QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
+        processed++;
+    }
+    if (staged) {
+        nvme_write_cqes(n, cq, start, staged);
     }
     if (processed) {
-        nvme_isr_notify(n, cq);
+        nvme_cq_notify(n, cq, processed);
     }
 }
 
-static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
+/*
+ * Flash timing model. Logical pages are striped across the dies, and the
+ * dies across the channels. A read occupies its die for the read latency,
+ * then the channel for the transfer; a write waits for a free write buffer
+ * slot, is transferred, and occupies its die for the program latency. The
+ * command's completion is held until the modeled finish of its last page.
+ */
+
+/*
+ * Once a die has programmed as many pages as it holds, every erase block it
+ * fills has to be reclaimed first: its still valid pages are read and
+ * programmed again, then it is erased. The share of valid pages follows how
+ * much of the namespace is written, scaled down by the over-provisioning.
+ */
+static int64_t nvme_model_gc(NvmeCtrl *n, NvmeNamespace *ns, uint32_t die)
 {
-    assert(cq->cqid == req->sq->cqid);
-    QTAILQ_REMOVE(&req->sq->out_req_list, req, entry);
-    QTAILQ_INSERT_TAIL(&cq->req_list, req, entry);
-    qemu_mod_timer(cq->timer, qemu_get_clock_ns(vm_clock) + 500);
+    NvmeFlashModel *m = &n->model;
+    uint64_t nsze = le64_to_cpu(ns->id_ns.nsze);
+    uint64_t valid;
+
+    m->die_progs[die]++;
+    if (!nsze || m->die_progs[die] <= m->die_pages ||
+            m->die_progs[die] % n->flash_ppb) {
+        return 0;
+    }
+    valid = (double)n->flash_ppb * range_set_count(ns->util) / nsze * 100 /
+        (100 + n->flash_op);
+    return ((int64_t)n->flash_erase_us + valid * (n->flash_read_us +
+        n->flash_prog_us)) * SCALE_US;
 }
 
-static void nvme_set_error_page(NvmeCtrl *n, uint16_t sqid, uint16_t cid,
-    uint16_t status, uint16_t location, uint64_t lba, uint32_t nsid)
+/* Returns when @len bytes of flash page @page are read or acknowledged */
+static int64_t nvme_model_page(NvmeCtrl *n, NvmeNamespace *ns, uint64_t page,
+    uint64_t len, bool write, int64_t now)
 {
-    NvmeErrorLog *elp;
+    NvmeFlashModel *m = &n->model;
+    uint32_t die = page % (n->flash_channels * n->flash_dies);
+    uint32_t chan = die % n->flash_channels;
+    int64_t xfer = len * 1000 / n->flash_chan_mbps;
+    int64_t admit, start;
+
+    if (!write) {
+        start = MAX(now, m->die_busy[die]);
+        m->die_busy[die] = start + n->flash_read_us * SCALE_US;
+        start = MAX(m->die_busy[die], m->chan_busy[chan]);
+        m->chan_busy[chan] = start + xfer;
+        return m->chan_busy[chan];
+    }
 
-    elp = &n->elpes[n->elp_index];
+    /* a full buffer takes the page once its oldest one is programmed */
+    admit = m->wbuf_pages ? MAX(now, m->wbuf[m->wbuf_head]) : now;
+    start = MAX(admit, m->chan_busy[chan]);
+    m->chan_busy[chan] = start + xfer;
+    start = MAX(m->chan_busy[chan], m->die_busy[die]) +
+        nvme_model_gc(n, ns, die);
+    m->die_busy[die] = start + n->flash_prog_us * SCALE_US;
+    m->wbuf_last = MAX(m->wbuf_last, m->die_busy[die]);
+    if (!m->wbuf_pages) {
+        return m->die_busy[die];
+    }
+    m->wbuf[m->wbuf_head] = m->die_busy[die];
+    m->wbuf_head = (m->wbuf_head + 1) % m->wbuf_pages;
+    return admit;
+}
+
+static int64_t nvme_model_rw(NvmeCtrl *n, NvmeNamespace *ns,
+    NvmeRequest *req)
+{
+    uint8_t lba_index = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
+    uint8_t ds = ns->id_ns.lbaf[lba_index].ds;
+    uint64_t page_size = (uint64_t)n->flash_page_kb << 10;
+    uint64_t pos = (ns->start_block << BDRV_SECTOR_BITS) + (req->slba << ds);
+    uint64_t end = pos + ((uint64_t)req->nlb << ds);
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    int64_t done = 0;
+
+    /* blocks never written are answered without reading the flash */
+    if (!req->is_write && !range_set_intersects(ns->util, req->slba,
+            req->nlb)) {
+        return 0;
+    }
+    while (pos < end) {
+        uint64_t len = MIN(end, (pos / page_size + 1) * page_size) - pos;
+
+        done = MAX(done, nvme_model_page(n, ns, pos / page_size, len,
+            req->is_write, now));
+        pos += len;
+    }
+    return done;
+}
+
+static void nvme_model_start(NvmeCtrl *n)
+{
+    uint64_t bytes = 0;
+    int i;
+
+    for (i = 0; i < n->num_namespaces; i++) {
+        bytes += n->namespaces[i].size;
+    }
+    n->model.die_pages = bytes / 100 * (100 + n->flash_op) /
+        ((uint64_t)n->flash_page_kb << 10) /
+        (n->flash_channels * n->flash_dies);
+}
+
+static void nvme_model_post(NvmeCtrl *n, NvmeRequest *req)
+{
+    NvmeCQueue *cq = n->cq[req->sq->cqid];
+
+    QTAILQ_REMOVE(&n->model.reqs, req, entry);
+    req->model_done = 0;
+    QTAILQ_INSERT_TAIL(&cq->req_list, req, entry);
+    qemu_bh_schedule(cq->bh);
+}
+
+static void nvme_model_timer(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    NvmeRequest *req;
+
+    while ((req = QTAILQ_FIRST(&n->model.reqs)) != NULL &&
+            req->model_done <= now) {
+        nvme_model_post(n, req);
+    }
+    if (req) {
+        qemu_mod_timer(n->model.timer, req->model_done);
+    }
+}
+
+/* Held completions are kept in order of their modeled finish time */
+static void nvme_model_hold(NvmeCtrl *n, NvmeRequest *req)
+{
+    NvmeFlashModel *m = &n->model;
+    NvmeRequest *prev;
+
+    QTAILQ_FOREACH_REVERSE(prev, &m->reqs, model_req_list, entry) {
+        if (prev->model_done <= req->model_done) {
+            break;
+        }
+    }
+    if (prev) {
+        QTAILQ_INSERT_AFTER(&m->reqs, prev, req, entry);
+    } else {
+        QTAILQ_INSERT_HEAD(&m->reqs, req, entry);
+        qemu_mod_timer(m->timer, req->model_done);
+    }
+}
+
+static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
+{
+    NvmeSQueue *sq = req->sq;
+
+    assert(cq->cqid == sq->cqid);
+    QTAILQ_REMOVE(&sq->out_req_list, req, entry);
+    if (req->model_done && req->model_done > qemu_get_clock_ns(vm_clock)) {
+        nvme_model_hold(cq->ctrl, req);
+    } else {
+        QTAILQ_INSERT_TAIL(&cq->req_list, req, entry);
+        qemu_bh_schedule(cq->bh);
+    }
+
+    /* the last command of an SQ being deleted lets the deletion finish */
+    if (sq->del_req && QTAILQ_EMPTY(&sq->out_req_list)) {
+        nvme_del_sq_done(cq->ctrl, sq);
+    }
+}
+
+static void nvme_set_error_page(NvmeCtrl *n, uint16_t sqid, uint16_t cid,
+    uint16_t status, uint16_t location, uint64_t lba, uint32_t nsid)
+{
+    NvmeErrorLog *elp;
+
+    elp = &n->elpes[n->elp_index];
     elp->error_count = n->error_count++;
     elp->sqid = sqid;
     elp->cid = cid;
@@ -380,499 +1145,855 @@ static void nvme_aer_process_cb(void *param)
     }
 }
 
-static uint16_t nvme_sgl_verify_dif_interleave(NvmeCtrl *n, QEMUSGList *qsg,
-    uint16_t ctrl, NvmeNamespace *ns, int slba)
+static uint16_t nvme_dif_verify_iov(QEMUIOVector *data, uint8_t *meta,
+    const uint32_t bs, const uint16_t ms, uint16_t ctrl, uint32_t slba,
+    RangeSet *util, uint8_t first)
 {
-    const uint8_t lba_index  = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
-    const uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
-    const uint16_t ms = le16_to_cpu(ns->id_ns.lbaf[lba_index].ms);
-    const uint8_t first = ns->id_ns.dps & DPS_FIRST_EIGHT;
-    const uint32_t bs = 1 << data_shift;
-
-    uint32_t i = 0, offset = 0, buf_offset = 0;
-    uint32_t trans_len, dma_len = bs;
-    uint8_t tmp[bs];
-    uint32_t len = qsg->size;
+    NvmeDifTuple *dif;
     uint16_t meta_offset = first ? ms - 8 : 0;
-    NvmeDifTuple dif;
-
-    while (len) {
-        trans_len = MIN(dma_len, qsg->sg[i].len - offset);
-        trans_len = MIN(trans_len, len);
+    uint16_t crc = 0;
+    size_t left = bs;
+    int i;
 
-        pci_dma_read(&n->parent_obj, qsg->sg[i].base + offset,
-            tmp + buf_offset, trans_len);
+    for (i = 0; i < data->niov; i++) {
+        uint8_t *base = data->iov[i].iov_base;
+        size_t len = data->iov[i].iov_len;
 
-        len -= trans_len;
-        dma_len -= trans_len;
-        offset += trans_len;
-        buf_offset += trans_len;
+        while (len) {
+            size_t chunk = MIN(len, left);
 
-        if (dma_len == 0) {
-            dma_addr_t tuple = qsg->sg[i].base + offset + meta_offset;
+            if (ctrl & NVME_RW_PRINFO_PRCHK_GUARD) {
+                crc = crc_t10dif_update(crc, base, chunk);
+            }
+            base += chunk;
+            len -= chunk;
+            left -= chunk;
+            if (left) {
+                continue;
+            }
 
-            pci_dma_read(&n->parent_obj, tuple, &dif, sizeof(dif));
-            if (test_bit(slba, ns->util)) {
+            dif = (NvmeDifTuple *)(meta + meta_offset);
+            if (range_set_test(util, slba)) {
                 if (ctrl & NVME_RW_PRINFO_PRCHK_GUARD) {
-                    if (dif.guard_tag != cpu_to_be16(crc_t10dif(tmp, bs))) {
+                    if (dif->guard_tag != cpu_to_be16(crc)) {
                         return NVME_E2E_GUARD_ERROR;
                     }
                 }
                 if (ctrl & NVME_RW_PRINFO_PRCHK_REF) {
-                    if (slba != be32_to_cpu(dif.ref_tag)) {
+                    if (be32_to_cpu(dif->ref_tag) != slba) {
                         return NVME_E2E_REF_ERROR;
                     }
                 }
             } else {
-                dif.guard_tag = dif.app_tag = 0xffff;
-                dif.ref_tag = 0xffffffff;
-                pci_dma_write(&n->parent_obj, tuple, &dif, sizeof(dif));
+                dif->guard_tag = dif->app_tag = 0xffff;
+                dif->ref_tag = 0xffffffff;
             }
-
-            offset += ms;
-            dma_len = bs;
+            meta += ms;
+            left = bs;
+            crc = 0;
             slba++;
-            buf_offset = 0;
-        }
-
-        assert(offset <= qsg->sg[i].len);
-        if (offset == qsg->sg[i].len) {
-            offset = 0;
-            i++;
         }
     }
 
     return NVME_SUCCESS;
 }
 
-static uint16_t nvme_sgl_verify_dif_separate(NvmeCtrl *n, QEMUSGList *qsg,
-    uint8_t *buf, uint16_t ctrl, NvmeNamespace *ns, uint32_t slba,
+/*
+ * Check the protection information of an extended LBA transfer in place on
+ * the mapped guest buffers, where each data block is immediately followed by
+ * its meta-data. Blocks that were never written get the 0xffff escape tuple
+ * stored straight into guest memory instead of being checked.
+ */
+static uint16_t nvme_dif_verify_ext_iov(QEMUIOVector *qiov, const uint32_t bs,
+    const uint16_t ms, uint16_t ctrl, uint32_t slba, RangeSet *util,
     uint8_t first)
 {
-    const uint8_t lba_index  = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
-    const uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
-    const uint16_t ms = le16_to_cpu(ns->id_ns.lbaf[lba_index].ms);
-    const uint32_t bs = 1 << data_shift;
-
-    uint32_t i = 0, offset = 0, buf_offset = 0;
-    uint32_t trans_len, dma_len = bs;
-    uint8_t tmp[bs];
-    uint32_t len = qsg->size;
-    uint16_t meta_offset = first ? ms - 8 : 0;
-    NvmeDifTuple *dif;
-
-    while (len) {
-        trans_len = MIN(dma_len, qsg->sg[i].len - offset);
-        trans_len = MIN(trans_len, len);
-
-        pci_dma_read(&n->parent_obj, qsg->sg[i].base + offset,
-            tmp + buf_offset, trans_len);
+    static const NvmeDifTuple unwritten = {
+        .guard_tag = 0xffff,
+        .app_tag = 0xffff,
+        .ref_tag = 0xffffffff,
+    };
+    const uint16_t meta_offset = first ? ms - sizeof(NvmeDifTuple) : 0;
+    const struct iovec *iov = qiov->iov;
+    size_t pos = 0, off = 0;
+    NvmeDifTuple tmp, *dif;
+
+    while (pos + bs + ms <= qiov->size) {
+        const int written = range_set_test(util, slba);
+        size_t left = bs + ms;
+        uint16_t crc = 0;
+
+        /* guard over the data, which may span several mapped segments */
+        while (left > ms) {
+            size_t chunk = MIN(left - ms, iov->iov_len - off);
+
+            if (written && (ctrl & NVME_RW_PRINFO_PRCHK_GUARD)) {
+                crc = crc_t10dif_update(crc, (uint8_t *)iov->iov_base + off,
+                    chunk);
+            }
+            off += chunk;
+            left -= chunk;
+            if (off == iov->iov_len) {
+                iov++;
+                off = 0;
+            }
+        }
 
-        len -= trans_len;
-        dma_len -= trans_len;
-        offset += trans_len;
-        buf_offset += trans_len;
+        if (off + meta_offset + sizeof(*dif) <= iov->iov_len) {
+            dif = (NvmeDifTuple *)((uint8_t *)iov->iov_base + off +
+                meta_offset);
+        } else {
+            iov_to_buf(qiov->iov, qiov->niov, pos + bs + meta_offset, &tmp,
+                sizeof(tmp));
+            dif = &tmp;
+        }
 
-        if (dma_len == 0) {
-            dif = (NvmeDifTuple *)(buf + meta_offset);
-            if (test_bit(slba, ns->util)) {
-                if (ctrl & NVME_RW_PRINFO_PRCHK_GUARD) {
-                    if (dif->guard_tag != cpu_to_be16(crc_t10dif(tmp, bs))) {
-                        return NVME_E2E_GUARD_ERROR;
-                    }
+        if (written) {
+            if (ctrl & NVME_RW_PRINFO_PRCHK_GUARD) {
+                if (dif->guard_tag != cpu_to_be16(crc)) {
+                    return NVME_E2E_GUARD_ERROR;
                 }
-                if (ctrl & NVME_RW_PRINFO_PRCHK_REF) {
-                    if (slba != be32_to_cpu(dif->ref_tag)) {
-                        return NVME_E2E_REF_ERROR;
-                    }
+            }
+            if (ctrl & NVME_RW_PRINFO_PRCHK_REF) {
+                if (be32_to_cpu(dif->ref_tag) != slba) {
+                    return NVME_E2E_REF_ERROR;
                 }
-            } else {
-                dif->guard_tag = dif->app_tag = 0xffff;
-                dif->ref_tag = 0xffffffff;
             }
-
-            dma_len = bs;
-            buf += ms;
-            slba++;
-            buf_offset = 0;
+        } else if (dif == &tmp) {
+            iov_from_buf(qiov->iov, qiov->niov, pos + bs + meta_offset,
+                &unwritten, sizeof(unwritten));
+        } else {
+            *dif = unwritten;
         }
-        if (offset == qsg->sg[i].len) {
-            offset = 0;
-            i++;
+
+        /* skip over the rest of the meta-data */
+        while (left) {
+            size_t chunk = MIN(left, iov->iov_len - off);
+
+            off += chunk;
+            left -= chunk;
+            if (off == iov->iov_len) {
+                iov++;
+                off = 0;
+            }
         }
+        pos += bs + ms;
+        slba++;
     }
 
     return NVME_SUCCESS;
 }
 
-static uint16_t nvme_pract_verify_dif(uint8_t *buf, const uint32_t bs,
-    const uint16_t ms, uint16_t ctrl, uint32_t nlb, uint32_t slba,
-    unsigned long *util, uint8_t first)
+static void nvme_dif_generate_iov(QEMUIOVector *data, uint8_t *meta,
+    const uint32_t bs, const uint16_t ms, uint32_t slba, uint8_t first)
 {
     NvmeDifTuple *dif;
-    uint8_t *end = buf + ((bs + ms) * nlb);
-    uint16_t meta_offset = bs;
-    meta_offset += first ? ms - 8 : 0;
+    uint16_t meta_offset = first ? ms - 8 : 0;
+    uint16_t crc = 0;
+    size_t left = bs;
+    int i;
 
-    for (; buf < end; buf += (bs + ms)) {
-        dif = (NvmeDifTuple *)(buf + meta_offset);
-        if (test_bit(slba, util)) {
-            if (ctrl & NVME_RW_PRINFO_PRCHK_GUARD) {
-                if (dif->guard_tag != cpu_to_be16(crc_t10dif(buf, bs))) {
-                    return NVME_E2E_GUARD_ERROR;
-                }
-            }
-            if (ctrl & NVME_RW_PRINFO_PRCHK_REF) {
-                if (be32_to_cpu(dif->ref_tag) != slba) {
-                    return NVME_E2E_REF_ERROR;
-                }
+    for (i = 0; i < data->niov; i++) {
+        uint8_t *base = data->iov[i].iov_base;
+        size_t len = data->iov[i].iov_len;
+
+        while (len) {
+            size_t chunk = MIN(len, left);
+
+            crc = crc_t10dif_update(crc, base, chunk);
+            base += chunk;
+            len -= chunk;
+            left -= chunk;
+            if (left) {
+                continue;
             }
+
+            dif = (NvmeDifTuple *)(meta + meta_offset);
+            dif->guard_tag = cpu_to_be16(crc);
+            dif->ref_tag = cpu_to_be32(slba);
+            dif->app_tag = 0;
+            meta += ms;
+            left = bs;
+            crc = 0;
             slba++;
         }
     }
-
-    return NVME_SUCCESS;
 }
 
-static void nvme_pract_generate_dif(NvmeNamespace *ns, uint8_t *buf,
-    const uint32_t bs, const uint16_t ms, uint16_t ctrl, uint32_t nlb,
-    int32_t slba, uint8_t first)
+/*
+ * Build the on-disk image of an extended LBA transfer: each data block from
+ * the guest followed by its meta-data from the controller's buffer.
+ */
+static void nvme_interleave_iov(QEMUIOVector *dst, QEMUIOVector *data,
+    uint8_t *meta, const uint32_t bs, const uint16_t ms)
 {
-    NvmeDifTuple *dif;
-    uint8_t *end = buf + ((bs + ms) * nlb);
-    uint16_t meta_offset = bs;
-    meta_offset += first ? ms - 8 : 0;
+    size_t left = bs;
+    int i;
 
-    for (; buf < end; buf += (bs + ms), slba++) {
-        dif = (NvmeDifTuple *)(buf + meta_offset);
-        dif->guard_tag = cpu_to_be16(crc_t10dif(buf, bs));
-        dif->ref_tag = cpu_to_be32(slba);
-        dif->app_tag = 0;
+    for (i = 0; i < data->niov; i++) {
+        uint8_t *base = data->iov[i].iov_base;
+        size_t len = data->iov[i].iov_len;
+
+        while (len) {
+            size_t chunk = MIN(len, left);
+
+            qemu_iovec_add(dst, base, chunk);
+            base += chunk;
+            len -= chunk;
+            left -= chunk;
+            if (!left) {
+                qemu_iovec_add(dst, meta, ms);
+                meta += ms;
+                left = bs;
+            }
+        }
     }
 }
 
-static void nvme_interleave_sgl(NvmeCtrl *n, QEMUSGList *qsg, uint8_t *buf,
-    uint32_t len, const uint32_t bs, const uint16_t ms, int is_write)
+/*
+ * Unmap the guest memory in req->iov. The entries covering a bit bucket
+ * point at the controller's scratch buffer and are left alone.
+ */
+static void nvme_unmap_iov_mem(NvmeRequest *req, DMADirection dir,
+    bool done)
 {
-    uint32_t i = 0, sg_offset = 0;
-    uint32_t trans_len, dma_len = bs;
+    NvmeBitBucket *bb = req->bit_buckets;
+    NvmeBitBucket *bb_end = bb + req->nr_bit_buckets;
+    uint32_t offset = 0;
+    int i;
 
-    while (len) {
-        trans_len = MIN(MIN(len, dma_len), qsg->sg[i].len - sg_offset);
-        if (is_write) {
-            pci_dma_read(&n->parent_obj, qsg->sg[i].base + sg_offset, buf,
-                trans_len);
-        } else {
-            pci_dma_write(&n->parent_obj, qsg->sg[i].base + sg_offset, buf,
-                trans_len);
+    for (i = 0; i < req->iov.niov; i++) {
+        size_t len = req->iov.iov[i].iov_len;
+
+        if (bb == bb_end || offset < bb->offset) {
+            dma_memory_unmap(req->qsg.dma, req->iov.iov[i].iov_base, len,
+                dir, done ? len : 0);
+        }
+        offset += len;
+        if (bb != bb_end && offset == bb->offset + bb->len) {
+            bb++;
         }
+    }
+}
 
-        buf += trans_len;
-        len -= trans_len;
-        dma_len -= trans_len;
-        sg_offset += trans_len;
-        if (dma_len == 0) {
-            dma_len = bs;
-            buf += ms;
-            len -= ms;
+/*
+ * Map the transfer into req->iov. The guest memory in req->qsg is taken in
+ * order, with the byte ranges of any bit buckets in between all landing in
+ * the same scratch buffer.
+ */
+static void nvme_map_iov(NvmeCtrl *n, NvmeRequest *req)
+{
+    QEMUSGList *qsg = &req->qsg;
+    DMADirection dir = req->is_write ? DMA_DIRECTION_TO_DEVICE :
+        DMA_DIRECTION_FROM_DEVICE;
+    NvmeBitBucket *bb = req->bit_buckets;
+    NvmeBitBucket *bb_end = bb + req->nr_bit_buckets;
+    dma_addr_t base = 0, left = 0;
+    uint32_t offset = 0, size = qsg->size;
+    int i = 0;
+
+    req->bounce = NULL;
+    qemu_iovec_init(&req->iov, qsg->nsg + req->nr_bit_buckets);
+    while (i < qsg->nsg || left || bb != bb_end) {
+        dma_addr_t plen;
+        void *mem;
+
+        if (bb != bb_end && bb->offset == offset) {
+            uint32_t len = bb->len;
+
+            while (len) {
+                plen = MIN(len, NVME_BIT_BUCKET_SIZE);
+                qemu_iovec_add(&req->iov, n->bit_bucket, plen);
+                len -= plen;
+            }
+            offset += bb->len;
+            bb++;
+            continue;
         }
-        if (sg_offset == qsg->sg[i].len) {
-            sg_offset = 0;
+        if (!left) {
+            base = qsg->sg[i].base;
+            left = qsg->sg[i].len;
             i++;
         }
+        plen = bb != bb_end ? MIN(left, bb->offset - offset) : left;
+        mem = dma_memory_map(qsg->dma, base, &plen, dir);
+        if (!mem) {
+            goto bounce;
+        }
+        qemu_iovec_add(&req->iov, mem, plen);
+        base += plen;
+        left -= plen;
+        offset += plen;
     }
+    return;
+
+ bounce:
+    /* not plain RAM; fall back to copying the whole transfer */
+    nvme_unmap_iov_mem(req, dir, false);
+    qemu_iovec_reset(&req->iov);
+    for (bb = req->bit_buckets; bb != bb_end; bb++) {
+        size += bb->len;
+    }
+    req->bounce = qemu_blockalign(req->ns->bs, size);
+    if (req->is_write) {
+        dma_buf_write(req->bounce, qsg->size, qsg);
+    }
+    qemu_iovec_add(&req->iov, req->bounce, size);
 }
 
-static void nvme_rw_cb(void *opaque, int ret)
+static void nvme_unmap_iov(NvmeRequest *req)
 {
-    NvmeRequest *req = opaque;
-    NvmeSQueue *sq = req->sq;
-    NvmeCtrl *n = sq->ctrl;
-    NvmeCQueue *cq = n->cq[sq->cqid];
-    NvmeNamespace *ns = req->ns;
-    const uint8_t pi = ns->id_ns.dps & DPS_TYPE_MASK;
-    const uint8_t first = ns->id_ns.dps & DPS_FIRST_EIGHT;
-    const uint8_t lba_index  = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
-    const uint8_t separate = !NVME_ID_NS_FLBAS_EXTENDED(ns->id_ns.flbas);
-    const uint16_t ms = le16_to_cpu(ns->id_ns.lbaf[lba_index].ms);
-
-    bdrv_acct_done(n->conf.bs, &req->acct);
+    QEMUSGList *qsg = &req->qsg;
+    DMADirection dir = req->is_write ? DMA_DIRECTION_TO_DEVICE :
+        DMA_DIRECTION_FROM_DEVICE;
+    NvmeBitBucket *bb = req->bit_buckets;
+    uint8_t *ptr;
+    uint32_t offset = 0;
+    int i;
 
-    if (!ret) {
-        req->status = NVME_SUCCESS;
-        if (req->meta_size) {
-            if (separate && pi) {
-                req->status = nvme_sgl_verify_dif_separate(n, &req->qsg,
-                    req->meta_buf, req->ctrl, ns, req->slba, first);
-                pci_dma_write(&n->parent_obj, req->mptr, req->meta_buf,
-                    req->meta_size);
+    if (req->bounce) {
+        if (!req->is_write) {
+            /* squeeze the discarded ranges out before copying to the host */
+            ptr = req->bounce;
+            for (i = 0; i < req->nr_bit_buckets; i++, bb++) {
+                memmove(ptr, req->bounce + offset, bb->offset - offset);
+                ptr += bb->offset - offset;
+                offset = bb->offset + bb->len;
             }
-            g_free(req->meta_buf);
-        }
-        if (req->status == NVME_SUCCESS && ms && !separate && pi) {
-            req->status = nvme_sgl_verify_dif_interleave(n, &req->qsg,
-                req->ctrl, ns, req->slba);
+            if (req->nr_bit_buckets) {
+                memmove(ptr, req->bounce + offset,
+                    qsg->size - (ptr - (uint8_t *)req->bounce));
+            }
+            dma_buf_read(req->bounce, qsg->size, qsg);
         }
+        qemu_vfree(req->bounce);
+        req->bounce = NULL;
     } else {
-        req->status = NVME_INTERNAL_DEV_ERROR;
-    }
-    if (req->status != NVME_SUCCESS) {
-    	nvme_set_error_page(n, sq->sqid, req->cqe.cid, req->status,
-            offsetof(NvmeRwCmd, slba), req->slba, ns->id);
-        if (req->is_write) {
-            bitmap_clear(ns->util, req->slba, req->nlb);
-        }
+        nvme_unmap_iov_mem(req, dir, true);
     }
-
-    qemu_sglist_destroy(&req->qsg);
-    nvme_enqueue_req_completion(cq, req);
+    qemu_iovec_destroy(&req->iov);
 }
 
-static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
-    NvmeRequest *req)
+/*
+ * Byte granular read or write on the backing device. Meta-data does not
+ * start or end on a sector boundary, so the partial head and tail sectors
+ * are padded and, for writes, filled in from the device first. The lock
+ * serialises those read-modify-write cycles between in-flight commands.
+ */
+static int coroutine_fn nvme_co_prw(BlockDriverState *bs, uint64_t offset,
+    QEMUIOVector *qiov, int is_write, CoMutex *lock)
 {
-    NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
-    uint16_t ctrl = le16_to_cpu(rw->control);
-    uint32_t nlb  = le16_to_cpu(rw->nlb) + 1;
-    uint64_t slba = le64_to_cpu(rw->slba);
-    uint64_t prp1 = le64_to_cpu(rw->prp1);
-    uint64_t prp2 = le64_to_cpu(rw->prp2);
-    uint64_t mptr = le64_to_cpu(rw->mptr);
-
-    const uint64_t elba = slba + nlb;
-    const uint8_t lba_index  = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
-    const uint8_t separate  = !NVME_ID_NS_FLBAS_EXTENDED(ns->id_ns.flbas);
-    const uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
-    const uint32_t bs = 1 << data_shift;
-    const uint16_t  ms = le16_to_cpu(ns->id_ns.lbaf[lba_index].ms);
-    const uint8_t pi = ns->id_ns.dps & DPS_TYPE_MASK;
-    const uint8_t first = ns->id_ns.dps & DPS_FIRST_EIGHT;
-    uint64_t data_size = nlb << data_shift;
-    uint64_t meta_size = nlb * ms;
-    uint64_t aio_slba  = ns->start_block + (slba << (data_shift -
-        BDRV_SECTOR_BITS));
-    uint64_t offset;
-    void *buf;
+    int64_t sector = offset >> BDRV_SECTOR_BITS;
+    size_t head = offset & (BDRV_SECTOR_SIZE - 1);
+    size_t tail = -(offset + qiov->size) & (BDRV_SECTOR_SIZE - 1);
+    int nb_sectors = (head + qiov->size + tail) >> BDRV_SECTOR_BITS;
+    QEMUIOVector aligned, pad_qiov;
+    struct iovec pad_iov;
+    uint8_t *pad;
+    int ret = 0;
+
+    if (!head && !tail) {
+        return is_write ? bdrv_co_writev(bs, sector, nb_sectors, qiov) :
+            bdrv_co_readv(bs, sector, nb_sectors, qiov);
+    }
 
-    req->is_write = rw->opcode == NVME_CMD_WRITE;
-    if (elba > le64_to_cpu(ns->id_ns.nsze)) {
-        nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_LBA_RANGE,
-            offsetof(NvmeRwCmd, nlb), elba, ns->id);
-        return NVME_LBA_RANGE | NVME_DNR;
+    pad = qemu_blockalign(bs, 2 * BDRV_SECTOR_SIZE);
+    qemu_iovec_init(&aligned, qiov->niov + 2);
+    if (head) {
+        qemu_iovec_add(&aligned, pad, head);
     }
-    if (n->id_ctrl.mdts && data_size > n->page_size * (1 << n->id_ctrl.mdts)) {
-        nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_INVALID_FIELD,
-            offsetof(NvmeRwCmd, nlb), nlb, ns->id);
-        return NVME_INVALID_FIELD | NVME_DNR;
+    qemu_iovec_concat(&aligned, qiov, 0, qiov->size);
+    if (tail) {
+        qemu_iovec_add(&aligned, pad + 2 * BDRV_SECTOR_SIZE - tail, tail);
     }
-    if (meta_size && !mptr && separate && !(ctrl & NVME_RW_PRINFO_PRACT)) {
-        nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_INVALID_FIELD,
-            offsetof(NvmeRwCmd, control), ctrl, ns->id);
-        return NVME_INVALID_FIELD | NVME_DNR;
+
+    if (!is_write) {
+        ret = bdrv_co_readv(bs, sector, nb_sectors, &aligned);
+        goto out;
     }
-    if ((ctrl & NVME_RW_PRINFO_PRACT) && !(ns->id_ns.dps & DPS_TYPE_MASK)) {
-        nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_INVALID_FIELD,
-            offsetof(NvmeRwCmd, control), ctrl, ns->id);
-        return NVME_INVALID_FIELD | NVME_DNR;
+
+    qemu_co_mutex_lock(lock);
+    pad_iov.iov_len = BDRV_SECTOR_SIZE;
+    if (head) {
+        pad_iov.iov_base = pad;
+        qemu_iovec_init_external(&pad_qiov, &pad_iov, 1);
+        ret = bdrv_co_readv(bs, sector, 1, &pad_qiov);
     }
-    if (!req->is_write && find_next_bit(ns->uncorrectable, elba, slba) < elba) {
-        nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_UNRECOVERED_READ,
-            offsetof(NvmeRwCmd, slba), elba, ns->id);
-        return NVME_UNRECOVERED_READ;
+    if (!ret && tail) {
+        pad_iov.iov_base = pad + BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&pad_qiov, &pad_iov, 1);
+        ret = bdrv_co_readv(bs, sector + nb_sectors - 1, 1, &pad_qiov);
+    }
+    if (!ret) {
+        ret = bdrv_co_writev(bs, sector, nb_sectors, &aligned);
     }
+    qemu_co_mutex_unlock(lock);
 
-    if (separate && meta_size && !mptr) {
-        /* separate meta-buffer, controller gen/strip; do nothing */
-        return NVME_INVALID_FIELD | NVME_DNR;
-        meta_size = 0;
-    } else if (!separate && (!(ctrl & NVME_RW_PRINFO_PRACT) ||
-            ms != sizeof(NvmeDifTuple))) {
-        data_size += meta_size;
-        assert(data_size == (nlb * ((1 << data_shift) + ms)));
+ out:
+    qemu_iovec_destroy(&aligned);
+    qemu_vfree(pad);
+    return ret;
+}
+
+static RangeSet *nvme_state_map(NvmeNamespace *ns, uint8_t map)
+{
+    switch (map) {
+    case NVME_STATE_UTIL:
+        return ns->util;
+    case NVME_STATE_UNCORRECTABLE:
+        return ns->uncorrectable;
+    case NVME_STATE_DEALLOCATED:
+        return ns->deallocated;
+    default:
+        return NULL;
     }
+}
 
-    if (nvme_map_prp(&req->qsg, prp1, prp2, data_size, n)) {
-        nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_INVALID_FIELD,
-            offsetof(NvmeRwCmd, prp1), 0, ns->id);
-        return NVME_INVALID_FIELD | NVME_DNR;
+/*
+ * Only the main loop changes the block maps, but the migration thread reads
+ * them while the guest runs, so every change is made under map_lock and
+ * marks its range for resending if a migration is under way.
+ */
+static void nvme_map_update(NvmeNamespace *ns, uint64_t slba, uint64_t nlb,
+    uint8_t set, uint8_t clear)
+{
+    NvmeCtrl *n = ns->ctrl;
+    int i;
+
+    qemu_mutex_lock(&n->map_lock);
+    for (i = 0; i < NVME_STATE_MAPS; i++) {
+        if (set & (1 << i)) {
+            range_set_add(nvme_state_map(ns, i), slba, nlb);
+        } else if (clear & (1 << i)) {
+            range_set_remove(nvme_state_map(ns, i), slba, nlb);
+        }
     }
-    if (!separate && (ctrl & NVME_RW_PRINFO_PRACT)) {
-        data_size += meta_size;
-	meta_size = 0;
-        assert(data_size == (nlb * ((1 << data_shift) + ms)));
+    if (ns->mig_dirty) {
+        range_set_add(ns->mig_dirty, slba, nlb);
     }
+    qemu_mutex_unlock(&n->map_lock);
+}
 
-    req->slba = slba;
-    req->meta_size = 0;
-    req->status = NVME_SUCCESS;
-    offset = ns->meta_start_offset + (req->slba * ms);
-    if (req->is_write) {
-        bitmap_set(ns->util, slba, nlb);
-        bitmap_clear(ns->uncorrectable, slba, nlb);
-    }
-    if (!separate && (!(ctrl & NVME_RW_PRINFO_PRACT) ||
-            ms != sizeof(NvmeDifTuple))) {
-        meta_size = req->qsg.size % BDRV_SECTOR_SIZE;
-        offset = aio_slba * BDRV_SECTOR_SIZE + (req->qsg.size - meta_size);
-        mptr = req->qsg.sg[req->qsg.nsg - 1].base +
-            (req->qsg.sg[req->qsg.nsg - 1].len - meta_size);
-    }
-    if (meta_size) {
-        buf = g_malloc(meta_size);
-        if (req->is_write) {
-            pci_dma_read(&n->parent_obj, mptr, buf, meta_size);
-            if (separate && pi) {
-                req->status = nvme_sgl_verify_dif_separate(n, &req->qsg,
-                    buf, ctrl, ns, req->slba, first);
-            }
-            if (req->status == NVME_SUCCESS) {
-                if (bdrv_pwrite_sync(n->conf.bs, offset, buf, meta_size)) {
-                    req->status = NVME_INTERNAL_DEV_ERROR;
-                }
-            }
-            free(buf);
-        } else {
-            if (bdrv_pread(n->conf.bs, offset, buf, meta_size) != meta_size) {
-                free(buf);
-                return NVME_INTERNAL_DEV_ERROR;
-            }
-            if (separate && pi) {
-                req->mptr = mptr;
-                req->meta_size = meta_size;
-                req->meta_buf = buf;
-                req->ctrl = ctrl;
-            } else {
-                pci_dma_write(&n->parent_obj, mptr, buf, meta_size);
-                free(buf);
-            }
-        }
-        if (req->status) {
-            return req->status;
-        }
-    } else if (ctrl & NVME_RW_PRINFO_PRACT && ms == sizeof(NvmeDifTuple)) {
-        /* the mete-data is interleaved; strip/insert meta-data */
-    	buf = g_malloc(data_size);
-        offset = aio_slba * BDRV_SECTOR_SIZE + aio_slba * ms;
+static NvmeZone *nvme_get_zone(NvmeNamespace *ns, uint64_t slba)
+{
+    return &ns->zones[slba / ns->zone_size];
+}
 
-        if (!req->is_write) {
-            if (bdrv_pread(n->conf.bs, offset, buf, data_size) != data_size) {
-                qemu_sglist_destroy(&req->qsg);
-                g_free(buf);
+static uint64_t nvme_zone_slba(NvmeNamespace *ns, NvmeZone *zone)
+{
+    return (zone - ns->zones) * ns->zone_size;
+}
 
-                nvme_set_error_page(n, req->sq->sqid, req->cqe.cid,
-                    NVME_INTERNAL_DEV_ERROR, offsetof(NvmeRwCmd, slba),
-                    req->slba, ns->id);
+static bool nvme_zone_is_open(uint8_t state)
+{
+    return state == NVME_ZONE_STATE_IMPL_OPEN ||
+        state == NVME_ZONE_STATE_EXPL_OPEN;
+}
 
-                return NVME_INTERNAL_DEV_ERROR;
-            }
-            req->status = nvme_pract_verify_dif(buf, bs, ms, ctrl, nlb, slba,
-                ns->util, first);
-	    
-            if (req->status != NVME_SUCCESS) {
-                qemu_sglist_destroy(&req->qsg);
-                g_free(buf);
+static bool nvme_zone_is_active(uint8_t state)
+{
+    return nvme_zone_is_open(state) || state == NVME_ZONE_STATE_CLOSED;
+}
+
+static bool nvme_zone_state_valid(uint8_t state)
+{
+    switch (state) {
+    case NVME_ZONE_STATE_EMPTY:
+    case NVME_ZONE_STATE_IMPL_OPEN:
+    case NVME_ZONE_STATE_EXPL_OPEN:
+    case NVME_ZONE_STATE_CLOSED:
+    case NVME_ZONE_STATE_READ_ONLY:
+    case NVME_ZONE_STATE_FULL:
+    case NVME_ZONE_STATE_OFFLINE:
+        return true;
+    default:
+        return false;
+    }
+}
 
-                nvme_set_error_page(n, req->sq->sqid, req->cqe.cid,
-                    NVME_INTERNAL_DEV_ERROR, offsetof(NvmeRwCmd, slba),
-                    req->slba, ns->id);
+static void nvme_zone_set_state(NvmeNamespace *ns, NvmeZone *zone,
+    uint8_t state)
+{
+    ns->nr_open += nvme_zone_is_open(state) - nvme_zone_is_open(zone->state);
+    ns->nr_active += nvme_zone_is_active(state) -
+        nvme_zone_is_active(zone->state);
+    zone->state = state;
+}
 
-                return NVME_INTERNAL_DEV_ERROR;	        
-	    } 
-        }
+/* a zone closed before anything was written to it is empty again */
+static void nvme_zone_close(NvmeNamespace *ns, NvmeZone *zone)
+{
+    nvme_zone_set_state(ns, zone, zone->wp == nvme_zone_slba(ns, zone) ?
+        NVME_ZONE_STATE_EMPTY : NVME_ZONE_STATE_CLOSED);
+}
 
-        nvme_interleave_sgl(n, &req->qsg, buf, data_size, bs, ms, req->is_write);
-        if (req->is_write) {
-            nvme_pract_generate_dif(ns, buf, bs, ms, ctrl, nlb, slba, first);
-            if (bdrv_pwrite(n->conf.bs, offset, buf, data_size) != data_size) {
-                qemu_sglist_destroy(&req->qsg);
-                g_free(buf);
+/*
+ * Zones are zone_size_mb of data each, and whatever is left at the end of
+ * the namespace is not exposed. Every zone starts out empty.
+ */
+static void nvme_zone_init(NvmeNamespace *ns)
+{
+    NvmeCtrl *n = ns->ctrl;
+    NvmeIdNsZoned *id_zoned = &ns->id_ns_zoned;
+    uint8_t lba_index = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
+    uint64_t zone_bytes = (uint64_t)n->zone_size_mb << 20;
+    uint32_t i;
+
+    ns->zone_size = zone_bytes >> ns->id_ns.lbaf[lba_index].ds;
+    ns->nr_zones = le64_to_cpu(ns->id_ns.nsze) / ns->zone_size;
+    ns->id_ns.nsze = cpu_to_le64(ns->nr_zones * ns->zone_size);
+    ns->id_ns.ncap = ns->id_ns.nsze;
+    ns->id_ns.nuse = ns->id_ns.nsze;
+
+    g_free(ns->zones);
+    ns->zones = g_new(NvmeZone, ns->nr_zones);
+    for (i = 0; i < ns->nr_zones; i++) {
+        ns->zones[i].wp = i * ns->zone_size;
+        ns->zones[i].state = NVME_ZONE_STATE_EMPTY;
+    }
+    ns->nr_open = 0;
+    ns->nr_active = 0;
+
+    memset(id_zoned, 0, sizeof(*id_zoned));
+    /* both limits are 0's based, all ones meaning no limit */
+    id_zoned->mar = cpu_to_le32(n->zone_max_active - 1);
+    id_zoned->mor = cpu_to_le32(n->zone_max_open - 1);
+    for (i = 0; i <= ns->id_ns.nlbaf; i++) {
+        id_zoned->lbafe[i].zsze = cpu_to_le64(zone_bytes >>
+            ns->id_ns.lbaf[i].ds);
+    }
+}
 
-                nvme_set_error_page(n, req->sq->sqid, req->cqe.cid,
-                    NVME_INTERNAL_DEV_ERROR, offsetof(NvmeRwCmd, slba),
-                    req->slba, ns->id);
+/*
+ * Opening a zone beyond the open limit implicitly closes another zone if one
+ * was implicitly opened, as the controller is allowed to; zones the host
+ * opened explicitly stay open until it closes them.
+ */
+static uint16_t nvme_zone_open(NvmeNamespace *ns, NvmeZone *zone,
+    uint8_t state)
+{
+    uint32_t max_active = ns->ctrl->zone_max_active;
+    uint32_t max_open = ns->ctrl->zone_max_open;
+    uint32_t i;
 
-                return NVME_INTERNAL_DEV_ERROR;
+    switch (zone->state) {
+    case NVME_ZONE_STATE_EXPL_OPEN:
+        return NVME_SUCCESS;
+    case NVME_ZONE_STATE_IMPL_OPEN:
+        nvme_zone_set_state(ns, zone, state);
+        return NVME_SUCCESS;
+    case NVME_ZONE_STATE_EMPTY:
+        if (max_active && ns->nr_active >= max_active) {
+            return NVME_ZONE_TOO_MANY_ACTIVE;
+        }
+        /* fall through */
+    case NVME_ZONE_STATE_CLOSED:
+        for (i = 0; max_open && ns->nr_open >= max_open &&
+                i < ns->nr_zones; i++) {
+            if (ns->zones[i].state == NVME_ZONE_STATE_IMPL_OPEN) {
+                nvme_zone_close(ns, &ns->zones[i]);
             }
         }
-
-        qemu_sglist_destroy(&req->qsg);
-        g_free(buf);
+        if (max_open && ns->nr_open >= max_open) {
+            return NVME_ZONE_TOO_MANY_OPEN;
+        }
+        nvme_zone_set_state(ns, zone, state);
         return NVME_SUCCESS;
+    default:
+        return NVME_ZONE_INVAL_TRANSITION | NVME_DNR;
     }
+}
 
-    req->nlb = nlb;
-    req->ns = ns;
+/* Whether @zone can take @nlb blocks written at @slba */
+static uint16_t nvme_zone_writable(NvmeNamespace *ns, NvmeZone *zone,
+    uint64_t slba, uint32_t nlb)
+{
+    switch (zone->state) {
+    case NVME_ZONE_STATE_FULL:
+        return NVME_ZONE_FULL | NVME_DNR;
+    case NVME_ZONE_STATE_READ_ONLY:
+        return NVME_ZONE_READ_ONLY | NVME_DNR;
+    case NVME_ZONE_STATE_OFFLINE:
+        return NVME_ZONE_OFFLINE | NVME_DNR;
+    }
+    if (slba + nlb > nvme_zone_slba(ns, zone) + ns->zone_size) {
+        return NVME_ZONE_BOUNDARY_ERROR | NVME_DNR;
+    }
+    return NVME_SUCCESS;
+}
 
-    dma_acct_start(n->conf.bs, &req->acct, &req->qsg, req->is_write ?
-        BDRV_ACCT_WRITE : BDRV_ACCT_READ);
+/*
+ * Writes to a zoned namespace must start at the zone's write pointer and
+ * stay within the zone. The write pointer moves as soon as the command is
+ * accepted, so the host may queue the next write before this one completes.
+ */
+static uint16_t nvme_zone_write(NvmeNamespace *ns, uint64_t slba,
+    uint32_t nlb)
+{
+    NvmeZone *zone = nvme_get_zone(ns, slba);
+    uint64_t zslba = nvme_zone_slba(ns, zone);
+    uint16_t status;
 
-    req->aiocb = req->is_write ?
-        dma_bdrv_write(n->conf.bs, &req->qsg, aio_slba, nvme_rw_cb, req) :
-        dma_bdrv_read(n->conf.bs, &req->qsg, aio_slba, nvme_rw_cb, req);
+    status = nvme_zone_writable(ns, zone, slba, nlb);
+    if (status) {
+        return status;
+    }
+    if (slba != zone->wp) {
+        return NVME_ZONE_INVALID_WRITE | NVME_DNR;
+    }
+    status = nvme_zone_open(ns, zone, NVME_ZONE_STATE_IMPL_OPEN);
+    if (status) {
+        return status;
+    }
 
-    return NVME_NO_COMPLETE;
+    zone->wp += nlb;
+    if (zone->wp == zslba + ns->zone_size) {
+        nvme_zone_set_state(ns, zone, NVME_ZONE_STATE_FULL);
+    }
+    return NVME_SUCCESS;
 }
 
-static uint16_t nvme_dsm(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
-    NvmeRequest *req)
+static uint16_t nvme_zone_read(NvmeNamespace *ns, uint64_t slba, uint32_t nlb)
 {
-    uint32_t dw10 = le32_to_cpu(cmd->cdw10);
-    uint32_t dw11 = le32_to_cpu(cmd->cdw11);
-    uint64_t prp1 = le64_to_cpu(cmd->prp1);
-    uint64_t prp2 = le64_to_cpu(cmd->prp2);
+    uint64_t i;
+
+    for (i = slba / ns->zone_size; i <= (slba + nlb - 1) / ns->zone_size;
+            i++) {
+        if (ns->zones[i].state == NVME_ZONE_STATE_OFFLINE) {
+            return NVME_ZONE_OFFLINE | NVME_DNR;
+        }
+    }
+    return NVME_SUCCESS;
+}
 
-    if (dw11 & NVME_DSMGMT_AD) {
-        uint16_t nr = (dw10 & 0xff) + 1;
-        uint8_t lba_index = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
-        uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds - BDRV_SECTOR_BITS;
+static void nvme_rw_cb(void *opaque, int ret)
+{
+    NvmeRequest *req = opaque;
+    NvmeSQueue *sq = req->sq;
+    NvmeCtrl *n = sq->ctrl;
+    NvmeCQueue *cq = n->cq[sq->cqid];
+    NvmeNamespace *ns = req->ns;
 
-        int i;
-        uint64_t slba;
-        uint32_t nlb;
-        NvmeDsmRange range[nr];
+    bdrv_acct_done(ns->bs, &req->acct);
 
-        if (nvme_dma_write_prp(n, (uint8_t *)range, sizeof(range), prp1, prp2)) {
-            nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_INVALID_FIELD,
-                offsetof(NvmeCmd, prp1), 0, ns->id);
-            return NVME_INVALID_FIELD | NVME_DNR;
+    if (ret) {
+        req->status = NVME_INTERNAL_DEV_ERROR;
+    }
+    if (req->status != NVME_SUCCESS) {
+        nvme_set_error_page(n, sq->sqid, req->cqe.cid, req->status,
+            offsetof(NvmeRwCmd, slba), req->slba, ns->id);
+        if (req->is_write) {
+            nvme_map_update(ns, req->slba, req->nlb, 0, NVME_MAP_UTIL);
         }
+    }
+
+    qemu_sglist_destroy(&req->qsg);
+    nvme_free_bit_buckets(req);
+    nvme_enqueue_req_completion(cq, req);
+}
+
+/*
+ * Deallocated blocks read back as zeroes (DLFEAT). Blank the data of each
+ * one in a completed read; blocks are @stride bytes apart in the mapped
+ * buffer.
+ */
+static void nvme_zero_deallocated(NvmeNamespace *ns, NvmeRequest *req,
+    size_t stride, size_t bs_size)
+{
+    uint64_t lba = req->slba, elba = req->slba + req->nlb;
 
-        for (i = 0; i < nr; i++) {
-            slba = le64_to_cpu(range[i].slba);
-            nlb = le32_to_cpu(range[i].nlb);
-            if (slba + nlb > le64_to_cpu(ns->id_ns.nsze)) {
-                nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_LBA_RANGE,
-                    offsetof(NvmeCmd, cdw10), slba + nlb, ns->id);
-                return NVME_LBA_RANGE | NVME_DNR;
+    if (!range_set_intersects(ns->deallocated, lba, req->nlb)) {
+        return;
+    }
+    while (lba < elba) {
+        bool dealloc;
+        uint64_t i, run = range_set_run(ns->deallocated, lba, elba - lba,
+            &dealloc);
+
+        if (dealloc && stride == bs_size) {
+            qemu_iovec_memset(&req->iov, (lba - req->slba) * stride, 0,
+                run * bs_size);
+        } else if (dealloc) {
+            for (i = 0; i < run; i++) {
+                qemu_iovec_memset(&req->iov, (lba + i - req->slba) * stride,
+                    0, bs_size);
             }
+        }
+        lba += run;
+    }
+}
+
+/*
+ * Reads without meta-data that cannot go straight through dma_bdrv_read.
+ * Runs of deallocated blocks are zero filled without touching the backing
+ * drive; everything else is read from it.
+ */
+static int coroutine_fn nvme_co_read_runs(NvmeNamespace *ns, NvmeRequest *req,
+    uint8_t data_shift)
+{
+    uint64_t lba = req->slba, elba = req->slba + req->nlb;
+    QEMUIOVector qiov;
+    int ret = 0;
+
+    qemu_iovec_init(&qiov, req->iov.niov);
+    while (!ret && lba < elba) {
+        bool dealloc;
+        uint64_t run = range_set_run(ns->deallocated, lba, elba - lba,
+            &dealloc);
+        size_t offset = (lba - req->slba) << data_shift;
+        size_t len = run << data_shift;
+
+        if (dealloc) {
+            qemu_iovec_memset(&req->iov, offset, 0, len);
+        } else {
+            qemu_iovec_reset(&qiov);
+            qemu_iovec_concat(&qiov, &req->iov, offset, len);
+            ret = bdrv_co_readv(ns->bs, ns->start_block + (lba << (data_shift -
+                BDRV_SECTOR_BITS)), len >> BDRV_SECTOR_BITS, &qiov);
+        }
+        lba += run;
+    }
+    qemu_iovec_destroy(&qiov);
+    return ret;
+}
+
+/*
+ * Meta-data carrying reads and writes. The guest data buffers are mapped
+ * and handed to the block layer directly; protection information is
+ * generated before a write is issued and checked once a read returns.
+ */
+static void coroutine_fn nvme_rw_co(void *opaque)
+{
+    NvmeRequest *req = opaque;
+    NvmeCtrl *n = req->sq->ctrl;
+    NvmeNamespace *ns = req->ns;
+    BlockDriverState *bs = ns->bs;
+
+    const uint8_t lba_index  = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
+    const uint8_t separate = !NVME_ID_NS_FLBAS_EXTENDED(ns->id_ns.flbas);
+    const uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
+    const uint32_t bs_size = 1 << data_shift;
+    const uint16_t ms = le16_to_cpu(ns->id_ns.lbaf[lba_index].ms);
+    const uint8_t pi = ns->id_ns.dps & DPS_TYPE_MASK;
+    const uint8_t first = ns->id_ns.dps & DPS_FIRST_EIGHT;
+    uint64_t aio_slba = ns->start_block + (req->slba << (data_shift -
+        BDRV_SECTOR_BITS));
+    QEMUIOVector meta_qiov, qiov;
+    int ret = 0;
+
+    nvme_map_iov(n, req);
 
-            bitmap_clear(ns->util, slba, nlb);
-            if (bdrv_discard(n->conf.bs, ns->start_block + (slba << data_shift),
-                    nlb << data_shift) < 0) {
-                req->status = NVME_INTERNAL_DEV_ERROR;
+    if (!ms) {
+        /* plain reads with bit buckets or deallocated blocks */
+        ret = nvme_co_read_runs(ns, req, data_shift);
+        nvme_unmap_iov(req);
+    } else if (separate) {
+        uint64_t meta_offset = ns->meta_start_offset + req->slba * ms;
+
+        qemu_iovec_init(&meta_qiov, 1);
+        qemu_iovec_add(&meta_qiov, req->meta_buf, req->meta_size);
+        if (req->is_write) {
+            pci_dma_read(&n->parent_obj, req->mptr, req->meta_buf,
+                req->meta_size);
+            if (pi) {
+                req->status = nvme_dif_verify_iov(&req->iov, req->meta_buf,
+                    bs_size, ms, req->ctrl, req->slba, ns->util, first);
+            }
+            if (req->status == NVME_SUCCESS) {
+                ret = bdrv_co_writev(bs, aio_slba, req->qsg.size >>
+                    BDRV_SECTOR_BITS, &req->iov);
             }
+            if (req->status == NVME_SUCCESS && !ret) {
+                ret = nvme_co_prw(bs, meta_offset, &meta_qiov, 1,
+                    &ns->rmw_lock);
+            }
+        } else {
+            ret = bdrv_co_readv(bs, aio_slba, req->qsg.size >>
+                BDRV_SECTOR_BITS, &req->iov);
+            if (!ret) {
+                ret = nvme_co_prw(bs, meta_offset, &meta_qiov, 0,
+                    &ns->rmw_lock);
+            }
+            if (!ret && pi) {
+                req->status = nvme_dif_verify_iov(&req->iov, req->meta_buf,
+                    bs_size, ms, req->ctrl, req->slba, ns->util, first);
+            }
+            if (!ret) {
+                nvme_zero_deallocated(ns, req, bs_size, bs_size);
+                pci_dma_write(&n->parent_obj, req->mptr, req->meta_buf,
+                    req->meta_size);
+            }
+        }
+        qemu_iovec_destroy(&meta_qiov);
+        nvme_unmap_iov(req);
+    } else if (req->meta_buf) {
+        /* PRACT with an 8 byte tuple: insert/strip the protection info */
+        qemu_iovec_init(&qiov, req->iov.niov + 2 * req->nlb);
+        nvme_interleave_iov(&qiov, &req->iov, req->meta_buf, bs_size, ms);
+        if (req->is_write) {
+            nvme_dif_generate_iov(&req->iov, req->meta_buf, bs_size, ms,
+                req->slba, first);
+            ret = nvme_co_prw(bs, req->data_offset, &qiov, 1, &ns->rmw_lock);
+        } else {
+            ret = nvme_co_prw(bs, req->data_offset, &qiov, 0, &ns->rmw_lock);
+            if (!ret) {
+                req->status = nvme_dif_verify_iov(&req->iov, req->meta_buf,
+                    bs_size, ms, req->ctrl, req->slba, ns->util, first);
+                nvme_zero_deallocated(ns, req, bs_size, bs_size);
+            }
+        }
+        qemu_iovec_destroy(&qiov);
+        nvme_unmap_iov(req);
+    } else {
+        /* extended LBAs with the meta-data supplied by the host */
+        if (req->is_write && pi) {
+            req->status = nvme_dif_verify_ext_iov(&req->iov, bs_size, ms,
+                req->ctrl, req->slba, ns->util, first);
+        }
+        if (req->status == NVME_SUCCESS) {
+            ret = nvme_co_prw(bs, req->data_offset, &req->iov, req->is_write,
+                &ns->rmw_lock);
+        }
+        if (!ret && !req->is_write && pi) {
+            req->status = nvme_dif_verify_ext_iov(&req->iov, bs_size, ms,
+                req->ctrl, req->slba, ns->util, first);
+        }
+        if (!ret && !req->is_write) {
+            nvme_zero_deallocated(ns, req, bs_size + ms, bs_size);
         }
+        nvme_unmap_iov(req);
     }
-    return NVME_SUCCESS;
+
+    g_free(req->meta_buf);
+    req->meta_buf = NULL;
+    nvme_rw_cb(req, ret);
 }
 
-static uint16_t nvme_compare(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
+static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     NvmeRequest *req)
 {
     NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
+    uint16_t ctrl = le16_to_cpu(rw->control);
     uint32_t nlb  = le16_to_cpu(rw->nlb) + 1;
     uint64_t slba = le64_to_cpu(rw->slba);
-    uint64_t prp1 = le64_to_cpu(rw->prp1);
-    uint64_t prp2 = le64_to_cpu(rw->prp2);
+    uint64_t mptr = le64_to_cpu(rw->mptr);
 
-    uint64_t elba = slba + nlb;
-    uint8_t lba_index = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
-    uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
+    const uint64_t elba = slba + nlb;
+    const uint8_t lba_index  = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
+    const uint8_t separate  = !NVME_ID_NS_FLBAS_EXTENDED(ns->id_ns.flbas);
+    const uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
+    const uint16_t  ms = le16_to_cpu(ns->id_ns.lbaf[lba_index].ms);
+    const uint8_t pract = ctrl & NVME_RW_PRINFO_PRACT &&
+        ms == sizeof(NvmeDifTuple);
     uint64_t data_size = nlb << data_shift;
-    uint64_t offset  = ns->start_block + (slba << data_shift);
-    int i;
+    uint64_t meta_size = nlb * ms;
+    uint64_t aio_slba  = ns->start_block + (slba << (data_shift -
+        BDRV_SECTOR_BITS));
+    uint16_t status;
+    Coroutine *co;
 
-    if ((slba + nlb) > le64_to_cpu(ns->id_ns.nsze)) {
+    req->is_write = rw->opcode == NVME_CMD_WRITE;
+    if (elba > le64_to_cpu(ns->id_ns.nsze)) {
         nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_LBA_RANGE,
             offsetof(NvmeRwCmd, nlb), elba, ns->id);
         return NVME_LBA_RANGE | NVME_DNR;
@@ -882,901 +2003,2929 @@ static uint16_t nvme_compare(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
             offsetof(NvmeRwCmd, nlb), nlb, ns->id);
         return NVME_INVALID_FIELD | NVME_DNR;
     }
-    if (nvme_map_prp(&req->qsg, prp1, prp2, data_size, n)) {
+    if (meta_size && !mptr && separate) {
+        /* separate meta-buffer, controller gen/strip is not supported */
         nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_INVALID_FIELD,
-            offsetof(NvmeRwCmd, prp1), 0, ns->id);
+            offsetof(NvmeRwCmd, control), ctrl, ns->id);
         return NVME_INVALID_FIELD | NVME_DNR;
     }
+    if ((ctrl & NVME_RW_PRINFO_PRACT) && !(ns->id_ns.dps & DPS_TYPE_MASK)) {
+        nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_INVALID_FIELD,
+            offsetof(NvmeRwCmd, control), ctrl, ns->id);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    if (!req->is_write && range_set_intersects(ns->uncorrectable, slba, nlb)) {
+        nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_UNRECOVERED_READ,
+            offsetof(NvmeRwCmd, slba), elba, ns->id);
+        return NVME_UNRECOVERED_READ;
+    }
+    if (n->zoned && !req->is_write) {
+        status = nvme_zone_read(ns, slba, nlb);
+        if (status) {
+            nvme_set_error_page(n, req->sq->sqid, cmd->cid, status,
+                offsetof(NvmeRwCmd, slba), slba, ns->id);
+            return status;
+        }
+    }
 
-    if (find_next_bit(ns->uncorrectable, elba, slba) < elba) {
-		return NVME_UNRECOVERED_READ;
-	}
-
-    for (i = 0; i < req->qsg.nsg; i++) {
-        uint32_t len = req->qsg.sg[i].len;
-        uint8_t tmp[2][len];
-
-		if (bdrv_pread(n->conf.bs, offset, tmp[0], len) != len) {
+    if (!separate && !pract) {
+        data_size += meta_size;
+        assert(data_size == (nlb * ((1 << data_shift) + ms)));
+    }
+    req->bit_buckets = NULL;
+    req->nr_bit_buckets = 0;
+    status = nvme_map_dptr(&req->qsg, cmd, data_size,
+        req->is_write || ms ? NULL : req, req->sq);
+    if (status) {
+        nvme_set_error_page(n, req->sq->sqid, cmd->cid, status,
+            offsetof(NvmeRwCmd, prp1), 0, ns->id);
+        return status;
+    }
+    if (n->zoned && req->is_write) {
+        status = nvme_zone_write(ns, slba, nlb);
+        if (status) {
             qemu_sglist_destroy(&req->qsg);
-            nvme_set_error_page(n, req->sq->sqid, req->cqe.cid,
-                NVME_INTERNAL_DEV_ERROR, offsetof(NvmeRwCmd, slba),
-                req->slba, ns->id);
-            return NVME_INTERNAL_DEV_ERROR;
+            nvme_free_bit_buckets(req);
+            nvme_set_error_page(n, req->sq->sqid, cmd->cid, status,
+                offsetof(NvmeRwCmd, slba), slba, ns->id);
+            return status;
         }
+    }
 
-        pci_dma_read(&n->parent_obj, req->qsg.sg[i].base, tmp[1], len);
-
-		if (memcmp(tmp[0], tmp[1], len)) {
-			qemu_sglist_destroy(&req->qsg);
-			fprintf(stderr, "\n%s:  Memory miscompare, len = 0x%x, i = %d\n",__func__, len, i);
-
-			// print tmp[0] and tmp[1]
-			fprintf(stderr,	"tmp[0] data\n");
-			int j;
-			for (j = 0; j < len; j++) {
-				fprintf(stderr, "%x", tmp[0][j]);
-				if ((j != 0) && ((j+1) % 32 == 0))
-					fprintf(stderr, "\n");
-			}
+    req->slba = slba;
+    req->nlb = nlb;
+    req->ns = ns;
+    req->ctrl = ctrl;
+    req->status = NVME_SUCCESS;
+    if (n->flash_model) {
+        req->model_done = nvme_model_rw(n, ns, req);
+    }
+    if (req->is_write) {
+        nvme_map_update(ns, slba, nlb, NVME_MAP_UTIL,
+            NVME_MAP_UNCORRECTABLE | NVME_MAP_DEALLOCATED);
+    }
 
-			fprintf(stderr, "\ntmp[1] data\n");
-			for (j = 0; j < len; j++) {
-				fprintf(stderr, "%x", tmp[1][j]);
-				if ((j != 0) && ((j+1) % 32 == 0))
-					fprintf(stderr, "\n");
-			}
+    dma_acct_start(ns->bs, &req->acct, &req->qsg, req->is_write ?
+        BDRV_ACCT_WRITE : BDRV_ACCT_READ);
 
-			return NVME_CMP_FAILURE;
-		}
+    if (!ms && !req->nr_bit_buckets && (req->is_write ||
+            !range_set_intersects(ns->deallocated, slba, nlb))) {
+        req->aiocb = req->is_write ?
+            dma_bdrv_write(ns->bs, &req->qsg, aio_slba, nvme_rw_cb, req) :
+            dma_bdrv_read(ns->bs, &req->qsg, aio_slba, nvme_rw_cb, req);
+        return NVME_NO_COMPLETE;
+    }
 
-        offset += len;
+    req->meta_buf = NULL;
+    req->meta_size = 0;
+    req->mptr = mptr;
+    req->data_offset = (ns->start_block << BDRV_SECTOR_BITS) +
+        slba * ((1 << data_shift) + ms);
+    if (separate || pract) {
+        req->meta_size = meta_size;
+        req->meta_buf = g_malloc(meta_size);
     }
 
-    qemu_sglist_destroy(&req->qsg);
-    return NVME_SUCCESS;
+    co = qemu_coroutine_create(nvme_rw_co);
+    qemu_coroutine_enter(co, req);
+    return NVME_NO_COMPLETE;
 }
 
-static uint16_t nvme_flush(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
-    NvmeRequest *req)
+/* Copy @len bytes from @offset into the transfer that @qsg maps */
+static void nvme_sglist_read(NvmeCtrl *n, QEMUSGList *qsg, dma_addr_t offset,
+    uint8_t *buf, dma_addr_t len)
 {
-    if (bdrv_flush(n->conf.bs) < 0) {
-        return NVME_INTERNAL_DEV_ERROR;
-    }
-    return NVME_SUCCESS;
-}
+    int i;
 
-static uint16_t nvme_write_uncor(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
-    NvmeRequest *req)
-{
-    NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
-    uint64_t slba = le64_to_cpu(rw->slba);
-    uint32_t nlb  = le16_to_cpu(rw->nlb) + 1;
+    for (i = 0; i < qsg->nsg && len; i++) {
+        dma_addr_t plen;
 
-    if ((slba + nlb) > ns->id_ns.nsze) {
-        nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_LBA_RANGE,
-            offsetof(NvmeRwCmd, nlb), slba + nlb, ns->id);
-        return NVME_LBA_RANGE | NVME_DNR;
+        if (offset >= qsg->sg[i].len) {
+            offset -= qsg->sg[i].len;
+            continue;
+        }
+        plen = MIN(len, qsg->sg[i].len - offset);
+        pci_dma_read(&n->parent_obj, qsg->sg[i].base + offset, buf, plen);
+        buf += plen;
+        len -= plen;
+        offset = 0;
     }
-
-    bitmap_set(ns->uncorrectable, slba, nlb);
-    return NVME_SUCCESS;
 }
 
-static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+/*
+ * Blocks are read back a bounded chunk at a time and checked against the
+ * host buffers, which are laid out as a read of the same blocks would
+ * fill them. Deallocated blocks compare against zeroes.
+ */
+static void coroutine_fn nvme_compare_co(void *opaque)
 {
-    NvmeNamespace *ns;
-    uint32_t nsid = le32_to_cpu(cmd->nsid);
+    NvmeRequest *req = opaque;
+    NvmeSQueue *sq = req->sq;
+    NvmeCtrl *n = sq->ctrl;
+    NvmeCQueue *cq = n->cq[sq->cqid];
+    NvmeNamespace *ns = req->ns;
 
-    if (nsid == 0 || nsid > n->num_namespaces) {
-        return NVME_INVALID_NSID | NVME_DNR;
+    const uint8_t lba_index = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
+    const uint8_t separate = !NVME_ID_NS_FLBAS_EXTENDED(ns->id_ns.flbas);
+    const uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
+    const uint32_t bs_size = 1 << data_shift;
+    const uint16_t ms = le16_to_cpu(ns->id_ns.lbaf[lba_index].ms);
+    const uint8_t pract = req->ctrl & NVME_RW_PRINFO_PRACT &&
+        ms == sizeof(NvmeDifTuple);
+    const uint32_t dev_stride = separate ? bs_size : bs_size + ms;
+    const uint32_t host_stride = separate || pract ? bs_size : bs_size + ms;
+    const uint32_t chunk = MAX(NVME_CMP_CHUNK / dev_stride, 1);
+    uint64_t lba = req->slba, elba = req->slba + req->nlb;
+    uint8_t *buf[2], *meta[2] = { NULL, NULL };
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret = 0;
+
+    buf[0] = qemu_blockalign(ns->bs, chunk * dev_stride);
+    buf[1] = g_malloc(chunk * host_stride);
+    if (separate && ms && !pract) {
+        meta[0] = g_malloc(chunk * ms);
+        meta[1] = g_malloc(chunk * ms);
     }
-
-    ns = &n->namespaces[nsid - 1];
-    switch (cmd->opcode) {
-    case NVME_CMD_WRITE:
-    case NVME_CMD_READ:
-        return nvme_rw(n, ns, cmd, req);
-
-    case NVME_CMD_FLUSH:
-        if (!n->id_ctrl.vwc || !n->features.volatile_wc) {
-            return NVME_SUCCESS;
+    while (!ret && req->status == NVME_SUCCESS && lba < elba) {
+        uint32_t i, nlb = MIN(chunk, elba - lba);
+        uint64_t l, run;
+        bool dealloc;
+
+        iov.iov_base = buf[0];
+        iov.iov_len = nlb * dev_stride;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        if (separate) {
+            ret = bdrv_co_readv(ns->bs, ns->start_block + (lba << (data_shift -
+                BDRV_SECTOR_BITS)), nlb << (data_shift - BDRV_SECTOR_BITS),
+                &qiov);
+        } else {
+            ret = nvme_co_prw(ns->bs, (ns->start_block << BDRV_SECTOR_BITS) +
+                lba * dev_stride, &qiov, 0, &ns->rmw_lock);
         }
-        return nvme_flush(n, ns, cmd, req);
-
-    case NVME_CMD_DSM:
-        if (NVME_ONCS_DSM & n->oncs) {
-            return nvme_dsm(n, ns, cmd, req);
+        if (!ret && meta[0]) {
+            iov.iov_base = meta[0];
+            iov.iov_len = nlb * ms;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            ret = nvme_co_prw(ns->bs, ns->meta_start_offset + lba * ms, &qiov,
+                0, &ns->rmw_lock);
+        }
+        if (ret) {
+            break;
         }
-        return NVME_INVALID_OPCODE | NVME_DNR;
 
-    case NVME_CMD_COMPARE:
-        if (NVME_ONCS_COMPARE & n->oncs) {
-            return nvme_compare(n, ns, cmd, req);
+        for (l = lba; l < lba + nlb; l += run) {
+            run = range_set_run(ns->deallocated, l, lba + nlb - l, &dealloc);
+            for (i = 0; dealloc && i < run; i++) {
+                memset(buf[0] + (l + i - lba) * dev_stride, 0, bs_size);
+            }
         }
-        return NVME_INVALID_OPCODE | NVME_DNR;
 
-    case NVME_CMD_WRITE_UNCOR:
-        if (NVME_ONCS_WRITE_UNCORR & n->oncs) {
-            return nvme_write_uncor(n, ns, cmd, req);
+        nvme_sglist_read(n, &req->qsg, (lba - req->slba) * host_stride, buf[1],
+            nlb * host_stride);
+        for (i = 0; i < nlb; i++) {
+            if (memcmp(buf[0] + i * dev_stride, buf[1] + i * host_stride,
+                    host_stride)) {
+                req->status = NVME_CMP_FAILURE;
+                break;
+            }
         }
-        return NVME_INVALID_OPCODE | NVME_DNR;
+        if (meta[0] && req->status == NVME_SUCCESS) {
+            pci_dma_read(&n->parent_obj, req->mptr + (lba - req->slba) * ms,
+                meta[1], nlb * ms);
+            if (memcmp(meta[0], meta[1], nlb * ms)) {
+                req->status = NVME_CMP_FAILURE;
+            }
+        }
+        lba += nlb;
+    }
+    qemu_vfree(buf[0]);
+    g_free(buf[1]);
+    g_free(meta[0]);
+    g_free(meta[1]);
 
-    default:
-        return NVME_INVALID_OPCODE | NVME_DNR;
+    if (ret) {
+        req->status = NVME_INTERNAL_DEV_ERROR;
+        nvme_set_error_page(n, sq->sqid, req->cqe.cid, req->status,
+            offsetof(NvmeRwCmd, slba), req->slba, ns->id);
     }
+    qemu_sglist_destroy(&req->qsg);
+    nvme_enqueue_req_completion(cq, req);
 }
 
-static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
+static uint16_t nvme_compare(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
+    NvmeRequest *req)
 {
-    n->sq[sq->sqid] = NULL;
-    qemu_del_timer(sq->timer);
-    qemu_free_timer(sq->timer);
-    g_free(sq->io_req);
-    if (sq->prp_list) {
-        g_free(sq->prp_list);
+    NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
+    uint16_t ctrl = le16_to_cpu(rw->control);
+    uint32_t nlb  = le16_to_cpu(rw->nlb) + 1;
+    uint64_t slba = le64_to_cpu(rw->slba);
+    uint64_t mptr = le64_to_cpu(rw->mptr);
+
+    const uint64_t elba = slba + nlb;
+    const uint8_t lba_index = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
+    const uint8_t separate = !NVME_ID_NS_FLBAS_EXTENDED(ns->id_ns.flbas);
+    const uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
+    const uint16_t ms = le16_to_cpu(ns->id_ns.lbaf[lba_index].ms);
+    const uint8_t pract = ctrl & NVME_RW_PRINFO_PRACT &&
+        ms == sizeof(NvmeDifTuple);
+    uint64_t data_size = nlb << data_shift;
+    uint16_t status;
+    Coroutine *co;
+
+    if (elba > le64_to_cpu(ns->id_ns.nsze)) {
+        nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_LBA_RANGE,
+            offsetof(NvmeRwCmd, nlb), elba, ns->id);
+        return NVME_LBA_RANGE | NVME_DNR;
     }
-    if (sq->sqid) {
-        g_free(sq);
+    if (n->id_ctrl.mdts && data_size > n->page_size * (1 << n->id_ctrl.mdts)) {
+        nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_INVALID_FIELD,
+            offsetof(NvmeRwCmd, nlb), nlb, ns->id);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    if (ms && separate && !pract && !mptr) {
+        nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_INVALID_FIELD,
+            offsetof(NvmeRwCmd, mptr), 0, ns->id);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    if (range_set_intersects(ns->uncorrectable, slba, nlb)) {
+        nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_UNRECOVERED_READ,
+            offsetof(NvmeRwCmd, slba), elba, ns->id);
+        return NVME_UNRECOVERED_READ;
     }
+
+    if (!separate && !pract) {
+        data_size += nlb * ms;
+    }
+    status = nvme_map_dptr(&req->qsg, cmd, data_size, NULL, req->sq);
+    if (status) {
+        nvme_set_error_page(n, req->sq->sqid, cmd->cid, status,
+            offsetof(NvmeRwCmd, prp1), 0, ns->id);
+        return status;
+    }
+
+    req->slba = slba;
+    req->nlb = nlb;
+    req->ns = ns;
+    req->ctrl = ctrl;
+    req->mptr = mptr;
+    req->status = NVME_SUCCESS;
+    req->aiocb = NULL;
+
+    co = qemu_coroutine_create(nvme_compare_co);
+    qemu_coroutine_enter(co, req);
+    return NVME_NO_COMPLETE;
 }
 
-static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeCmd *cmd)
+static uint16_t nvme_flush(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
+    NvmeRequest *req)
 {
-    NvmeDeleteQ *c = (NvmeDeleteQ *)cmd;
-    NvmeRequest *req, *next;
-    NvmeSQueue *sq;
-    NvmeCQueue *cq;
-    uint16_t qid = le16_to_cpu(c->qid);
-
-    if (!qid || nvme_check_sqid(n, qid)) {
-        return NVME_INVALID_QID | NVME_DNR;
+    if (bdrv_flush(ns->bs) < 0) {
+        return NVME_INTERNAL_DEV_ERROR;
+    }
+    if (n->flash_model) {
+        /* done once everything in the write buffer is programmed */
+        req->model_done = n->model.wbuf_last;
     }
+    return NVME_SUCCESS;
+}
 
-    sq = n->sq[qid];
-    while (!QTAILQ_EMPTY(&sq->out_req_list)) {
-        req = QTAILQ_FIRST(&sq->out_req_list);
-        assert(req->aiocb);
-        bdrv_aio_cancel(req->aiocb);
+static uint16_t nvme_write_uncor(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
+    NvmeRequest *req)
+{
+    NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
+    uint64_t slba = le64_to_cpu(rw->slba);
+    uint32_t nlb  = le16_to_cpu(rw->nlb) + 1;
+
+    if ((slba + nlb) > ns->id_ns.nsze) {
+        nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_LBA_RANGE,
+            offsetof(NvmeRwCmd, nlb), slba + nlb, ns->id);
+        return NVME_LBA_RANGE | NVME_DNR;
     }
-    if (!nvme_check_cqid(n, sq->cqid)) {
-        cq = n->cq[sq->cqid];
-        QTAILQ_REMOVE(&cq->sq_list, sq, entry);
+    if (n->zoned) {
+        uint16_t status = nvme_zone_write(ns, slba, nlb);
 
-        nvme_post_cqes(cq);
-        QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
-            if (req->sq == sq) {
-                QTAILQ_REMOVE(&cq->req_list, req, entry);
-                QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
-            }
+        if (status) {
+            nvme_set_error_page(n, req->sq->sqid, cmd->cid, status,
+                offsetof(NvmeRwCmd, slba), slba, ns->id);
+            return status;
         }
     }
 
-    nvme_free_sq(sq, n);
+    nvme_map_update(ns, slba, nlb, NVME_MAP_UNCORRECTABLE, 0);
     return NVME_SUCCESS;
 }
 
-static uint16_t nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
-    uint16_t sqid, uint16_t cqid, uint16_t size, enum NvmeQueueFlags prio,
-    int contig)
+/*
+ * Zero @len bytes at @offset of the namespace's drive. Whole sectors go
+ * through bdrv_co_write_zeroes, which lets the image format or file system
+ * record them as zero without data being written, or are discarded when
+ * @discard is set; only a partial sector at either end is written out.
+ * Drivers without native zeroing have the block layer write a zeroed bounce
+ * buffer the size of the request, so zeroing goes NVME_ZERO_SECTORS at a
+ * time; discards need no buffer and take much larger pieces.
+ */
+static int coroutine_fn nvme_co_zero_bytes(NvmeNamespace *ns, uint64_t offset,
+    uint64_t len, bool discard)
 {
-    int i;
-    NvmeCQueue *cq;
-
-    sq->ctrl = n;
-    sq->sqid = sqid;
-    sq->size = size;
-    sq->cqid = cqid;
-    sq->head = sq->tail = 0;
-    sq->phys_contig = contig;
-
-    if (sq->phys_contig) {
-        sq->dma_addr = dma_addr;
-    } else {
-        sq->prp_list = nvme_setup_discontig(n, dma_addr, size, n->sqe_size);
-        if (!sq->prp_list) {
-            return NVME_INVALID_FIELD | NVME_DNR;
-        }
+    uint64_t start = ROUND_UP(offset, BDRV_SECTOR_SIZE);
+    uint64_t end = (offset + len) & ~(uint64_t)(BDRV_SECTOR_SIZE - 1);
+    QEMUIOVector qiov;
+    struct iovec iov;
+    uint8_t *zeroes;
+    int ret = 0;
+
+    if (start >= end) {
+        start = end = offset + len;
     }
 
-    sq->io_req = g_malloc(sq->size * sizeof(*sq->io_req));
-    QTAILQ_INIT(&sq->req_list);
-    QTAILQ_INIT(&sq->out_req_list);
-    for (i = 0; i < sq->size; i++) {
-        sq->io_req[i].sq = sq;
-        QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
+    zeroes = g_malloc0(2 * BDRV_SECTOR_SIZE);
+    iov.iov_base = zeroes;
+    if (start > offset) {
+        iov.iov_len = MIN(start, offset + len) - offset;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = nvme_co_prw(ns->bs, offset, &qiov, 1, &ns->rmw_lock);
     }
-
-    switch (prio) {
-    case NVME_Q_PRIO_URGENT:
-        sq->arb_burst = (1 << NVME_ARB_AB(n->features.arbitration));
-        break;
-    case NVME_Q_PRIO_HIGH:
-        sq->arb_burst = NVME_ARB_HPW(n->features.arbitration) + 1;
-        break;
-    case NVME_Q_PRIO_NORMAL:
-        sq->arb_burst = NVME_ARB_MPW(n->features.arbitration) + 1;
-        break;
-    case NVME_Q_PRIO_LOW:
-    default:
-        sq->arb_burst = NVME_ARB_LPW(n->features.arbitration) + 1;
-        break;
+    if (!ret && offset + len > end && end > start) {
+        iov.iov_len = offset + len - end;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = nvme_co_prw(ns->bs, end, &qiov, 1, &ns->rmw_lock);
     }
+    g_free(zeroes);
 
-    sq->timer = qemu_new_timer_ns(vm_clock, nvme_process_sq, sq);
-
-    assert(n->cq[cqid]);
-    cq = n->cq[cqid];
-    QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
-    n->sq[sqid] = sq;
+    while (!ret && start < end) {
+        int chunk = MIN((end - start) >> BDRV_SECTOR_BITS,
+            discard ? NVME_DISCARD_SECTORS : NVME_ZERO_SECTORS);
 
-    return NVME_SUCCESS;
+        ret = discard ?
+            bdrv_co_discard(ns->bs, start >> BDRV_SECTOR_BITS, chunk) :
+            bdrv_co_write_zeroes(ns->bs, start >> BDRV_SECTOR_BITS, chunk);
+        start += (uint64_t)chunk << BDRV_SECTOR_BITS;
+    }
+    return ret;
 }
 
-static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
+/* Zero or discard a block range together with its meta-data */
+static int coroutine_fn nvme_co_erase_lbas(NvmeNamespace *ns, uint64_t slba,
+    uint64_t nlb, bool discard)
 {
-    NvmeSQueue *sq;
-    NvmeCreateSq *c = (NvmeCreateSq *)cmd;
+    const uint8_t lba_index = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
+    const uint8_t separate = !NVME_ID_NS_FLBAS_EXTENDED(ns->id_ns.flbas);
+    const uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
+    const uint16_t ms = le16_to_cpu(ns->id_ns.lbaf[lba_index].ms);
+    uint64_t aio_slba = ns->start_block + (slba << (data_shift -
+        BDRV_SECTOR_BITS));
+    int ret;
+
+    if (!ms || separate) {
+        ret = nvme_co_zero_bytes(ns, aio_slba << BDRV_SECTOR_BITS,
+            nlb << data_shift, discard);
+        if (!ret && ms) {
+            ret = nvme_co_zero_bytes(ns, ns->meta_start_offset + slba * ms,
+                nlb * ms, discard);
+        }
+    } else {
+        ret = nvme_co_zero_bytes(ns, (ns->start_block << BDRV_SECTOR_BITS) +
+            slba * ((1 << data_shift) + ms), nlb * ((1 << data_shift) + ms),
+            discard);
+    }
+    return ret;
+}
 
-    uint16_t cqid = le16_to_cpu(c->cqid);
-    uint16_t sqid = le16_to_cpu(c->sqid);
-    uint16_t qsize = le16_to_cpu(c->qsize);
-    uint16_t qflags = le16_to_cpu(c->sq_flags);
-    uint64_t prp1 = le64_to_cpu(c->prp1);
+/* Deallocate job of a Dataset Management or Zone Management Send command */
+typedef struct NvmeDsmCtx {
+    NvmeRequest *req;
+    RangeSet *extents;
+    uint8_t clear;
+} NvmeDsmCtx;
 
-    if (!cqid || nvme_check_cqid(n, cqid)) {
-        return NVME_INVALID_CQID | NVME_DNR;
-    }
-    if (!sqid || (sqid && !nvme_check_sqid(n, sqid))) {
-        return NVME_INVALID_QID | NVME_DNR;
-    }
-    if (!qsize || qsize > NVME_CAP_MQES(n->bar.cap)) {
-        return NVME_MAX_QSIZE_EXCEEDED | NVME_DNR;
-    }
-    if (!prp1 || prp1 & (n->page_size - 1)) {
-        return NVME_INVALID_FIELD | NVME_DNR;
-    }
-    if (!(NVME_SQ_FLAGS_PC(qflags)) && NVME_CAP_CQR(n->bar.cap)) {
-        return NVME_INVALID_FIELD | NVME_DNR;
-    }
+static int coroutine_fn nvme_dsm_discard(uint64_t slba, uint64_t nlb,
+    void *opaque)
+{
+    NvmeDsmCtx *ctx = opaque;
+    NvmeNamespace *ns = ctx->req->ns;
+    int ret;
 
-    sq = g_malloc0(sizeof(*sq));
-    if (nvme_init_sq(sq, n, prp1, sqid, cqid, qsize + 1,
-            NVME_SQ_FLAGS_QPRIO(qflags),
-            NVME_SQ_FLAGS_PC(qflags))) {
-        g_free(sq);
-        return NVME_INVALID_FIELD | NVME_DNR;
+    ret = nvme_co_erase_lbas(ns, slba, nlb, true);
+    if (!ret) {
+        nvme_map_update(ns, slba, nlb, NVME_MAP_DEALLOCATED, ctx->clear);
     }
-
-    return NVME_SUCCESS;
+    return ret;
 }
 
-static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
+/*
+ * Each merged extent is erased together with its meta-data, and only marked
+ * deallocated once that succeeded. The command completes when every extent
+ * is done, or at the first failure.
+ */
+static void coroutine_fn nvme_dsm_co(void *opaque)
 {
-    n->cq[cq->cqid] = NULL;
-    qemu_del_timer(cq->timer);
-    qemu_free_timer(cq->timer);
-    msix_vector_unuse(&n->parent_obj, cq->vector);
-    if (cq->prp_list) {
-        g_free(cq->prp_list);
-    }
-    if (cq->cqid) {
-        g_free(cq);
+    NvmeDsmCtx *ctx = opaque;
+    NvmeRequest *req = ctx->req;
+    NvmeSQueue *sq = req->sq;
+    NvmeCtrl *n = sq->ctrl;
+
+    if (range_set_foreach(ctx->extents, nvme_dsm_discard, ctx) &&
+            req->status == NVME_SUCCESS) {
+        req->status = NVME_INTERNAL_DEV_ERROR;
+        nvme_set_error_page(n, sq->sqid, req->cqe.cid, req->status,
+            offsetof(NvmeCmd, cdw10), 0, req->ns->id);
     }
+    range_set_free(ctx->extents);
+    g_free(ctx);
+    nvme_enqueue_req_completion(n->cq[sq->cqid], req);
 }
 
-static uint16_t nvme_del_cq(NvmeCtrl *n, NvmeCmd *cmd)
+/*
+ * Deallocates @extents, which the job frees, and completes @req after.
+ * Every extent erased also loses the @clear map flags.
+ */
+static uint16_t nvme_dsm_start(NvmeRequest *req, RangeSet *extents,
+    uint8_t clear)
 {
-    NvmeDeleteQ *c = (NvmeDeleteQ *)cmd;
-    NvmeCQueue *cq;
-    uint16_t qid = le16_to_cpu(c->qid);
+    NvmeDsmCtx *ctx = g_new(NvmeDsmCtx, 1);
+    Coroutine *co;
+
+    ctx->req = req;
+    ctx->extents = extents;
+    ctx->clear = clear;
+    co = qemu_coroutine_create(nvme_dsm_co);
+    qemu_coroutine_enter(co, ctx);
+    return NVME_NO_COMPLETE;
+}
 
-    if (!qid || nvme_check_cqid(n, qid)) {
-        return NVME_INVALID_CQID | NVME_DNR;
+/*
+ * Deallocate merges the ranges into sorted extents first. The blocks read
+ * back as zeroes once the command completed, whether or not the backing
+ * drive honours the discard.
+ */
+static uint16_t nvme_dsm(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
+    NvmeRequest *req)
+{
+    uint32_t dw10 = le32_to_cpu(cmd->cdw10);
+    uint32_t dw11 = le32_to_cpu(cmd->cdw11);
+    uint16_t nr = (dw10 & 0xff) + 1;
+    NvmeDsmRange *range;
+    RangeSet *extents;
+    uint16_t status;
+    int i;
+
+    if (!(dw11 & NVME_DSMGMT_AD)) {
+        return NVME_SUCCESS;
     }
 
-    cq = n->cq[qid];
-    if (!QTAILQ_EMPTY(&cq->sq_list)) {
-        return NVME_INVALID_QUEUE_DEL;
+    range = g_new(NvmeDsmRange, nr);
+    status = nvme_dma_write_dptr(req->sq, (uint8_t *)range,
+        nr * sizeof(*range), cmd);
+    if (status) {
+        nvme_set_error_page(n, req->sq->sqid, cmd->cid, status,
+            offsetof(NvmeCmd, prp1), 0, ns->id);
+        g_free(range);
+        return status;
     }
-    nvme_free_cq(cq, n);
-    return NVME_SUCCESS;
-}
 
-static uint16_t nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
-    uint16_t cqid, uint16_t vector, uint16_t size, uint16_t irq_enabled,
-    int contig)
-{
-    cq->ctrl = n;
-    cq->cqid = cqid;
-    cq->size = size;
-    cq->phase = 1;
-    cq->irq_enabled = irq_enabled;
-    cq->vector = vector;
-    cq->head = cq->tail = 0;
-    cq->phys_contig = contig;
-    if (cq->phys_contig) {
-        cq->dma_addr = dma_addr;
-    } else {
-        cq->prp_list = nvme_setup_discontig(n, dma_addr, size,
-            n->cqe_size);
-        if (!cq->prp_list) {
-            return NVME_INVALID_FIELD | NVME_DNR;
+    extents = range_set_new();
+    for (i = 0; i < nr; i++) {
+        uint64_t slba = le64_to_cpu(range[i].slba);
+        uint32_t nlb = le32_to_cpu(range[i].nlb);
+
+        if (slba + nlb > le64_to_cpu(ns->id_ns.nsze)) {
+            nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_LBA_RANGE,
+                offsetof(NvmeCmd, cdw10), slba + nlb, ns->id);
+            range_set_free(extents);
+            g_free(range);
+            return NVME_LBA_RANGE | NVME_DNR;
         }
+        range_set_add(extents, slba, nlb);
     }
-    QTAILQ_INIT(&cq->req_list);
-    QTAILQ_INIT(&cq->sq_list);
-    msix_vector_use(&n->parent_obj, cq->vector);
-    n->cq[cqid] = cq;
-    cq->timer = qemu_new_timer_ns(vm_clock, nvme_post_cqes, cq);
+    g_free(range);
 
-    return NVME_SUCCESS;
+    req->ns = ns;
+    req->status = NVME_SUCCESS;
+    req->aiocb = NULL;
+    return nvme_dsm_start(req, extents, NVME_MAP_UTIL);
 }
 
-static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
+static void coroutine_fn nvme_write_zeros_co(void *opaque)
 {
-    NvmeCQueue *cq;
-    NvmeCreateCq *c = (NvmeCreateCq *)cmd;
-    uint16_t cqid = le16_to_cpu(c->cqid);
-    uint16_t vector = le16_to_cpu(c->irq_vector);
-    uint16_t qsize = le16_to_cpu(c->qsize);
-    uint16_t qflags = le16_to_cpu(c->cq_flags);
-    uint64_t prp1 = le64_to_cpu(c->prp1);
+    NvmeRequest *req = opaque;
+    NvmeSQueue *sq = req->sq;
+    NvmeCtrl *n = sq->ctrl;
+    NvmeCQueue *cq = n->cq[sq->cqid];
+    NvmeNamespace *ns = req->ns;
+    int ret;
 
-    if (!cqid || (cqid && !nvme_check_cqid(n, cqid))) {
-        return NVME_INVALID_CQID | NVME_DNR;
-    }
-    if (!qsize || qsize > NVME_CAP_MQES(n->bar.cap)) {
-        return NVME_MAX_QSIZE_EXCEEDED | NVME_DNR;
-    }
-    if (!prp1) {
-        return NVME_INVALID_FIELD | NVME_DNR;
-    }
-    if (vector > n->num_queues) {
-        return NVME_INVALID_IRQ_VECTOR | NVME_DNR;
-    }
-    if (!(NVME_CQ_FLAGS_PC(qflags)) && NVME_CAP_CQR(n->bar.cap)) {
-        return NVME_INVALID_FIELD | NVME_DNR;
-    }
+    ret = nvme_co_erase_lbas(ns, req->slba, req->nlb, false);
 
-    cq = g_malloc0(sizeof(*cq));
-    nvme_init_cq(cq, n, prp1, cqid, vector, qsize + 1,
-        NVME_CQ_FLAGS_IEN(qflags), NVME_CQ_FLAGS_PC(qflags));
-    return NVME_SUCCESS;
+    bdrv_acct_done(ns->bs, &req->acct);
+    if (ret) {
+        req->status = NVME_INTERNAL_DEV_ERROR;
+        nvme_set_error_page(n, sq->sqid, req->cqe.cid, req->status,
+            offsetof(NvmeRwCmd, slba), req->slba, ns->id);
+    }
+    nvme_enqueue_req_completion(cq, req);
 }
 
-static uint16_t nvme_identify(NvmeCtrl *n, NvmeCmd *cmd)
+/*
+ * Zeroed blocks count as unwritten afterwards, so protection information
+ * is not checked on them until they are written again.
+ */
+static uint16_t nvme_write_zeros(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
+    NvmeRequest *req)
 {
-    NvmeNamespace *ns;
-    NvmeIdentify *c = (NvmeIdentify *)cmd;
-    uint32_t cns  = le32_to_cpu(c->cns);
-    uint32_t nsid = le32_to_cpu(c->nsid);
-    uint64_t prp1 = le64_to_cpu(c->prp1);
-    uint64_t prp2 = le64_to_cpu(c->prp2);
+    NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
+    uint64_t slba = le64_to_cpu(rw->slba);
+    uint32_t nlb  = le16_to_cpu(rw->nlb) + 1;
+    uint8_t lba_index = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
+    Coroutine *co;
 
-    if (cns) {
-        return nvme_dma_read_prp(n, (uint8_t *)&n->id_ctrl, sizeof(n->id_ctrl),
-            prp1, prp2);
+    if ((slba + nlb) > le64_to_cpu(ns->id_ns.nsze)) {
+        nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_LBA_RANGE,
+            offsetof(NvmeRwCmd, nlb), slba + nlb, ns->id);
+        return NVME_LBA_RANGE | NVME_DNR;
     }
+    if (n->zoned) {
+        uint16_t status = nvme_zone_write(ns, slba, nlb);
 
-    if (nsid == 0 || nsid > n->num_namespaces) {
-        return NVME_INVALID_NSID | NVME_DNR;
+        if (status) {
+            nvme_set_error_page(n, req->sq->sqid, cmd->cid, status,
+                offsetof(NvmeRwCmd, slba), slba, ns->id);
+            return status;
+        }
     }
-    ns = &n->namespaces[nsid - 1];
-    return nvme_dma_read_prp(n, (uint8_t *)&ns->id_ns, sizeof(ns->id_ns),
-        prp1, prp2);
+
+    req->slba = slba;
+    req->nlb = nlb;
+    req->ns = ns;
+    req->status = NVME_SUCCESS;
+    req->aiocb = NULL;
+    nvme_map_update(ns, slba, nlb, 0, NVME_MAP_ALL);
+
+    bdrv_acct_start(ns->bs, &req->acct, (uint64_t)nlb <<
+        ns->id_ns.lbaf[lba_index].ds, BDRV_ACCT_WRITE);
+    co = qemu_coroutine_create(nvme_write_zeros_co);
+    qemu_coroutine_enter(co, req);
+    return NVME_NO_COMPLETE;
 }
 
-static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+static bool nvme_zone_select_all(uint8_t action, uint8_t state)
 {
-    NvmeRangeType *rt;
-    uint32_t dw10 = le32_to_cpu(cmd->cdw10);
-    uint32_t dw11 = le32_to_cpu(cmd->cdw11);
-    uint32_t nsid = le32_to_cpu(cmd->nsid);
-    uint64_t prp1 = le64_to_cpu(cmd->prp1);
-    uint64_t prp2 = le64_to_cpu(cmd->prp2);
+    switch (action) {
+    case NVME_ZONE_ACTION_CLOSE:
+        return nvme_zone_is_open(state);
+    case NVME_ZONE_ACTION_FINISH:
+        return nvme_zone_is_active(state);
+    case NVME_ZONE_ACTION_OPEN:
+        return state == NVME_ZONE_STATE_CLOSED;
+    case NVME_ZONE_ACTION_RESET:
+        return nvme_zone_is_active(state) || state == NVME_ZONE_STATE_FULL;
+    case NVME_ZONE_ACTION_OFFLINE:
+        return state == NVME_ZONE_STATE_READ_ONLY;
+    default:
+        return false;
+    }
+}
 
-    switch (dw10) {
-    case NVME_ARBITRATION:
-        req->cqe.result = cpu_to_le32(n->features.arbitration);
-        break;
-    case NVME_POWER_MANAGEMENT:
-        req->cqe.result = cpu_to_le32(n->features.power_mgmt);
-        break;
-    case NVME_LBA_RANGE_TYPE:
-        if (nsid == 0 || nsid > n->num_namespaces) {
-            return NVME_INVALID_NSID | NVME_DNR;
+/*
+ * Resetting a zone adds it to @extents, which are then deallocated the way
+ * Dataset Management does, so its blocks read back as zeroes until they are
+ * written again. Blocks marked uncorrectable only lose that mark once their
+ * zone was erased.
+ */
+static uint16_t nvme_zone_action(NvmeNamespace *ns, NvmeZone *zone,
+    uint8_t action, RangeSet *extents)
+{
+    uint64_t zslba = nvme_zone_slba(ns, zone);
+
+    switch (action) {
+    case NVME_ZONE_ACTION_CLOSE:
+        switch (zone->state) {
+        case NVME_ZONE_STATE_IMPL_OPEN:
+        case NVME_ZONE_STATE_EXPL_OPEN:
+            nvme_zone_close(ns, zone);
+            /* fall through */
+        case NVME_ZONE_STATE_CLOSED:
+            return NVME_SUCCESS;
         }
-        rt = n->namespaces[nsid - 1].lba_range;
-        return nvme_dma_read_prp(n, (uint8_t *)rt,
-            MIN(sizeof(*rt), (dw11 & 0x3f) * sizeof(*rt)),
-            prp1, prp2);
-    case NVME_TEMPERATURE_THRESHOLD:
-        req->cqe.result = cpu_to_le32(n->features.temp_thresh);
-        break;
-    case NVME_ERROR_RECOVERY:
-        req->cqe.result = cpu_to_le32(n->features.err_rec);
         break;
-    case NVME_VOLATILE_WRITE_CACHE:
-        req->cqe.result = cpu_to_le32(n->features.volatile_wc);
+    case NVME_ZONE_ACTION_FINISH:
+        switch (zone->state) {
+        case NVME_ZONE_STATE_EMPTY:
+        case NVME_ZONE_STATE_IMPL_OPEN:
+        case NVME_ZONE_STATE_EXPL_OPEN:
+        case NVME_ZONE_STATE_CLOSED:
+            zone->wp = zslba + ns->zone_size;
+            nvme_zone_set_state(ns, zone, NVME_ZONE_STATE_FULL);
+            /* fall through */
+        case NVME_ZONE_STATE_FULL:
+            return NVME_SUCCESS;
+        }
         break;
-    case NVME_NUMBER_OF_QUEUES:
-        req->cqe.result = cpu_to_le32(n->num_queues | (n->num_queues << 16));
+    case NVME_ZONE_ACTION_OPEN:
+        return nvme_zone_open(ns, zone, NVME_ZONE_STATE_EXPL_OPEN);
+    case NVME_ZONE_ACTION_RESET:
+        switch (zone->state) {
+        case NVME_ZONE_STATE_IMPL_OPEN:
+        case NVME_ZONE_STATE_EXPL_OPEN:
+        case NVME_ZONE_STATE_CLOSED:
+        case NVME_ZONE_STATE_FULL:
+            zone->wp = zslba;
+            nvme_zone_set_state(ns, zone, NVME_ZONE_STATE_EMPTY);
+            range_set_add(extents, zslba, ns->zone_size);
+            /* fall through */
+        case NVME_ZONE_STATE_EMPTY:
+            return NVME_SUCCESS;
+        }
         break;
-    case NVME_INTERRUPT_COALESCING:
-        req->cqe.result = cpu_to_le32(n->features.int_coalescing);
+    case NVME_ZONE_ACTION_OFFLINE:
+        switch (zone->state) {
+        case NVME_ZONE_STATE_READ_ONLY:
+            nvme_zone_set_state(ns, zone, NVME_ZONE_STATE_OFFLINE);
+            /* fall through */
+        case NVME_ZONE_STATE_OFFLINE:
+            return NVME_SUCCESS;
+        }
         break;
-    case NVME_INTERRUPT_VECTOR_CONF:
-        if ((dw11 & 0xffff) > n->num_queues) {
+    }
+    return NVME_ZONE_INVAL_TRANSITION | NVME_DNR;
+}
+
+/*
+ * Zone Management Send acts on the zone starting at SLBA, or with Select All
+ * on every zone in a state the action applies to. Resets complete once
+ * their discards have.
+ */
+static uint16_t nvme_zone_mgmt_send(NvmeCtrl *n, NvmeNamespace *ns,
+    NvmeCmd *cmd, NvmeRequest *req)
+{
+    NvmeZoneMgmtCmd *c = (NvmeZoneMgmtCmd *)cmd;
+    uint64_t slba = le64_to_cpu(c->slba);
+    uint32_t dw13 = le32_to_cpu(c->action);
+    uint8_t action = NVME_ZONE_SEND_ACTION(dw13);
+    uint16_t status = NVME_SUCCESS;
+    RangeSet *extents;
+    uint32_t i;
+
+    if (action < NVME_ZONE_ACTION_CLOSE || action > NVME_ZONE_ACTION_OFFLINE) {
+        nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_INVALID_FIELD,
+            offsetof(NvmeZoneMgmtCmd, action), dw13, ns->id);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    if (!NVME_ZONE_SEND_ALL(dw13)) {
+        if (slba >= le64_to_cpu(ns->id_ns.nsze)) {
+            nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_LBA_RANGE,
+                offsetof(NvmeZoneMgmtCmd, slba), slba, ns->id);
+            return NVME_LBA_RANGE | NVME_DNR;
+        }
+        if (slba % ns->zone_size) {
+            nvme_set_error_page(n, req->sq->sqid, cmd->cid,
+                NVME_INVALID_FIELD, offsetof(NvmeZoneMgmtCmd, slba), slba,
+                ns->id);
             return NVME_INVALID_FIELD | NVME_DNR;
         }
-        req->cqe.result = cpu_to_le32(
-            n->features.int_vector_config[dw11 & 0xffff]);
-        break;
-    case NVME_WRITE_ATOMICITY:
-        req->cqe.result = cpu_to_le32(n->features.write_atomicity);
-        break;
-    case NVME_ASYNCHRONOUS_EVENT_CONF:
-        req->cqe.result = cpu_to_le32(n->features.async_config);
-        break;
-    case NVME_SOFTWARE_PROGRESS_MARKER:
-        req->cqe.result = cpu_to_le32(n->features.sw_prog_marker);
-        break;
+    }
+
+    req->ns = ns;
+    req->status = NVME_SUCCESS;
+    req->aiocb = NULL;
+
+    extents = range_set_new();
+    if (NVME_ZONE_SEND_ALL(dw13)) {
+        for (i = 0; !status && i < ns->nr_zones; i++) {
+            if (nvme_zone_select_all(action, ns->zones[i].state)) {
+                status = nvme_zone_action(ns, &ns->zones[i], action,
+                    extents);
+            }
+        }
+    } else {
+        status = nvme_zone_action(ns, nvme_get_zone(ns, slba), action,
+            extents);
+    }
+    if (status) {
+        req->status = status;
+        nvme_set_error_page(n, req->sq->sqid, cmd->cid, status,
+            offsetof(NvmeZoneMgmtCmd, action), dw13, ns->id);
+    }
+    return nvme_dsm_start(req, extents,
+        NVME_MAP_UTIL | NVME_MAP_UNCORRECTABLE);
+}
+
+static bool nvme_zone_report_match(uint8_t filter, uint8_t state)
+{
+    switch (filter) {
+    case NVME_ZONE_REPORT_ALL:
+        return true;
+    case NVME_ZONE_REPORT_EMPTY:
+        return state == NVME_ZONE_STATE_EMPTY;
+    case NVME_ZONE_REPORT_IMPL_OPEN:
+        return state == NVME_ZONE_STATE_IMPL_OPEN;
+    case NVME_ZONE_REPORT_EXPL_OPEN:
+        return state == NVME_ZONE_STATE_EXPL_OPEN;
+    case NVME_ZONE_REPORT_CLOSED:
+        return state == NVME_ZONE_STATE_CLOSED;
+    case NVME_ZONE_REPORT_FULL:
+        return state == NVME_ZONE_STATE_FULL;
+    case NVME_ZONE_REPORT_READ_ONLY:
+        return state == NVME_ZONE_STATE_READ_ONLY;
+    case NVME_ZONE_REPORT_OFFLINE:
+        return state == NVME_ZONE_STATE_OFFLINE;
     default:
+        return false;
+    }
+}
+
+/*
+ * Report Zones describes the zones matching the filter from the one holding
+ * SLBA on. The header counts every matching zone up to the end of the
+ * namespace, or with Partial Report only those that fit in the buffer.
+ */
+static uint16_t nvme_zone_mgmt_recv(NvmeCtrl *n, NvmeNamespace *ns,
+    NvmeCmd *cmd, NvmeRequest *req)
+{
+    NvmeZoneMgmtCmd *c = (NvmeZoneMgmtCmd *)cmd;
+    uint64_t slba = le64_to_cpu(c->slba);
+    uint32_t dw13 = le32_to_cpu(c->action);
+    uint64_t len = ((uint64_t)le32_to_cpu(c->numdw) + 1) << 2;
+    uint8_t filter = NVME_ZONE_RECV_FILTER(dw13);
+    NvmeZoneReportHdr *hdr;
+    NvmeZoneDescr *descr;
+    uint64_t nr = 0, max;
+    uint16_t status;
+    uint8_t *buf;
+    uint32_t i;
+
+    if (NVME_ZONE_RECV_ACTION(dw13) != NVME_ZONE_REPORT ||
+            filter > NVME_ZONE_REPORT_OFFLINE || len < sizeof(*hdr) ||
+            (n->id_ctrl.mdts && len > n->page_size * (1 << n->id_ctrl.mdts))) {
+        nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_INVALID_FIELD,
+            offsetof(NvmeZoneMgmtCmd, numdw), len, ns->id);
         return NVME_INVALID_FIELD | NVME_DNR;
     }
-    return NVME_SUCCESS;
+    if (slba >= le64_to_cpu(ns->id_ns.nsze)) {
+        nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_LBA_RANGE,
+            offsetof(NvmeZoneMgmtCmd, slba), slba, ns->id);
+        return NVME_LBA_RANGE | NVME_DNR;
+    }
+
+    len = MIN(len, sizeof(*hdr) + ns->nr_zones * sizeof(*descr));
+    buf = g_malloc0(len);
+    hdr = (NvmeZoneReportHdr *)buf;
+    descr = (NvmeZoneDescr *)(hdr + 1);
+    max = (len - sizeof(*hdr)) / sizeof(*descr);
+    for (i = slba / ns->zone_size; i < ns->nr_zones; i++) {
+        NvmeZone *zone = &ns->zones[i];
+
+        if (!nvme_zone_report_match(filter, zone->state)) {
+            continue;
+        }
+        if (nr < max) {
+            descr[nr].zt = NVME_ZONE_TYPE_SEQ_WRITE;
+            descr[nr].zs = zone->state << 4;
+            descr[nr].zcap = cpu_to_le64(ns->zone_size);
+            descr[nr].zslba = cpu_to_le64(nvme_zone_slba(ns, zone));
+            descr[nr].wp = cpu_to_le64(zone->wp);
+            if (zone->state == NVME_ZONE_STATE_READ_ONLY ||
+                    zone->state == NVME_ZONE_STATE_OFFLINE) {
+                descr[nr].wp = cpu_to_le64(~0ULL);
+            }
+        } else if (NVME_ZONE_RECV_PARTIAL(dw13)) {
+            break;
+        }
+        nr++;
+    }
+    hdr->nr_zones = cpu_to_le64(nr);
+
+    status = nvme_dma_read_dptr(req->sq, buf, len, cmd);
+    if (status) {
+        nvme_set_error_page(n, req->sq->sqid, cmd->cid, status,
+            offsetof(NvmeCmd, prp1), 0, ns->id);
+    }
+    g_free(buf);
+    return status;
 }
 
-static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+/*
+ * Zone Append writes at the zone's write pointer, wherever that is when the
+ * command is fetched, and returns the LBA it wrote to. The data goes to the
+ * drive as an ordinary write at that LBA, so appends to a zone land in the
+ * backing file sequentially, in the order they were fetched. The zone is
+ * checked here: the write pointer of a full zone is the start of the next
+ * one, which the ordinary write would otherwise accept.
+ */
+static uint16_t nvme_zone_append(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
+    NvmeRequest *req)
 {
-    NvmeRangeType *rt;
-    uint32_t dw10 = le32_to_cpu(cmd->cdw10);
-    uint32_t dw11 = le32_to_cpu(cmd->cdw11);
+    NvmeRwCmd rw = *(NvmeRwCmd *)cmd;
+    uint64_t slba = le64_to_cpu(rw.slba);
+    uint32_t nlb = le16_to_cpu(rw.nlb) + 1;
+    uint8_t lba_index = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
+    uint64_t data_size = (uint64_t)nlb << ns->id_ns.lbaf[lba_index].ds;
+    NvmeZone *zone;
+    uint16_t status;
+    uint64_t wp;
+
+    if (slba >= le64_to_cpu(ns->id_ns.nsze) || slba % ns->zone_size) {
+        nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_INVALID_FIELD,
+            offsetof(NvmeRwCmd, slba), slba, ns->id);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    if (n->zasl && data_size > (1ULL << (12 + n->mpsmin + n->zasl))) {
+        nvme_set_error_page(n, req->sq->sqid, cmd->cid, NVME_INVALID_FIELD,
+            offsetof(NvmeRwCmd, nlb), nlb, ns->id);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    zone = nvme_get_zone(ns, slba);
+    status = nvme_zone_writable(ns, zone, zone->wp, nlb);
+    if (status) {
+        nvme_set_error_page(n, req->sq->sqid, cmd->cid, status,
+            offsetof(NvmeRwCmd, slba), slba, ns->id);
+        return status;
+    }
+
+    wp = zone->wp;
+    rw.opcode = NVME_CMD_WRITE;
+    rw.slba = cpu_to_le64(wp);
+    req->cqe.result = cpu_to_le32(wp);
+    req->cqe.rsvd = cpu_to_le32(wp >> 32);
+    return nvme_rw(n, ns, (NvmeCmd *)&rw, req);
+}
+
+static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    NvmeNamespace *ns;
     uint32_t nsid = le32_to_cpu(cmd->nsid);
-    uint64_t prp1 = le64_to_cpu(cmd->prp1);
-    uint64_t prp2 = le64_to_cpu(cmd->prp2);
 
-    switch (dw10) {
-    case NVME_ARBITRATION:
-        req->cqe.result = cpu_to_le32(n->features.arbitration);
-        break;
-    case NVME_POWER_MANAGEMENT:
-        n->features.power_mgmt = dw11;
-        break;
-    case NVME_LBA_RANGE_TYPE:
-        if (nsid == 0 || nsid > n->num_namespaces) {
-            return NVME_INVALID_NSID | NVME_DNR;
+    if (nsid == 0 || nsid > n->num_namespaces) {
+        return NVME_INVALID_NSID | NVME_DNR;
+    }
+
+    ns = &n->namespaces[nsid - 1];
+    if (ns->formatting) {
+        return NVME_FORMAT_IN_PROGRESS;
+    }
+    switch (cmd->opcode) {
+    case NVME_CMD_WRITE:
+    case NVME_CMD_READ:
+        return nvme_rw(n, ns, cmd, req);
+
+    case NVME_CMD_FLUSH:
+        if (!n->id_ctrl.vwc || !n->features.volatile_wc) {
+            return NVME_SUCCESS;
         }
-        rt = n->namespaces[nsid - 1].lba_range;
-        return nvme_dma_write_prp(n, (uint8_t *)rt,
-            MIN(sizeof(*rt), (dw11 & 0x3f) * sizeof(*rt)),
-            prp1, prp2);
-    case NVME_NUMBER_OF_QUEUES:
-        req->cqe.result = cpu_to_le32(n->num_queues | (n->num_queues << 16));
-        break;
-    case NVME_TEMPERATURE_THRESHOLD:
-        n->features.temp_thresh = dw11;
-        if (n->features.temp_thresh <= n->temperature && !n->temp_warn_issued) {
-            n->temp_warn_issued = 1;
-            nvme_enqueue_event(n, NVME_AER_TYPE_SMART,
-                    NVME_AER_INFO_SMART_TEMP_THRESH,
-                    NVME_LOG_SMART_INFO);
-        } else if (n->features.temp_thresh > n->temperature &&
-                !(n->aer_mask & 1 << NVME_AER_TYPE_SMART)) {
-            n->temp_warn_issued = 0;
+        return nvme_flush(n, ns, cmd, req);
+
+    case NVME_CMD_DSM:
+        if (NVME_ONCS_DSM & n->oncs) {
+            return nvme_dsm(n, ns, cmd, req);
         }
-        break;
-    case NVME_ERROR_RECOVERY:
-        n->features.err_rec = dw11;
-        break;
-    case NVME_VOLATILE_WRITE_CACHE:
-        n->features.volatile_wc = dw11;
-        break;
-    case NVME_INTERRUPT_COALESCING:
-        break;
-    case NVME_INTERRUPT_VECTOR_CONF:
-        if ((dw11 & 0xffff) > n->num_queues) {
-            return NVME_INVALID_FIELD | NVME_DNR;
+        return NVME_INVALID_OPCODE | NVME_DNR;
+
+    case NVME_CMD_WRITE_ZEROS:
+        if (NVME_ONCS_WRITE_ZEROS & n->oncs) {
+            return nvme_write_zeros(n, ns, cmd, req);
+        }
+        return NVME_INVALID_OPCODE | NVME_DNR;
+
+    case NVME_CMD_COMPARE:
+        if (NVME_ONCS_COMPARE & n->oncs) {
+            return nvme_compare(n, ns, cmd, req);
+        }
+        return NVME_INVALID_OPCODE | NVME_DNR;
+
+    case NVME_CMD_WRITE_UNCOR:
+        if (NVME_ONCS_WRITE_UNCORR & n->oncs) {
+            return nvme_write_uncor(n, ns, cmd, req);
+        }
+        return NVME_INVALID_OPCODE | NVME_DNR;
+
+    case NVME_CMD_ZONE_MGMT_SEND:
+        if (n->zoned) {
+            return nvme_zone_mgmt_send(n, ns, cmd, req);
+        }
+        return NVME_INVALID_OPCODE | NVME_DNR;
+
+    case NVME_CMD_ZONE_MGMT_RECV:
+        if (n->zoned) {
+            return nvme_zone_mgmt_recv(n, ns, cmd, req);
+        }
+        return NVME_INVALID_OPCODE | NVME_DNR;
+
+    case NVME_CMD_ZONE_APPEND:
+        if (n->zoned) {
+            return nvme_zone_append(n, ns, cmd, req);
+        }
+        return NVME_INVALID_OPCODE | NVME_DNR;
+
+    default:
+        return NVME_INVALID_OPCODE | NVME_DNR;
+    }
+}
+
+static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
+{
+    n->sq[sq->sqid] = NULL;
+    nvme_arb_dequeue(n, sq);
+    nvme_stop_sq_ioeventfd(n, sq);
+    event_notifier_set_handler(&sq->notifier, NULL);
+    event_notifier_cleanup(&sq->notifier);
+    g_free(sq->io_req);
+    g_free(sq->prp_scratch);
+    if (sq->prp_list) {
+        g_free(sq->prp_list);
+    }
+    if (sq->sqid) {
+        g_free(sq);
+    }
+}
+
+/*
+ * Posts what the SQ's commands completed with, as far as the CQ has room,
+ * drops the rest and frees the SQ. Completes the Delete I/O SQ command if
+ * it had to wait for commands in flight.
+ */
+static void nvme_del_sq_done(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    NvmeRequest *del_req = sq->del_req;
+    NvmeRequest *req, *next;
+    NvmeCQueue *cq;
+
+    if (!nvme_check_cqid(n, sq->cqid)) {
+        cq = n->cq[sq->cqid];
+        QTAILQ_REMOVE(&cq->sq_list, sq, entry);
+
+        QTAILQ_FOREACH_SAFE(req, &n->model.reqs, entry, next) {
+            if (req->sq == sq) {
+                nvme_model_post(n, req);
+            }
+        }
+        nvme_post_cqes(cq);
+        QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
+            if (req->sq == sq) {
+                QTAILQ_REMOVE(&cq->req_list, req, entry);
+                QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
+            }
+        }
+    }
+
+    nvme_free_sq(sq, n);
+    if (del_req) {
+        del_req->status = NVME_SUCCESS;
+        nvme_enqueue_req_completion(n->cq[0], del_req);
+    }
+}
+
+/*
+ * Commands still in flight are not waited for here: the SQ stops fetching
+ * and the command completes once the last of them does.
+ */
+static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    NvmeDeleteQ *c = (NvmeDeleteQ *)cmd;
+    NvmeSQueue *sq;
+    uint16_t qid = le16_to_cpu(c->qid);
+
+    if (!qid || nvme_check_sqid(n, qid) || n->sq[qid]->del_req) {
+        return NVME_INVALID_QID | NVME_DNR;
+    }
+
+    sq = n->sq[qid];
+    nvme_arb_dequeue(n, sq);
+    if (!QTAILQ_EMPTY(&sq->out_req_list)) {
+        sq->del_req = req;
+        return NVME_NO_COMPLETE;
+    }
+
+    nvme_del_sq_done(n, sq);
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
+    uint16_t sqid, uint16_t cqid, uint16_t size, enum NvmeQueueFlags prio,
+    int contig)
+{
+    int i;
+    NvmeCQueue *cq;
+
+    sq->ctrl = n;
+    sq->sqid = sqid;
+    sq->size = size;
+    sq->cqid = cqid;
+    sq->head = sq->tail = 0;
+    sq->phys_contig = contig;
+    sq->inflight = 0;
+    sq->del_req = NULL;
+    memset(&sq->stats, 0, sizeof(sq->stats));
+
+    /* for discontiguous queues this is the PRP list, kept for migration */
+    sq->dma_addr = dma_addr;
+    if (!sq->phys_contig) {
+        sq->prp_list = nvme_setup_discontig(n, dma_addr, size, n->sqe_size);
+        if (!sq->prp_list) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+    }
+    if (event_notifier_init(&sq->notifier, 0)) {
+        g_free(sq->prp_list);
+        sq->prp_list = NULL;
+        return NVME_INTERNAL_DEV_ERROR;
+    }
+
+    sq->io_req = g_malloc(sq->size * sizeof(*sq->io_req));
+    sq->prp_scratch = g_malloc(n->max_prp_ents * sizeof(*sq->prp_scratch));
+    QTAILQ_INIT(&sq->req_list);
+    QTAILQ_INIT(&sq->out_req_list);
+    for (i = 0; i < sq->size; i++) {
+        sq->io_req[i].sq = sq;
+        QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
+    }
+
+    sq->prio = prio;
+    sq->arb_queued = 0;
+    if (!sqid) {
+        sq->arb_class = NVME_ARB_ADMIN;
+    } else if (NVME_CC_AMS(n->bar.cc) != NVME_CC_AMS_WRRU) {
+        sq->arb_class = NVME_ARB_MEDIUM;
+    } else {
+        switch (prio) {
+        case NVME_Q_PRIO_URGENT:
+            sq->arb_class = NVME_ARB_URGENT;
+            break;
+        case NVME_Q_PRIO_HIGH:
+            sq->arb_class = NVME_ARB_HIGH;
+            break;
+        case NVME_Q_PRIO_NORMAL:
+            sq->arb_class = NVME_ARB_MEDIUM;
+            break;
+        case NVME_Q_PRIO_LOW:
+        default:
+            sq->arb_class = NVME_ARB_LOW;
+            break;
+        }
+    }
+
+    event_notifier_set_handler(&sq->notifier, nvme_sq_notifier);
+    if (sqid && n->dbbuf_dbs) {
+        nvme_sq_init_dbbuf(n, sq);
+    }
+
+    assert(n->cq[cqid]);
+    cq = n->cq[cqid];
+    QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
+    n->sq[sqid] = sq;
+
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    NvmeSQueue *sq;
+    NvmeCreateSq *c = (NvmeCreateSq *)cmd;
+
+    uint16_t cqid = le16_to_cpu(c->cqid);
+    uint16_t sqid = le16_to_cpu(c->sqid);
+    uint16_t qsize = le16_to_cpu(c->qsize);
+    uint16_t qflags = le16_to_cpu(c->sq_flags);
+    uint64_t prp1 = le64_to_cpu(c->prp1);
+
+    if (!cqid || nvme_check_cqid(n, cqid)) {
+        return NVME_INVALID_CQID | NVME_DNR;
+    }
+    if (!sqid || (sqid && !nvme_check_sqid(n, sqid))) {
+        return NVME_INVALID_QID | NVME_DNR;
+    }
+    if (!qsize || qsize > NVME_CAP_MQES(n->bar.cap)) {
+        return NVME_MAX_QSIZE_EXCEEDED | NVME_DNR;
+    }
+    if (!prp1 || prp1 & (n->page_size - 1)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    if (!(NVME_SQ_FLAGS_PC(qflags)) && NVME_CAP_CQR(n->bar.cap)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    sq = g_malloc0(sizeof(*sq));
+    if (nvme_init_sq(sq, n, prp1, sqid, cqid, qsize + 1,
+            NVME_SQ_FLAGS_QPRIO(qflags),
+            NVME_SQ_FLAGS_PC(qflags))) {
+        g_free(sq);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    return NVME_SUCCESS;
+}
+
+static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
+{
+    n->cq[cq->cqid] = NULL;
+    qemu_bh_delete(cq->bh);
+    qemu_del_timer(cq->intc_timer);
+    qemu_free_timer(cq->intc_timer);
+    g_free(cq->cqe_buf);
+    msix_vector_unuse(&n->parent_obj, cq->vector);
+    if (cq->prp_list) {
+        g_free(cq->prp_list);
+    }
+    if (cq->cqid) {
+        g_free(cq);
+    }
+}
+
+static uint16_t nvme_del_cq(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    NvmeDeleteQ *c = (NvmeDeleteQ *)cmd;
+    NvmeCQueue *cq;
+    uint16_t qid = le16_to_cpu(c->qid);
+
+    if (!qid || nvme_check_cqid(n, qid)) {
+        return NVME_INVALID_CQID | NVME_DNR;
+    }
+
+    cq = n->cq[qid];
+    if (!QTAILQ_EMPTY(&cq->sq_list)) {
+        return NVME_INVALID_QUEUE_DEL;
+    }
+    nvme_free_cq(cq, n);
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
+    uint16_t cqid, uint16_t vector, uint16_t size, uint16_t irq_enabled,
+    int contig)
+{
+    cq->ctrl = n;
+    cq->cqid = cqid;
+    cq->size = size;
+    cq->phase = 1;
+    cq->irq_enabled = irq_enabled;
+    cq->vector = vector;
+    cq->head = cq->tail = 0;
+    cq->phys_contig = contig;
+    cq->doorbells = cq->interrupts = 0;
+    cq->dma_addr = dma_addr;
+    if (!cq->phys_contig) {
+        cq->prp_list = nvme_setup_discontig(n, dma_addr, size,
+            n->cqe_size);
+        if (!cq->prp_list) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+    }
+    QTAILQ_INIT(&cq->req_list);
+    QTAILQ_INIT(&cq->sq_list);
+    msix_vector_use(&n->parent_obj, cq->vector);
+    if (cqid && n->dbbuf_dbs) {
+        nvme_cq_init_dbbuf(n, cq);
+    }
+    n->cq[cqid] = cq;
+    cq->pending = 0;
+    cq->cqe_buf = g_malloc0(n->page_size);
+    cq->bh = qemu_bh_new(nvme_post_cqes, cq);
+    cq->intc_timer = qemu_new_timer_ns(vm_clock, nvme_intc_timer, cq);
+
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    NvmeCQueue *cq;
+    NvmeCreateCq *c = (NvmeCreateCq *)cmd;
+    uint16_t cqid = le16_to_cpu(c->cqid);
+    uint16_t vector = le16_to_cpu(c->irq_vector);
+    uint16_t qsize = le16_to_cpu(c->qsize);
+    uint16_t qflags = le16_to_cpu(c->cq_flags);
+    uint64_t prp1 = le64_to_cpu(c->prp1);
+
+    if (!cqid || (cqid && !nvme_check_cqid(n, cqid))) {
+        return NVME_INVALID_CQID | NVME_DNR;
+    }
+    if (!qsize || qsize > NVME_CAP_MQES(n->bar.cap)) {
+        return NVME_MAX_QSIZE_EXCEEDED | NVME_DNR;
+    }
+    if (!prp1) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    if (vector > n->num_queues) {
+        return NVME_INVALID_IRQ_VECTOR | NVME_DNR;
+    }
+    if (!(NVME_CQ_FLAGS_PC(qflags)) && NVME_CAP_CQR(n->bar.cap)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    cq = g_malloc0(sizeof(*cq));
+    nvme_init_cq(cq, n, prp1, cqid, vector, qsize + 1,
+        NVME_CQ_FLAGS_IEN(qflags), NVME_CQ_FLAGS_PC(qflags));
+    return NVME_SUCCESS;
+}
+
+/*
+ * Zoned namespaces are reported through the NVMe 2.0 command set model:
+ * the namespace identification descriptors give each namespace's command
+ * set, and CNS 05h and 06h return the zoned command set's own structures.
+ * Those of the NVM command set have nothing this controller fills in.
+ */
+static uint16_t nvme_identify(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    NvmeNamespace *ns;
+    NvmeIdentify *c = (NvmeIdentify *)cmd;
+    uint32_t cns  = NVME_ID_CNS(le32_to_cpu(c->cns));
+    uint32_t csi  = NVME_ID_CSI(le32_to_cpu(c->csi));
+    uint32_t nsid = le32_to_cpu(c->nsid);
+    uint64_t prp1 = le64_to_cpu(c->prp1);
+    uint64_t prp2 = le64_to_cpu(c->prp2);
+    uint8_t buf[NVME_IDENTIFY_DATA_SIZE];
+
+    if (cns == NVME_ID_CNS_CTRL) {
+        return nvme_dma_read_prp(n, (uint8_t *)&n->id_ctrl, sizeof(n->id_ctrl),
+            prp1, prp2);
+    }
+    if (cns == NVME_ID_CNS_CS_CTRL) {
+        if (csi == NVME_CSI_ZONED && n->zoned) {
+            return nvme_dma_read_prp(n, (uint8_t *)&n->id_ctrl_zoned,
+                sizeof(n->id_ctrl_zoned), prp1, prp2);
+        }
+        if (csi != NVME_CSI_NVM) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        memset(buf, 0, sizeof(buf));
+        return nvme_dma_read_prp(n, buf, sizeof(buf), prp1, prp2);
+    }
+
+    if (nsid == 0 || nsid > n->num_namespaces) {
+        return NVME_INVALID_NSID | NVME_DNR;
+    }
+    ns = &n->namespaces[nsid - 1];
+    switch (cns) {
+    case NVME_ID_CNS_NS:
+        return nvme_dma_read_prp(n, (uint8_t *)&ns->id_ns, sizeof(ns->id_ns),
+            prp1, prp2);
+    case NVME_ID_CNS_NS_DESCRS:
+        memset(buf, 0, sizeof(buf));
+        buf[0] = NVME_NIDT_CSI;
+        buf[1] = NVME_NIDL_CSI;
+        buf[4] = n->zoned ? NVME_CSI_ZONED : NVME_CSI_NVM;
+        return nvme_dma_read_prp(n, buf, sizeof(buf), prp1, prp2);
+    case NVME_ID_CNS_CS_NS:
+        if (csi == NVME_CSI_ZONED && n->zoned) {
+            return nvme_dma_read_prp(n, (uint8_t *)&ns->id_ns_zoned,
+                sizeof(ns->id_ns_zoned), prp1, prp2);
+        }
+        if (csi != NVME_CSI_NVM) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        memset(buf, 0, sizeof(buf));
+        return nvme_dma_read_prp(n, buf, sizeof(buf), prp1, prp2);
+    default:
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+}
+
+static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    NvmeRangeType *rt;
+    uint32_t dw10 = le32_to_cpu(cmd->cdw10);
+    uint32_t dw11 = le32_to_cpu(cmd->cdw11);
+    uint32_t nsid = le32_to_cpu(cmd->nsid);
+    uint64_t prp1 = le64_to_cpu(cmd->prp1);
+    uint64_t prp2 = le64_to_cpu(cmd->prp2);
+
+    switch (dw10) {
+    case NVME_ARBITRATION:
+        req->cqe.result = cpu_to_le32(n->features.arbitration);
+        break;
+    case NVME_POWER_MANAGEMENT:
+        req->cqe.result = cpu_to_le32(n->features.power_mgmt);
+        break;
+    case NVME_LBA_RANGE_TYPE:
+        if (nsid == 0 || nsid > n->num_namespaces) {
+            return NVME_INVALID_NSID | NVME_DNR;
+        }
+        rt = n->namespaces[nsid - 1].lba_range;
+        return nvme_dma_read_prp(n, (uint8_t *)rt,
+            MIN(sizeof(*rt), (dw11 & 0x3f) * sizeof(*rt)),
+            prp1, prp2);
+    case NVME_TEMPERATURE_THRESHOLD:
+        req->cqe.result = cpu_to_le32(n->features.temp_thresh);
+        break;
+    case NVME_ERROR_RECOVERY:
+        req->cqe.result = cpu_to_le32(n->features.err_rec);
+        break;
+    case NVME_VOLATILE_WRITE_CACHE:
+        req->cqe.result = cpu_to_le32(n->features.volatile_wc);
+        break;
+    case NVME_NUMBER_OF_QUEUES:
+        req->cqe.result = cpu_to_le32(n->num_queues | (n->num_queues << 16));
+        break;
+    case NVME_INTERRUPT_COALESCING:
+        req->cqe.result = cpu_to_le32(n->features.int_coalescing);
+        break;
+    case NVME_INTERRUPT_VECTOR_CONF:
+        if ((dw11 & 0xffff) > n->num_queues) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        req->cqe.result = cpu_to_le32(
+            n->features.int_vector_config[dw11 & 0xffff]);
+        break;
+    case NVME_WRITE_ATOMICITY:
+        req->cqe.result = cpu_to_le32(n->features.write_atomicity);
+        break;
+    case NVME_ASYNCHRONOUS_EVENT_CONF:
+        req->cqe.result = cpu_to_le32(n->features.async_config);
+        break;
+    case NVME_SOFTWARE_PROGRESS_MARKER:
+        req->cqe.result = cpu_to_le32(n->features.sw_prog_marker);
+        break;
+    default:
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    NvmeRangeType *rt;
+    uint32_t dw10 = le32_to_cpu(cmd->cdw10);
+    uint32_t dw11 = le32_to_cpu(cmd->cdw11);
+    uint32_t nsid = le32_to_cpu(cmd->nsid);
+    uint64_t prp1 = le64_to_cpu(cmd->prp1);
+    uint64_t prp2 = le64_to_cpu(cmd->prp2);
+
+    switch (dw10) {
+    case NVME_ARBITRATION:
+        n->features.arbitration = dw11 & 0xffffff07;
+        nvme_arb_reset_credits(n);
+        break;
+    case NVME_POWER_MANAGEMENT:
+        n->features.power_mgmt = dw11;
+        break;
+    case NVME_LBA_RANGE_TYPE:
+        if (nsid == 0 || nsid > n->num_namespaces) {
+            return NVME_INVALID_NSID | NVME_DNR;
+        }
+        rt = n->namespaces[nsid - 1].lba_range;
+        return nvme_dma_write_prp(n, (uint8_t *)rt,
+            MIN(sizeof(*rt), (dw11 & 0x3f) * sizeof(*rt)),
+            prp1, prp2);
+    case NVME_NUMBER_OF_QUEUES:
+        req->cqe.result = cpu_to_le32(n->num_queues | (n->num_queues << 16));
+        break;
+    case NVME_TEMPERATURE_THRESHOLD:
+        n->features.temp_thresh = dw11;
+        if (n->features.temp_thresh <= n->temperature && !n->temp_warn_issued) {
+            n->temp_warn_issued = 1;
+            nvme_enqueue_event(n, NVME_AER_TYPE_SMART,
+                    NVME_AER_INFO_SMART_TEMP_THRESH,
+                    NVME_LOG_SMART_INFO);
+        } else if (n->features.temp_thresh > n->temperature &&
+                !(n->aer_mask & 1 << NVME_AER_TYPE_SMART)) {
+            n->temp_warn_issued = 0;
+        }
+        break;
+    case NVME_ERROR_RECOVERY:
+        n->features.err_rec = dw11;
+        break;
+    case NVME_VOLATILE_WRITE_CACHE:
+        n->features.volatile_wc = dw11;
+        break;
+    case NVME_INTERRUPT_COALESCING:
+        n->features.int_coalescing = dw11 & 0xffff;
+        break;
+    case NVME_INTERRUPT_VECTOR_CONF:
+        if ((dw11 & 0xffff) > n->num_queues) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        n->features.int_vector_config[dw11 & 0xffff] = dw11 & 0x1ffff;
+        break;
+    case NVME_WRITE_ATOMICITY:
+        n->features.write_atomicity = dw11;
+        break;
+    case NVME_ASYNCHRONOUS_EVENT_CONF:
+        n->features.async_config = dw11;
+        break;
+    case NVME_SOFTWARE_PROGRESS_MARKER:
+        n->features.sw_prog_marker = dw11;
+        break;
+    default:
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_fw_log_info(NvmeCtrl *n, NvmeCmd *cmd, uint32_t buf_len)
+{
+    uint32_t trans_len;
+    uint64_t prp1 = le64_to_cpu(cmd->prp1);
+    uint64_t prp2 = le64_to_cpu(cmd->prp2);
+    NvmeFwSlotInfoLog fw_log;
+
+    trans_len = MIN(sizeof(fw_log), buf_len);
+    return nvme_dma_read_prp(n, (uint8_t *)&fw_log, trans_len, prp1, prp2);
+}
+
+static uint16_t nvme_error_log_info(NvmeCtrl *n, NvmeCmd *cmd, uint32_t buf_len)
+{
+    uint32_t trans_len;
+    uint64_t prp1 = le64_to_cpu(cmd->prp1);
+    uint64_t prp2 = le64_to_cpu(cmd->prp2);
+
+    trans_len = MIN(sizeof(*n->elpes) * n->elpe, buf_len);
+    n->aer_mask &= ~(1 << NVME_AER_TYPE_ERROR);
+    if (!QSIMPLEQ_EMPTY(&n->aer_queue)) {
+        qemu_mod_timer(n->aer_timer, qemu_get_clock_ns(vm_clock) + 10000);
+    }
+    return nvme_dma_read_prp(n, (uint8_t *)n->elpes, trans_len, prp1, prp2);
+}
+
+static uint16_t nvme_smart_info(NvmeCtrl *n, NvmeCmd *cmd, uint32_t buf_len)
+{
+    uint64_t prp1 = le64_to_cpu(cmd->prp1);
+    uint64_t prp2 = le64_to_cpu(cmd->prp2);
+
+    uint32_t trans_len;
+    time_t current_seconds;
+    NvmeSmartLog smart;
+    uint64_t rd_bytes = 0, wr_bytes = 0, rd_ops = 0, wr_ops = 0;
+    int i;
+
+    /* namespaces carved from the controller's drive share its statistics */
+    for (i = 0; i < n->num_namespaces; i++) {
+        BlockDriverState *bs = n->namespaces[i].bs;
+        BlockStats *s;
+
+        if (i && bs == n->namespaces[i - 1].bs) {
+            continue;
+        }
+        s = bdrv_query_stats(bs);
+        rd_bytes += s->stats->rd_bytes;
+        wr_bytes += s->stats->wr_bytes;
+        rd_ops += s->stats->rd_operations;
+        wr_ops += s->stats->wr_operations;
+        qapi_free_BlockStats(s);
+    }
+
+    trans_len = MIN(sizeof(smart), buf_len);
+    memset(&smart, 0x0, sizeof(smart));
+    smart.data_units_read[0] = cpu_to_le64(rd_bytes);
+    smart.data_units_written[0] = cpu_to_le64(wr_bytes);
+    smart.host_read_commands[0] = cpu_to_le64(rd_ops);
+    smart.host_write_commands[0] = cpu_to_le64(wr_ops);
+
+    smart.number_of_error_log_entries[0] = cpu_to_le64(n->num_errors);
+    smart.temperature[0] = n->temperature & 0xff;
+    smart.temperature[1] = (n->temperature >> 8) & 0xff;
+
+    current_seconds = time(NULL);
+    smart.power_on_hours[0] = cpu_to_le64(
+        ((current_seconds - n->start_time) / 60) / 60);
+
+    smart.available_spare_threshold = NVME_SPARE_THRESHOLD;
+    if (smart.available_spare <= NVME_SPARE_THRESHOLD) {
+        smart.critical_warning |= NVME_SMART_SPARE;
+    }
+    if (n->features.temp_thresh <= n->temperature) {
+        smart.critical_warning |= NVME_SMART_TEMPERATURE;
+    }
+
+    n->aer_mask &= ~(1 << NVME_AER_TYPE_SMART);
+    if (!QSIMPLEQ_EMPTY(&n->aer_queue)) {
+        qemu_mod_timer(n->aer_timer, qemu_get_clock_ns(vm_clock) + 10000);
+    }
+
+    return nvme_dma_read_prp(n, (uint8_t *)&smart, trans_len, prp1, prp2);
+}
+
+/*
+ * Vendor specific emulation statistics. The PRP coalescing ratio is the
+ * number of PRP entries mapped per resulting scatter-gather element, in
+ * hundredths.
+ */
+static uint16_t nvme_stats_log_info(NvmeCtrl *n, NvmeCmd *cmd,
+    uint32_t buf_len)
+{
+    uint32_t trans_len;
+    uint64_t prp1 = le64_to_cpu(cmd->prp1);
+    uint64_t prp2 = le64_to_cpu(cmd->prp2);
+    NvmeStatsLog stats;
+
+    trans_len = MIN(sizeof(stats), buf_len);
+    memset(&stats, 0x0, sizeof(stats));
+    stats.prp_entries = cpu_to_le64(n->prp_entries);
+    stats.prp_sg_elems = cpu_to_le64(n->prp_sg_elems);
+    if (n->prp_sg_elems) {
+        stats.prp_coalesce_ratio = cpu_to_le32(n->prp_entries * 100 /
+            n->prp_sg_elems);
+    }
+    return nvme_dma_read_prp(n, (uint8_t *)&stats, trans_len, prp1, prp2);
+}
+
+/* Vendor specific progress of the outstanding Format NVM, if any */
+static uint16_t nvme_format_log_info(NvmeCtrl *n, NvmeCmd *cmd,
+    uint32_t buf_len)
+{
+    uint32_t trans_len;
+    uint64_t prp1 = le64_to_cpu(cmd->prp1);
+    uint64_t prp2 = le64_to_cpu(cmd->prp2);
+    NvmeFormatLog format;
+
+    trans_len = MIN(sizeof(format), buf_len);
+    memset(&format, 0x0, sizeof(format));
+    if (n->format_nsid) {
+        format.nsid = cpu_to_le32(n->format_nsid);
+        format.ses = n->format_ses;
+        format.percent = n->format_done * 100 / n->format_total;
+        format.blocks_done = cpu_to_le64(n->format_done);
+        format.blocks_total = cpu_to_le64(n->format_total);
+    }
+    return nvme_dma_read_prp(n, (uint8_t *)&format, trans_len, prp1, prp2);
+}
+
+static void nvme_lat_to_le(NvmeLatStats *dst, const NvmeLatStats *src)
+{
+    int i;
+
+    dst->count = cpu_to_le64(src->count);
+    dst->total_ns = cpu_to_le64(src->total_ns);
+    for (i = 0; i < NVME_LAT_BUCKETS; i++) {
+        dst->hist[i] = cpu_to_le64(src->hist[i]);
+    }
+}
+
+/*
+ * Vendor specific latency histograms of a namespace, or of the whole
+ * controller when no namespace is given
+ */
+static uint16_t nvme_latency_log_info(NvmeCtrl *n, NvmeCmd *cmd,
+    uint32_t buf_len)
+{
+    uint32_t trans_len;
+    uint32_t nsid = le32_to_cpu(cmd->nsid);
+    uint64_t prp1 = le64_to_cpu(cmd->prp1);
+    uint64_t prp2 = le64_to_cpu(cmd->prp2);
+    NvmeLatStats *lat = n->stats.lat;
+    NvmeLatencyLog *log;
+    uint16_t ret;
+    int i;
+
+    if (nsid && nsid != 0xffffffff) {
+        if (nsid > n->num_namespaces) {
+            return NVME_INVALID_NSID | NVME_DNR;
+        }
+        lat = n->namespaces[nsid - 1].lat;
+    }
+
+    log = g_malloc0(sizeof(*log));
+    trans_len = MIN(sizeof(*log), buf_len);
+    for (i = 0; i < NVME_STATS_OPS; i++) {
+        nvme_lat_to_le(&log->lat[i], &lat[i]);
+    }
+    if (lat == n->stats.lat) {
+        log->doorbells = cpu_to_le64(n->stats.doorbells);
+        log->interrupts = cpu_to_le64(n->stats.interrupts);
+        log->qd_samples = cpu_to_le64(n->stats.qd_samples);
+        log->qd_total = cpu_to_le64(n->stats.qd_total);
+        log->qd_max = cpu_to_le64(n->stats.qd_max);
+    }
+    ret = nvme_dma_read_prp(n, (uint8_t *)log, trans_len, prp1, prp2);
+    g_free(log);
+    return ret;
+}
+
+static uint16_t nvme_get_log(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint32_t dw10 = le32_to_cpu(cmd->cdw10);
+    uint16_t lid = dw10 & 0xffff;
+    uint32_t len = ((dw10 >> 16) & 0xff) << 2;
+
+    switch (lid) {
+    case NVME_LOG_ERROR_INFO:
+        return nvme_error_log_info(n, cmd, len);
+    case NVME_LOG_SMART_INFO:
+        return nvme_smart_info(n, cmd, len);
+    case NVME_LOG_FW_SLOT_INFO:
+        return nvme_fw_log_info(n, cmd, len);
+    case NVME_LOG_VENDOR_STATS:
+        return nvme_stats_log_info(n, cmd, len);
+    case NVME_LOG_VENDOR_FORMAT:
+        return nvme_format_log_info(n, cmd, len);
+    case NVME_LOG_VENDOR_LATENCY:
+        return nvme_latency_log_info(n, cmd, len);
+    default:
+        return NVME_INVALID_LOG_ID | NVME_DNR;
+    }
+}
+
+static uint16_t nvme_async_req(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    if (n->outstanding_aers > n->aerl + 1) {
+        return NVME_AER_LIMIT_EXCEEDED;
+    }
+    n->aer_reqs[n->outstanding_aers] = req;
+    qemu_mod_timer(n->aer_timer, qemu_get_clock_ns(vm_clock) + 10000);
+    n->outstanding_aers++;
+    return NVME_NO_COMPLETE;
+}
+
+static uint16_t nvme_abort_req(NvmeCtrl *n, NvmeCmd *cmd, uint32_t *result)
+{
+    uint32_t index = 0;
+    uint16_t sqid = cmd->cdw10 & 0xffff;
+    uint16_t cid = (cmd->cdw10 >> 16) & 0xffff;
+    NvmeSQueue *sq;
+    NvmeRequest *req;
+
+    *result = 1;
+    if (nvme_check_sqid(n, sqid)) {
+        return NVME_SUCCESS;
+    }
+
+    sq = n->sq[sqid];
+    QTAILQ_FOREACH(req, &sq->out_req_list, entry) {
+        if (req->aiocb && req->cqe.cid == cid) {
+            bdrv_aio_cancel(req->aiocb);
+            *result = 0;
+            return NVME_SUCCESS;
+        }
+    }
+
+    while ((sq->head + index) % sq->size != sq->tail) {
+        NvmeCmd abort_cmd;
+        hwaddr addr;
+
+        if (sq->phys_contig) {
+            addr = sq->dma_addr + ((sq->head + index) % sq->size) *
+                n->sqe_size;
+        } else {
+            addr = nvme_discontig(sq->prp_list, n->page_size,
+                (sq->head + index) % sq->size, n->sqe_size);
+        }
+
+        nvme_addr_read(n, addr, (void *)&abort_cmd, sizeof(abort_cmd));
+        if (abort_cmd.cid == cid) {
+            *result = 0;
+            req = QTAILQ_FIRST(&sq->req_list);
+            QTAILQ_REMOVE(&sq->req_list, req, entry);
+            QTAILQ_INSERT_TAIL(&sq->out_req_list, req, entry);
+
+            memset(&req->cqe, 0, sizeof(req->cqe));
+            req->cqe.cid = cid;
+            req->cqe.status = NVME_CMD_ABORT_REQ << 1;
+            req->model_done = 0;
+            req->fetch_ns = get_clock();
+            req->stats_op = NVME_STATS_OPS;
+            req->stats_ns = NULL;
+            sq->inflight++;
+
+            abort_cmd.opcode = NVME_OP_ABORTED;
+            pci_dma_write(&n->parent_obj, addr, (void *)&abort_cmd,
+                sizeof(abort_cmd));
+
+            nvme_enqueue_req_completion(n->cq[sq->cqid], req);
+            return NVME_SUCCESS;
+        }
+
+        ++index;
+    }
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_format_namespace(NvmeNamespace *ns, uint8_t lba_idx,
+    uint8_t meta_loc, uint8_t pil, uint8_t pi, uint8_t sec_erase)
+{
+    uint64_t blks;
+    uint16_t ms = le16_to_cpu(ns->id_ns.lbaf[lba_idx].ms);
+
+    if (lba_idx > ns->id_ns.nlbaf) {
+        return NVME_INVALID_FORMAT | NVME_DNR;
+    }
+    if (pi) {
+        if (pil && !NVME_ID_NS_DPC_LAST_EIGHT(ns->id_ns.dpc)) {
+            return NVME_INVALID_FORMAT | NVME_DNR;
+        }
+        if (!pil && !NVME_ID_NS_DPC_FIRST_EIGHT(ns->id_ns.dpc)) {
+            return NVME_INVALID_FORMAT | NVME_DNR;
+        }
+        if (!((ns->id_ns.dpc & 0x7) & (1 << (pi - 1)))) {
+            return NVME_INVALID_FORMAT | NVME_DNR;
+        }
+    }
+    if (meta_loc && ms && !NVME_ID_NS_MC_EXTENDED(ns->id_ns.mc)) {
+        return NVME_INVALID_FORMAT | NVME_DNR;
+    }
+    if (!meta_loc && ms && !NVME_ID_NS_MC_SEPARATE(ns->id_ns.mc)) {
+        return NVME_INVALID_FORMAT | NVME_DNR;
+    }
+
+    blks = ns->size / ((1 << ns->id_ns.lbaf[lba_idx].ds) + ns->ctrl->meta);
+    qemu_mutex_lock(&ns->ctrl->map_lock);
+    range_set_clear(ns->util);
+    range_set_clear(ns->uncorrectable);
+    range_set_clear(ns->deallocated);
+    ns->meta_start_offset = meta_loc ? 0 :
+        (ns->start_block << BDRV_SECTOR_BITS) +
+        (blks << ns->id_ns.lbaf[lba_idx].ds);
+    ns->id_ns.flbas = lba_idx | meta_loc;
+    ns->id_ns.nsze = cpu_to_le64(blks);
+    ns->id_ns.ncap = ns->id_ns.nsze;
+    ns->id_ns.nuse = ns->id_ns.nsze;
+    ns->id_ns.dps = pil | pi;
+    ns->formatting = sec_erase != NVME_FORMAT_SES_NONE;
+    if (ns->ctrl->zoned) {
+        nvme_zone_init(ns);
+    }
+    if (ns->mig_dirty) {
+        range_set_clear(ns->mig_dirty);
+        range_set_add(ns->mig_dirty, 0, blks);
+    }
+    qemu_mutex_unlock(&ns->ctrl->map_lock);
+
+    return NVME_SUCCESS;
+}
+
+/*
+ * Secure erase runs in the background: the namespaces being formatted are
+ * zeroed (user data erase) or discarded (cryptographic erase) a chunk at a
+ * time, and only they reject I/O meanwhile. The Format NVM command completes
+ * when the job does. The first chunk that fails ends the job: the command
+ * then completes with Internal Device Error, and the namespaces not erased
+ * yet accept I/O again with whatever they held.
+ */
+static void coroutine_fn nvme_format_co(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+    bool discard = n->format_ses == NVME_FORMAT_SES_CRYPTO;
+    NvmeNamespace *ns = NULL;
+    NvmeRequest *req;
+    uint64_t slba = 0;
+    uint32_t i;
+    int ret = 0;
+
+    for (i = 0; !ret && i < n->num_namespaces; i++) {
+        uint64_t nsze, chunk;
+        uint8_t lba_index;
+
+        ns = &n->namespaces[i];
+        if (!ns->formatting) {
+            continue;
+        }
+        nsze = le64_to_cpu(ns->id_ns.nsze);
+        lba_index = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
+        chunk = (uint64_t)(discard ? NVME_DISCARD_SECTORS :
+            NVME_ZERO_SECTORS) << BDRV_SECTOR_BITS >>
+            ns->id_ns.lbaf[lba_index].ds;
+        for (slba = 0; slba < nsze; slba += chunk) {
+            chunk = MIN(chunk, nsze - slba);
+            ret = nvme_co_erase_lbas(ns, slba, chunk, discard);
+            if (ret) {
+                break;
+            }
+            n->format_done += chunk;
+        }
+        if (!ret && discard) {
+            /* reads return zeroes whether or not the drive discards */
+            nvme_map_update(ns, 0, nsze, NVME_MAP_DEALLOCATED, 0);
+        }
+    }
+    for (i = 0; i < n->num_namespaces; i++) {
+        n->namespaces[i].formatting = false;
+    }
+
+    req = n->format_req;
+    n->format_req = NULL;
+    n->format_nsid = 0;
+    if (req) {
+        if (ret) {
+            req->status = NVME_INTERNAL_DEV_ERROR;
+            nvme_set_error_page(n, 0, req->cqe.cid, req->status, 0, slba,
+                ns->id);
+        }
+        nvme_enqueue_req_completion(n->cq[0], req);
+    }
+}
+
+static uint16_t nvme_format(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    NvmeNamespace *ns;
+    uint32_t dw10 = le32_to_cpu(cmd->cdw10);
+    uint32_t nsid = le32_to_cpu(cmd->nsid);
+
+    uint8_t lba_idx = dw10 & 0xf;
+    uint8_t meta_loc = dw10 & 0x10;
+    uint8_t pil = (dw10 >> 5) & 0x8;
+    uint8_t pi = (dw10 >> 5) & 0x7;
+    uint8_t sec_erase = (dw10 >> 9) & 0x7;
+    uint16_t ret = NVME_SUCCESS;
+    Coroutine *co;
+    uint32_t i;
+
+    if (sec_erase > NVME_FORMAT_SES_CRYPTO ||
+            (sec_erase == NVME_FORMAT_SES_CRYPTO &&
+            !(n->id_ctrl.fna & NVME_FNA_CRYPTO_ERASE))) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    if (n->format_nsid) {
+        return NVME_FORMAT_IN_PROGRESS;
+    }
+
+    if (nsid == 0xffffffff) {
+        for (i = 0; i < n->num_namespaces; ++i) {
+            ns = &n->namespaces[i];
+            ret = nvme_format_namespace(ns, lba_idx, meta_loc, pil, pi,
+                sec_erase);
+            if (ret != NVME_SUCCESS) {
+                break;
+            }
+        }
+        req->ns = NULL;
+    } else if (nsid == 0 || nsid > n->num_namespaces) {
+        return NVME_INVALID_NSID | NVME_DNR;
+    } else {
+        ns = &n->namespaces[nsid - 1];
+        ret = nvme_format_namespace(ns, lba_idx, meta_loc, pil, pi,
+            sec_erase);
+        req->ns = ns;
+    }
+
+    n->format_total = 0;
+    n->format_done = 0;
+    for (i = 0; i < n->num_namespaces; ++i) {
+        if (n->namespaces[i].formatting) {
+            n->format_total += le64_to_cpu(n->namespaces[i].id_ns.nsze);
+        }
+    }
+    if (!n->format_total) {
+        return ret;
+    }
+
+    /* namespaces formatted before a failure still get erased */
+    n->format_req = ret == NVME_SUCCESS ? req : NULL;
+    n->format_nsid = nsid;
+    n->format_ses = sec_erase;
+    co = qemu_coroutine_create(nvme_format_co);
+    qemu_coroutine_enter(co, n);
+    return ret == NVME_SUCCESS ? NVME_NO_COMPLETE : ret;
+}
+
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t dbs_addr = le64_to_cpu(cmd->prp1);
+    uint64_t eis_addr = le64_to_cpu(cmd->prp2);
+    int i;
+
+    if (!dbs_addr || dbs_addr & (n->page_size - 1) ||
+            !eis_addr || eis_addr & (n->page_size - 1)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+
+    /* the admin queue is never shadowed */
+    for (i = 1; i < n->num_queues; i++) {
+        if (n->cq[i] != NULL) {
+            nvme_cq_init_dbbuf(n, n->cq[i]);
+        }
+        if (n->sq[i] != NULL) {
+            nvme_sq_init_dbbuf(n, n->sq[i]);
+            nvme_kick_sq(n->sq[i]);
+        }
+    }
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    switch (cmd->opcode) {
+    case NVME_ADM_CMD_DELETE_SQ:
+        return nvme_del_sq(n, cmd, req);
+    case NVME_ADM_CMD_CREATE_SQ:
+        return nvme_create_sq(n, cmd);
+    case NVME_ADM_CMD_DELETE_CQ:
+        return nvme_del_cq(n, cmd);
+    case NVME_ADM_CMD_CREATE_CQ:
+        return nvme_create_cq(n, cmd);
+    case NVME_ADM_CMD_IDENTIFY:
+        return nvme_identify(n, cmd);
+    case NVME_ADM_CMD_SET_FEATURES:
+        return nvme_set_feature(n, cmd, req);
+    case NVME_ADM_CMD_GET_FEATURES:
+        return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_GET_LOG_PAGE:
+        return nvme_get_log(n, cmd);
+    case NVME_ADM_CMD_ASYNC_EV_REQ:
+        return nvme_async_req(n, cmd, req);
+    case NVME_ADM_CMD_ABORT:
+        return nvme_abort_req(n, cmd, &req->cqe.result);
+    case NVME_ADM_CMD_FORMAT_NVM:
+        if (NVME_OACS_FORMAT & n->oacs) {
+            return nvme_format(n, cmd, req);
+        }
+        return NVME_INVALID_OPCODE | NVME_DNR;
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        if (NVME_OACS_DBBUF & n->oacs) {
+            return nvme_dbbuf_config(n, cmd);
+        }
+        return NVME_INVALID_OPCODE | NVME_DNR;
+    case NVME_ADM_CMD_ACTIVATE_FW:
+    case NVME_ADM_CMD_DOWNLOAD_FW:
+    case NVME_ADM_CMD_SECURITY_SEND:
+    case NVME_ADM_CMD_SECURITY_RECV:
+    default:
+        return NVME_INVALID_OPCODE | NVME_DNR;
+    }
+}
+
+/* Fetches and starts at most @max commands, returning how many it took */
+static int nvme_process_sq(NvmeSQueue *sq, int max)
+{
+    uint16_t status;
+    hwaddr addr;
+    NvmeCmd cmd;
+    NvmeRequest *req;
+    NvmeCtrl *n = sq->ctrl;
+    NvmeCQueue *cq = n->cq[sq->cqid];
+    int processed = 0;
+
+    if (sq->db_addr) {
+        nvme_update_sq_tail(sq);
+    }
+
+    while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list)) &&
+            processed < max) {
+        processed++;
+        if (sq->phys_contig) {
+            addr = sq->dma_addr + sq->head * n->sqe_size;
+        } else {
+            addr = nvme_discontig(sq->prp_list, n->page_size, sq->head,
+                n->sqe_size);
+        }
+        nvme_addr_read(n, addr, (void *)&cmd, sizeof(cmd));
+        nvme_inc_sq_head(sq);
+
+        req = QTAILQ_FIRST(&sq->req_list);
+        QTAILQ_REMOVE(&sq->req_list, req, entry);
+        QTAILQ_INSERT_TAIL(&sq->out_req_list, req, entry);
+        memset(&req->cqe, 0, sizeof(req->cqe));
+        req->cqe.cid = cmd.cid;
+        req->aiocb = NULL;
+        req->model_done = 0;
+        nvme_stats_fetch(n, sq, req, &cmd);
+
+        status = sq->sqid ? nvme_io_cmd(n, &cmd, req) :
+            nvme_admin_cmd(n, &cmd, req);
+        if (status != NVME_NO_COMPLETE) {
+            req->status = status;
+            nvme_enqueue_req_completion(cq, req);
+        }
+    }
+
+    sq->completed += processed;
+    if (sq->db_addr && nvme_sq_empty(sq)) {
+        /* idle: ask for a doorbell, then recheck for a racing update */
+        nvme_update_sq_eventidx(sq);
+        nvme_update_sq_tail(sq);
+    }
+    return processed;
+}
+
+/*
+ * Picks the next SQ to fetch from. The admin SQ, then urgent SQs, are served
+ * strictly first. High, medium and low priority SQs share the rest by
+ * weighted round robin: each class may fetch its weight plus one commands per
+ * round, and a new round starts once no class with work has credit left.
+ * @credit is set to the class's credit, or NULL for the strict classes.
+ */
+static NvmeSQueue *nvme_arb_select(NvmeCtrl *n, uint32_t **credit)
+{
+    int c, round;
+
+    *credit = NULL;
+    for (c = NVME_ARB_ADMIN; c <= NVME_ARB_URGENT; c++) {
+        if (!QTAILQ_EMPTY(&n->arb_list[c])) {
+            return QTAILQ_FIRST(&n->arb_list[c]);
+        }
+    }
+    for (round = 0; round < 2; round++) {
+        for (c = NVME_ARB_HIGH; c < NVME_ARB_CLASSES; c++) {
+            if (!QTAILQ_EMPTY(&n->arb_list[c]) && n->arb_credit[c]) {
+                *credit = &n->arb_credit[c];
+                return QTAILQ_FIRST(&n->arb_list[c]);
+            }
+        }
+        nvme_arb_reset_credits(n);
+    }
+    return NULL;
+}
+
+/*
+ * The controller's single arbiter. Each visit to an SQ fetches at most one
+ * arbitration burst before the SQ goes to the back of its class, and the
+ * arbiter yields to the main loop after NVME_ARB_BUDGET commands.
+ */
+static void nvme_arbitrate(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+    uint8_t ab = NVME_ARB_AB(n->features.arbitration);
+    int budget = NVME_ARB_BUDGET;
+    uint32_t *credit;
+    NvmeSQueue *sq;
+    int c;
+
+    while (budget > 0 && (sq = nvme_arb_select(n, &credit)) != NULL) {
+        int burst = ab == 7 ? sq->size : 1 << ab;
+        int processed;
+
+        if (credit) {
+            burst = MIN(burst, *credit);
+        }
+        nvme_arb_dequeue(n, sq);
+        processed = nvme_process_sq(sq, burst);
+
+        budget -= MAX(processed, 1);
+        if (credit) {
+            *credit -= MIN(*credit, MAX(processed, 1));
+        }
+        if (!nvme_sq_empty(sq) && !QTAILQ_EMPTY(&sq->req_list)) {
+            QTAILQ_INSERT_TAIL(&n->arb_list[sq->arb_class], sq, arb_entry);
+            sq->arb_queued = 1;
+        }
+    }
+
+    for (c = 0; c < NVME_ARB_CLASSES; c++) {
+        if (!QTAILQ_EMPTY(&n->arb_list[c])) {
+            qemu_bh_schedule(n->arb_bh);
+            break;
+        }
+    }
+}
+
+static void nvme_sq_notifier(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    event_notifier_test_and_clear(e);
+    sq->stats.doorbells++;
+    sq->ctrl->stats.doorbells++;
+    nvme_kick_sq(sq);
+}
+
+/*
+ * The written, uncorrectable and deallocated block maps of every namespace
+ * survive restarts in the statefile: a header, then one record per map
+ * listing its extents. A record only applies to a namespace whose nsid,
+ * format and size still match; anything else starts out unwritten.
+ */
+static int nvme_save_extent(uint64_t start, uint64_t count, void *opaque)
+{
+    NvmeStateExtent ext = {
+        .slba = cpu_to_le64(start),
+        .nlb = cpu_to_le64(count),
+    };
+
+    return fwrite(&ext, sizeof(ext), 1, opaque) != 1;
+}
+
+static int nvme_save_zones(NvmeNamespace *ns, FILE *f)
+{
+    NvmeStateRecord rec = {
+        .nsid = cpu_to_le32(ns->id),
+        .map = NVME_STATE_ZONES,
+        .flbas = ns->id_ns.flbas,
+        .nsze = ns->id_ns.nsze,
+        .nr_extents = cpu_to_le64(ns->nr_zones),
+    };
+    uint32_t i;
+
+    if (fwrite(&rec, sizeof(rec), 1, f) != 1) {
+        return -1;
+    }
+    for (i = 0; i < ns->nr_zones; i++) {
+        NvmeStateZone zone = {
+            .wp = cpu_to_le64(ns->zones[i].wp),
+            .state = ns->zones[i].state,
+        };
+
+        if (fwrite(&zone, sizeof(zone), 1, f) != 1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Zones are restored through nvme_zone_set_state so the open and active
+ * counts follow, except that open zones are closed as on a controller reset.
+ */
+static void nvme_restore_zone(NvmeNamespace *ns, NvmeZone *zone, uint64_t wp,
+    uint8_t state)
+{
+    uint64_t zslba = nvme_zone_slba(ns, zone);
+
+    if (wp < zslba || wp > zslba + ns->zone_size) {
+        return;
+    }
+    zone->wp = wp;
+    switch (state) {
+    case NVME_ZONE_STATE_IMPL_OPEN:
+    case NVME_ZONE_STATE_EXPL_OPEN:
+    case NVME_ZONE_STATE_CLOSED:
+        nvme_zone_close(ns, zone);
+        break;
+    case NVME_ZONE_STATE_FULL:
+        zone->wp = zslba + ns->zone_size;
+        /* fall through */
+    case NVME_ZONE_STATE_READ_ONLY:
+    case NVME_ZONE_STATE_OFFLINE:
+        nvme_zone_set_state(ns, zone, state);
+        break;
+    default:
+        zone->wp = zslba;
+        nvme_zone_set_state(ns, zone, NVME_ZONE_STATE_EMPTY);
+        break;
+    }
+}
+
+static int nvme_load_zones(NvmeNamespace *ns, FILE *f)
+{
+    NvmeStateZone zone;
+    uint32_t i;
+
+    for (i = 0; i < ns->nr_zones; i++) {
+        if (fread(&zone, sizeof(zone), 1, f) != 1) {
+            return -1;
+        }
+        nvme_restore_zone(ns, &ns->zones[i], le64_to_cpu(zone.wp),
+            zone.state);
+    }
+    return 0;
+}
+
+static void nvme_save_state(NvmeCtrl *n)
+{
+    NvmeStateHeader hdr;
+    char *tmp;
+    FILE *f;
+    int i, ret;
+
+    if (!n->statefile) {
+        return;
+    }
+
+    tmp = g_strdup_printf("%s.tmp", n->statefile);
+    f = fopen(tmp, "wb");
+    if (!f) {
+        error_report("nvme: could not create %s: %s", tmp, strerror(errno));
+        g_free(tmp);
+        return;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, NVME_STATE_MAGIC, sizeof(hdr.magic));
+    hdr.version = cpu_to_le32(NVME_STATE_VERSION);
+    hdr.nr_records = cpu_to_le32(n->num_namespaces * (NVME_STATE_MAPS +
+        (n->zoned ? 1 : 0)));
+    ret = fwrite(&hdr, sizeof(hdr), 1, f) != 1;
+
+    for (i = 0; !ret && i < n->num_namespaces * NVME_STATE_MAPS; i++) {
+        NvmeNamespace *ns = &n->namespaces[i / NVME_STATE_MAPS];
+        RangeSet *map = nvme_state_map(ns, i % NVME_STATE_MAPS);
+        NvmeStateRecord rec = {
+            .nsid = cpu_to_le32(ns->id),
+            .map = i % NVME_STATE_MAPS,
+            .flbas = ns->id_ns.flbas,
+            .nsze = ns->id_ns.nsze,
+            .nr_extents = cpu_to_le64(range_set_extents(map)),
+        };
+
+        ret = fwrite(&rec, sizeof(rec), 1, f) != 1 ||
+            range_set_foreach(map, nvme_save_extent, f);
+    }
+    for (i = 0; !ret && n->zoned && i < n->num_namespaces; i++) {
+        ret = nvme_save_zones(&n->namespaces[i], f);
+    }
+
+    if (fclose(f) || ret || rename(tmp, n->statefile)) {
+        error_report("nvme: could not write %s", n->statefile);
+        unlink(tmp);
+    }
+    g_free(tmp);
+}
+
+static void nvme_load_state(NvmeCtrl *n, NvmeNamespace *ns)
+{
+    NvmeStateHeader hdr;
+    NvmeStateRecord rec;
+    NvmeStateExtent ext;
+    uint64_t nsze = le64_to_cpu(ns->id_ns.nsze);
+    uint32_t i;
+    FILE *f;
+
+    if (!n->statefile || !(f = fopen(n->statefile, "rb"))) {
+        return;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+            memcmp(hdr.magic, NVME_STATE_MAGIC, sizeof(hdr.magic)) ||
+            le32_to_cpu(hdr.version) != NVME_STATE_VERSION) {
+        error_report("nvme: %s is not a state file, ignoring it",
+            n->statefile);
+        goto out;
+    }
+
+    for (i = 0; i < le32_to_cpu(hdr.nr_records); i++) {
+        RangeSet *map = NULL;
+        uint64_t j, nr;
+
+        if (fread(&rec, sizeof(rec), 1, f) != 1) {
+            break;
+        }
+        nr = le64_to_cpu(rec.nr_extents);
+        if (le32_to_cpu(rec.nsid) == ns->id && rec.flbas == ns->id_ns.flbas &&
+                le64_to_cpu(rec.nsze) == nsze) {
+            if (rec.map == NVME_STATE_ZONES && n->zoned &&
+                    nr == ns->nr_zones) {
+                if (nvme_load_zones(ns, f)) {
+                    goto out;
+                }
+                continue;
+            }
+            map = nvme_state_map(ns, rec.map);
+        }
+        if (!map) {
+            if (fseeko(f, nr * sizeof(ext), SEEK_CUR)) {
+                break;
+            }
+            continue;
+        }
+        for (j = 0; j < nr; j++) {
+            uint64_t slba, nlb;
+
+            if (fread(&ext, sizeof(ext), 1, f) != 1) {
+                goto out;
+            }
+            slba = le64_to_cpu(ext.slba);
+            nlb = le64_to_cpu(ext.nlb);
+            if (slba < nsze && nlb <= nsze - slba) {
+                range_set_add(map, slba, nlb);
+            }
+        }
+    }
+ out:
+    fclose(f);
+}
+
+static void nvme_exit_notify(Notifier *notifier, void *data)
+{
+    NvmeCtrl *n = container_of(notifier, NvmeCtrl, exit_notifier);
+
+    nvme_save_state(n);
+}
+
+static void nvme_clear_ctrl(NvmeCtrl *n)
+{
+    NvmeAsyncEvent *event;
+    int i;
+
+    /* commands in flight complete into the queues about to be freed */
+    bdrv_drain_all();
+    if (n->flash_model) {
+        qemu_del_timer(n->model.timer);
+        QTAILQ_INIT(&n->model.reqs);
+    }
+    for (i = 0; i < n->num_queues; i++) {
+        if (n->sq[i] != NULL) {
+            nvme_free_sq(n->sq[i], n);
+        }
+    }
+    for (i = 0; i < n->num_queues; i++) {
+        if (n->cq[i] != NULL) {
+            nvme_free_cq(n->cq[i], n);
+        }
+    }
+    if (n->aer_timer) {
+        qemu_del_timer(n->aer_timer);
+        qemu_free_timer(n->aer_timer);
+        n->aer_timer = NULL;
+    }
+    while ((event = QSIMPLEQ_FIRST(&n->aer_queue)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&n->aer_queue, entry);
+        g_free(event);
+    }
+    n->outstanding_aers = 0;
+    for (i = 0; n->zoned && i < n->num_namespaces; i++) {
+        NvmeNamespace *ns = &n->namespaces[i];
+        uint32_t j;
+
+        /* open zones are closed by a controller reset */
+        for (j = 0; j < ns->nr_zones; j++) {
+            if (nvme_zone_is_open(ns->zones[j].state)) {
+                nvme_zone_close(ns, &ns->zones[j]);
+            }
         }
-        n->features.int_vector_config[dw11 & 0xffff] = dw11 & 0x1ffff;
-        break;
-    case NVME_WRITE_ATOMICITY:
-        n->features.write_atomicity = dw11;
-        break;
-    case NVME_ASYNCHRONOUS_EVENT_CONF:
-        n->features.async_config = dw11;
-        break;
-    case NVME_SOFTWARE_PROGRESS_MARKER:
-        n->features.sw_prog_marker = dw11;
-        break;
-    default:
-        return NVME_INVALID_FIELD | NVME_DNR;
     }
-    return NVME_SUCCESS;
+    n->dbbuf_dbs = 0;
+    n->dbbuf_eis = 0;
+    n->bar.cc = 0;
+
+    /* a running format finishes erasing but has no command to complete */
+    n->format_req = NULL;
 }
 
-static uint16_t nvme_fw_log_info(NvmeCtrl *n, NvmeCmd *cmd, uint32_t buf_len)
+static int nvme_start_ctrl(NvmeCtrl *n)
 {
-    uint32_t trans_len;
-    uint64_t prp1 = le64_to_cpu(cmd->prp1);
-    uint64_t prp2 = le64_to_cpu(cmd->prp2);
-    NvmeFwSlotInfoLog fw_log;
+    uint32_t page_bits = NVME_CC_MPS(n->bar.cc) + 12;
+    uint32_t page_size = 1 << page_bits;
 
-    trans_len = MIN(sizeof(fw_log), buf_len);
-    return nvme_dma_read_prp(n, (uint8_t *)&fw_log, trans_len, prp1, prp2);
-}
+    if (n->cq[0] || n->sq[0] || !n->bar.asq || !n->bar.acq ||
+            n->bar.asq & (page_size - 1) || n->bar.acq & (page_size - 1) ||
+            NVME_CC_MPS(n->bar.cc) < NVME_CAP_MPSMIN(n->bar.cap) ||
+            NVME_CC_MPS(n->bar.cc) > NVME_CAP_MPSMAX(n->bar.cap) ||
 
-static uint16_t nvme_error_log_info(NvmeCtrl *n, NvmeCmd *cmd, uint32_t buf_len)
-{
-    uint32_t trans_len;
-    uint64_t prp1 = le64_to_cpu(cmd->prp1);
-    uint64_t prp2 = le64_to_cpu(cmd->prp2);
+            NVME_CC_IOCQES(n->bar.cc) < NVME_CTRL_CQES_MIN(n->id_ctrl.cqes) ||
+            NVME_CC_IOCQES(n->bar.cc) > NVME_CTRL_CQES_MAX(n->id_ctrl.cqes) ||
+            NVME_CC_IOSQES(n->bar.cc) < NVME_CTRL_SQES_MIN(n->id_ctrl.sqes) ||
+            NVME_CC_IOSQES(n->bar.cc) > NVME_CTRL_SQES_MAX(n->id_ctrl.sqes) ||
+            (NVME_CC_AMS(n->bar.cc) != NVME_CC_AMS_RR &&
+                NVME_CC_AMS(n->bar.cc) != NVME_CC_AMS_WRRU) ||
 
-    trans_len = MIN(sizeof(*n->elpes) * n->elpe, buf_len);
-    n->aer_mask &= ~(1 << NVME_AER_TYPE_ERROR);
-    if (!QSIMPLEQ_EMPTY(&n->aer_queue)) {
-        qemu_mod_timer(n->aer_timer, qemu_get_clock_ns(vm_clock) + 10000);
+            !NVME_AQA_ASQS(n->bar.aqa) || NVME_AQA_ASQS(n->bar.aqa) > 4095 ||
+            !NVME_AQA_ACQS(n->bar.aqa) || NVME_AQA_ACQS(n->bar.aqa) > 4095) {
+        return -1;
     }
-    return nvme_dma_read_prp(n, (uint8_t *)n->elpes, trans_len, prp1, prp2);
+
+    n->page_bits = page_bits;
+    n->page_size = 1 << n->page_bits;
+    n->max_prp_ents = n->page_size / sizeof(uint64_t);
+    nvme_arb_reset_credits(n);
+    n->cqe_size = 1 << NVME_CC_IOCQES(n->bar.cc);
+    n->sqe_size = 1 << NVME_CC_IOSQES(n->bar.cc);
+    if (n->flash_model) {
+        nvme_model_start(n);
+    }
+
+    nvme_init_cq(&n->admin_cq, n, n->bar.acq, 0, 0,
+            NVME_AQA_ACQS(n->bar.aqa) + 1, 1, 1);
+    nvme_init_sq(&n->admin_sq, n, n->bar.asq, 0, 0,
+            NVME_AQA_ASQS(n->bar.aqa) + 1, NVME_Q_PRIO_HIGH, 1);
+
+    n->aer_timer = qemu_new_timer_ns(vm_clock, nvme_aer_process_cb, n);
+    QSIMPLEQ_INIT(&n->aer_queue);
+    return 0;
 }
 
-static uint16_t nvme_smart_info(NvmeCtrl *n, NvmeCmd *cmd, uint32_t buf_len)
+/*
+ * Migration. Stopping the VM drains the block layer, so by the time the
+ * device state is saved every command has finished except outstanding
+ * Asynchronous Event Requests, and completions may still be waiting for room
+ * in a full CQ. Both are recorded along with the queues and are back in
+ * place on the destination before the guest runs again.
+ */
+static void nvme_put_queues(QEMUFile *f, void *pv, size_t size)
 {
-    uint64_t prp1 = le64_to_cpu(cmd->prp1);
-    uint64_t prp2 = le64_to_cpu(cmd->prp2);
+    NvmeCtrl *n = pv;
+    NvmeAsyncEvent *event;
+    NvmeRequest *req;
+    int i;
 
-    uint32_t trans_len;
-    time_t current_seconds;
-    NvmeSmartLog smart;
-    BlockStats *s = bdrv_query_stats(n->conf.bs);
+    for (i = 0; i < n->num_queues; i++) {
+        NvmeCQueue *cq = n->cq[i];
 
-    trans_len = MIN(sizeof(smart), buf_len);
-    memset(&smart, 0x0, sizeof(smart));
-    smart.data_units_read[0] = cpu_to_le64(s->stats->rd_bytes);
-    smart.data_units_written[0] = cpu_to_le64(s->stats->wr_bytes);
-    smart.host_read_commands[0] = cpu_to_le64(s->stats->rd_operations);
-    smart.host_write_commands[0] = cpu_to_le64(s->stats->wr_operations);
+        if (!cq) {
+            continue;
+        }
+        qemu_put_byte(f, 1);
+        qemu_put_be16(f, cq->cqid);
+        qemu_put_be16(f, cq->vector);
+        qemu_put_be16(f, cq->irq_enabled);
+        qemu_put_byte(f, cq->phys_contig);
+        qemu_put_byte(f, cq->phase);
+        qemu_put_be32(f, cq->size);
+        qemu_put_be32(f, cq->head);
+        qemu_put_be32(f, cq->tail);
+        qemu_put_be32(f, cq->pending);
+        qemu_put_be64(f, cq->dma_addr);
+    }
+    qemu_put_byte(f, 0);
 
-    g_free(s);
-    smart.number_of_error_log_entries[0] = cpu_to_le64(n->num_errors);
-    smart.temperature[0] = n->temperature & 0xff;
-    smart.temperature[1] = (n->temperature >> 8) & 0xff;
+    for (i = 0; i < n->num_queues; i++) {
+        NvmeSQueue *sq = n->sq[i];
 
-    current_seconds = time(NULL);
-    smart.power_on_hours[0] = cpu_to_le64(
-        ((current_seconds - n->start_time) / 60) / 60);
+        if (!sq) {
+            continue;
+        }
+        qemu_put_byte(f, 1);
+        qemu_put_be16(f, sq->sqid);
+        qemu_put_be16(f, sq->cqid);
+        qemu_put_byte(f, sq->prio);
+        qemu_put_byte(f, sq->phys_contig);
+        qemu_put_be32(f, sq->size);
+        qemu_put_be32(f, sq->head);
+        qemu_put_be32(f, sq->tail);
+        qemu_put_be64(f, sq->dma_addr);
+    }
+    qemu_put_byte(f, 0);
 
-    smart.available_spare_threshold = NVME_SPARE_THRESHOLD;
-    if (smart.available_spare <= NVME_SPARE_THRESHOLD) {
-        smart.critical_warning |= NVME_SMART_SPARE;
+    for (i = 0; i < n->num_queues; i++) {
+        if (!n->cq[i]) {
+            continue;
+        }
+        QTAILQ_FOREACH(req, &n->cq[i]->req_list, entry) {
+            qemu_put_byte(f, 1);
+            qemu_put_be16(f, req->sq->sqid);
+            qemu_put_be16(f, le16_to_cpu(req->cqe.cid));
+            qemu_put_be16(f, req->status);
+            qemu_put_be32(f, le32_to_cpu(req->cqe.result));
+        }
     }
-    if (n->features.temp_thresh <= n->temperature) {
-        smart.critical_warning |= NVME_SMART_TEMPERATURE;
+    /* completions held by the timing model are posted right away */
+    QTAILQ_FOREACH(req, &n->model.reqs, entry) {
+        qemu_put_byte(f, 1);
+        qemu_put_be16(f, req->sq->sqid);
+        qemu_put_be16(f, le16_to_cpu(req->cqe.cid));
+        qemu_put_be16(f, req->status);
+        qemu_put_be32(f, le32_to_cpu(req->cqe.result));
     }
+    qemu_put_byte(f, 0);
 
-    n->aer_mask &= ~(1 << NVME_AER_TYPE_SMART);
-    if (!QSIMPLEQ_EMPTY(&n->aer_queue)) {
-        qemu_mod_timer(n->aer_timer, qemu_get_clock_ns(vm_clock) + 10000);
+    qemu_put_byte(f, n->outstanding_aers);
+    for (i = 0; i < n->outstanding_aers; i++) {
+        qemu_put_be16(f, le16_to_cpu(n->aer_reqs[i]->cqe.cid));
     }
+    QSIMPLEQ_FOREACH(event, &n->aer_queue, entry) {
+        qemu_put_byte(f, 1);
+        qemu_put_byte(f, event->result.event_type);
+        qemu_put_byte(f, event->result.event_info);
+        qemu_put_byte(f, event->result.log_page);
+    }
+    qemu_put_byte(f, 0);
 
-    return nvme_dma_read_prp(n, (uint8_t *)&smart, trans_len, prp1, prp2);
-}
-
-static uint16_t nvme_get_log(NvmeCtrl *n, NvmeCmd *cmd)
-{
-    uint32_t dw10 = le32_to_cpu(cmd->cdw10);
-    uint16_t lid = dw10 & 0xffff;
-    uint32_t len = ((dw10 >> 16) & 0xff) << 2;
-
-    switch (lid) {
-    case NVME_LOG_ERROR_INFO:
-        return nvme_error_log_info(n, cmd, len);
-    case NVME_LOG_SMART_INFO:
-        return nvme_smart_info(n, cmd, len);
-    case NVME_LOG_FW_SLOT_INFO:
-        return nvme_fw_log_info(n, cmd, len);
-    default:
-        return NVME_INVALID_LOG_ID | NVME_DNR;
+    qemu_put_buffer(f, (uint8_t *)n->elpes, (n->elpe + 1) * sizeof(*n->elpes));
+    for (i = 0; i < NVME_ARB_CLASSES; i++) {
+        qemu_put_be32(f, n->arb_credit[i]);
     }
 }
 
-static uint16_t nvme_async_req(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+/* Take a free request off @sq as if its command had just been fetched */
+static NvmeRequest *nvme_load_req(NvmeSQueue *sq, uint16_t cid)
 {
-    if (n->outstanding_aers > n->aerl + 1) {
-        return NVME_AER_LIMIT_EXCEEDED;
+    NvmeRequest *req = QTAILQ_FIRST(&sq->req_list);
+
+    if (!req) {
+        return NULL;
     }
-    n->aer_reqs[n->outstanding_aers] = req;
-    qemu_mod_timer(n->aer_timer, qemu_get_clock_ns(vm_clock) + 10000);
-    n->outstanding_aers++;
-    return NVME_NO_COMPLETE;
+    QTAILQ_REMOVE(&sq->req_list, req, entry);
+    memset(&req->cqe, 0, sizeof(req->cqe));
+    req->cqe.cid = cpu_to_le16(cid);
+    req->aiocb = NULL;
+    req->model_done = 0;
+    req->fetch_ns = get_clock();
+    req->stats_op = NVME_STATS_OPS;
+    req->stats_ns = NULL;
+    sq->inflight++;
+    return req;
 }
 
-static uint16_t nvme_abort_req(NvmeCtrl *n, NvmeCmd *cmd, uint32_t *result)
+static int nvme_get_queues(QEMUFile *f, void *pv, size_t size)
 {
-    uint32_t index = 0;
-    uint16_t sqid = cmd->cdw10 & 0xffff;
-    uint16_t cid = (cmd->cdw10 >> 16) & 0xffff;
-    NvmeSQueue *sq;
+    NvmeCtrl *n = pv;
+    NvmeAsyncEvent *event;
     NvmeRequest *req;
+    uint8_t aers;
+    int i;
 
-    *result = 1;
-    if (nvme_check_sqid(n, sqid)) {
-        return NVME_SUCCESS;
+    while (qemu_get_byte(f)) {
+        NvmeCQueue *cq;
+        uint16_t cqid = qemu_get_be16(f);
+        uint16_t vector = qemu_get_be16(f);
+        uint16_t irq_enabled = qemu_get_be16(f);
+        uint8_t contig = qemu_get_byte(f);
+        uint8_t phase = qemu_get_byte(f);
+        uint32_t qsize = qemu_get_be32(f);
+        uint32_t head = qemu_get_be32(f);
+        uint32_t tail = qemu_get_be32(f);
+        uint32_t pending = qemu_get_be32(f);
+        uint64_t dma_addr = qemu_get_be64(f);
+
+        if (cqid >= n->num_queues || n->cq[cqid] ||
+                vector > n->num_queues || (!cqid && !contig) ||
+                qsize < 2 || qsize > NVME_MAX_QUEUE_ENTRIES ||
+                head >= qsize || tail >= qsize) {
+            return -EINVAL;
+        }
+        cq = cqid ? g_malloc0(sizeof(*cq)) : &n->admin_cq;
+        if (nvme_init_cq(cq, n, dma_addr, cqid, vector, qsize, irq_enabled,
+                contig)) {
+            if (cqid) {
+                g_free(cq);
+            }
+            return -EINVAL;
+        }
+        cq->phase = phase;
+        cq->head = head;
+        cq->tail = tail;
+        cq->pending = pending;
+        if (cq->pending) {
+            qemu_mod_timer(cq->intc_timer, qemu_get_clock_ns(vm_clock));
+        }
     }
 
-    sq = n->sq[sqid];
-    while (!QTAILQ_EMPTY(&sq->out_req_list)) {
-        req = QTAILQ_FIRST(&sq->out_req_list);
-        assert(req->aiocb);
-        if (req->cqe.cid == cid) {
-            bdrv_aio_cancel(req->aiocb);
-            *result = 0;
-            return NVME_SUCCESS;
+    while (qemu_get_byte(f)) {
+        NvmeSQueue *sq;
+        uint16_t sqid = qemu_get_be16(f);
+        uint16_t cqid = qemu_get_be16(f);
+        uint8_t prio = qemu_get_byte(f);
+        uint8_t contig = qemu_get_byte(f);
+        uint32_t qsize = qemu_get_be32(f);
+        uint32_t head = qemu_get_be32(f);
+        uint32_t tail = qemu_get_be32(f);
+        uint64_t dma_addr = qemu_get_be64(f);
+
+        if (sqid >= n->num_queues || n->sq[sqid] ||
+                nvme_check_cqid(n, cqid) || (!sqid && (cqid || !contig)) ||
+                qsize < 2 || qsize > NVME_MAX_QUEUE_ENTRIES ||
+                head >= qsize || tail >= qsize) {
+            return -EINVAL;
+        }
+        sq = sqid ? g_malloc0(sizeof(*sq)) : &n->admin_sq;
+        if (nvme_init_sq(sq, n, dma_addr, sqid, cqid, qsize, prio, contig)) {
+            if (sqid) {
+                g_free(sq);
+            }
+            return -EINVAL;
         }
+        sq->head = head;
+        sq->tail = tail;
     }
 
-    while ((sq->head + index) % sq->size != sq->tail) {
-        NvmeCmd abort_cmd;
-        hwaddr addr;
+    while (qemu_get_byte(f)) {
+        uint16_t sqid = qemu_get_be16(f);
+        uint16_t cid = qemu_get_be16(f);
+        uint16_t status = qemu_get_be16(f);
+        uint32_t result = qemu_get_be32(f);
 
-        if (sq->phys_contig) {
-            addr = sq->dma_addr + ((sq->head + index) % sq->size) *
-                n->sqe_size;
-        } else {
-            addr = nvme_discontig(sq->prp_list, (sq->head + index) % sq->size,
-                n->page_size, n->sqe_size);
+        if (nvme_check_sqid(n, sqid) ||
+                !(req = nvme_load_req(n->sq[sqid], cid))) {
+            return -EINVAL;
         }
+        req->cqe.result = cpu_to_le32(result);
+        req->status = status;
+        QTAILQ_INSERT_TAIL(&n->cq[req->sq->cqid]->req_list, req, entry);
+    }
 
-        pci_dma_read(&n->parent_obj, addr, (void *)&abort_cmd,
-            sizeof(abort_cmd));
-        if (abort_cmd.cid == cid) {
-            *result = 0;
-            req = QTAILQ_FIRST(&sq->req_list);
-            QTAILQ_REMOVE(&sq->req_list, req, entry);
-            QTAILQ_INSERT_TAIL(&sq->out_req_list, req, entry);
-
-            memset(&req->cqe, 0, sizeof(req->cqe));
-            req->cqe.cid = cid;
-            req->cqe.status = NVME_CMD_ABORT_REQ << 1;
-
-            abort_cmd.opcode = NVME_OP_ABORTED;
-            pci_dma_write(&n->parent_obj, addr, (void *)&abort_cmd,
-                sizeof(abort_cmd));
+    aers = qemu_get_byte(f);
+    if (aers > n->aerl + 1 || (aers && !n->sq[0])) {
+        return -EINVAL;
+    }
+    for (i = 0; i < aers; i++) {
+        req = nvme_load_req(n->sq[0], qemu_get_be16(f));
+        if (!req) {
+            return -EINVAL;
+        }
+        QTAILQ_INSERT_TAIL(&n->sq[0]->out_req_list, req, entry);
+        n->aer_reqs[i] = req;
+    }
+    n->outstanding_aers = aers;
 
-            nvme_enqueue_req_completion(n->cq[sq->cqid], req);
-            return NVME_SUCCESS;
+    QSIMPLEQ_INIT(&n->aer_queue);
+    while (qemu_get_byte(f)) {
+        event = g_malloc(sizeof(*event));
+        event->result.event_type = qemu_get_byte(f);
+        event->result.event_info = qemu_get_byte(f);
+        event->result.log_page = qemu_get_byte(f);
+        QSIMPLEQ_INSERT_TAIL(&n->aer_queue, event, entry);
+    }
+    if (n->cq[0]) {
+        n->aer_timer = qemu_new_timer_ns(vm_clock, nvme_aer_process_cb, n);
+        if (!QSIMPLEQ_EMPTY(&n->aer_queue)) {
+            qemu_mod_timer(n->aer_timer, qemu_get_clock_ns(vm_clock));
         }
+    }
 
-        ++index;
+    qemu_get_buffer(f, (uint8_t *)n->elpes, (n->elpe + 1) * sizeof(*n->elpes));
+    for (i = 0; i < NVME_ARB_CLASSES; i++) {
+        n->arb_credit[i] = qemu_get_be32(f);
     }
-    return NVME_SUCCESS;
+
+    /* derived model parameters aren't migrated, compute them like at start */
+    if (n->flash_model && n->cq[0]) {
+        nvme_model_start(n);
+    }
+    return qemu_file_get_error(f);
 }
 
-static uint16_t nvme_format_namespace(NvmeNamespace *ns, uint8_t lba_idx,
-    uint8_t meta_loc, uint8_t pil, uint8_t pi, uint8_t sec_erase)
+static const VMStateInfo nvme_vmstate_info_queues = {
+    .name = "nvme-queues",
+    .get  = nvme_get_queues,
+    .put  = nvme_put_queues,
+};
+
+static void nvme_put_zones(QEMUFile *f, void *pv, size_t size)
 {
-    uint64_t blks;
-    uint16_t ms = le16_to_cpu(ns->id_ns.lbaf[lba_idx].ms);
+    NvmeCtrl *n = pv;
+    uint32_t i, j;
 
-    if (lba_idx > ns->id_ns.nlbaf) {
-        return NVME_INVALID_FORMAT | NVME_DNR;
-    }
-    if (pi) {
-        if (pil && !NVME_ID_NS_DPC_LAST_EIGHT(ns->id_ns.dpc)) {
-            return NVME_INVALID_FORMAT | NVME_DNR;
-        }
-        if (!pil && !NVME_ID_NS_DPC_FIRST_EIGHT(ns->id_ns.dpc)) {
-            return NVME_INVALID_FORMAT | NVME_DNR;
-        }
-        if (!((ns->id_ns.dpc & 0x7) & (1 << (pi - 1)))) {
-            return NVME_INVALID_FORMAT | NVME_DNR;
+    for (i = 0; i < n->num_namespaces; i++) {
+        NvmeNamespace *ns = &n->namespaces[i];
+
+        qemu_put_be32(f, n->zoned ? ns->nr_zones : 0);
+        for (j = 0; n->zoned && j < ns->nr_zones; j++) {
+            qemu_put_be64(f, ns->zones[j].wp);
+            qemu_put_byte(f, ns->zones[j].state);
         }
     }
-    if (meta_loc && ms && !NVME_ID_NS_MC_EXTENDED(ns->id_ns.mc)) {
-        return NVME_INVALID_FORMAT | NVME_DNR;
-    }
-    if (!meta_loc && ms && !NVME_ID_NS_MC_SEPARATE(ns->id_ns.mc)) {
-        return NVME_INVALID_FORMAT | NVME_DNR;
-    }
+}
 
-    g_free(ns->util);
-    g_free(ns->uncorrectable);
-    blks = ns->ctrl->ns_size / ((1 << ns->id_ns.lbaf[lba_idx].ds) +
-                ns->ctrl->meta);
-    ns->id_ns.flbas = lba_idx | meta_loc;
-    ns->id_ns.nsze = cpu_to_le64(blks);
-    ns->id_ns.ncap = ns->id_ns.nsze;
-    ns->id_ns.nuse = ns->id_ns.nsze;
-    ns->id_ns.dps = pil | pi;
-    ns->util = bitmap_new(blks);
-    ns->uncorrectable = bitmap_new(blks);
+/*
+ * The block maps stream carries any format change and so the zone size, and
+ * is loaded before the device state; the zone tables must match it here.
+ */
+static int nvme_get_zones(QEMUFile *f, void *pv, size_t size)
+{
+    NvmeCtrl *n = pv;
+    uint32_t i, j;
+
+    for (i = 0; i < n->num_namespaces; i++) {
+        NvmeNamespace *ns = &n->namespaces[i];
 
-    if (sec_erase) {
-        /* TODO: write zeros, complete asynchronously */;
+        if (qemu_get_be32(f) != (n->zoned ? ns->nr_zones : 0)) {
+            return -EINVAL;
+        }
+        for (j = 0; n->zoned && j < ns->nr_zones; j++) {
+            NvmeZone *zone = &ns->zones[j];
+            uint64_t wp = qemu_get_be64(f);
+            uint8_t state = qemu_get_byte(f);
+            uint64_t zslba = nvme_zone_slba(ns, zone);
+
+            if (wp < zslba || wp > zslba + ns->zone_size ||
+                    !nvme_zone_state_valid(state)) {
+                return -EINVAL;
+            }
+            zone->wp = wp;
+            nvme_zone_set_state(ns, zone, state);
+        }
     }
+    return 0;
+}
 
-    return NVME_SUCCESS;
+static const VMStateInfo nvme_vmstate_info_zones = {
+    .name = "nvme-zones",
+    .get  = nvme_get_zones,
+    .put  = nvme_put_zones,
+};
+
+/* The queues are rebuilt from the incoming state, so drop the current ones */
+static int nvme_pre_load(void *opaque)
+{
+    nvme_clear_ctrl(opaque);
+    return 0;
 }
 
-static uint16_t nvme_format(NvmeCtrl *n, NvmeCmd *cmd)
+/*
+ * Commands and completions left waiting while the VM was stopped, including
+ * those restored by migration, are picked up once it runs again.
+ */
+static void nvme_vm_state_change(void *opaque, int running, RunState state)
 {
-    NvmeNamespace *ns;
-    uint32_t dw10 = le32_to_cpu(cmd->cdw10);
-    uint32_t nsid = le32_to_cpu(cmd->nsid);
+    NvmeCtrl *n = opaque;
+    int i;
 
-    uint8_t lba_idx = dw10 & 0xf;
-    uint8_t meta_loc = dw10 & 0x10;
-    uint8_t pil = (dw10 >> 5) & 0x8;
-    uint8_t pi = (dw10 >> 5) & 0x7;
-    uint8_t sec_erase = (dw10 >> 8) & 0x7;
+    if (!running) {
+        return;
+    }
+    for (i = 0; i < n->num_queues; i++) {
+        if (n->cq[i] && !QTAILQ_EMPTY(&n->cq[i]->req_list)) {
+            qemu_bh_schedule(n->cq[i]->bh);
+        }
+        if (n->sq[i]) {
+            nvme_kick_sq(n->sq[i]);
+        }
+    }
+}
 
-    if (nsid == 0xffffffff) {
-        uint32_t i;
-        uint16_t ret = NVME_SUCCESS;
+/*
+ * The block maps can be large, so they are not part of the device state but
+ * streamed while the guest runs: every namespace starts out dirty, chunks of
+ * NVME_MIG_CHUNK blocks are sent with the extents each map has in them, and
+ * ranges the guest changes meanwhile are marked dirty again. Only what
+ * changed since the last pass is left to send once the VM has stopped.
+ */
+static bool nvme_mig_send_chunk(NvmeCtrl *n, QEMUFile *f)
+{
+    GArray *ext[NVME_STATE_MAPS];
+    NvmeNamespace *ns = NULL;
+    uint64_t slba, nlb, pos, run;
+    uint8_t flbas, dps;
+    bool in;
+    guint j;
+    int i;
 
-        for (i = 0; i < n->num_namespaces; ++i) {
+    qemu_mutex_lock(&n->map_lock);
+    for (i = 0; i < n->num_namespaces; i++) {
+        if (n->namespaces[i].mig_dirty &&
+                range_set_count(n->namespaces[i].mig_dirty)) {
             ns = &n->namespaces[i];
-            ret = nvme_format_namespace(ns, lba_idx, meta_loc, pil, pi,
-                sec_erase);
-            if (ret != NVME_SUCCESS) {
-                return ret;
-            }
+            break;
         }
-        return ret;
     }
-
-    if (nsid == 0 || nsid > n->num_namespaces) {
-        return NVME_INVALID_NSID | NVME_DNR;
+    if (!ns) {
+        qemu_mutex_unlock(&n->map_lock);
+        return false;
     }
 
-    ns = &n->namespaces[nsid - 1];
-    return nvme_format_namespace(ns, lba_idx, meta_loc, pil, pi,
-        sec_erase);
+    slba = range_set_run(ns->mig_dirty, 0, UINT64_MAX, &in);
+    if (in) {
+        slba = 0;
+    }
+    nlb = range_set_run(ns->mig_dirty, slba, NVME_MIG_CHUNK, &in);
+    range_set_remove(ns->mig_dirty, slba, nlb);
+    flbas = ns->id_ns.flbas;
+    dps = ns->id_ns.dps;
+    for (i = 0; i < NVME_STATE_MAPS; i++) {
+        ext[i] = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+        for (pos = slba; pos < slba + nlb; pos += run) {
+            run = range_set_run(nvme_state_map(ns, i), pos, slba + nlb - pos,
+                &in);
+            if (in) {
+                g_array_append_val(ext[i], pos);
+                g_array_append_val(ext[i], run);
+            }
+        }
+    }
+    qemu_mutex_unlock(&n->map_lock);
+
+    qemu_put_be32(f, NVME_MIG_FLAG_CHUNK);
+    qemu_put_be32(f, ns->id);
+    qemu_put_byte(f, flbas);
+    qemu_put_byte(f, dps);
+    qemu_put_be64(f, slba);
+    qemu_put_be64(f, nlb);
+    for (i = 0; i < NVME_STATE_MAPS; i++) {
+        qemu_put_be32(f, ext[i]->len / 2);
+        for (j = 0; j < ext[i]->len; j++) {
+            qemu_put_be64(f, g_array_index(ext[i], uint64_t, j));
+        }
+        g_array_free(ext[i], TRUE);
+    }
+    return true;
 }
 
-static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+static void nvme_mig_cleanup(NvmeCtrl *n)
 {
-    switch (cmd->opcode) {
-    case NVME_ADM_CMD_DELETE_SQ:
-        return nvme_del_sq(n, cmd);
-    case NVME_ADM_CMD_CREATE_SQ:
-        return nvme_create_sq(n, cmd);
-    case NVME_ADM_CMD_DELETE_CQ:
-        return nvme_del_cq(n, cmd);
-    case NVME_ADM_CMD_CREATE_CQ:
-        return nvme_create_cq(n, cmd);
-    case NVME_ADM_CMD_IDENTIFY:
-        return nvme_identify(n, cmd);
-    case NVME_ADM_CMD_SET_FEATURES:
-        return nvme_set_feature(n, cmd, req);
-    case NVME_ADM_CMD_GET_FEATURES:
-        return nvme_get_feature(n, cmd, req);
-    case NVME_ADM_CMD_GET_LOG_PAGE:
-        return nvme_get_log(n, cmd);
-    case NVME_ADM_CMD_ASYNC_EV_REQ:
-        return nvme_async_req(n, cmd, req);
-    case NVME_ADM_CMD_ABORT:
-        return nvme_abort_req(n, cmd, &req->cqe.result);
-    case NVME_ADM_CMD_FORMAT_NVM:
-        if (NVME_OACS_FORMAT & n->oacs) {
-            return nvme_format(n, cmd);
-        }
-        return NVME_INVALID_OPCODE | NVME_DNR;
-    case NVME_ADM_CMD_ACTIVATE_FW:
-    case NVME_ADM_CMD_DOWNLOAD_FW:
-    case NVME_ADM_CMD_SECURITY_SEND:
-    case NVME_ADM_CMD_SECURITY_RECV:
-    default:
-        return NVME_INVALID_OPCODE | NVME_DNR;
+    int i;
+
+    qemu_mutex_lock(&n->map_lock);
+    for (i = 0; i < n->num_namespaces; i++) {
+        range_set_free(n->namespaces[i].mig_dirty);
+        n->namespaces[i].mig_dirty = NULL;
     }
+    qemu_mutex_unlock(&n->map_lock);
 }
 
-static void nvme_process_sq(void *opaque)
+static int nvme_mig_setup(QEMUFile *f, void *opaque)
 {
-    uint16_t status;
-    hwaddr addr;
-    NvmeCmd cmd;
-    NvmeRequest *req;
-    NvmeSQueue *sq = opaque;
-    NvmeCtrl *n = sq->ctrl;
-    NvmeCQueue *cq = n->cq[sq->cqid];
-    int processed = 0;
+    NvmeCtrl *n = opaque;
+    int i;
 
-    while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list)) &&
-            processed++ < sq->arb_burst) {
-        if (sq->phys_contig) {
-            addr = sq->dma_addr + sq->head * n->sqe_size;
-        } else {
-            addr = nvme_discontig(sq->prp_list, sq->head, n->page_size,
-                n->sqe_size);
-        }
-        pci_dma_read(&n->parent_obj, addr, (void *)&cmd, sizeof(cmd));
-        nvme_inc_sq_head(sq);
+    nvme_mig_cleanup(n);
+    qemu_mutex_lock(&n->map_lock);
+    for (i = 0; i < n->num_namespaces; i++) {
+        NvmeNamespace *ns = &n->namespaces[i];
 
-        req = QTAILQ_FIRST(&sq->req_list);
-        QTAILQ_REMOVE(&sq->req_list, req, entry);
-        QTAILQ_INSERT_TAIL(&sq->out_req_list, req, entry);
-        memset(&req->cqe, 0, sizeof(req->cqe));
-        req->cqe.cid = cmd.cid;
-        req->aiocb = NULL;
+        ns->mig_dirty = range_set_new();
+        range_set_add(ns->mig_dirty, 0, le64_to_cpu(ns->id_ns.nsze));
+    }
+    qemu_mutex_unlock(&n->map_lock);
 
-        status = sq->sqid ? nvme_io_cmd(n, &cmd, req) :
-            nvme_admin_cmd(n, &cmd, req);
-        if (status != NVME_NO_COMPLETE) {
-            req->status = status;
-            nvme_enqueue_req_completion(cq, req);
+    qemu_put_be32(f, NVME_MIG_FLAG_EOS);
+    return 0;
+}
+
+static int nvme_mig_iterate(QEMUFile *f, void *opaque)
+{
+    NvmeCtrl *n = opaque;
+    int ret = 0;
+
+    while (!qemu_file_rate_limit(f)) {
+        if (!nvme_mig_send_chunk(n, f)) {
+            ret = 1;
+            break;
         }
     }
+    qemu_put_be32(f, NVME_MIG_FLAG_EOS);
+    return ret;
+}
 
-    sq->completed += processed;
-    if (!nvme_sq_empty(sq)) {
-        qemu_mod_timer(sq->timer, qemu_get_clock_ns(vm_clock) + 500);
+static int nvme_mig_complete(QEMUFile *f, void *opaque)
+{
+    NvmeCtrl *n = opaque;
+
+    while (nvme_mig_send_chunk(n, f)) {
+        ;
     }
+    nvme_mig_cleanup(n);
+    qemu_put_be32(f, NVME_MIG_FLAG_EOS);
+    return 0;
 }
 
-static void nvme_clear_ctrl(NvmeCtrl *n)
+/*
+ * A chunk costs a 38 byte header plus 16 bytes per extent; assume the
+ * extents are spread evenly over the namespace.
+ */
+static uint64_t nvme_mig_pending(QEMUFile *f, void *opaque, uint64_t max_size)
 {
-    NvmeAsyncEvent *event;
-    int i;
+    NvmeCtrl *n = opaque;
+    uint64_t pending = 0;
+    int i, m;
 
-    for (i = 0; i < n->num_queues; i++) {
-        if (n->sq[i] != NULL) {
-            nvme_free_sq(n->sq[i], n);
+    qemu_mutex_lock(&n->map_lock);
+    for (i = 0; i < n->num_namespaces; i++) {
+        NvmeNamespace *ns = &n->namespaces[i];
+        uint64_t nsze = le64_to_cpu(ns->id_ns.nsze);
+        uint64_t dirty, extents = 0;
+
+        if (!ns->mig_dirty || !nsze) {
+            continue;
         }
-    }
-    for (i = 0; i < n->num_queues; i++) {
-        if (n->cq[i] != NULL) {
-            nvme_free_cq(n->cq[i], n);
+        dirty = range_set_count(ns->mig_dirty);
+        for (m = 0; m < NVME_STATE_MAPS; m++) {
+            extents += range_set_extents(nvme_state_map(ns, m));
         }
+        pending += DIV_ROUND_UP(dirty, NVME_MIG_CHUNK) * 38 +
+            (uint64_t)((double)extents * 16 * dirty / nsze);
     }
-    if (n->aer_timer) {
-        qemu_del_timer(n->aer_timer);
-        qemu_free_timer(n->aer_timer);
-        n->aer_timer = NULL;
-    }
-    while ((event = QSIMPLEQ_FIRST(&n->aer_queue)) != NULL) {
-        QSIMPLEQ_REMOVE_HEAD(&n->aer_queue, entry);
-        g_free(event);
-    }
-    n->bar.cc = 0;
+    qemu_mutex_unlock(&n->map_lock);
+    return pending;
 }
 
-static int nvme_start_ctrl(NvmeCtrl *n)
+static void nvme_mig_cancel(void *opaque)
 {
-    uint32_t page_bits = NVME_CC_MPS(n->bar.cc) + 12;
-    uint32_t page_size = 1 << page_bits;
-
-    if (n->cq[0] || n->sq[0] || !n->bar.asq || !n->bar.acq ||
-            n->bar.asq & (page_size - 1) || n->bar.acq & (page_size - 1) ||
-            NVME_CC_MPS(n->bar.cc) < NVME_CAP_MPSMIN(n->bar.cap) ||
-            NVME_CC_MPS(n->bar.cc) > NVME_CAP_MPSMAX(n->bar.cap) ||
+    nvme_mig_cleanup(opaque);
+}
 
-            NVME_CC_IOCQES(n->bar.cc) < NVME_CTRL_CQES_MIN(n->id_ctrl.cqes) ||
-            NVME_CC_IOCQES(n->bar.cc) > NVME_CTRL_CQES_MAX(n->id_ctrl.cqes) ||
-            NVME_CC_IOSQES(n->bar.cc) < NVME_CTRL_SQES_MIN(n->id_ctrl.sqes) ||
-            NVME_CC_IOSQES(n->bar.cc) > NVME_CTRL_SQES_MAX(n->id_ctrl.sqes) ||
+static int nvme_mig_load(QEMUFile *f, void *opaque, int version_id)
+{
+    NvmeCtrl *n = opaque;
+    uint32_t flags;
 
-            !NVME_AQA_ASQS(n->bar.aqa) || NVME_AQA_ASQS(n->bar.aqa) > 4095 ||
-            !NVME_AQA_ACQS(n->bar.aqa) || NVME_AQA_ACQS(n->bar.aqa) > 4095) {
-        return -1;
+    if (version_id != 1) {
+        return -EINVAL;
     }
+    while ((flags = qemu_get_be32(f)) == NVME_MIG_FLAG_CHUNK) {
+        uint32_t nsid = qemu_get_be32(f);
+        uint8_t flbas = qemu_get_byte(f);
+        uint8_t dps = qemu_get_byte(f);
+        uint64_t slba = qemu_get_be64(f);
+        uint64_t nlb = qemu_get_be64(f);
+        NvmeNamespace *ns;
+        uint64_t nsze;
+        int m;
+
+        if (!nsid || nsid > n->num_namespaces) {
+            return -EINVAL;
+        }
+        ns = &n->namespaces[nsid - 1];
+
+        /* the guest formatted the namespace since it started */
+        if ((ns->id_ns.flbas != flbas || ns->id_ns.dps != dps) &&
+                nvme_format_namespace(ns, NVME_ID_NS_FLBAS_INDEX(flbas),
+                    flbas & 0x10, dps & 0x8, dps & 0x7,
+                    NVME_FORMAT_SES_NONE)) {
+            return -EINVAL;
+        }
+        nsze = le64_to_cpu(ns->id_ns.nsze);
+        if (slba > nsze || nlb > nsze - slba) {
+            return -EINVAL;
+        }
 
-    n->page_bits = page_bits;
-    n->page_size = 1 << n->page_bits;
-    n->max_prp_ents = n->page_size / sizeof(uint64_t);
-    n->cqe_size = 1 << NVME_CC_IOCQES(n->bar.cc);
-    n->sqe_size = 1 << NVME_CC_IOSQES(n->bar.cc);
+        for (m = 0; m < NVME_STATE_MAPS; m++) {
+            RangeSet *map = nvme_state_map(ns, m);
+            uint32_t nr = qemu_get_be32(f);
 
-    nvme_init_cq(&n->admin_cq, n, n->bar.acq, 0, 0,
-            NVME_AQA_ACQS(n->bar.aqa) + 1, 1, 1);
-    nvme_init_sq(&n->admin_sq, n, n->bar.asq, 0, 0,
-            NVME_AQA_ASQS(n->bar.aqa) + 1, NVME_Q_PRIO_HIGH, 1);
+            range_set_remove(map, slba, nlb);
+            while (nr--) {
+                uint64_t start = qemu_get_be64(f);
+                uint64_t count = qemu_get_be64(f);
 
-    n->aer_timer = qemu_new_timer_ns(vm_clock, nvme_aer_process_cb, n);
-    QSIMPLEQ_INIT(&n->aer_queue);
-    return 0;
+                if (start < slba || start - slba > nlb ||
+                        count > slba + nlb - start) {
+                    return -EINVAL;
+                }
+                range_set_add(map, start, count);
+            }
+        }
+    }
+    if (flags != NVME_MIG_FLAG_EOS) {
+        return -EINVAL;
+    }
+    return qemu_file_get_error(f);
 }
 
+static SaveVMHandlers nvme_mig_handlers = {
+    .save_live_setup = nvme_mig_setup,
+    .save_live_iterate = nvme_mig_iterate,
+    .save_live_complete = nvme_mig_complete,
+    .save_live_pending = nvme_mig_pending,
+    .cancel = nvme_mig_cancel,
+    .load_state = nvme_mig_load,
+};
+
 static void nvme_write_bar(NvmeCtrl *n, hwaddr offset, uint64_t data,
     unsigned size)
 {
@@ -1813,6 +4962,7 @@ static void nvme_write_bar(NvmeCtrl *n, hwaddr offset, uint64_t data,
      
         if (NVME_CC_SHN(data) && !shutdownActive) {
                 nvme_clear_ctrl(n);
+                nvme_save_state(n);
                 n->bar.cc = data;
                 n->bar.csts |= NVME_CSTS_SHST_COMPLETE;
         } else if (!NVME_CC_SHN(data) && shutdownActive) {
@@ -1875,15 +5025,17 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         if (new_head >= cq->size) {
             return;
         }
+        cq->doorbells++;
+        n->stats.doorbells++;
 
         start_sqs = nvme_cq_full(cq) ? 1 : 0;
         cq->head = new_head;
         if (start_sqs) {
             NvmeSQueue *sq;
             QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
-                qemu_mod_timer(sq->timer, qemu_get_clock_ns(vm_clock) + 500);
+                nvme_kick_sq(sq);
             }
-            qemu_mod_timer(cq->timer, qemu_get_clock_ns(vm_clock) + 500);
+            qemu_bh_schedule(cq->bh);
         }
 
         if (cq->tail != cq->head) {
@@ -1902,9 +5054,11 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         if (new_tail >= sq->size) {
             return;
         }
+        sq->stats.doorbells++;
+        n->stats.doorbells++;
 
         sq->tail = new_tail;
-        qemu_mod_timer(sq->timer, qemu_get_clock_ns(vm_clock) + 500);
+        nvme_kick_sq(sq);
     }
 }
 
@@ -1931,14 +5085,24 @@ static const MemoryRegionOps nvme_mmio_ops = {
 
 static int nvme_check_constraints(NvmeCtrl *n)
 {
-    if ((!(n->conf.bs)) || !(n->serial) ||
-        (n->num_namespaces == 0 || n->num_namespaces > NVME_MAX_NUM_NAMESPACES) ||
+    if (!(n->serial) ||
+        (n->conf.bs && (n->num_namespaces == 0 ||
+            n->num_namespaces > NVME_MAX_NUM_NAMESPACES)) ||
         (n->num_queues < 1 || n->num_queues > NVME_MAX_QS) ||
         (n->db_stride > NVME_MAX_STRIDE) ||
         (n->max_q_ents < 1) ||
         (n->max_sqes > NVME_MAX_QUEUE_ES || n->max_cqes > NVME_MAX_QUEUE_ES ||
             n->max_sqes < NVME_MIN_SQUEUE_ES || n->max_cqes < NVME_MIN_CQUEUE_ES) ||
         (n->vwc > 1 || n->intc > 1 || n->cqr > 1 || n->extended > 1) ||
+        (n->ioeventfd > 1 || n->sgl > 1) ||
+        (n->flash_model > 1) ||
+        (n->flash_model && (!n->flash_channels || !n->flash_dies ||
+            n->flash_channels * (uint64_t)n->flash_dies > 0x10000 ||
+            !n->flash_page_kb || !n->flash_ppb || !n->flash_chan_mbps)) ||
+        (n->zoned > 1) ||
+        (n->zoned && (!n->zone_size_mb || (n->mdts && n->zasl > n->mdts))) ||
+        (n->cmb_size_mb && (!is_power_of_2(n->cmb_size_mb) ||
+            n->cmb_size_mb > CMBSZ_SZ_MASK)) ||
         (n->nlbaf > 16) ||
         (n->lba_index >= n->nlbaf) ||
         (n->meta && !n->mc) ||
@@ -1952,66 +5116,87 @@ static int nvme_check_constraints(NvmeCtrl *n)
         (n->dps & DPS_TYPE_MASK && !((n->dpc & NVME_ID_NS_DPC_TYPE_MASK) &
             (1 << ((n->dps & DPS_TYPE_MASK) - 1)))) ||
         (n->mpsmax > 0xf || n->mpsmax > n->mpsmin) ||
-        (n->oacs & ~(NVME_OACS_FORMAT)) ||
+        (n->oacs & ~(NVME_OACS_FORMAT | NVME_OACS_DBBUF)) ||
         (n->oncs & ~(NVME_ONCS_COMPARE | NVME_ONCS_WRITE_UNCORR |
-            NVME_ONCS_DSM))) {
+            NVME_ONCS_DSM | NVME_ONCS_WRITE_ZEROS))) {
         return -1;
     }
     return 0;
 }
 
-static void nvme_init_namespaces(NvmeCtrl *n)
+static void nvme_init_namespace(NvmeCtrl *n, NvmeNamespace *ns,
+    BlockDriverState *bs, uint32_t nsid, uint64_t start_block, uint64_t size)
 {
-    int i, j, k;
+    NvmeIdNs *id_ns = &ns->id_ns;
     int ji = n->meta ? 2 : 1;
+    int j, k, lba_index;
+    uint64_t blks;
+    uint64_t blk_size_without_md;
+    uint64_t blk_size_include_md;
+
+    id_ns->nsfeat = 0;
+    id_ns->nlbaf = n->nlbaf - 1;
+
+    id_ns->flbas = n->lba_index | (n->extended << 4);
+    id_ns->mc = n->mc;
+    id_ns->dpc = n->dpc;
+    id_ns->dps = n->dps;
+    if (n->oncs & NVME_ONCS_DSM) {
+        id_ns->dlfeat = NVME_ID_NS_DLFEAT_ZEROES;
+    }
 
-    for (i = 0; i < n->num_namespaces; i++) {
-        NvmeNamespace *ns = &n->namespaces[i];
-        NvmeIdNs *id_ns = &ns->id_ns;
-        uint64_t blks;
-	uint64_t blk_size_without_md;
-	uint64_t blk_size_include_md;
-        int lba_index;
-
-        id_ns->nsfeat = 0;
-        id_ns->nlbaf = n->nlbaf - 1;
-
-        id_ns->flbas = n->lba_index | (n->extended << 4);
-        id_ns->mc = n->mc;
-        id_ns->dpc = n->dpc;
-        id_ns->dps = n->dps;
-
-        for (j = 0; j < ji; j++) {
-            for (k = 0; k < n->nlbaf / ji; k++) {
-                id_ns->lbaf[k + (n->nlbaf / ji) * j].ds = BDRV_SECTOR_BITS + k;
-                if (j) {
-                    id_ns->lbaf[k + (n->nlbaf / ji)].ms = cpu_to_le16(n->meta);
-                }
+    for (j = 0; j < ji; j++) {
+        for (k = 0; k < n->nlbaf / ji; k++) {
+            id_ns->lbaf[k + (n->nlbaf / ji) * j].ds = BDRV_SECTOR_BITS + k;
+            if (j) {
+                id_ns->lbaf[k + (n->nlbaf / ji)].ms = cpu_to_le16(n->meta);
             }
         }
+    }
+
+    lba_index = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
+    blk_size_without_md = (1 << id_ns->lbaf[lba_index].ds);
+    blk_size_include_md = blk_size_without_md + n->meta;
+    blks = size / blk_size_include_md;
+
+    id_ns->nuse = id_ns->ncap = id_ns->nsze = cpu_to_le64(blks);
+    ns->id = nsid;
+    ns->ctrl = n;
+    ns->bs = bs;
+    ns->size = blks * blk_size_include_md;
+    ns->start_block = start_block;
+
+    if (n->extended) {
+        ns->meta_start_offset = 0;
+    } else {
+        ns->meta_start_offset = (ns->start_block << BDRV_SECTOR_BITS) +
+            blks * blk_size_without_md;
+    }
+
+    ns->util = range_set_new();
+    ns->uncorrectable = range_set_new();
+    ns->deallocated = range_set_new();
+    qemu_co_mutex_init(&ns->rmw_lock);
+    if (n->zoned) {
+        nvme_zone_init(ns);
+    }
+    nvme_load_state(n, ns);
+}
 
-	if (i == 0) {
-            lba_index = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
-	    blk_size_without_md = (1 << id_ns->lbaf[lba_index].ds);
-	    blk_size_include_md = blk_size_without_md + n->meta;
-            blks = n->ns_size / blk_size_include_md;
-            n->ns_size = blks * blk_size_include_md;
-	}
-        id_ns->nuse = id_ns->ncap = id_ns->nsze = cpu_to_le64(blks);
-        ns->id = i + 1;
-        ns->ctrl = n;
-	ns->start_block = blks*i;
+/*
+ * Namespaces carved out of the controller's own drive. Each one gets an equal
+ * share, laid out back to back; start_block is the sector the share starts
+ * at, whatever the namespace's block format.
+ */
+static void nvme_init_namespaces(NvmeCtrl *n)
+{
+    int i;
 
-	if (n->extended) {
-	    ns->meta_start_offset = 0;
-	}
-	else {
-            ns->meta_start_offset = ns->start_block*blk_size_include_md +
-	       blks*blk_size_without_md;
-	}
+    for (i = 0; i < n->num_namespaces; i++) {
+        NvmeNamespace *ns = &n->namespaces[i];
 
-        ns->util = bitmap_new(blks);
-        ns->uncorrectable = bitmap_new(blks);
+        nvme_init_namespace(n, ns, n->conf.bs, i + 1,
+            n->ns_size * i >> BDRV_SECTOR_BITS, n->ns_size);
     }
 }
 
@@ -2044,10 +5229,15 @@ static void nvme_init_ctrl(NvmeCtrl *n)
     id->nn = cpu_to_le32(n->num_namespaces);
     id->oncs = cpu_to_le16(n->oncs);
     id->fuses = cpu_to_le16(0);
-    id->fna = 0;
+    id->fna = NVME_FNA_CRYPTO_ERASE;
     id->vwc = n->vwc;
     id->awun = cpu_to_le16(0);
     id->awupf = cpu_to_le16(0);
+    if (n->sgl) {
+        id->sgls = cpu_to_le32(NVME_CTRL_SGLS_SUPPORTED |
+            NVME_CTRL_SGLS_BIT_BUCKET | NVME_CTRL_SGLS_MPTR_CONTIGUOUS |
+            NVME_CTRL_SGLS_EXCESS_LENGTH);
+    }
     id->psd[0].mp = cpu_to_le16(0x9c4);
     id->psd[0].enlat = cpu_to_le32(0x10);
     id->psd[0].exlat = cpu_to_le32(0x4);
@@ -2077,11 +5267,25 @@ static void nvme_init_ctrl(NvmeCtrl *n)
     NVME_CAP_SET_TO(n->bar.cap, 0xf);
     NVME_CAP_SET_DSTRD(n->bar.cap, n->db_stride);
     NVME_CAP_SET_NSSRS(n->bar.cap, 0);
-    NVME_CAP_SET_CSS(n->bar.cap, 1);
+    NVME_CAP_SET_CSS(n->bar.cap, n->zoned ? NVME_CAP_CSS_NVM |
+        NVME_CAP_CSS_CSI : NVME_CAP_CSS_NVM);
     NVME_CAP_SET_MPSMIN(n->bar.cap, n->mpsmin);
     NVME_CAP_SET_MPSMAX(n->bar.cap, n->mpsmax);
 
     n->bar.vs = 0x00010001;
+    if (n->cmb_size_mb) {
+        /* the CMB registers are defined from NVMe 1.2 on */
+        n->bar.vs = 0x00010200;
+        n->bar.cmbloc = NVME_CMB_BIR << CMBLOC_BIR_SHIFT;
+        n->bar.cmbsz = NVME_CMBSZ_SQS | NVME_CMBSZ_LISTS | NVME_CMBSZ_RDS |
+            NVME_CMBSZ_WDS | NVME_CMBSZ_SZU_1MB |
+            n->cmb_size_mb << CMBSZ_SZ_SHIFT;
+    }
+    if (n->zoned) {
+        /* I/O command sets other than NVM came with NVMe 2.0 */
+        n->bar.vs = 0x00020000;
+        n->id_ctrl_zoned.zasl = n->zasl;
+    }
     n->bar.intmc = n->bar.intms = 0;
 
     n->temperature = NVME_TEMPERATURE;
@@ -2114,6 +5318,16 @@ static void nvme_init_pci(NvmeCtrl *n)
         PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_TYPE_64,
         &n->iomem);
 
+    if (n->cmb_size_mb) {
+        memory_region_init_ram(&n->ctrl_mem, "nvme-cmb",
+            (uint64_t)n->cmb_size_mb << 20);
+        vmstate_register_ram(&n->ctrl_mem, &pci_dev->qdev);
+        n->cmbuf = memory_region_get_ram_ptr(&n->ctrl_mem);
+        pci_register_bar(&n->parent_obj, NVME_CMB_BIR,
+            PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_TYPE_64 |
+            PCI_BASE_ADDRESS_MEM_PREFETCH, &n->ctrl_mem);
+    }
+
     if (n->num_msix>=0)
         nr_msix = n->num_msix;
 
@@ -2132,21 +5346,32 @@ static void nvme_init_pci(NvmeCtrl *n)
 static int nvme_init(PCIDevice *pci_dev)
 {
     NvmeCtrl *n = NVME(pci_dev);
-    int64_t bs_size;
+    int64_t bs_size = 0;
+    int i;
 
-    blkconf_serial(&n->conf, &n->serial);
+    if (n->conf.bs) {
+        blkconf_serial(&n->conf, &n->serial);
+    }
     if (nvme_check_constraints(n)) {
         return -1;
     }
 
-    bs_size = bdrv_getlength(n->conf.bs);
-    if (bs_size <= 0) {
-        return -1;
+    if (n->conf.bs) {
+        bs_size = bdrv_getlength(n->conf.bs);
+        if (bs_size <= 0) {
+            return -1;
+        }
+    } else {
+        /* all namespaces come from nvme-ns devices on our bus */
+        n->num_namespaces = 0;
     }
 
     n->start_time = time(NULL);
     n->reg_size = 1 << qemu_fls(0x1004 + 2 * (n->num_queues + 1) * 4);
-    n->ns_size = bs_size / (uint64_t)n->num_namespaces;
+    if (n->num_namespaces) {
+        n->ns_size = bs_size / (uint64_t)n->num_namespaces &
+            ~(uint64_t)(BDRV_SECTOR_SIZE - 1);
+    }
 
     n->sq = g_malloc0(sizeof(*n->sq)*n->num_queues);
     n->cq = g_malloc0(sizeof(*n->cq)*n->num_queues);
@@ -2155,10 +5380,41 @@ static int nvme_init(PCIDevice *pci_dev)
     n->aer_reqs = g_malloc0((n->aerl + 1) * sizeof(*n->aer_reqs));
     n->features.int_vector_config = g_malloc(n->num_queues *
         sizeof(*n->features.int_vector_config));
+    if (n->sgl) {
+        n->bit_bucket = qemu_blockalign(n->conf.bs, NVME_BIT_BUCKET_SIZE);
+    }
+
+    if (n->statefile) {
+        n->exit_notifier.notify = nvme_exit_notify;
+        qemu_add_exit_notifier(&n->exit_notifier);
+    }
+    n->arb_bh = qemu_bh_new(nvme_arbitrate, n);
+    for (i = 0; i < NVME_ARB_CLASSES; i++) {
+        QTAILQ_INIT(&n->arb_list[i]);
+    }
+    QSIMPLEQ_INIT(&n->aer_queue);
+    QTAILQ_INIT(&n->model.reqs);
+    if (n->flash_model) {
+        uint32_t dies = n->flash_channels * n->flash_dies;
+
+        n->model.die_busy = g_new0(int64_t, dies);
+        n->model.die_progs = g_new0(uint64_t, dies);
+        n->model.chan_busy = g_new0(int64_t, n->flash_channels);
+        n->model.wbuf_pages = n->flash_wbuf_kb / n->flash_page_kb;
+        n->model.wbuf = g_new0(int64_t, n->model.wbuf_pages);
+        n->model.timer = qemu_new_timer_ns(vm_clock, nvme_model_timer, n);
+    }
+    qemu_mutex_init(&n->map_lock);
+    register_savevm_live(DEVICE(n), "nvme-maps", -1, 1, &nvme_mig_handlers,
+        n);
+    n->vmstate_change = qemu_add_vm_change_state_handler(nvme_vm_state_change,
+        n);
 
     nvme_init_pci(n);
+    QLIST_INSERT_HEAD(&nvme_ctrls, n, entry);
     nvme_init_ctrl(n);
     nvme_init_namespaces(n);
+    qbus_create_inplace(&n->bus, TYPE_NVME_BUS, DEVICE(n), NULL);
 
     return 0;
 }
@@ -2166,21 +5422,196 @@ static int nvme_init(PCIDevice *pci_dev)
 static void nvme_exit(PCIDevice *pci_dev)
 {
     NvmeCtrl *n = NVME(pci_dev);
+    int i;
 
+    QLIST_REMOVE(n, entry);
+    qemu_del_vm_change_state_handler(n->vmstate_change);
+    unregister_savevm(DEVICE(n), "nvme-maps", n);
     nvme_clear_ctrl(n);
+    if (n->statefile) {
+        nvme_save_state(n);
+        qemu_remove_exit_notifier(&n->exit_notifier);
+    }
+    for (i = 0; i < n->num_namespaces; i++) {
+        range_set_free(n->namespaces[i].util);
+        range_set_free(n->namespaces[i].uncorrectable);
+        range_set_free(n->namespaces[i].deallocated);
+        range_set_free(n->namespaces[i].mig_dirty);
+        g_free(n->namespaces[i].zones);
+    }
+    qemu_mutex_destroy(&n->map_lock);
+    if (n->flash_model) {
+        qemu_free_timer(n->model.timer);
+        g_free(n->model.die_busy);
+        g_free(n->model.die_progs);
+        g_free(n->model.chan_busy);
+        g_free(n->model.wbuf);
+    }
+    qemu_bh_delete(n->arb_bh);
     g_free(n->namespaces);
     g_free(n->features.int_vector_config);
     g_free(n->aer_reqs);
     g_free(n->elpes);
+    qemu_vfree(n->bit_bucket);
     g_free(n->cq);
     g_free(n->sq);
     msix_uninit_exclusive_bar(pci_dev);
     memory_region_destroy(&n->iomem);
+    if (n->cmbuf) {
+        vmstate_unregister_ram(&n->ctrl_mem, &pci_dev->qdev);
+        memory_region_destroy(&n->ctrl_mem);
+    }
+}
+
+static const char *nvme_stats_op_names[NVME_STATS_OPS] = {
+    [NVME_STATS_READ] = "read",
+    [NVME_STATS_WRITE] = "write",
+    [NVME_STATS_FLUSH] = "flush",
+};
+
+static NvmeLatencyInfoList *nvme_qmp_latency(const NvmeLatStats *lat)
+{
+    NvmeLatencyInfoList *head = NULL, **tail = &head;
+    int i, j;
+
+    for (i = 0; i < NVME_STATS_OPS; i++) {
+        NvmeLatencyInfoList *info = g_new0(NvmeLatencyInfoList, 1);
+        NvmeLatencyBucketList **btail;
+
+        info->value = g_new0(NvmeLatencyInfo, 1);
+        info->value->operation = g_strdup(nvme_stats_op_names[i]);
+        info->value->count = lat[i].count;
+        info->value->total_ns = lat[i].total_ns;
+        btail = &info->value->histogram;
+        for (j = 0; j < NVME_LAT_BUCKETS; j++) {
+            NvmeLatencyBucketList *bucket;
+
+            if (!lat[i].hist[j]) {
+                continue;
+            }
+            bucket = g_new0(NvmeLatencyBucketList, 1);
+            bucket->value = g_new0(NvmeLatencyBucket, 1);
+            bucket->value->bucket = j;
+            bucket->value->count = lat[i].hist[j];
+            *btail = bucket;
+            btail = &bucket->next;
+        }
+        *tail = info;
+        tail = &info->next;
+    }
+    return head;
+}
+
+NvmeStatsInfoList *qmp_query_nvme_stats(Error **errp)
+{
+    NvmeStatsInfoList *head = NULL, **tail = &head;
+    NvmeCtrl *n;
+
+    QLIST_FOREACH(n, &nvme_ctrls, entry) {
+        NvmeStatsInfoList *entry = g_new0(NvmeStatsInfoList, 1);
+        NvmeStatsInfo *info = g_new0(NvmeStatsInfo, 1);
+        NvmeQueueStatsInfoList **qtail = &info->queues;
+        NvmeNamespaceStatsInfoList **nstail = &info->namespaces;
+        uint32_t i;
+
+        info->has_id = !!DEVICE(n)->id;
+        info->id = g_strdup(DEVICE(n)->id);
+        info->serial = g_strdup(n->serial);
+        info->doorbells = n->stats.doorbells;
+        info->interrupts = n->stats.interrupts;
+        info->depth_samples = n->stats.qd_samples;
+        info->depth_total = n->stats.qd_total;
+        info->depth_max = n->stats.qd_max;
+        info->latency = nvme_qmp_latency(n->stats.lat);
+
+        for (i = 0; i < n->num_queues; i++) {
+            NvmeSQueue *sq = n->sq[i];
+            NvmeCQueue *cq;
+            NvmeQueueStatsInfoList *q;
+
+            if (!sq) {
+                continue;
+            }
+            cq = n->cq[sq->cqid];
+            q = g_new0(NvmeQueueStatsInfoList, 1);
+            q->value = g_new0(NvmeQueueStatsInfo, 1);
+            q->value->sqid = sq->sqid;
+            q->value->cqid = sq->cqid;
+            q->value->sq_doorbells = sq->stats.doorbells;
+            q->value->cq_doorbells = cq->doorbells;
+            q->value->interrupts = cq->interrupts;
+            q->value->depth_samples = sq->stats.qd_samples;
+            q->value->depth_total = sq->stats.qd_total;
+            q->value->depth_max = sq->stats.qd_max;
+            q->value->latency = nvme_qmp_latency(sq->stats.lat);
+            *qtail = q;
+            qtail = &q->next;
+        }
+
+        for (i = 0; i < n->num_namespaces; i++) {
+            NvmeNamespaceStatsInfoList *ns;
+
+            ns = g_new0(NvmeNamespaceStatsInfoList, 1);
+            ns->value = g_new0(NvmeNamespaceStatsInfo, 1);
+            ns->value->nsid = n->namespaces[i].id;
+            ns->value->latency = nvme_qmp_latency(n->namespaces[i].lat);
+            *nstail = ns;
+            nstail = &ns->next;
+        }
+
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
+/*
+ * A namespace backed by a drive of its own. Namespace IDs are handed out in
+ * the order the devices are created, following any namespaces carved from
+ * the controller's drive.
+ */
+static int nvme_ns_init(DeviceState *dev)
+{
+    NvmeNsDev *nsdev = NVME_NS(dev);
+    NvmeCtrl *n = NVME(dev->parent_bus->parent);
+    uint32_t nsid = nsdev->nsid ? nsdev->nsid : n->num_namespaces + 1;
+    int64_t bs_size;
+    int i;
+
+    if (!nsdev->conf.bs) {
+        error_report("nvme-ns: drive property not set");
+        return -1;
+    }
+    if (nsid != n->num_namespaces + 1 || nsid > NVME_MAX_NUM_NAMESPACES) {
+        error_report("nvme-ns: nsid %u unavailable, next free nsid is %u",
+            nsid, n->num_namespaces + 1);
+        return -1;
+    }
+    bs_size = bdrv_getlength(nsdev->conf.bs);
+    if (bs_size <= 0) {
+        error_report("nvme-ns: could not get drive size");
+        return -1;
+    }
+
+    n->namespaces = g_realloc(n->namespaces, nsid * sizeof(*n->namespaces));
+    memset(&n->namespaces[nsid - 1], 0, sizeof(*n->namespaces));
+    for (i = 0; i < nsid - 1; i++) {
+        /* the lock's wait queue points into itself, so it can't be moved */
+        qemu_co_mutex_init(&n->namespaces[i].rmw_lock);
+    }
+    nvme_init_namespace(n, &n->namespaces[nsid - 1], nsdev->conf.bs, nsid, 0,
+        bs_size);
+    n->num_namespaces = nsid;
+    n->id_ctrl.nn = cpu_to_le32(n->num_namespaces);
+
+    return 0;
 }
 
 static Property nvme_props[] = {
     DEFINE_BLOCK_PROPERTIES(NvmeCtrl, conf),
     DEFINE_PROP_STRING("serial", NvmeCtrl, serial),
+    DEFINE_PROP_STRING("statefile", NvmeCtrl, statefile),
     DEFINE_PROP_UINT32("namespaces", NvmeCtrl, num_namespaces, 1),
     DEFINE_PROP_UINT32("queues", NvmeCtrl, num_queues, 64),
     DEFINE_PROP_UINT32("entries", NvmeCtrl, max_q_ents, 0x7ff),
@@ -2203,18 +5634,40 @@ static Property nvme_props[] = {
     DEFINE_PROP_UINT8("dps", NvmeCtrl, dps, 0),
     DEFINE_PROP_UINT8("mc", NvmeCtrl, mc, 0),
     DEFINE_PROP_UINT8("meta", NvmeCtrl, meta, 0),
-    DEFINE_PROP_UINT16("oacs", NvmeCtrl, oacs, NVME_OACS_FORMAT),
-    DEFINE_PROP_UINT16("oncs", NvmeCtrl, oncs, NVME_ONCS_DSM),
+    DEFINE_PROP_UINT16("oacs", NvmeCtrl, oacs, NVME_OACS_FORMAT |
+        NVME_OACS_DBBUF),
+    DEFINE_PROP_UINT16("oncs", NvmeCtrl, oncs, NVME_ONCS_DSM |
+        NVME_ONCS_WRITE_ZEROS),
     DEFINE_PROP_INT32("num_msix", NvmeCtrl, num_msix, -1),
     DEFINE_PROP_INT32("num_msi", NvmeCtrl, num_msi, -1),
+    DEFINE_PROP_UINT8("ioeventfd", NvmeCtrl, ioeventfd, 1),
+    DEFINE_PROP_UINT8("sgl", NvmeCtrl, sgl, 1),
+    DEFINE_PROP_UINT32("cmb_size_mb", NvmeCtrl, cmb_size_mb, 0),
+    DEFINE_PROP_UINT8("flash_model", NvmeCtrl, flash_model, 0),
+    DEFINE_PROP_UINT32("flash_channels", NvmeCtrl, flash_channels, 8),
+    DEFINE_PROP_UINT32("flash_dies", NvmeCtrl, flash_dies, 4),
+    DEFINE_PROP_UINT32("flash_page_kb", NvmeCtrl, flash_page_kb, 16),
+    DEFINE_PROP_UINT32("flash_ppb", NvmeCtrl, flash_ppb, 256),
+    DEFINE_PROP_UINT32("flash_read_us", NvmeCtrl, flash_read_us, 50),
+    DEFINE_PROP_UINT32("flash_prog_us", NvmeCtrl, flash_prog_us, 500),
+    DEFINE_PROP_UINT32("flash_erase_us", NvmeCtrl, flash_erase_us, 3000),
+    DEFINE_PROP_UINT32("flash_chan_mbps", NvmeCtrl, flash_chan_mbps, 400),
+    DEFINE_PROP_UINT32("flash_wbuf_kb", NvmeCtrl, flash_wbuf_kb, 4096),
+    DEFINE_PROP_UINT8("flash_op", NvmeCtrl, flash_op, 7),
+    DEFINE_PROP_UINT8("zoned", NvmeCtrl, zoned, 0),
+    DEFINE_PROP_UINT32("zone_size_mb", NvmeCtrl, zone_size_mb, 128),
+    DEFINE_PROP_UINT32("zone_max_open", NvmeCtrl, zone_max_open, 0),
+    DEFINE_PROP_UINT32("zone_max_active", NvmeCtrl, zone_max_active, 0),
+    DEFINE_PROP_UINT8("zasl", NvmeCtrl, zasl, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
 static const VMStateDescription nvme_vmstate = {
     .name = "nvme",
-    .version_id = 1,
-    .minimum_version_id = 1,
-    .minimum_version_id_old = 1,
+    .version_id = 3,
+    .minimum_version_id = 2,
+    .minimum_version_id_old = 2,
+    .pre_load = nvme_pre_load,
     .fields = (VMStateField[]) {
         VMSTATE_PCI_DEVICE(parent_obj, NvmeCtrl),
         VMSTATE_UINT64(bar.cap, NvmeCtrl),
@@ -2227,6 +5680,51 @@ static const VMStateDescription nvme_vmstate = {
         VMSTATE_UINT32(bar.aqa, NvmeCtrl),
         VMSTATE_UINT64(bar.asq, NvmeCtrl),
         VMSTATE_UINT64(bar.acq, NvmeCtrl),
+        VMSTATE_UINT16(temperature, NvmeCtrl),
+        VMSTATE_UINT16(page_size, NvmeCtrl),
+        VMSTATE_UINT16(page_bits, NvmeCtrl),
+        VMSTATE_UINT16(max_prp_ents, NvmeCtrl),
+        VMSTATE_UINT16(cqe_size, NvmeCtrl),
+        VMSTATE_UINT16(sqe_size, NvmeCtrl),
+        VMSTATE_UINT64(dbbuf_dbs, NvmeCtrl),
+        VMSTATE_UINT64(dbbuf_eis, NvmeCtrl),
+        VMSTATE_UINT8(elp_index, NvmeCtrl),
+        VMSTATE_UINT8(error_count, NvmeCtrl),
+        VMSTATE_UINT8(num_errors, NvmeCtrl),
+        VMSTATE_UINT8(temp_warn_issued, NvmeCtrl),
+        VMSTATE_UINT8(aer_mask, NvmeCtrl),
+        VMSTATE_UINT32(features.arbitration, NvmeCtrl),
+        VMSTATE_UINT32(features.power_mgmt, NvmeCtrl),
+        VMSTATE_UINT32(features.temp_thresh, NvmeCtrl),
+        VMSTATE_UINT32(features.err_rec, NvmeCtrl),
+        VMSTATE_UINT32(features.volatile_wc, NvmeCtrl),
+        VMSTATE_UINT32(features.num_queues, NvmeCtrl),
+        VMSTATE_UINT32(features.int_coalescing, NvmeCtrl),
+        VMSTATE_VARRAY_UINT32(features.int_vector_config, NvmeCtrl,
+            num_queues, 0, vmstate_info_uint32, uint32_t),
+        VMSTATE_UINT32(features.write_atomicity, NvmeCtrl),
+        VMSTATE_UINT32(features.async_config, NvmeCtrl),
+        VMSTATE_UINT32(features.sw_prog_marker, NvmeCtrl),
+        VMSTATE_UINT64(format_done, NvmeCtrl),
+        VMSTATE_UINT64(format_total, NvmeCtrl),
+        {
+            .name         = "queues",
+            .version_id   = 0,
+            .field_exists = NULL,
+            .size         = 0,
+            .info         = &nvme_vmstate_info_queues,
+            .flags        = VMS_SINGLE,
+            .offset       = 0,
+        },
+        {
+            .name         = "zones",
+            .version_id   = 3,
+            .field_exists = NULL,
+            .size         = 0,
+            .info         = &nvme_vmstate_info_zones,
+            .flags        = VMS_SINGLE,
+            .offset       = 0,
+        },
         VMSTATE_END_OF_LIST()
     }
 };
@@ -2263,9 +5761,40 @@ static const TypeInfo nvme_info = {
     .class_init    = nvme_class_init,
 };
 
+static const TypeInfo nvme_bus_info = {
+    .name          = TYPE_NVME_BUS,
+    .parent        = TYPE_BUS,
+    .instance_size = sizeof(NvmeBus),
+};
+
+static Property nvme_ns_props[] = {
+    DEFINE_BLOCK_PROPERTIES(NvmeNsDev, conf),
+    DEFINE_PROP_UINT32("nsid", NvmeNsDev, nsid, 0),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void nvme_ns_class_init(ObjectClass *oc, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(oc);
+
+    dc->init = nvme_ns_init;
+    dc->bus_type = TYPE_NVME_BUS;
+    dc->desc = "Non-Volatile Memory Express namespace";
+    dc->props = nvme_ns_props;
+}
+
+static const TypeInfo nvme_ns_info = {
+    .name          = TYPE_NVME_NS,
+    .parent        = TYPE_DEVICE,
+    .instance_size = sizeof(NvmeNsDev),
+    .class_init    = nvme_ns_class_init,
+};
+
 static void nvme_register_types(void)
 {
     type_register_static(&nvme_info);
+    type_register_static(&nvme_bus_info);
+    type_register_static(&nvme_ns_info);
 }
 
 type_init(nvme_register_types)
@@ -13,6 +13,8 @@ typedef struct NvmeBar {
     uint32_t    aqa;
     uint64_t    asq;
     uint64_t    acq;
+    uint32_t    cmbloc;
+    uint32_t    cmbsz;
 } NvmeBar;
 
 enum NvmeCapShift {
@@ -68,6 +70,11 @@ enum NvmeCapMask {
 #define NVME_CAP_SET_MPSMAX(cap, val) (cap |= (uint64_t)(val & CAP_MPSMAX_MASK)\
                                                             << CAP_MPSMAX_SHIFT)
 
+enum NvmeCapCss {
+    NVME_CAP_CSS_NVM        = 1 << 0,
+    NVME_CAP_CSS_CSI        = 1 << 6,
+};
+
 enum NvmeCcShift {
     CC_EN_SHIFT     = 0,
     CC_CSS_SHIFT    = 4,
@@ -96,6 +103,11 @@ enum NvmeCcMask {
 #define NVME_CC_IOSQES(cc) ((cc >> CC_IOSQES_SHIFT) & CC_IOSQES_MASK)
 #define NVME_CC_IOCQES(cc) ((cc >> CC_IOCQES_SHIFT) & CC_IOCQES_MASK)
 
+enum NvmeCcAms {
+    NVME_CC_AMS_RR      = 0,
+    NVME_CC_AMS_WRRU    = 1,
+};
+
 enum NvmeCstsShift {
     CSTS_RDY_SHIFT      = 0,
     CSTS_CFS_SHIFT      = 1,
@@ -137,6 +149,48 @@ enum NvmeAqaMask {
 #define NVME_AQA_ASQS(aqa) ((aqa >> AQA_ASQS_SHIFT) & AQA_ASQS_MASK)
 #define NVME_AQA_ACQS(aqa) ((aqa >> AQA_ACQS_SHIFT) & AQA_ACQS_MASK)
 
+enum NvmeCmblocShift {
+    CMBLOC_BIR_SHIFT    = 0,
+    CMBLOC_OFST_SHIFT   = 12,
+};
+
+enum NvmeCmblocMask {
+    CMBLOC_BIR_MASK     = 0x7,
+    CMBLOC_OFST_MASK    = 0xfffff,
+};
+
+#define NVME_CMBLOC_BIR(cmbloc)  ((cmbloc >> CMBLOC_BIR_SHIFT)  & \
+                                  CMBLOC_BIR_MASK)
+#define NVME_CMBLOC_OFST(cmbloc) ((cmbloc >> CMBLOC_OFST_SHIFT) & \
+                                  CMBLOC_OFST_MASK)
+
+enum NvmeCmbszShift {
+    CMBSZ_SQS_SHIFT     = 0,
+    CMBSZ_CQS_SHIFT     = 1,
+    CMBSZ_LISTS_SHIFT   = 2,
+    CMBSZ_RDS_SHIFT     = 3,
+    CMBSZ_WDS_SHIFT     = 4,
+    CMBSZ_SZU_SHIFT     = 8,
+    CMBSZ_SZ_SHIFT      = 12,
+};
+
+enum NvmeCmbszMask {
+    CMBSZ_SZU_MASK      = 0xf,
+    CMBSZ_SZ_MASK       = 0xfffff,
+};
+
+enum NvmeCmbsz {
+    NVME_CMBSZ_SQS      = 1 << CMBSZ_SQS_SHIFT,
+    NVME_CMBSZ_CQS      = 1 << CMBSZ_CQS_SHIFT,
+    NVME_CMBSZ_LISTS    = 1 << CMBSZ_LISTS_SHIFT,
+    NVME_CMBSZ_RDS      = 1 << CMBSZ_RDS_SHIFT,
+    NVME_CMBSZ_WDS      = 1 << CMBSZ_WDS_SHIFT,
+    NVME_CMBSZ_SZU_1MB  = 2 << CMBSZ_SZU_SHIFT,
+};
+
+#define NVME_CMBSZ_SZU(cmbsz) ((cmbsz >> CMBSZ_SZU_SHIFT) & CMBSZ_SZU_MASK)
+#define NVME_CMBSZ_SZ(cmbsz)  ((cmbsz >> CMBSZ_SZ_SHIFT)  & CMBSZ_SZ_MASK)
+
 typedef struct NvmeCmd {
     uint8_t     opcode;
     uint8_t     fuse;
@@ -154,6 +208,36 @@ typedef struct NvmeCmd {
     uint32_t    cdw15;
 } NvmeCmd;
 
+#define NVME_CMD_FLAGS_FUSE(flags) (flags & 0x3)
+#define NVME_CMD_FLAGS_PSDT(flags) ((flags >> 6) & 0x3)
+
+enum NvmePsdt {
+    NVME_PSDT_PRP                   = 0x0,
+    NVME_PSDT_SGL_MPTR_CONTIGUOUS   = 0x1,
+    NVME_PSDT_SGL_MPTR_SGL          = 0x2,
+};
+
+typedef struct NvmeSglDescriptor {
+    uint64_t    addr;
+    uint32_t    len;
+    uint8_t     rsvd[3];
+    uint8_t     type;
+} NvmeSglDescriptor;
+
+#define NVME_SGL_TYPE(type)     ((type >> 4) & 0xf)
+#define NVME_SGL_SUBTYPE(type)  (type & 0xf)
+
+enum NvmeSglDescriptorType {
+    NVME_SGL_DESCR_TYPE_DATA_BLOCK      = 0x0,
+    NVME_SGL_DESCR_TYPE_BIT_BUCKET      = 0x1,
+    NVME_SGL_DESCR_TYPE_SEGMENT         = 0x2,
+    NVME_SGL_DESCR_TYPE_LAST_SEGMENT    = 0x3,
+};
+
+enum NvmeSglDescriptorSubtype {
+    NVME_SGL_DESCR_SUBTYPE_ADDRESS      = 0x0,
+};
+
 enum NvmeAdminCommands {
     NVME_ADM_CMD_DELETE_SQ      = 0x00,
     NVME_ADM_CMD_CREATE_SQ      = 0x01,
@@ -167,6 +251,7 @@ enum NvmeAdminCommands {
     NVME_ADM_CMD_ASYNC_EV_REQ   = 0x0c,
     NVME_ADM_CMD_ACTIVATE_FW    = 0x10,
     NVME_ADM_CMD_DOWNLOAD_FW    = 0x11,
+    NVME_ADM_CMD_DBBUF_CONFIG   = 0x7c,
     NVME_ADM_CMD_FORMAT_NVM     = 0x80,
     NVME_ADM_CMD_SECURITY_SEND  = 0x81,
     NVME_ADM_CMD_SECURITY_RECV  = 0x82,
@@ -178,7 +263,11 @@ enum NvmeIoCommands {
     NVME_CMD_READ               = 0x02,
     NVME_CMD_WRITE_UNCOR        = 0x04,
     NVME_CMD_COMPARE            = 0x05,
+    NVME_CMD_WRITE_ZEROS        = 0x08,
     NVME_CMD_DSM                = 0x09,
+    NVME_CMD_ZONE_MGMT_SEND     = 0x79,
+    NVME_CMD_ZONE_MGMT_RECV     = 0x7a,
+    NVME_CMD_ZONE_APPEND        = 0x7d,
 };
 
 typedef struct NvmeDeleteQ {
@@ -242,9 +331,33 @@ typedef struct NvmeIdentify {
     uint64_t    prp1;
     uint64_t    prp2;
     uint32_t    cns;
-    uint32_t    rsvd11[5];
+    uint32_t    csi;
+    uint32_t    rsvd12[4];
 } NvmeIdentify;
 
+enum NvmeIdCns {
+    NVME_ID_CNS_NS          = 0x00,
+    NVME_ID_CNS_CTRL        = 0x01,
+    NVME_ID_CNS_NS_DESCRS   = 0x03,
+    NVME_ID_CNS_CS_NS       = 0x05,
+    NVME_ID_CNS_CS_CTRL     = 0x06,
+};
+
+enum NvmeIdNsDescr {
+    NVME_NIDT_CSI           = 0x04,
+    NVME_NIDL_CSI           = 0x01,
+};
+
+#define NVME_IDENTIFY_DATA_SIZE 4096
+
+enum NvmeCsi {
+    NVME_CSI_NVM            = 0x00,
+    NVME_CSI_ZONED          = 0x02,
+};
+
+#define NVME_ID_CNS(cdw10)  ((cdw10) & 0xff)
+#define NVME_ID_CSI(cdw11)  (((cdw11) >> 24) & 0xff)
+
 typedef struct NvmeRwCmd {
     uint8_t     opcode;
     uint8_t     flags;
@@ -312,6 +425,77 @@ typedef struct NvmeDsmRange {
     uint64_t    slba;
 } NvmeDsmRange;
 
+typedef struct NvmeZoneMgmtCmd {
+    uint8_t     opcode;
+    uint8_t     flags;
+    uint16_t    cid;
+    uint32_t    nsid;
+    uint64_t    rsvd2[2];
+    uint64_t    prp1;
+    uint64_t    prp2;
+    uint64_t    slba;
+    uint32_t    numdw;
+    uint32_t    action;
+    uint32_t    rsvd14[2];
+} NvmeZoneMgmtCmd;
+
+#define NVME_ZONE_SEND_ACTION(action)   ((action) & 0xff)
+#define NVME_ZONE_SEND_ALL(action)      (((action) >> 8) & 0x1)
+#define NVME_ZONE_RECV_ACTION(action)   ((action) & 0xff)
+#define NVME_ZONE_RECV_FILTER(action)   (((action) >> 8) & 0xff)
+#define NVME_ZONE_RECV_PARTIAL(action)  (((action) >> 16) & 0x1)
+
+enum NvmeZoneSendAction {
+    NVME_ZONE_ACTION_CLOSE      = 0x01,
+    NVME_ZONE_ACTION_FINISH     = 0x02,
+    NVME_ZONE_ACTION_OPEN       = 0x03,
+    NVME_ZONE_ACTION_RESET      = 0x04,
+    NVME_ZONE_ACTION_OFFLINE    = 0x05,
+};
+
+enum NvmeZoneRecvAction {
+    NVME_ZONE_REPORT            = 0x00,
+};
+
+enum NvmeZoneReportFilter {
+    NVME_ZONE_REPORT_ALL        = 0x00,
+    NVME_ZONE_REPORT_EMPTY      = 0x01,
+    NVME_ZONE_REPORT_IMPL_OPEN  = 0x02,
+    NVME_ZONE_REPORT_EXPL_OPEN  = 0x03,
+    NVME_ZONE_REPORT_CLOSED     = 0x04,
+    NVME_ZONE_REPORT_FULL       = 0x05,
+    NVME_ZONE_REPORT_READ_ONLY  = 0x06,
+    NVME_ZONE_REPORT_OFFLINE    = 0x07,
+};
+
+enum NvmeZoneState {
+    NVME_ZONE_STATE_EMPTY       = 0x1,
+    NVME_ZONE_STATE_IMPL_OPEN   = 0x2,
+    NVME_ZONE_STATE_EXPL_OPEN   = 0x3,
+    NVME_ZONE_STATE_CLOSED      = 0x4,
+    NVME_ZONE_STATE_READ_ONLY   = 0xd,
+    NVME_ZONE_STATE_FULL        = 0xe,
+    NVME_ZONE_STATE_OFFLINE     = 0xf,
+};
+
+#define NVME_ZONE_TYPE_SEQ_WRITE    0x2
+
+typedef struct NvmeZoneReportHdr {
+    uint64_t    nr_zones;
+    uint8_t     rsvd8[56];
+} NvmeZoneReportHdr;
+
+typedef struct NvmeZoneDescr {
+    uint8_t     zt;
+    uint8_t     zs;
+    uint8_t     za;
+    uint8_t     rsvd3[5];
+    uint64_t    zcap;
+    uint64_t    zslba;
+    uint64_t    wp;
+    uint8_t     rsvd32[32];
+} NvmeZoneDescr;
+
 enum NvmeAsyncEventRequest {
     NVME_AER_TYPE_ERROR                     = 0,
     NVME_AER_TYPE_SMART                     = 1,
@@ -358,10 +542,16 @@ enum NvmeStatusCodes {
     NVME_CMD_ABORT_MISSING_FUSE = 0x000a,
     NVME_INVALID_NSID           = 0x000b,
     NVME_CMD_SEQ_ERROR          = 0x000c,
+    NVME_INVALID_SGL_SEG_DESCR  = 0x000d,
+    NVME_INVALID_NUM_SGL_DESCRS = 0x000e,
+    NVME_DATA_SGL_LEN_INVALID   = 0x000f,
+    NVME_MD_SGL_LEN_INVALID     = 0x0010,
+    NVME_SGL_DESCR_TYPE_INVALID = 0x0011,
     NVME_LBA_RANGE              = 0x0080,
     NVME_CAP_EXCEEDED           = 0x0081,
     NVME_NS_NOT_READY           = 0x0082,
     NVME_NS_RESV_CONFLICT       = 0x0083,
+    NVME_FORMAT_IN_PROGRESS     = 0x0084,
     NVME_INVALID_CQID           = 0x0100,
     NVME_INVALID_QID            = 0x0101,
     NVME_MAX_QSIZE_EXCEEDED     = 0x0102,
@@ -381,6 +571,14 @@ enum NvmeStatusCodes {
     NVME_CONFLICTING_ATTRS      = 0x0180,
     NVME_INVALID_PROT_INFO      = 0x0181,
     NVME_WRITE_TO_RO            = 0x0182,
+    NVME_ZONE_BOUNDARY_ERROR    = 0x01b8,
+    NVME_ZONE_FULL              = 0x01b9,
+    NVME_ZONE_READ_ONLY         = 0x01ba,
+    NVME_ZONE_OFFLINE           = 0x01bb,
+    NVME_ZONE_INVALID_WRITE     = 0x01bc,
+    NVME_ZONE_TOO_MANY_ACTIVE   = 0x01bd,
+    NVME_ZONE_TOO_MANY_OPEN     = 0x01be,
+    NVME_ZONE_INVAL_TRANSITION  = 0x01bf,
     NVME_WRITE_FAULT            = 0x0280,
     NVME_UNRECOVERED_READ       = 0x0281,
     NVME_E2E_GUARD_ERROR        = 0x0282,
@@ -450,8 +648,63 @@ enum LogIdentifier {
     NVME_LOG_ERROR_INFO     = 0x01,
     NVME_LOG_SMART_INFO     = 0x02,
     NVME_LOG_FW_SLOT_INFO   = 0x03,
+    NVME_LOG_VENDOR_STATS   = 0xc0,
+    NVME_LOG_VENDOR_FORMAT  = 0xc1,
+    NVME_LOG_VENDOR_LATENCY = 0xc2,
 };
 
+typedef struct NvmeStatsLog {
+    uint64_t    prp_entries;
+    uint64_t    prp_sg_elems;
+    uint32_t    prp_coalesce_ratio;
+    uint8_t     rsvd511[492];
+} NvmeStatsLog;
+
+typedef struct NvmeFormatLog {
+    uint32_t    nsid;
+    uint8_t     ses;
+    uint8_t     percent;
+    uint16_t    rsvd6;
+    uint64_t    blocks_done;
+    uint64_t    blocks_total;
+    uint8_t     rsvd511[488];
+} NvmeFormatLog;
+
+enum NvmeStatsOp {
+    NVME_STATS_READ     = 0,
+    NVME_STATS_WRITE    = 1,
+    NVME_STATS_FLUSH    = 2,
+    NVME_STATS_OPS      = 3,
+};
+
+#define NVME_LAT_BUCKETS    32
+
+/* hist[i] counts latencies from 2^i up to 2^(i+1) ns; the last is open */
+typedef struct NvmeLatStats {
+    uint64_t    count;
+    uint64_t    total_ns;
+    uint64_t    hist[NVME_LAT_BUCKETS];
+} NvmeLatStats;
+
+typedef struct NvmeLatencyLog {
+    NvmeLatStats lat[NVME_STATS_OPS];
+    uint64_t    doorbells;
+    uint64_t    interrupts;
+    uint64_t    qd_samples;
+    uint64_t    qd_total;
+    uint64_t    qd_max;
+    uint8_t     rsvd1023[168];
+} NvmeLatencyLog;
+
+typedef struct NvmeIoStats {
+    uint64_t    doorbells;
+    uint64_t    interrupts;
+    uint64_t    qd_samples;
+    uint64_t    qd_total;
+    uint64_t    qd_max;
+    NvmeLatStats lat[NVME_STATS_OPS];
+} NvmeIoStats;
+
 typedef struct NvmePSD {
     uint16_t    mp;
     uint16_t    reserved;
@@ -493,7 +746,12 @@ typedef struct NvmeIdCtrl {
     uint8_t     vwc;
     uint16_t    awun;
     uint16_t    awupf;
-    uint8_t     rsvd703[174];
+    uint8_t     nvscc;
+    uint8_t     rsvd531;
+    uint16_t    acwu;
+    uint16_t    rsvd535;
+    uint32_t    sgls;
+    uint8_t     rsvd703[164];
     uint8_t     rsvd2047[1344];
     NvmePSD     psd[32];
     uint8_t     vs[1024];
@@ -503,6 +761,7 @@ enum NvmeIdCtrlOacs {
     NVME_OACS_SECURITY  = 1 << 0,
     NVME_OACS_FORMAT    = 1 << 1,
     NVME_OACS_FW        = 1 << 2,
+    NVME_OACS_DBBUF     = 1 << 8,
 };
 
 enum NvmeIdCtrlOncs {
@@ -514,6 +773,25 @@ enum NvmeIdCtrlOncs {
     NVME_ONCS_RESRVATIONS   = 1 << 5,
 };
 
+enum NvmeIdCtrlFna {
+    NVME_FNA_FORMAT_ALL     = 1 << 0,
+    NVME_FNA_SECURE_ALL     = 1 << 1,
+    NVME_FNA_CRYPTO_ERASE   = 1 << 2,
+};
+
+enum NvmeFormatSes {
+    NVME_FORMAT_SES_NONE        = 0,
+    NVME_FORMAT_SES_USER_DATA   = 1,
+    NVME_FORMAT_SES_CRYPTO      = 2,
+};
+
+enum NvmeIdCtrlSgls {
+    NVME_CTRL_SGLS_SUPPORTED        = 1 << 0,
+    NVME_CTRL_SGLS_BIT_BUCKET       = 1 << 16,
+    NVME_CTRL_SGLS_MPTR_CONTIGUOUS  = 1 << 17,
+    NVME_CTRL_SGLS_EXCESS_LENGTH    = 1 << 18,
+};
+
 #define NVME_CTRL_SQES_MIN(sqes) ((sqes) & 0xf)
 #define NVME_CTRL_SQES_MAX(sqes) (((sqes) >> 4) & 0xf)
 #define NVME_CTRL_CQES_MIN(cqes) ((cqes) & 0xf)
@@ -538,6 +816,15 @@ typedef struct NvmeFeatureVal {
 #define NVME_ARB_MPW(arb)   ((arb >> 16) & 0xff)
 #define NVME_ARB_HPW(arb)   ((arb >> 24) & 0xff)
 
+enum NvmeArbClass {
+    NVME_ARB_ADMIN      = 0,
+    NVME_ARB_URGENT     = 1,
+    NVME_ARB_HIGH       = 2,
+    NVME_ARB_MEDIUM     = 3,
+    NVME_ARB_LOW        = 4,
+    NVME_ARB_CLASSES    = 5,
+};
+
 #define NVME_INTC_THR(intc)     (intc & 0xff)
 #define NVME_INTC_TIME(intc)    ((intc >> 8) & 0xff)
 
@@ -582,7 +869,11 @@ typedef struct NvmeIdNs {
     uint8_t     mc;
     uint8_t     dpc;
     uint8_t     dps;
-    uint8_t     res30[98];
+    uint8_t     nmic;
+    uint8_t     rescap;
+    uint8_t     fpi;
+    uint8_t     dlfeat;
+    uint8_t     res34[94];
     NvmeLBAF    lbaf[16];
     uint8_t     res192[192];
     uint8_t     vs[3712];
@@ -600,6 +891,34 @@ typedef struct NvmeIdNs {
 #define NVME_ID_NS_DPC_TYPE_1(dpc)          ((dpc & 0x1))
 #define NVME_ID_NS_DPC_TYPE_MASK            0x7
 
+typedef struct NvmeLBAFE {
+    uint64_t    zsze;
+    uint8_t     zdes;
+    uint8_t     rsvd9[7];
+} NvmeLBAFE;
+
+typedef struct NvmeIdNsZoned {
+    uint16_t    zoc;
+    uint16_t    ozcs;
+    uint32_t    mar;
+    uint32_t    mor;
+    uint32_t    rrl;
+    uint32_t    frl;
+    uint8_t     rsvd20[2796];
+    NvmeLBAFE   lbafe[16];
+    uint8_t     rsvd3072[768];
+    uint8_t     vs[256];
+} NvmeIdNsZoned;
+
+typedef struct NvmeIdCtrlZoned {
+    uint8_t     zasl;
+    uint8_t     rsvd1[4095];
+} NvmeIdCtrlZoned;
+
+enum NvmeIdNsDlfeat {
+    NVME_ID_NS_DLFEAT_ZEROES    = 1 << 0,
+};
+
 enum NvmeIdNsDps {
     DPS_TYPE_NONE   = 0,
     DPS_TYPE_1      = 1,
@@ -609,11 +928,64 @@ enum NvmeIdNsDps {
     DPS_FIRST_EIGHT = 8,
 };
 
+#define NVME_STATE_MAGIC    "QNVMESTA"
+#define NVME_STATE_VERSION  1
+
+enum NvmeStateMap {
+    NVME_STATE_UTIL             = 0,
+    NVME_STATE_UNCORRECTABLE    = 1,
+    NVME_STATE_DEALLOCATED      = 2,
+    NVME_STATE_MAPS             = 3,
+    NVME_STATE_ZONES            = 0x80,
+};
+
+enum NvmeMapMask {
+    NVME_MAP_UTIL           = 1 << NVME_STATE_UTIL,
+    NVME_MAP_UNCORRECTABLE  = 1 << NVME_STATE_UNCORRECTABLE,
+    NVME_MAP_DEALLOCATED    = 1 << NVME_STATE_DEALLOCATED,
+    NVME_MAP_ALL            = (1 << NVME_STATE_MAPS) - 1,
+};
+
+enum NvmeMigFlags {
+    NVME_MIG_FLAG_CHUNK     = 1,
+    NVME_MIG_FLAG_EOS       = 2,
+};
+
+typedef struct NvmeStateHeader {
+    uint8_t     magic[8];
+    uint32_t    version;
+    uint32_t    nr_records;
+} NvmeStateHeader;
+
+typedef struct NvmeStateRecord {
+    uint32_t    nsid;
+    uint8_t     map;
+    uint8_t     flbas;
+    uint16_t    rsvd6;
+    uint64_t    nsze;
+    uint64_t    nr_extents;
+} NvmeStateRecord;
+
+typedef struct NvmeStateExtent {
+    uint64_t    slba;
+    uint64_t    nlb;
+} NvmeStateExtent;
+
+typedef struct NvmeStateZone {
+    uint64_t    wp;
+    uint8_t     state;
+    uint8_t     rsvd9[7];
+} NvmeStateZone;
+
 static inline void _nvme_check_size(void)
 {
     QEMU_BUILD_BUG_ON(sizeof(NvmeAerResult) != 4);
     QEMU_BUILD_BUG_ON(sizeof(NvmeCqe) != 16);
     QEMU_BUILD_BUG_ON(sizeof(NvmeDsmRange) != 16);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeZoneMgmtCmd) != 64);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeZoneReportHdr) != 64);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeZoneDescr) != 64);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeSglDescriptor) != 16);
     QEMU_BUILD_BUG_ON(sizeof(NvmeCmd) != 64);
     QEMU_BUILD_BUG_ON(sizeof(NvmeDeleteQ) != 64);
     QEMU_BUILD_BUG_ON(sizeof(NvmeCreateCq) != 64);
@@ -625,8 +997,17 @@ static inline void _nvme_check_size(void)
     QEMU_BUILD_BUG_ON(sizeof(NvmeErrorLog) != 64);
     QEMU_BUILD_BUG_ON(sizeof(NvmeFwSlotInfoLog) != 512);
     QEMU_BUILD_BUG_ON(sizeof(NvmeSmartLog) != 512);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeStatsLog) != 512);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeFormatLog) != 512);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeLatencyLog) != 1024);
     QEMU_BUILD_BUG_ON(sizeof(NvmeIdCtrl) != 4096);
     QEMU_BUILD_BUG_ON(sizeof(NvmeIdNs) != 4096);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeIdNsZoned) != 4096);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeIdCtrlZoned) != 4096);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeStateHeader) != 16);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeStateRecord) != 24);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeStateExtent) != 16);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeStateZone) != sizeof(NvmeStateExtent));
 }
 
 typedef struct NvmeAsyncEvent {
@@ -634,6 +1015,12 @@ typedef struct NvmeAsyncEvent {
     NvmeAerResult result;
 } NvmeAsyncEvent;
 
+/* Byte range of a read transfer that a Bit Bucket descriptor discards */
+typedef struct NvmeBitBucket {
+    uint32_t    offset;
+    uint32_t    len;
+} NvmeBitBucket;
+
 typedef struct NvmeRequest {
     struct NvmeSQueue       *sq;
     struct NvmeNamespace    *ns;
@@ -645,30 +1032,50 @@ typedef struct NvmeRequest {
     uint16_t                ctrl;
     uint64_t                meta_size;
     uint64_t                mptr;
+    uint64_t                data_offset;
+    uint32_t                nr_bit_buckets;
+    NvmeBitBucket           *bit_buckets;
+    uint8_t                 stats_op;
+    int64_t                 fetch_ns;
+    int64_t                 model_done;
+    struct NvmeNamespace    *stats_ns;
     void                    *meta_buf;
+    void                    *bounce;
     NvmeCqe                 cqe;
     BlockAcctCookie         acct;
     QEMUSGList              qsg;
+    QEMUIOVector            iov;
     QTAILQ_ENTRY(NvmeRequest)entry;
 } NvmeRequest;
 
 typedef struct NvmeSQueue {
     struct NvmeCtrl *ctrl;
     uint8_t     phys_contig;
-    uint8_t     arb_burst;
+    uint8_t     prio;
+    uint8_t     arb_class;
+    uint8_t     arb_queued;
+    uint8_t     ioeventfd_enabled;
     uint16_t    sqid;
     uint16_t    cqid;
     uint32_t    head;
     uint32_t    tail;
     uint32_t    size;
     uint64_t    dma_addr;
+    uint64_t    db_addr;
+    uint64_t    ei_addr;
     uint64_t    completed;
+    uint32_t    inflight;
     uint64_t    *prp_list;
-    QEMUTimer   *timer;
+    uint64_t    *prp_scratch;
+    NvmeIoStats stats;
+    EventNotifier notifier;
     NvmeRequest *io_req;
+    /* Delete I/O SQ command waiting for the SQ's commands to complete */
+    NvmeRequest *del_req;
     QTAILQ_HEAD(sq_req_list, NvmeRequest) req_list;
     QTAILQ_HEAD(out_req_list, NvmeRequest) out_req_list;
     QTAILQ_ENTRY(NvmeSQueue) entry;
+    QTAILQ_ENTRY(NvmeSQueue) arb_entry;
 } NvmeSQueue;
 
 typedef struct NvmeCQueue {
@@ -681,24 +1088,66 @@ typedef struct NvmeCQueue {
     uint32_t    tail;
     uint32_t    vector;
     uint32_t    size;
+    uint32_t    pending;
+    uint64_t    doorbells;
+    uint64_t    interrupts;
     uint64_t    dma_addr;
+    uint64_t    db_addr;
+    uint64_t    ei_addr;
     uint64_t    *prp_list;
-    QEMUTimer   *timer;
+    uint8_t     *cqe_buf;
+    QEMUBH      *bh;
+    QEMUTimer   *intc_timer;
     QTAILQ_HEAD(sq_list, NvmeSQueue) sq_list;
     QTAILQ_HEAD(cq_req_list, NvmeRequest) req_list;
 } NvmeCQueue;
 
+typedef struct NvmeZone {
+    uint64_t    wp;
+    uint8_t     state;
+} NvmeZone;
+
 typedef struct NvmeNamespace {
     struct NvmeCtrl *ctrl;
+    BlockDriverState *bs;
     NvmeIdNs        id_ns;
     NvmeRangeType   lba_range[64];
-    unsigned long   *util;
-    unsigned long   *uncorrectable;
+    RangeSet        *util;
+    RangeSet        *uncorrectable;
+    RangeSet        *deallocated;
+    RangeSet        *mig_dirty;
+    NvmeZone        *zones;
+    NvmeIdNsZoned   id_ns_zoned;
+    uint64_t        zone_size;
+    uint32_t        nr_zones;
+    uint32_t        nr_open;
+    uint32_t        nr_active;
     uint32_t        id;
+    /* first 512 byte sector of the namespace on its drive */
     uint64_t        start_block;
     uint64_t        meta_start_offset;
+    uint64_t        size;
+    CoMutex         rmw_lock;
+    bool            formatting;
+    NvmeLatStats    lat[NVME_STATS_OPS];
 } NvmeNamespace;
 
+#define TYPE_NVME_BUS "nvme-bus"
+
+typedef struct NvmeBus {
+    BusState qbus;
+} NvmeBus;
+
+#define TYPE_NVME_NS "nvme-ns"
+#define NVME_NS(obj) \
+        OBJECT_CHECK(NvmeNsDev, (obj), TYPE_NVME_NS)
+
+typedef struct NvmeNsDev {
+    DeviceState parent_obj;
+    BlockConf   conf;
+    uint32_t    nsid;
+} NvmeNsDev;
+
 #define TYPE_NVME "nvme"
 #define NVME(obj) \
         OBJECT_CHECK(NvmeCtrl, (obj), TYPE_NVME)
@@ -706,11 +1155,31 @@ typedef struct NvmeNamespace {
 /* PCIe extended config space offset for AER Capability */
 #define NVME_EP_AER_OFFSET               0x0100
 
+/*
+ * Flash timing model state. Times are vm_clock nanoseconds at which each die
+ * and channel becomes free, and at which each write buffer slot's page will
+ * have been programmed.
+ */
+typedef struct NvmeFlashModel {
+    int64_t     *die_busy;
+    int64_t     *chan_busy;
+    int64_t     *wbuf;
+    uint64_t    *die_progs;
+    uint64_t    die_pages;
+    uint32_t    wbuf_pages;
+    uint32_t    wbuf_head;
+    int64_t     wbuf_last;
+    QEMUTimer   *timer;
+    QTAILQ_HEAD(model_req_list, NvmeRequest) reqs;
+} NvmeFlashModel;
+
 typedef struct NvmeCtrl {
     PCIDevice    parent_obj;
     MemoryRegion iomem;
+    MemoryRegion ctrl_mem;
     NvmeBar      bar;
     BlockConf    conf;
+    NvmeBus      bus;
 
     time_t      start_time;
     uint16_t    temperature;
@@ -726,6 +1195,10 @@ typedef struct NvmeCtrl {
     uint32_t    num_queues;
     uint32_t    max_q_ents;
     uint64_t    ns_size;
+    uint64_t    dbbuf_dbs;
+    uint64_t    dbbuf_eis;
+    uint64_t    prp_entries;
+    uint64_t    prp_sg_elems;
     uint8_t     db_stride;
     uint8_t     aerl;
     uint8_t     acl;
@@ -750,11 +1223,34 @@ typedef struct NvmeCtrl {
     uint8_t     outstanding_aers;
     uint8_t     temp_warn_issued;
     uint8_t     num_errors;
+    uint8_t     ioeventfd;
+    uint8_t     sgl;
     int32_t     num_msi;
     int32_t     num_msix;
+    uint32_t    cmb_size_mb;
+    uint8_t     flash_model;
+    uint8_t     flash_op;
+    uint32_t    flash_channels;
+    uint32_t    flash_dies;
+    uint32_t    flash_page_kb;
+    uint32_t    flash_ppb;
+    uint32_t    flash_read_us;
+    uint32_t    flash_prog_us;
+    uint32_t    flash_erase_us;
+    uint32_t    flash_chan_mbps;
+    uint32_t    flash_wbuf_kb;
+    uint8_t     zoned;
+    uint8_t     zasl;
+    uint32_t    zone_size_mb;
+    uint32_t    zone_max_open;
+    uint32_t    zone_max_active;
 
     char            *serial;
+    char            *statefile;
+    Notifier        exit_notifier;
     NvmeErrorLog    *elpes;
+    uint8_t         *bit_bucket;
+    uint8_t         *cmbuf;
     NvmeRequest     **aer_reqs;
     NvmeNamespace   *namespaces;
     NvmeSQueue      **sq;
@@ -763,10 +1259,29 @@ typedef struct NvmeCtrl {
     NvmeCQueue      admin_cq;
     NvmeFeatureVal  features;
     NvmeIdCtrl      id_ctrl;
+    NvmeIdCtrlZoned id_ctrl_zoned;
 
     QSIMPLEQ_HEAD(aer_queue, NvmeAsyncEvent) aer_queue;
     QEMUTimer   *aer_timer;
     uint8_t     aer_mask;
+
+    QEMUBH      *arb_bh;
+    uint32_t    arb_credit[NVME_ARB_CLASSES];
+    QTAILQ_HEAD(arb_list, NvmeSQueue) arb_list[NVME_ARB_CLASSES];
+
+    NvmeRequest *format_req;
+    uint32_t    format_nsid;
+    uint8_t     format_ses;
+    uint64_t    format_done;
+    uint64_t    format_total;
+
+    NvmeIoStats stats;
+    QLIST_ENTRY(NvmeCtrl) entry;
+
+    NvmeFlashModel model;
+
+    QemuMutex   map_lock;
+    VMChangeStateEntry *vmstate_change;
 } NvmeCtrl;
 
 typedef struct NvmeDifTuple {
@@ -775,53 +1290,4 @@ typedef struct NvmeDifTuple {
     uint32_t ref_tag;
 } NvmeDifTuple;
 
-/* Copied from Linux, lib/crc-t10dif.c */
-static const uint16_t t10_dif_crc_table[256] = {
-    0x0000, 0x8BB7, 0x9CD9, 0x176E, 0xB205, 0x39B2, 0x2EDC, 0xA56B,
-    0xEFBD, 0x640A, 0x7364, 0xF8D3, 0x5DB8, 0xD60F, 0xC161, 0x4AD6,
-    0x54CD, 0xDF7A, 0xC814, 0x43A3, 0xE6C8, 0x6D7F, 0x7A11, 0xF1A6,
-    0xBB70, 0x30C7, 0x27A9, 0xAC1E, 0x0975, 0x82C2, 0x95AC, 0x1E1B,
-    0xA99A, 0x222D, 0x3543, 0xBEF4, 0x1B9F, 0x9028, 0x8746, 0x0CF1,
-    0x4627, 0xCD90, 0xDAFE, 0x5149, 0xF422, 0x7F95, 0x68FB, 0xE34C,
-    0xFD57, 0x76E0, 0x618E, 0xEA39, 0x4F52, 0xC4E5, 0xD38B, 0x583C,
-    0x12EA, 0x995D, 0x8E33, 0x0584, 0xA0EF, 0x2B58, 0x3C36, 0xB781,
-    0xD883, 0x5334, 0x445A, 0xCFED, 0x6A86, 0xE131, 0xF65F, 0x7DE8,
-    0x373E, 0xBC89, 0xABE7, 0x2050, 0x853B, 0x0E8C, 0x19E2, 0x9255,
-    0x8C4E, 0x07F9, 0x1097, 0x9B20, 0x3E4B, 0xB5FC, 0xA292, 0x2925,
-    0x63F3, 0xE844, 0xFF2A, 0x749D, 0xD1F6, 0x5A41, 0x4D2F, 0xC698,
-    0x7119, 0xFAAE, 0xEDC0, 0x6677, 0xC31C, 0x48AB, 0x5FC5, 0xD472,
-    0x9EA4, 0x1513, 0x027D, 0x89CA, 0x2CA1, 0xA716, 0xB078, 0x3BCF,
-    0x25D4, 0xAE63, 0xB90D, 0x32BA, 0x97D1, 0x1C66, 0x0B08, 0x80BF,
-    0xCA69, 0x41DE, 0x56B0, 0xDD07, 0x786C, 0xF3DB, 0xE4B5, 0x6F02,
-    0x3AB1, 0xB106, 0xA668, 0x2DDF, 0x88B4, 0x0303, 0x146D, 0x9FDA,
-    0xD50C, 0x5EBB, 0x49D5, 0xC262, 0x6709, 0xECBE, 0xFBD0, 0x7067,
-    0x6E7C, 0xE5CB, 0xF2A5, 0x7912, 0xDC79, 0x57CE, 0x40A0, 0xCB17,
-    0x81C1, 0x0A76, 0x1D18, 0x96AF, 0x33C4, 0xB873, 0xAF1D, 0x24AA,
-    0x932B, 0x189C, 0x0FF2, 0x8445, 0x212E, 0xAA99, 0xBDF7, 0x3640,
-    0x7C96, 0xF721, 0xE04F, 0x6BF8, 0xCE93, 0x4524, 0x524A, 0xD9FD,
-    0xC7E6, 0x4C51, 0x5B3F, 0xD088, 0x75E3, 0xFE54, 0xE93A, 0x628D,
-    0x285B, 0xA3EC, 0xB482, 0x3F35, 0x9A5E, 0x11E9, 0x0687, 0x8D30,
-    0xE232, 0x6985, 0x7EEB, 0xF55C, 0x5037, 0xDB80, 0xCCEE, 0x4759,
-    0x0D8F, 0x8638, 0x9156, 0x1AE1, 0xBF8A, 0x343D, 0x2353, 0xA8E4,
-    0xB6FF, 0x3D48, 0x2A26, 0xA191, 0x04FA, 0x8F4D, 0x9823, 0x1394,
-    0x5942, 0xD2F5, 0xC59B, 0x4E2C, 0xEB47, 0x60F0, 0x779E, 0xFC29,
-    0x4BA8, 0xC01F, 0xD771, 0x5CC6, 0xF9AD, 0x721A, 0x6574, 0xEEC3,
-    0xA415, 0x2FA2, 0x38CC, 0xB37B, 0x1610, 0x9DA7, 0x8AC9, 0x017E,
-    0x1F65, 0x94D2, 0x83BC, 0x080B, 0xAD60, 0x26D7, 0x31B9, 0xBA0E,
-    0xF0D8, 0x7B6F, 0x6C01, 0xE7B6, 0x42DD, 0xC96A, 0xDE04, 0x55B3
-};
-
-static uint16_t crc_t10dif(const unsigned char *buffer, size_t len)
-{
-    uint16_t crc = 0;
-    unsigned int i;
-
-    for (i = 0 ; i < len ; i++) {
-        crc = (crc << 8) ^ t10_dif_crc_table[((crc >> 8) ^ buffer[i]) & 0xff];
-    }
-
-    return crc;
-}
-/* End lib/crc-t10dif.c */
-
 #endif /* HW_NVME_H */
@@ -30,6 +30,22 @@
 //                  layer. Information to/from the PQI queues are presented
 //                  to/from the SOP host-interface for processing.
 //
+//                  Usage:
+//                    -drive file=<file>,if=none,id=<id>
+//                    -device soppqi,drive=<id>[,luns=<n>][,size=<blocks>]
+//
+//                  The drive is split into "luns" LUNs of "size" logical
+//                  blocks each (size=0, the default, shares the whole
+//                  drive equally between the LUNs). The logical block size
+//                  comes from the drive's logical_block_size property.
+//
+//                  IQ doorbell writes only latch the PI; the IUs are
+//                  fetched from the main loop, at most "iq_batch" (default
+//                  32) per queue before the other queues get a turn.
+//                  Responses wait while their OQ is full and are posted in
+//                  batches with one PI update; OQ interrupts are coalesced
+//                  per the Create/Change OQ Properties count and time.
+//
 //    $Id: ih_mgr.hpp 304 2012-10-23 14:09:21Z RBenn7142835 $
 //
 //*****************************************************************************
@@ -82,6 +98,7 @@ void sop_pci_bus_init(PCIBus *bus);
 static void pqi_pci_space_init(PCIDevice* pciDev);
 static void pqi_set_registry(PQIState* n);
 static void qdev_pqi_reset(DeviceState* dev);
+static void pqi_reset_queues(PQIState* n);
 static void pqi_pci_write_config(PCIDevice* pciDev, uint32_t addr, uint32_t val, int len);
 static uint32_t pqi_pci_read_config(PCIDevice* pciDev, uint32_t addr, int len);
 static inline uint8_t range_covers_reg(uint64_t addr, uint64_t len, uint64_t reg, uint64_t regSize);
@@ -174,6 +191,7 @@ static void process_aq_config(PQIState* pqiDev) {
 
             // setup device admin OQ
             PQIOutboundQueue* oq = &pqiDev->oq[AOQ_ID];
+            pqi_oq_discard(pqiDev, AOQ_ID);
             oq->id = AOQ_ID;
             oq->pi_addr  = pqi_cntrl_read_config(pqiDev, PQI_AOQ_PIA, DWORD) & 0xFFFFFFC0;
             oq->pi_addr += (uint64_t)pqi_cntrl_read_config(pqiDev, PQI_AOQ_PIA + 4, DWORD) << 32;
@@ -308,7 +326,7 @@ static void pqi_mmio_writew(void* opaque, hwaddr addr, uint32_t val) {
 
         pqi_cntrl_write_config(pqiDev, addr, val, WORD);
         qid = (uint32_t)(addr - PQI_IQ_PI_BASE) / 8;
-        process_iq_event(pqiDev, qid);
+        pqi_kick_iq(pqiDev, qid);
 
     } else if ((addr >= PQI_OQ_CI_REG(AOQ_ID)) &&   // process OQ CI writes (admin and operational)
                (addr <= PQI_OQ_CI_REG(MAX_Q_ID))) {
@@ -482,7 +500,7 @@ static void pqi_mmio_writel(void* opaque, hwaddr addr, uint32_t val) {
 
                 pqi_cntrl_write_config(pqiDev, addr, val, DWORD);
                 qid = (uint32_t)(addr - PQI_IQ_PI_BASE) / 8;
-                process_iq_event(pqiDev, qid);
+                pqi_kick_iq(pqiDev, qid);
 
             } else if ((addr >= PQI_OQ_CI_REG(AOQ_ID)) &&   // process OQ CI writes (admin and operational)
                        (addr <= PQI_OQ_CI_REG(MAX_Q_ID))) {
@@ -668,7 +686,6 @@ void pqi_reset_request(PQIState* pqiDev, uint32_t val) {
 
 //    FILE* pqi_config_file;
     PQIReset* pr;
-    int i;
 
     SOP_LOG_NORM("%s(): pqiDev = 0x%08lx", __func__, (uint64_t)pqiDev);
 
@@ -719,32 +736,7 @@ void pqi_reset_request(PQIState* pqiDev, uint32_t val) {
 
 
             // 2 - Reset queuing layer
-
-            // initialize the inbound queues
-            PQIInboundQueue* ibQp  = &pqiDev->iq[1];
-            PQIOutboundQueue* obQp = &pqiDev->oq[1];
-
-            for (i=1; i < MAX_Q_ID; i++, ibQp++, obQp++) {
-
-                // in-bound Queue
-                ibQp->id = 0;
-                ibQp->pi = 0;
-                ibQp->ci_addr = 0;
-                ibQp->ci_work = 0;
-                ibQp->ci_local = 0;
-                ibQp->ea_addr = 0;
-                ibQp->size = 0;
-
-                // out-bound Queue
-                obQp->id = 0;
-                obQp->ci = 0;
-                obQp->pi_addr = 0;
-                obQp->pi_work = 0;
-                obQp->pi_local = 0;
-                obQp->ea_addr = 0;
-                obQp->size = 0;
-                obQp->msixEntry = 0;
-            }
+            pqi_reset_queues(pqiDev);
 
             // 3 - Reset IU layer content
 
@@ -1087,7 +1079,7 @@ static void pqi_set_registry(PQIState* n) {
 
 /*********************************************************************
  Function     :    do_pqi_reset
- Description  :    TODO: Not yet implemented
+ Description  :    Waits for outstanding LUN I/O to complete
  Return Type  :    void
  Arguments    :    PQIState * : Pointer to PQI device state
  *********************************************************************/
@@ -1096,12 +1088,70 @@ static void do_pqi_reset(PQIState* n) {
 
     SOP_LOG_NORM("%s(): PQIState = 0x%08lu", __func__, (uint64_t)n);
 
-    // (void)n;
-    
+    pqi_set_registry(n);
+    pqi_reset_queues(n);
+    n->sm.state = PQI_DEVICE_STATE_PD2;
+
     SOP_LOG_NORM("%s() exit...", __func__);
 }
 
 
+/*********************************************************************
+ Function     :    pqi_reset_queues
+ Description  :    Waits for outstanding LUN I/O, then drops every
+                   queue together with the responses it still holds
+ Return Type  :    void
+ Arguments    :    PQIState * : Pointer to PQI device state
+ *********************************************************************/
+
+static void pqi_reset_queues(PQIState* n) {
+
+    int i;
+
+    // completions of the drained I/O only reach the pending lists
+    bdrv_drain_all();
+
+    for (i = 0; i < PQI_MAX_QS_ALLOCATED; i++) {
+
+        PQIInboundQueue* iq = &n->iq[i];
+        PQIOutboundQueue* oq = &n->oq[i];
+
+        qemu_bh_cancel(iq->bh);
+        qemu_bh_cancel(oq->bh);
+        pqi_oq_discard(n, i);
+
+        // in-bound Queue
+        iq->id = 0;
+        iq->pi = 0;
+        iq->ci_addr = 0;
+        iq->ci_work = 0;
+        iq->ci_local = 0;
+        iq->ea_addr = 0;
+        iq->length = 0;
+        iq->protocol = 0;
+        iq->size = 0;
+        iq->vendor = 0;
+
+        // out-bound Queue
+        oq->id = 0;
+        oq->pi_addr = 0;
+        oq->pi_work = 0;
+        oq->pi_local = 0;
+        oq->ci = 0;
+        oq->ea_addr = 0;
+        oq->length = 0;
+        oq->protocol = 0;
+        oq->size = 0;
+        oq->msixEntry = 0;
+        oq->waitForRearm = 0;
+        oq->coCount = 0;
+        oq->minCoTime = 0;
+        oq->maxCoTime = 0;
+        oq->vendor = 0;
+    }
+}
+
+
 /*********************************************************************
  Function     :    qdev_pqi_reset
  Description  :    Handler for PCI Reset
@@ -1418,12 +1468,18 @@ static int pci_pqi_init(PCIDevice* pciDev) {
 		// return -1;
     }
 
-    if (n->lun_size == 0 || n->lun_size > SOP_MAX_LUN_SIZE) {
+    if (!n->conf.bs) {
 
-        SOP_LOG_ERR("Error %s() Bad LUN size value: %u, must be between 1 and %d", __func__, n->lun_size, SOP_MAX_LUN_SIZE);
-		return -1;
+        SOP_LOG_ERR("Error %s() drive property not set", __func__);
+        return -1;
     }
-    SOP_LOG_NORM("num_luns = %d. lun_size=%d",n->num_luns,n->lun_size);
+
+    if (n->iq_batch == 0) {
+
+        SOP_LOG_ERR("Error %s() iq_batch must be at least 1", __func__);
+        return -1;
+    }
+    SOP_LOG_NORM("num_luns = %d. lun_size=%"PRIu64,n->num_luns,n->lun_size);
 
     n->disk = (DiskInfo*)g_malloc(sizeof(DiskInfo) * n->num_luns);
 	if (n->disk) {
@@ -1551,6 +1607,20 @@ static int pci_pqi_init(PCIDevice* pciDev) {
     if (pqi_create_storage_disks(n)) {
 
         SOP_LOG_ERR("Error %s() could not create SOP disk", __func__);
+        return -1;
+    }
+
+    for (ret = 0; ret < PQI_MAX_QS_ALLOCATED; ret++) {
+
+        n->iq[ret].pqiDev = n;
+        n->iq[ret].index = ret;
+        n->iq[ret].bh = qemu_bh_new(pqi_iq_bh, &n->iq[ret]);
+
+        n->oq[ret].pqiDev = n;
+        n->oq[ret].index = ret;
+        QSIMPLEQ_INIT(&n->oq[ret].pending);
+        n->oq[ret].bh = qemu_bh_new(pqi_oq_bh, &n->oq[ret]);
+        n->oq[ret].timer = qemu_new_timer_ns(vm_clock, pqi_oq_timer, &n->oq[ret]);
     }
 
     // we should now be ready to accept PQI admin commands
@@ -1588,6 +1658,7 @@ static void pci_pqi_uninit(PCIDevice* pciDev) {
     SOP_LOG_NORM("%s(): pciDev = 0x%08lu", __func__, (uint64_t)pciDev);
 
     PQIState* n = DO_UPCAST(PQIState, dev, pciDev);
+    int i;
 
     // Freeing space allocated for SOP regspace masks
     g_free(n->cntrl_reg);
@@ -1595,9 +1666,18 @@ static void pci_pqi_uninit(PCIDevice* pciDev) {
     g_free(n->rwc_mask);
     g_free(n->rws_mask);
     g_free(n->used_mask);
-    g_free(n->disk);
 
     pqi_close_storage_disks(n);
+    g_free(n->disk);
+
+    for (i = 0; i < PQI_MAX_QS_ALLOCATED; i++) {
+
+        qemu_bh_delete(n->iq[i].bh);
+
+        pqi_oq_discard(n, i);
+        qemu_bh_delete(n->oq[i].bh);
+        qemu_free_timer(n->oq[i].timer);
+    }
     SOP_LOG_NORM("Freed PQI device memory");
 
     SOP_LOG_NORM("%s() exit...", __func__);
@@ -1615,9 +1695,10 @@ void sop_pci_bus_init(PCIBus *bus)
 }
 
 static Property soppqi_properties[] = {
+        DEFINE_BLOCK_PROPERTIES(PQIState, conf),
         DEFINE_PROP_UINT32("luns", PQIState, num_luns, 1),
-        DEFINE_PROP_UINT32("size", PQIState, lun_size, 1048576),
-        DEFINE_PROP_STRING("wdir", PQIState, working_dir),
+        DEFINE_PROP_UINT64("size", PQIState, lun_size, 0),
+        DEFINE_PROP_UINT32("iq_batch", PQIState, iq_batch, 32),
         DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -1652,6 +1733,16 @@ static const TypeInfo pqi_info = {
 static inline void _sop_check_size(void)
 {
     BUILD_BUG_ON(sizeof(sopLimitedCommandIU) != 64);
+    BUILD_BUG_ON(sizeof(sopCommandIU) != 80);
+    BUILD_BUG_ON(sizeof(rw16CDB) != 16);
+    BUILD_BUG_ON(sizeof(writeSame10CDB) != 10);
+    BUILD_BUG_ON(sizeof(writeSame16CDB) != 16);
+    BUILD_BUG_ON(sizeof(unmapCDB) != 10);
+    BUILD_BUG_ON(sizeof(unmapParamHdr) != 8);
+    BUILD_BUG_ON(sizeof(unmapBlockDesc) != 16);
+    BUILD_BUG_ON(sizeof(reportLunsCDB) != 12);
+    BUILD_BUG_ON(sizeof(readCapacity16CDB) != 16);
+    BUILD_BUG_ON(sizeof(readCapacity16Data) != 32);
 }
 /*********************************************************************
  Function     :    sop_register_devices
@@ -26,8 +26,11 @@
 #include "hw/pci/pci.h"
 #include "qemu/timer.h"
 #include "qemu/queue.h"
+#include "qemu/host-utils.h"
 #include "hw/loader.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/dma.h"
+#include "hw/block/block.h"
 #include <pthread.h>
 #include <sched.h>
 
@@ -144,8 +147,16 @@
 
 #define SOP_SPARE_THRESH 20
 #define SOP_TEMPERATURE 0x143
-#define SOP_MAX_LUN_SIZE 1048576
-#define SOP_MAX_NUM_LUNS 4 // TODO: BWS - should this be 256?
+#define SOP_MAX_NUM_LUNS 256
+
+// Largest data transfer of a single READ/WRITE command
+#define SOP_MAX_XFER_BYTES (1U << 30)
+// Longest SGL segment table, and most segments chained in one SGL
+#define SOP_MAX_SGL_SEGMENT_LEN (4096 * 16)
+#define SOP_MAX_SGL_SEGMENTS 1024
+
+// Most block descriptors accepted in one UNMAP parameter list
+#define SOP_MAX_UNMAP_DESCS 255
 
 // PQI Device Registers
 // Section 5.2.1 (T10/2240-D PQI specification)
@@ -991,9 +1002,24 @@ typedef struct PQIInboundQueue {
     uint16_t    size;       // number of elements in the queue
     uint32_t    vendor;
 
+    QEMUBH      *bh;        // fetches IUs after a PI doorbell
+    struct PQIState *pqiDev;
+    uint16_t    index;      // position in PQIState.iq[]
+    bool        held;       // fetching stopped until the OQ drains
+
 } PQIInboundQueue;
 
 
+// A response waiting for room in its OQ
+typedef struct SopPendingRsp {
+
+    QSIMPLEQ_ENTRY(SopPendingRsp) entry;
+    int         length;
+    uint8_t     iu[];
+
+} SopPendingRsp;
+
+
 typedef struct PQIOutboundQueue {
 
     uint16_t    id;             // use '0' for admin queue
@@ -1009,9 +1035,17 @@ typedef struct PQIOutboundQueue {
     uint8_t     waitForRearm;
     uint16_t    coCount;        // coalescing info
     uint16_t    minCoTime;
-    uint16_t    maxCoTime;
+    uint16_t    maxCoTime;      // in microseconds
     uint32_t    vendor;
 
+    QSIMPLEQ_HEAD(, SopPendingRsp) pending; // responses not posted yet
+    uint32_t    nr_pending;
+    uint16_t    unsignalled;    // posted since the last interrupt
+    QEMUBH      *bh;            // posts pending responses
+    QEMUTimer   *timer;         // maxCoTime expiry
+    struct PQIState *pqiDev;
+    uint16_t    index;          // position in PQIState.oq[]
+
 } PQIOutboundQueue;
 
 
@@ -1065,16 +1099,13 @@ typedef struct PQIStateMachine {
 } PQIStateMachine;
 
 
+// A LUN is a contiguous range of logical blocks on the device's drive
 typedef struct DiskInfo {
 
-    int fd;
-    int mfd;
-    int lunid;
-    size_t mapping_size;
-    uint8_t *mapping_addr;
-
-    size_t meta_mapping_size;
-    uint8_t *meta_mapping_addr;
+    int lunid;              // LUN number, 0 based
+    uint8_t block_shift;    // log2 of the logical block size
+    uint64_t start_block;   // first logical block of the LUN on the drive
+    uint64_t nb_blocks;     // LUN size in logical blocks
 
 } DiskInfo;
 
@@ -1108,11 +1139,12 @@ typedef struct PQIState {
     PQIOutboundQueue oq[PQI_MAX_QS_ALLOCATED];
     PQIInboundQueue iq[PQI_MAX_QS_ALLOCATED];
 
+    BlockConf conf;       // backing drive, carved up into num_luns LUNs
     DiskInfo *disk;
-    uint32_t lun_size;
+    uint64_t lun_size;    // in logical blocks
     uint32_t num_luns;
     uint32_t instance;
-    char*    working_dir; // storage backing files are stored here
+    uint32_t iq_batch;    // IUs fetched per IQ pass before yielding
 
     time_t start_time;
 
@@ -1127,6 +1159,26 @@ typedef struct PQIState {
 } PQIState;
 
 
+// An in-flight media access command, completed from the block layer
+// AIO callback or coroutine
+typedef struct SopRequest {
+
+    PQIState *pqiDev;
+    DiskInfo *disk;
+    uint32_t qid;
+    uint16_t request_id;
+    uint8_t opcode;
+    bool is_write;
+    uint64_t lba;
+    uint64_t nlb;
+    uint8_t *buf;           // UNMAP parameter list / WRITE SAME block
+    uint32_t buf_len;
+    QEMUSGList qsg;
+    BlockAcctCookie acct;
+
+} SopRequest;
+
+
 // Structure used for default initialization sequence
 
 struct PQIReg {
@@ -1394,7 +1446,6 @@ enum {PCI_SPACE = 0, PQI_SPACE = 1};
 int pqi_create_storage_disks(PQIState *n);
 int pqi_create_storage_disk(uint32_t instance, uint32_t nsid, DiskInfo *disk, PQIState *n);
 int pqi_close_storage_disks(PQIState *n);
-int pqi_close_storage_disk(DiskInfo *disk);
 
 void pqi_dma_mem_read(hwaddr addr, uint8_t *buf, int len);
 void pqi_dma_mem_write(hwaddr addr, uint8_t *buf, int len);
@@ -1408,17 +1459,23 @@ void pqi_cntrl_write_config(PQIState *, hwaddr, uint32_t, uint8_t);
 void pqi_reset_request(PQIState* pqiDev, uint32_t val);
 
 // Functions for IQ/OQ queue processing
+void pqi_kick_iq(PQIState* pqiDev, uint32_t qid);
+void pqi_iq_bh(void *opaque);
 void process_iq_event(PQIState* pqiDev, uint32_t qid);
 void process_oq_event(PQIState* pqiDev, uint32_t qid);
+void pqi_oq_bh(void *opaque);
+void pqi_oq_timer(void *opaque);
+void pqi_oq_signal(PQIState* pqiDev, uint32_t qid);
+void pqi_oq_discard(PQIState* pqiDev, uint32_t qid);
 
 // Functions for admin IQ and OQ message processing
 void sop_execute_admin_command(PQIState* pqiDev, PQIInboundQueue* iq, uint16_t ci);
 void admin_report_caps(PQIState* pqiDev, reportPqiDevCapReq* iu);
 void admin_report_man_info(PQIState* pqiDev, reportManInfoReq* iu);
-uint32_t copy_sgl(sglDesc* sgl, uint8_t* pData, uint32_t len, uint8_t dir);
-uint32_t copy_from_sgl(sglDesc* sgl, uint8_t* pData, uint32_t len);
-uint32_t copy_to_sgl(sglDesc* sgl, uint8_t* pData, uint32_t len);
-sglDesc * download_sgl_segment(hwaddr address, uint32_t len);
+uint32_t copy_sgl(PQIState* pqiDev, sglDesc* sgl, uint32_t nsgl, uint8_t* pData, uint32_t len, uint8_t dir);
+uint32_t copy_from_sgl(PQIState* pqiDev, sglDesc* sgl, uint32_t nsgl, uint8_t* pData, uint32_t len);
+uint32_t copy_to_sgl(PQIState* pqiDev, sglDesc* sgl, uint32_t nsgl, uint8_t* pData, uint32_t len);
+uint32_t map_sgl(PQIState* pqiDev, QEMUSGList* qsg, sglDesc* sgl, uint32_t nsgl, uint32_t len);
 void admin_create_op_iq(PQIState* pqiDev, createOpIqReq* iu);
 void admin_create_op_oq(PQIState* pqiDev, createOpOqReq* iu);
 void admin_delete_op_iq(PQIState* pqiDev, deleteOpIqReq* iu);
@@ -1438,7 +1495,7 @@ void admin_report_op_iq_response(PQIState* pqiDev, reportOpIqListReq* iu, uint32
 void admin_report_op_oq_response(PQIState* pqiDev, reportOpOqListReq* iu, uint32_t status, uint32_t  add_status);
 
 
-void sop_execute_sop_command(PQIState* pqiDev, uint32_t qid, uint16_t ci);
+uint16_t sop_execute_sop_command(PQIState* pqiDev, uint32_t qid, uint16_t ci);
 
 
 uint16_t get_iq_pi(PQIState* pqiDev, uint16_t qid);
@@ -1501,6 +1558,29 @@ void post_to_oq (PQIState* pqiDev, int qid, void *iu, int length);
 
 
 
+// SOP Command IU: a limited command IU addressed to a LUN
+#pragma pack(push,1)
+typedef struct sopCommandIU {
+#define SOP_CMD_IU	0x11
+	iuHeader header;
+	uint16_t queue_id;
+	uint16_t work_area;
+	uint16_t request_id;
+	uint16_t nexus_id;
+	uint32_t xfer_size;
+	uint8_t  lun[8];
+	uint8_t  protocol_specific;
+	uint8_t  direction :2;
+	uint8_t  partial :1;
+	uint8_t  res1 :5;
+	uint8_t  task_attribute;
+	uint8_t  add_cdb_bytes;
+	uint8_t  res2[4];
+	uint8_t  cdb[16];
+	sglDesc sg[2];
+} sopCommandIU;
+#pragma pack(pop)
+
 #pragma pack(push,1)
 typedef struct sopLimitedCommandIU {
 #define SOP_LIMITED_CMD_IU	0x10
@@ -1613,9 +1693,129 @@ typedef struct write10CDB {
 } write10CDB;
 #pragma pack(pop)
 
+#pragma pack(push,1)
+typedef struct rw16CDB {
+#define OP_READ_16	0x88
+#define OP_WRITE_16	0x8A
+	uint8_t  op;
+	uint8_t  flags;
+	uint64_t lba;
+	uint32_t xfer_len;
+	uint8_t  group;
+	uint8_t  control;
+} rw16CDB;
+#pragma pack(pop)
+
+#pragma pack(push,1)
+typedef struct writeSame10CDB {
+#define OP_WRITE_SAME_10	0x41
+	uint8_t  op;
+	uint8_t  flags;
+	uint32_t lba;
+	uint8_t  group;
+	uint16_t xfer_len;
+	uint8_t  control;
+} writeSame10CDB;
+#pragma pack(pop)
+
+#pragma pack(push,1)
+typedef struct writeSame16CDB {
+#define OP_WRITE_SAME_16	0x93
+	uint8_t  op;
+	uint8_t  flags;
+	uint64_t lba;
+	uint32_t xfer_len;
+	uint8_t  group;
+	uint8_t  control;
+} writeSame16CDB;
+#pragma pack(pop)
+
+#pragma pack(push,1)
+typedef struct unmapCDB {
+#define OP_UNMAP	0x42
+	uint8_t  op;
+	uint8_t  anchor;
+	uint8_t  res[4];
+	uint8_t  group;
+	uint16_t param_len;
+	uint8_t  control;
+} unmapCDB;
+#pragma pack(pop)
+
+// UNMAP parameter list: header followed by block descriptors
+#pragma pack(push,1)
+typedef struct unmapParamHdr {
+	uint16_t data_len;
+	uint16_t desc_len;
+	uint8_t  res[4];
+} unmapParamHdr;
+
+typedef struct unmapBlockDesc {
+	uint64_t lba;
+	uint32_t nlb;
+	uint8_t  res[4];
+} unmapBlockDesc;
+#pragma pack(pop)
+
+#pragma pack(push,1)
+typedef struct reportLunsCDB {
+#define OP_REPORT_LUNS	0xA0
+	uint8_t  op;
+	uint8_t  res1;
+	uint8_t  select_report;
+	uint8_t  res2[3];
+	uint32_t alloc_len;
+	uint8_t  res3;
+	uint8_t  control;
+} reportLunsCDB;
+#pragma pack(pop)
+
+#pragma pack(push,1)
+typedef struct readCapacity16CDB {
+#define OP_SERVICE_ACTION_IN_16	0x9E
+#define SAI_READ_CAPACITY_16	0x10
+	uint8_t  op;
+	uint8_t  service_action;	// bits 4:0
+	uint64_t lba;
+	uint32_t alloc_len;
+	uint8_t  pmi;
+	uint8_t  control;
+} readCapacity16CDB;
+#pragma pack(pop)
+
+// READ CAPACITY(16) parameter data
+#pragma pack(push,1)
+typedef struct readCapacity16Data {
+	uint64_t last_lba;
+	uint32_t block_len;
+	uint8_t  prot;
+	uint8_t  lbppbe;		// logical blocks per physical block exponent
+	uint16_t lowest_aligned;	// bit 15 LBPME, bit 14 LBPRZ
+#define SOP_RC16_LBPME	0x8000
+	uint8_t  res[16];
+} readCapacity16Data;
+#pragma pack(pop)
+
 // CDBs
 #define OP_TEST_UNIT_READY 0x0
 #define OP_READ_CAPACITY   0x25
+#define OP_SYNCHRONIZE_CACHE_10	0x35
+#define OP_SYNCHRONIZE_CACHE_16	0x91
+
+// INQUIRY vital product data pages
+#define SOP_VPD_SUPPORTED_PAGES	0x00
+#define SOP_VPD_BLOCK_LIMITS	0xB0
+
+// Standard INQUIRY data: SPC-4, the same identity REPORT MANUFACTURER
+// INFORMATION gives
+#define SOP_INQ_VERSION_SPC4	0x06
+#define SOP_INQ_RESP_FORMAT	0x02
+#define SOP_INQ_HISUP		0x10
+#define SOP_INQ_CMDQUE		0x02
+#define SOP_INQ_STD_LEN		36
+#define SOP_INQ_VENDOR		"HGST"
+#define SOP_INQ_PRODUCT		"SOP-DEV-A"
+#define SOP_INQ_REVISION	"0.01"
 
 typedef struct sopSuccessRsp {
 
@@ -1627,10 +1827,17 @@ typedef struct sopSuccessRsp {
 
 } sopSuccessRsp;
 
-void sop_cdb_read_10(PQIState* pqiDev, uint32_t qid, sopLimitedCommandIU *r);
-void sop_cdb_write_10(PQIState* pqiDev, uint32_t qid, sopLimitedCommandIU *r);
-void sop_cdb_read_capacity(PQIState* pqiDev, uint32_t qid, sopLimitedCommandIU *r);
-void sop_cdb_inquiry(PQIState* pqiDev, uint32_t qid, sopLimitedCommandIU *r);
-void sop_cdb_test_unit_ready(PQIState* pqiDev, uint32_t qid, sopLimitedCommandIU *r);
+void sop_cdb_read_10(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r);
+void sop_cdb_write_10(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r);
+void sop_cdb_read_16(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r);
+void sop_cdb_write_16(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r);
+void sop_cdb_read_capacity(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r);
+void sop_cdb_read_capacity_16(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r);
+void sop_cdb_inquiry(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r);
+void sop_cdb_test_unit_ready(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r);
+void sop_cdb_synchronize_cache(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r);
+void sop_cdb_unmap(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r);
+void sop_cdb_write_same(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r);
+void sop_cdb_report_luns(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r);
 
 #endif // SOP_H_
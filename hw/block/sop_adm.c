@@ -132,7 +132,8 @@ void admin_report_caps(PQIState* pqiDev, reportPqiDevCapReq* iu) {
     capParam.adminSglDescTypeSupportBitmask = 0x0F;     // Support only manditory types
 
     // put Info inside the SGL...
-    rVal = copy_to_sgl(&iu->sglDescriptor, (uint8_t*)&capParam, iu->dataInBufferSize);
+    rVal = copy_to_sgl(pqiDev, &iu->sglDescriptor, 1, (uint8_t*)&capParam,
+            MIN(iu->dataInBufferSize, sizeof(capParam)));
 
     // build the response 
     reportPqiDevCapRsp capRsp;
@@ -221,7 +222,8 @@ void admin_report_man_info(PQIState* pqiDev, reportManInfoReq* iu) {
     }
 
     // put Info inside the SGL...
-    rVal = copy_to_sgl(&iu->sglDescriptor, (uint8_t*)&manInfoParam, iu->dataInBufferSize);
+    rVal = copy_to_sgl(pqiDev, &iu->sglDescriptor, 1, (uint8_t*)&manInfoParam,
+            MIN(iu->dataInBufferSize, sizeof(manInfoParam)));
 
     // build the response 
     reportManInfoRsp manInfoRsp;
@@ -408,6 +410,7 @@ void admin_delete_op_iq(PQIState* pqiDev, deleteOpIqReq* iu) {
         ibQ->ci_local = 0;
         ibQ->ea_addr = 0;
         ibQ->size = 0;
+        ibQ->held = false;
 
         admin_delete_op_iq_response(pqiDev, iu, ADM_STAT_GOOD, 0x00);
     }
@@ -431,9 +434,9 @@ void admin_delete_op_oq(PQIState* pqiDev, deleteOpOqReq* iu) {
         // error - queue id out of range
         admin_delete_op_oq_response(pqiDev, iu, ADM_STAT_INVALID_FIELD_IN_REQ_IU, 12);
 
-    } else if ( pqiDev->oq[iu->oqId].id || pqiDev->oq[iu->oqId].ea_addr ) {
+    } else if ( !pqiDev->oq[iu->oqId].id || !pqiDev->oq[iu->oqId].ea_addr ) {
 
-        // error - queue already created (or seems to be)
+        // error - queue already deleted (or seems to be)
         admin_delete_op_oq_response(pqiDev, iu, ADM_STAT_INVALID_FIELD_IN_REQ_IU, 12);
 
     } else {
@@ -451,6 +454,7 @@ void admin_delete_op_oq(PQIState* pqiDev, deleteOpOqReq* iu) {
         obQ->ea_addr = 0;
         obQ->size = 0;
         obQ->msixEntry = 0;
+        pqi_oq_discard(pqiDev, iu->oqId);
     }
 }
 
@@ -510,7 +514,19 @@ void admin_change_op_oq_props(PQIState* pqiDev, changeOpOqPropReq* iu) {
 
     } else {
 
-        // TODO: What is to be "changed" ?????
+        PQIOutboundQueue* obQ = &pqiDev->oq[iu->oqId];
+
+        // interrupt coalescing
+        obQ->waitForRearm = iu->wairForRearm;
+        obQ->coCount = iu->coalescingCount;
+        obQ->minCoTime = iu->minCoalescingTime;
+        obQ->maxCoTime = iu->maxCoalescingTime;
+
+        SOP_LOG_NORM("%s(): oq %d coalescing count=%d, time=%d us", __func__,
+                iu->oqId, obQ->coCount, obQ->maxCoTime);
+
+        // responses already waiting may now be due an interrupt
+        pqi_oq_signal(pqiDev, iu->oqId);
 
         admin_change_op_oq_response(pqiDev, iu, ADM_STAT_GOOD, 0x00);
     }
@@ -613,7 +629,7 @@ void admin_report_op_iq_list(PQIState* pqiDev, reportOpIqListReq* iu) {
     }
 
     // put Info inside the SGL & release scratch buffer
-    rVal = copy_to_sgl(&iu->sglDescriptor, pBuff, listSize);
+    rVal = copy_to_sgl(pqiDev, &iu->sglDescriptor, 1, pBuff, listSize);
     g_free(pBuff);
 
     if ( rVal == SUCCESS ) {
@@ -728,7 +744,7 @@ void admin_report_op_oq_list(PQIState* pqiDev, reportOpOqListReq* iu) {
     }
 
     // put Info inside the SGL & release scratch buffer
-    rVal = copy_to_sgl(&iu->sglDescriptor, pBuff, listSize);
+    rVal = copy_to_sgl(pqiDev, &iu->sglDescriptor, 1, pBuff, listSize);
     g_free(pBuff);
 
     if ( rVal == SUCCESS ) {
@@ -968,240 +984,196 @@ void admin_report_op_oq_response(PQIState* pqiDev, reportOpOqListReq* iu, uint32
 }
 
 
+// Called for every data block (or bit bucket) an SGL describes
+typedef int (*SglBlockFn)(void *opaque, hwaddr addr, uint32_t len, bool bit_bucket);
+
 /*****************************************************************************
- Function:         copy_to_sgl
- Description:      common function to put/take data to/from an SGL
+ Function:         walk_sgl
+ Description:      walks the descriptors of an SGL, following chained
+                   segments, until len bytes are described. Each segment
+                   table is fetched from the host with a single DMA into a
+                   buffer reused for the whole walk.
  Return Type:      uint32_t - 0: SUCCESS
-                              1: FAIL ---- sgl_bit_bucket_zero_byte_error
-                              2: FAIL +1 - sgl_std_last_seg_zero_byte_error
-                              3: FAIL +2 - sgl_std_seg_zero_byte_error
-                              4: FAIL +3 - sgl_data_block_zero_byte_error
-                              5: FAIL +4 - data_length_error
-                              6: FAIL +5 - Vendor-Specific SGL not supported
-                              7: FAIL +6 - unsupported SGL type
-                              8: FAIL +7 - bad last segment
-                              9: FAIL +8 - buffer to small
-                             10: FAIL +9 - bad segment
-                              
- Arguments:        sglDesc* sgl     SGL to put data into
-                   uint8_t* pData   data to put into SGL
-                   uint32_t len     number of bytes to put into the SGL
+                              1: FAIL - malformed or unsupported SGL, the
+                                        SGL describes less than len bytes,
+                                        or fn failed
+
+ Arguments:        PQIState* pqiDev  PQI device the SGL belongs to
+                   sglDesc* sgl      first SGL segment (from the IU)
+                   uint32_t nsgl     number of descriptors in sgl
+                   uint32_t len      number of bytes to walk
+                   SglBlockFn fn     called for every data block
+                   void* opaque      passed to fn
 
  Reference: T10/2240-D, PQI specification, section 7.3 and Annex A
  ****************************************************************************/
-uint32_t copy_to_sgl(sglDesc* sgl, uint8_t* pData, uint32_t len) {
-	return copy_sgl(sgl,pData,len,1);
-}
-uint32_t copy_from_sgl(sglDesc* sgl, uint8_t* pData, uint32_t len) {
-	return copy_sgl(sgl,pData,len,0);
-}
-uint32_t copy_sgl(sglDesc* sgl, uint8_t* pData, uint32_t len,uint8_t direction) {
-
-    hwaddr sglAddr;
-    uint32_t sglSegmentCount=2;
-    uint32_t sglDescSize=16;
-
-    SOP_LOG_DBG("%s()", __func__);
-
+static uint32_t walk_sgl(PQIState* pqiDev, sglDesc* sgl, uint32_t nsgl, uint32_t len,
+        SglBlockFn fn, void *opaque) {
+
+    sglDesc* seg = sgl;
+    sglDesc* table = NULL;
+    uint32_t count = nsgl;
+    uint32_t index = 0;
+    uint32_t nseg = 0;
+    uint32_t dlen;
+    hwaddr addr;
+    sglDesc* d;
     int last = false;
-    sglDesc* currentSgl = sgl;
-    int sgl_seg_index = 0;
-
-    // TODO: add error handling...
-    //       The following code assumes no errors (assumes properly build SGL lists)
 
     while (len) {
-    	if (sgl_seg_index >= sglSegmentCount) {
-    		// ran out of sgl segments with more data to xfer?
-    		goto sgl_too_small_error;
-    	}
-
-        SOP_LOG_DBG("%s():sgl desc = 0x%08x 0x%08x 0x%08x 0x%08x", __func__,
-        		((uint32_t*)&(currentSgl[sgl_seg_index]))[0],
-        		((uint32_t*)&(currentSgl[sgl_seg_index]))[1],
-        		((uint32_t*)&(currentSgl[sgl_seg_index]))[2],
-        		((uint32_t*)&(currentSgl[sgl_seg_index]))[3]);
-        SOP_LOG_DBG("type = %hhx, 'zero' = %hhx", currentSgl[sgl_seg_index].type, currentSgl[sgl_seg_index].zero);
-
-        switch ( currentSgl[sgl_seg_index].type )
-        {
-        case SGL_DATA_BLOCK:                        // SGL type that transfers data
-            if (currentSgl[sgl_seg_index].zero == 0) {
-
-                sglAddr = currentSgl[sgl_seg_index].desc.data.address;   // Data Address
-
-                // transfer data (some or all) to destination buffer
-                SOP_LOG_DBG("%s():writing 0x%08x bytes to 0x%16llx", __func__, currentSgl[sgl_seg_index].desc.data.length, (long long unsigned)sglAddr);
-                if (direction) {
-                	pqi_dma_mem_write(sglAddr, pData, (int)currentSgl[sgl_seg_index].desc.data.length);
-                } else {
-                	pqi_dma_mem_read(sglAddr, pData, (int)currentSgl[sgl_seg_index].desc.data.length);
-                }
-                pData += currentSgl[sgl_seg_index].desc.data.length;
 
-                if (len >= currentSgl[sgl_seg_index].desc.data.length) {
-
-                    len -= currentSgl[sgl_seg_index].desc.data.length;
-
-                } else {
-
-                    goto data_length_error;
-                }
-
-                ++sgl_seg_index;             // next SGL
+        if (index >= count) {
+            SOP_LOG_ERR("%s(): sgl describes buffer thats too small", __func__);
+            goto walk_error;
+        }
 
-            } else {
+        d = &seg[index++];
+        if (d->zero != 0) {
+            SOP_LOG_ERR("%s(): sgl type 0x%x, zero field is not zero", __func__, d->type);
+            goto walk_error;
+        }
 
-                goto sgl_data_block_zero_byte_error;
+        switch (d->type) {
+        case SGL_DATA_BLOCK:
+        case SGL_BIT_BUCKET:
+            addr = le64_to_cpu(d->desc.data.address);
+            dlen = MIN(le32_to_cpu(d->desc.data.length), len);
+            if (fn(opaque, addr, dlen, d->type == SGL_BIT_BUCKET)) {
+                goto walk_error;
             }
+            len -= dlen;
             break;
 
-        case SGL_STANDARD_SEGMENT:                  // SGL type that points to another SGL segment
-        	if (last) {
-        		// This type of descriptor is not allowed in the SGL_STANDARD_LAST_SEGMENT
-        		goto bad_last_sgl_error;
-        	}
-            if (currentSgl[sgl_seg_index].zero == 0) {                   // (points to a list of SGLs)
-
-                if (currentSgl != sgl)
-                    free(currentSgl);
+        case SGL_STANDARD_SEGMENT:
+        case SGL_STANDARD_LAST_SEGMENT:
+            if (last) {
+                SOP_LOG_ERR("%s(): segment descriptor in the last segment", __func__);
+                goto walk_error;
+            }
+            addr = le64_to_cpu(d->desc.std.address);
+            dlen = le32_to_cpu(d->desc.std.length);
+            last = (d->type == SGL_STANDARD_LAST_SEGMENT);
+
+            if (dlen == 0 || dlen % sizeof(sglDesc) || dlen > SOP_MAX_SGL_SEGMENT_LEN ||
+                    ++nseg > SOP_MAX_SGL_SEGMENTS) {
+                SOP_LOG_ERR("%s(): bad sgl segment, length 0x%x", __func__, dlen);
+                goto walk_error;
+            }
 
-                SOP_LOG_DBG("std download sgl segment");
+            // fetch the whole next segment table at once
+            table = g_realloc(table, dlen);
+            pci_dma_read(&pqiDev->dev, addr, table, dlen);
+            seg = table;
+            count = dlen / sizeof(sglDesc);
+            index = 0;
+            break;
 
-                sglSegmentCount = currentSgl[sgl_seg_index].desc.std.length / sglDescSize;
+        default:
+            // alternative last segment and vendor specific descriptors
+            SOP_LOG_ERR("%s(): unsupported sgl type 0x%x", __func__, d->type);
+            goto walk_error;
+        }
+    }
 
-                currentSgl = download_sgl_segment(currentSgl[sgl_seg_index].desc.std.address,
-                		currentSgl[sgl_seg_index].desc.std.length); // point to the next descriptor segment
+    g_free(table);
+    return (SUCCESS);
 
-                if (currentSgl == NULL) {
-                	goto sgl_segment_error;
-                }
+    walk_error:
+        g_free(table);
+        return (FAIL);
+}
 
-                sgl_seg_index = 0; // Reset our position in the SGL segment
 
-                continue;
+typedef struct SglCopy {
 
-            } else {
+    PQIState* pqiDev;
+    uint8_t* pData;
+    DMADirection dir;
 
-                goto sgl_std_seg_zero_byte_error;
-            }
-            break;
+} SglCopy;
 
-        case SGL_STANDARD_LAST_SEGMENT:             // SGL type that determines the next SGL is the last one...
-        	if (last) {
-        		// This type of descriptor is not allowed in the SGL_STANDARD_LAST_SEGMENT
-        		goto bad_last_sgl_error;
-        	}
-            if (currentSgl[sgl_seg_index].zero == 0) {
+static int copy_sgl_block(void *opaque, hwaddr addr, uint32_t len, bool bit_bucket) {
 
-                if (currentSgl != sgl)
-                    free(currentSgl);
+    SglCopy* c = opaque;
 
-                SOP_LOG_DBG("stdlast download sgl segment");
+    // a bit bucket skips that much of the data
+    if (!bit_bucket) {
+        pci_dma_rw(&c->pqiDev->dev, addr, c->pData, len, c->dir);
+    }
+    c->pData += len;
+    return 0;
+}
 
-                sglSegmentCount = currentSgl[sgl_seg_index].desc.std.length / sglDescSize;
+/*****************************************************************************
+ Function:         copy_to_sgl / copy_from_sgl
+ Description:      common function to put/take data to/from an SGL
+ Return Type:      uint32_t - 0: SUCCESS
+                              1: FAIL - see walk_sgl()
 
-                currentSgl = download_sgl_segment(currentSgl[sgl_seg_index].desc.std.address,
-                		currentSgl[sgl_seg_index].desc.std.length); // point to the next descriptor segment
+ Arguments:        PQIState* pqiDev  PQI device the SGL belongs to
+                   sglDesc* sgl      SGL to put data into
+                   uint32_t nsgl     number of descriptors in sgl
+                   uint8_t* pData    data to put into SGL
+                   uint32_t len      number of bytes to put into the SGL
 
-                if (currentSgl == NULL) {
-                	goto sgl_segment_error;
-                }
+ Reference: T10/2240-D, PQI specification, section 7.3 and Annex A
+ ****************************************************************************/
+uint32_t copy_to_sgl(PQIState* pqiDev, sglDesc* sgl, uint32_t nsgl, uint8_t* pData, uint32_t len) {
+	return copy_sgl(pqiDev, sgl, nsgl, pData, len, 1);
+}
+uint32_t copy_from_sgl(PQIState* pqiDev, sglDesc* sgl, uint32_t nsgl, uint8_t* pData, uint32_t len) {
+	return copy_sgl(pqiDev, sgl, nsgl, pData, len, 0);
+}
+uint32_t copy_sgl(PQIState* pqiDev, sglDesc* sgl, uint32_t nsgl, uint8_t* pData, uint32_t len,
+        uint8_t direction) {
 
-                sgl_seg_index = 0; // Reset our position in the SGL segment
+    SglCopy c = {
+        .pqiDev = pqiDev,
+        .pData = pData,
+        .dir = direction ? DMA_DIRECTION_FROM_DEVICE : DMA_DIRECTION_TO_DEVICE,
+    };
 
-                last = true;                  // tell the processing for the next descriptor to end it all...
+    SOP_LOG_DBG("%s()", __func__);
 
-            } else {
+    return walk_sgl(pqiDev, sgl, nsgl, len, copy_sgl_block, &c);
+}
 
-                goto sgl_std_last_seg_zero_byte_error;
-            }
-            break;
 
-        case SGL_ALTERNATIVE_LAST_SEGMENT:
-        	if (last) {
-        		goto bad_last_sgl_error;
-        	}
-            sglAddr = sgl->desc.altLast.address;
-            break;
+static int map_sgl_block(void *opaque, hwaddr addr, uint32_t len, bool bit_bucket) {
 
-        case SGL_BIT_BUCKET:
-            if (currentSgl[sgl_seg_index].zero == 0) {
-                if (direction) {
-                	// to sgl
-                    pData += currentSgl[sgl_seg_index].desc.data.length;
-                } else {
-                	// from sgl -- ignore
-                }
-            	++sgl_seg_index;
-            } else {
-
-                goto sgl_bit_bucket_zero_byte_error;
-            }
-            break;
+    QEMUSGList* qsg = opaque;
 
-        case VENDOR_SPECIFIC:
-            // TODO: put in Vendor-specific & illegal SGL type handling
-            goto vendor_sgl_error;
-            break;
-        default:
-            // TODO: put in Vendor-specific & illegal SGL type handling
-            // goto vendor_sgl_error;
-            goto sgl_type_error;
-            break;
-        }
+    // the block layer has nowhere to send (or take) bit bucket data
+    if (bit_bucket) {
+        SOP_LOG_ERR("%s(): bit bucket in a media access sgl", __func__);
+        return -1;
     }
-
-    return (SUCCESS);
-
-    sgl_bit_bucket_zero_byte_error:
-        SOP_LOG_ERR("Error. BitBucket sgl type, zero field is not zero.");
-        return (FAIL);
-    sgl_std_last_seg_zero_byte_error:
-        SOP_LOG_ERR("Error. Standard Last Segment sgl type, zero field is not zero.");
-        return (FAIL + 1);
-    sgl_std_seg_zero_byte_error:
-        SOP_LOG_ERR("Error. Standard Segment sgl type, zero field is not zero.");
-        return (FAIL + 2);
-    sgl_data_block_zero_byte_error:
-        SOP_LOG_ERR("Error. Data Block sgl type, zero field is not zero.");
-        return (FAIL + 3);
-    data_length_error:
-        SOP_LOG_ERR("Error. sgl length error.");
-        return (FAIL + 4);
-    vendor_sgl_error:
-        SOP_LOG_ERR("Error. vendor-specific sgl is not yet supported.");
-        return (FAIL + 5);
-    sgl_type_error:
-        SOP_LOG_ERR("Error. unrecognized sgl type.");
-        return (FAIL + 6);
-	bad_last_sgl_error:
-		SOP_LOG_ERR("Error. bad last sgl.");
-		return (FAIL + 7);
-	sgl_too_small_error:
-		SOP_LOG_ERR("Error. sgl describes buffer thats too small.");
-		return (FAIL + 8);
-	sgl_segment_error:
-		SOP_LOG_ERR("Error. bad sgl segment.");
-		return (FAIL + 9);
-
+    qemu_sglist_add(qsg, addr, len);
+    return 0;
 }
 
-sglDesc * download_sgl_segment(hwaddr address, uint32_t len) {
-    // Return null if the length is bad (not a multiple of sglDesc size)
-	SOP_LOG_DBG("%s():downloading from 0x%16llx (0x%08x bytes)", __func__, (long long unsigned)address, len);
-    if (len % sizeof(sglDesc) != 0)
-        return NULL;
+/*****************************************************************************
+ Function:         map_sgl
+ Description:      builds a QEMUSGList describing the guest buffers of an
+                   SGL, so the block layer can DMA straight to/from them
+ Return Type:      uint32_t - 0: SUCCESS
+                              1: FAIL - see walk_sgl(), or the SGL holds
+                                        a bit bucket
+                   On failure qsg is left destroyed.
+
+ Arguments:        PQIState* pqiDev  PQI device the SGL belongs to
+                   QEMUSGList* qsg   list to initialize and fill
+                   sglDesc* sgl      first SGL segment (from the IU)
+                   uint32_t nsgl     number of descriptors in sgl
+                   uint32_t len      number of bytes to map
+ ****************************************************************************/
+uint32_t map_sgl(PQIState* pqiDev, QEMUSGList* qsg, sglDesc* sgl, uint32_t nsgl, uint32_t len) {
 
-    // Otherwise download it from the host
-    sglDesc * sgl_buffer = (sglDesc *)malloc(len);
-    pqi_dma_mem_read(address, (uint8_t*)sgl_buffer, len);
-    
-    //print_bytes("new sgl segment",sgl_buffer,len);
+    pci_dma_sglist_init(qsg, &pqiDev->dev, nsgl);
 
-    return sgl_buffer;
+    if (walk_sgl(pqiDev, sgl, nsgl, len, map_sgl_block, qsg) != SUCCESS) {
+        qemu_sglist_destroy(qsg);
+        return (FAIL);
+    }
+    return (SUCCESS);
 }
-
-
-
-
@@ -19,79 +19,99 @@
  * along with this program; if not, see <http://www.gnu.org/licenses/>.
  */
 #include "sop.h"
+#include "block/coroutine.h"
 
 
-// Process IQ event (Host writing to IQ PI)
+// IQ doorbell (Host writing to IQ PI)
+//  - only schedules the queue's bottom half, so the vCPU that wrote the
+//    doorbell goes straight back to the guest; the IUs are fetched from
+//    the main loop by pqi_iq_bh()
+
+void pqi_kick_iq(PQIState* pqiDev, uint32_t qid) {
+
+    if (qid >= PQI_MAX_QS_ALLOCATED) {
+
+        SOP_LOG_ERR("%s(): bad qid %d", __func__, qid);
+        return;
+    }
+
+    qemu_bh_schedule(pqiDev->iq[qid].bh);
+}
+
+
+void pqi_iq_bh(void *opaque) {
+
+    PQIInboundQueue* iq = opaque;
+
+    process_iq_event(iq->pqiDev, iq->index);
+}
+
+
+// Process IQ event
+//  - fetches at most iq_batch IUs, then hands the CI back to the host
+//    once and yields to the other queues if more IUs are waiting
 
 void process_iq_event(PQIState* pqiDev, uint32_t qid) {
     
     uint16_t ci;
     uint16_t pi;
+    uint32_t count = 0;
+    PQIInboundQueue* iq = &pqiDev->iq[qid];
+    PQIOutboundQueue* oq = &pqiDev->oq[qid];
 
     SOP_LOG_NORM("%s(): called. qid=%d", __func__,qid);
 
-    if(qid == AIQ_ID) {
-        
-        PQIInboundQueue* iq = &pqiDev->iq[AIQ_ID];
-
-        // nab IQ CI & IQ PI
-        SOP_LOG_NORM("%s(): qid:%d before getting ci", __func__,qid);
-        ci = get_iq_ci(pqiDev, qid);
-        SOP_LOG_NORM("%s(): qid:%d ci = %i", __func__, qid, ci);
-        pi = get_iq_pi(pqiDev, qid);
-
-        SOP_LOG_NORM("%s(): qid:%d pi = %i", __func__, qid, pi);
+    if (iq->size == 0) {
 
-        while ( ci != pi ) {
+        // deleted (or reset) since the doorbell was rung
+        return;
+    }
 
-            //  process admin queue while inbound IUs exist
+    // nab IQ CI & IQ PI
+    ci = get_iq_ci(pqiDev, qid);
+    pi = get_iq_pi(pqiDev, qid);
 
-            SOP_LOG_NORM("%s(): qid = %d, ci = %d", __func__, qid, ci);
+    SOP_LOG_NORM("%s(): qid:%d ci = %i pi = %i", __func__, qid, ci, pi);
 
-            sop_execute_admin_command(pqiDev, iq, ci);
+    if (ci == pi) {
+        return;
+    }
 
-            if(++ci >= iq->size) {
+    while ( ci != pi && count++ < pqiDev->iq_batch ) {
 
-                ci = 0;     // queue wrap condition
-            }
+        if (oq->size && oq->nr_pending >= oq->size) {
 
-            iq->ci_work = iq->ci_local = ci;
-            set_iq_ci(pqiDev, qid, ci);
+            // the OQ is full and a queue's worth of responses is waiting:
+            // stop fetching until pqi_oq_bh() drains it
+            iq->held = true;
+            break;
         }
 
-        // TODO: send interrupt to host here?
-    
-    } else {
-
-        // process operational queues    
-        SOP_LOG_NORM("Warning: Processing Operational IQ %d is not supported yet", qid);
-        PQIInboundQueue* iq = &pqiDev->iq[qid];
-
-         // nab IQ CI & IQ PI
-         SOP_LOG_NORM("%s(): qid:%d before getting ci", __func__,qid);
-         ci = get_iq_ci(pqiDev, qid);
-         SOP_LOG_NORM("%s(): qid:%d ci = %i", __func__, qid, ci);
-         pi = get_iq_pi(pqiDev, qid);
+        SOP_LOG_NORM("%s(): qid = %d, ci = %d", __func__, qid, ci);
 
-         SOP_LOG_NORM("%s(): qid:%d pi = %i", __func__, qid, pi);
+        if(qid == AIQ_ID) {
 
-         while ( ci != pi ) {
+            sop_execute_admin_command(pqiDev, iq, ci);
+            ++ci;
 
-             //  process admin queue while inbound IUs exist
+        } else {
 
-             SOP_LOG_NORM("%s(): qid = %d, ci = %d", __func__, qid, ci);
+            // an IU may take up several elements
+            ci += sop_execute_sop_command(pqiDev, qid, ci);
+        }
 
-             sop_execute_sop_command(pqiDev, qid, ci);
+        if(ci >= iq->size) {
 
-             if(++ci >= iq->size) {
+            ci -= iq->size;     // queue wrap condition
+        }
+    }
 
-                 ci = 0;     // queue wrap condition
-             }
+    iq->ci_work = iq->ci_local = ci;
+    set_iq_ci(pqiDev, qid, ci);
 
-             iq->ci_work = iq->ci_local = ci;
-             set_iq_ci(pqiDev, qid, ci);
-         }
+    if (ci != pi && !iq->held) {
 
+        qemu_bh_schedule(iq->bh);
     }
 }
 
@@ -108,15 +128,21 @@ void process_oq_event(PQIState* pqiDev, uint32_t qid) {
         // nab OQ CI (actual) & copy to device's local OQ CI
         pqiDev->oq[AOQ_ID].ci = get_oq_ci(pqiDev, qid);
 
-        // TODO: call to process inbound queue
-        //        (possibly waiting for this queue to have room...)
-
-    } else {
+    } else if (qid < PQI_MAX_QS_ALLOCATED) {
 
         // process operational queues    
-        //SOP_LOG_ERR("Processing Operational OQ %d not supported yet", qid);
         // nab OQ CI (actual) & copy to device's local OQ CI
-        pqiDev->oq[qid].ci = get_oq_ci(pqiDev, qid);
+        pqiDev->oq[qid].ci = (uint16_t)pqi_cntrl_read_config(pqiDev, PQI_OQ_CI_REG(qid), DWORD);
+
+    } else {
+
+        return;
+    }
+
+    // room was made: post the responses held back
+    if (pqiDev->oq[qid].nr_pending) {
+
+        qemu_bh_schedule(pqiDev->oq[qid].bh);
     }
 }
 
@@ -226,286 +252,850 @@ void set_oq_pi(PQIState* pqiDev, uint16_t qid, uint16_t piVal) {
 }
 
 
-// post the response 
+// post the response
+//  - responses are queued and written out by pqi_oq_bh(), which holds
+//    them while the OQ is full and posts everything that fits with a
+//    single PI update
+
 void post_to_oq (PQIState* pqiDev, int qid, void *iu, int length) {
 
+    PQIOutboundQueue* oq = &pqiDev->oq[qid];
+    SopPendingRsp* rsp;
+
+    SOP_LOG_DBG("%s(): called. qid=%d", __func__, qid);
+
+    if (oq->size == 0) {
+
+        SOP_LOG_ERR("%s(): OQ %d does not exist, response dropped", __func__, qid);
+        return;
+    }
+
+    rsp = g_malloc(sizeof(*rsp) + length);
+    rsp->length = length;
+    memcpy(rsp->iu, iu, length);
+    QSIMPLEQ_INSERT_TAIL(&oq->pending, rsp, entry);
+    oq->nr_pending++;
+
+    qemu_bh_schedule(oq->bh);
+}
+
+
+void pqi_oq_bh(void *opaque) {
+
+    PQIOutboundQueue* oq = opaque;
+    PQIState* pqiDev = oq->pqiDev;
+    uint16_t qid = oq->index;
+    PQIInboundQueue* iq = &pqiDev->iq[qid];
+    SopPendingRsp* rsp;
+    uint16_t posted = 0;
     uint16_t ci;
     uint16_t pi;
-    hwaddr addr;
-    PQIOutboundQueue* oq;
-
+    uint16_t next;
 
-    oq = &pqiDev->oq[qid];
+    if (oq->size == 0) {
 
-    SOP_LOG_DBG("%s(): called. msixEntry=%d", __func__,oq->msixEntry);
+        pqi_oq_discard(pqiDev, qid);
+        return;
+    }
 
-    // nab OQ PI & IQ CI
+    // nab OQ PI & OQ CI
     pi = get_oq_pi(pqiDev, qid);
     ci = get_oq_ci(pqiDev, qid);
 
-    // TODO: what to do when the outbound queue is full ?? (start timer)
-    //
-    // if (pi == ci) { ??? }
+    while ((rsp = QSIMPLEQ_FIRST(&oq->pending)) != NULL) {
 
-    SOP_LOG_DBG("%s(): qid = %d, pi = %d, ci = %d", __func__, qid, pi, ci);
+        next = pi + 1;
+        if (next >= oq->size) {
 
-    addr = (hwaddr)(oq->ea_addr + (pi * oq->length));
-    
-    pqi_dma_mem_write(addr, (uint8_t*)iu, length);
+            next = 0;     // queue wrap condition
+        }
+
+        if (next == ci) {
+
+            // full: the rest waits for the host to move the CI
+            SOP_LOG_DBG("%s(): OQ %d full, %u responses held", __func__, qid, oq->nr_pending);
+            break;
+        }
+
+        pqi_dma_mem_write((hwaddr)(oq->ea_addr + (pi * oq->length)), rsp->iu,
+                MIN(rsp->length, oq->length));
+
+        QSIMPLEQ_REMOVE_HEAD(&oq->pending, entry);
+        oq->nr_pending--;
+        g_free(rsp);
+        pi = next;
+        posted++;
+    }
+
+    if (posted) {
+
+        oq->pi_work = oq->pi_local = pi;
+        set_oq_pi(pqiDev, qid, pi);
+
+        oq->unsignalled += posted;
+        pqi_oq_signal(pqiDev, qid);
+    }
+
+    // the IQ stopped fetching while this OQ was backed up
+    if (iq->held && oq->nr_pending < oq->size) {
 
-    SOP_LOG_DBG("%s(): %s", __func__, "Wrote entry");
-    if(++pi >= oq->size) {
+        iq->held = false;
+        pqi_kick_iq(pqiDev, qid);
+    }
+}
+
+
+// Raises the OQ's interrupt once coCount responses are waiting for it,
+// or maxCoTime after the first of them was posted. A coCount of 0 or 1,
+// or a maxCoTime of 0, interrupts for every batch. minCoTime is ignored.
+
+void pqi_oq_signal(PQIState* pqiDev, uint32_t qid) {
 
-        pi = 0;     // queue wrap condition
+    PQIOutboundQueue* oq = &pqiDev->oq[qid];
+
+    if (!oq->unsignalled) {
+
+        return;
     }
 
-    oq->pi_work = oq->pi_local = pi;
-    SOP_LOG_DBG("%s(): %s", __func__, "Going to write pi");
-    set_oq_pi(pqiDev, qid, pi);
+    if (oq->coCount <= 1 || oq->maxCoTime == 0 || oq->unsignalled >= oq->coCount) {
 
-    //if (oq->irq_enabled) {
+        qemu_del_timer(oq->timer);
+        oq->unsignalled = 0;
         msix_notify(&(pqiDev->dev), oq->msixEntry);
-    //}
+
+    } else if (!qemu_timer_pending(oq->timer)) {
+
+        qemu_mod_timer(oq->timer, qemu_get_clock_ns(vm_clock) +
+                (int64_t)oq->maxCoTime * SCALE_US);
+    }
+}
+
+
+void pqi_oq_timer(void *opaque) {
+
+    PQIOutboundQueue* oq = opaque;
+
+    if (oq->unsignalled) {
+
+        oq->unsignalled = 0;
+        msix_notify(&(oq->pqiDev->dev), oq->msixEntry);
+    }
+}
+
+
+// Drops the responses not posted yet (queue deleted or reset)
+
+void pqi_oq_discard(PQIState* pqiDev, uint32_t qid) {
+
+    PQIOutboundQueue* oq = &pqiDev->oq[qid];
+    SopPendingRsp* rsp;
+
+    while ((rsp = QSIMPLEQ_FIRST(&oq->pending)) != NULL) {
+
+        QSIMPLEQ_REMOVE_HEAD(&oq->pending, entry);
+        g_free(rsp);
+    }
+    oq->nr_pending = 0;
+    oq->unsignalled = 0;
+    qemu_del_timer(oq->timer);
+    pqiDev->iq[qid].held = false;
+}
+
+
+// UNMAP and WRITE SAME are cut into block layer calls of at most this
+// many sectors. Without native zeroing the block layer writes a zeroed
+// bounce buffer as large as the call, so write zeroes takes small pieces;
+// discards need no buffer.
+#define SOP_DISCARD_SECTORS (1 << 20)
+#define SOP_ZERO_SECTORS (4 << (20 - BDRV_SECTOR_BITS))
+
+// Size of the bounce buffer WRITE SAME replicates a non-zero block into
+#define SOP_WRITE_SAME_BUF_SIZE (64 * 1024)
+
+static void sop_post_success(PQIState* pqiDev, uint32_t qid, uint16_t request_id) {
+
+	sopSuccessRsp rsp;
+
+	memset(&rsp, 0, sizeof(rsp));
+	rsp.header.type=0x90;
+	rsp.header.feat=0;
+	rsp.header.length=0x000c;
+	rsp.requestIdentifier=request_id;
+	rsp.qisd = qid;
+
+	post_to_oq(pqiDev, qid, (void *)&rsp, sizeof(sopSuccessRsp));
+}
+
+static void sop_post_check_condition(PQIState* pqiDev, uint32_t qid, uint16_t request_id) {
+
+	sopCommandRspIU ersp;
+
+	memset(&ersp, 0, sizeof(ersp));
+	ersp.header.type=SOP_CMD_RSP_IU;
+	ersp.header.feat=0;
+	ersp.header.length=0x0010;
+	ersp.request_id=request_id;
+	ersp.queue_id = qid;
+	ersp.status = SOP_CHECK_CONDITION;
+	ersp.qualifier = SOP_ILLEGAL_REQUEST;
+
+	post_to_oq(pqiDev, qid, (void *)&ersp, sizeof(sopCommandRspIU));
 }
 
+// Decodes a single level LUN (SAM-5, 4.7) in peripheral device or flat
+// space addressing. Returns NULL if no such LUN exists.
+static DiskInfo* sop_lookup_lun(PQIState* pqiDev, const uint8_t* lun) {
 
-void sop_execute_sop_command(PQIState* pqiDev, uint32_t qid, uint16_t ci) {
+	uint32_t id;
+	int i;
+
+	for (i = 2; i < 8; i++) {
+		if (lun[i]) {
+			return NULL;
+		}
+	}
 
-    uint8_t iu_type;
-    uint8_t compatible_features;
+	switch (lun[0] >> 6) {
+	case 0:		// peripheral device addressing, bus 0 only
+		if (lun[0] & 0x3f) {
+			return NULL;
+		}
+		id = lun[1];
+		break;
+	case 1:		// flat space addressing
+		id = ((lun[0] & 0x3f) << 8) | lun[1];
+		break;
+	default:
+		return NULL;
+	}
+
+	return (id < pqiDev->num_luns) ? &pqiDev->disk[id] : NULL;
+}
+
+// Returns the number of IQ elements the IU occupied
+uint16_t sop_execute_sop_command(PQIState* pqiDev, uint32_t qid, uint16_t ci) {
+
+    iuHeader hdr;
     uint16_t iu_length;
+    uint16_t nelem;
+    uint16_t i;
     uint8_t* cdb;
+    DiskInfo* disk;
+    sopLimitedCommandIU lr;
+    sopLimitedCommandIU* r;
 
     PQIInboundQueue* iq = &pqiDev->iq[qid];
 
     SOP_LOG_NORM("%s(): called", __func__);
 
-    uint8_t iu [iq->length];
-    pqi_dma_mem_read(iq->ea_addr + (ci * iq->length), iu, iq->length);
+    pqi_dma_mem_read(iq->ea_addr + (ci * iq->length), (uint8_t*)&hdr, sizeof(hdr));
+    iu_length = le16_to_cpu(hdr.length);
 
-    iu_type = (uint8_t)(iu)[0];
-    compatible_features = (uint8_t)(iu)[1];
-    iu_length = (uint16_t)(iu)[2];
+    SOP_LOG_NORM("%s(): iutype = %x, iu_length = %x", __func__, hdr.type, iu_length);
 
-    SOP_LOG_NORM("%s(): iutype = %x, iu_length = %x", __func__, iu_type,iu_length);
-
-    if ((iu_type == 0) && (compatible_features == 0) && (iu_length == 0)) {
+    if ((hdr.type == 0) && (hdr.feat == 0) && (iu_length == 0)) {
 
         // NULL IU
-        return;
+        return 1;
     }
 
-    if ((iu_type == SOP_LIMITED_CMD_IU)) {
-    	// TBD: LIMITED_OMMAND_IU implies lun 0 is targeted, need to add
-    	// support for COMMAND_IU, which includes a 64-bit LOGICAL_UNIT_NUMBER
-        cdb = &iu[16];
-        SOP_LOG_NORM("%s(): cdb_type=%d",__func__,cdb[0]);
-        switch ( cdb[0] )
-        {
-        case OP_INQUIRY:
-            sop_cdb_inquiry(pqiDev, qid, (sopLimitedCommandIU *)iu);
-            break;
-        case OP_TEST_UNIT_READY:
-            sop_cdb_test_unit_ready(pqiDev, qid, (sopLimitedCommandIU *)iu);
-            break;
-        case OP_READ_CAPACITY:
-            sop_cdb_read_capacity(pqiDev, qid, (sopLimitedCommandIU *)iu);
-            break;
-        case OP_READ_10:
-        	sop_cdb_read_10(pqiDev, qid, (sopLimitedCommandIU *)iu);
-        	break;
-        case OP_WRITE_10:
-        	sop_cdb_write_10(pqiDev, qid, (sopLimitedCommandIU *)iu);
-        	break;
+    // an IU longer than the element length spills into the next elements
+    nelem = DIV_ROUND_UP(iu_length + sizeof(iuHeader), iq->length);
+    if (nelem >= iq->size) {
+        SOP_LOG_ERR("Error. IU length 0x%x does not fit IQ %d", iu_length, qid);
+        return 1;
+    }
 
-        default:
-            SOP_LOG_ERR("Error. Invalid/unsupported: 0x%x", cdb[0]);
-            break;
+    uint8_t iu [nelem * iq->length];
+    for (i = 0; i < nelem; i++) {
+        pqi_dma_mem_read(iq->ea_addr + (((ci + i) % iq->size) * iq->length),
+                iu + (i * iq->length), iq->length);
+    }
+
+    if (hdr.type == SOP_CMD_IU) {
+
+        sopCommandIU* c = (sopCommandIU *)iu;
+
+        if (iu_length + sizeof(iuHeader) < sizeof(sopCommandIU)) {
+            SOP_LOG_ERR("Error. Short command IU, length 0x%x", iu_length);
+            return nelem;
         }
-        return;
+
+        // handlers take the limited IU layout, the LUN is passed separately
+        memset(&lr, 0, sizeof(lr));
+        lr.header = c->header;
+        lr.queue_id = c->queue_id;
+        lr.work_area = c->work_area;
+        lr.request_id = c->request_id;
+        lr.direction = c->direction;
+        lr.partial = c->partial;
+        lr.xfer_size = c->xfer_size;
+        memcpy(lr.cdb, c->cdb, sizeof(lr.cdb));
+        memcpy(lr.sg, c->sg, sizeof(lr.sg));
+        r = &lr;
+        disk = sop_lookup_lun(pqiDev, c->lun);
+
+    } else if (hdr.type == SOP_LIMITED_CMD_IU) {
+
+        // a limited command IU always targets LUN 0
+        r = (sopLimitedCommandIU *)iu;
+        disk = &pqiDev->disk[0];
+
+    } else {
+
+        SOP_LOG_ERR("Error. Invalid/unsupported IU type: 0x%x", hdr.type);
+        return nelem;
+    }
+
+    cdb = r->cdb;
+    SOP_LOG_NORM("%s(): cdb_type=%d",__func__,cdb[0]);
+
+    // INQUIRY and REPORT LUNS are answered for LUNs that don't exist
+    if (disk == NULL && cdb[0] != OP_INQUIRY && cdb[0] != OP_REPORT_LUNS) {
+        SOP_LOG_ERR("Error. Command 0x%x to a LUN that does not exist", cdb[0]);
+        sop_post_check_condition(pqiDev, qid, r->request_id);
+        return nelem;
+    }
+
+    switch ( cdb[0] )
+    {
+    case OP_INQUIRY:
+        sop_cdb_inquiry(pqiDev, qid, disk, r);
+        break;
+    case OP_TEST_UNIT_READY:
+        sop_cdb_test_unit_ready(pqiDev, qid, disk, r);
+        break;
+    case OP_READ_CAPACITY:
+        sop_cdb_read_capacity(pqiDev, qid, disk, r);
+        break;
+    case OP_SERVICE_ACTION_IN_16:
+        sop_cdb_read_capacity_16(pqiDev, qid, disk, r);
+        break;
+    case OP_READ_10:
+        sop_cdb_read_10(pqiDev, qid, disk, r);
+        break;
+    case OP_WRITE_10:
+        sop_cdb_write_10(pqiDev, qid, disk, r);
+        break;
+    case OP_READ_16:
+        sop_cdb_read_16(pqiDev, qid, disk, r);
+        break;
+    case OP_WRITE_16:
+        sop_cdb_write_16(pqiDev, qid, disk, r);
+        break;
+    case OP_SYNCHRONIZE_CACHE_10:
+    case OP_SYNCHRONIZE_CACHE_16:
+        sop_cdb_synchronize_cache(pqiDev, qid, disk, r);
+        break;
+    case OP_UNMAP:
+        sop_cdb_unmap(pqiDev, qid, disk, r);
+        break;
+    case OP_WRITE_SAME_10:
+    case OP_WRITE_SAME_16:
+        sop_cdb_write_same(pqiDev, qid, disk, r);
+        break;
+    case OP_REPORT_LUNS:
+        sop_cdb_report_luns(pqiDev, qid, disk, r);
+        break;
+
+    default:
+        SOP_LOG_ERR("Error. Invalid/unsupported: 0x%x", cdb[0]);
+        sop_post_check_condition(pqiDev, qid, r->request_id);
+        break;
     }
+    return nelem;
 }
 
-void sop_cdb_inquiry(PQIState* pqiDev, uint32_t qid, sopLimitedCommandIU *r) {
+// Posts the response to a data-in command returning len bytes of buffer
+static void sop_data_in_done(PQIState* pqiDev, uint32_t qid, sopLimitedCommandIU *r,
+		uint8_t *buffer, uint32_t len) {
+
+	uint32_t rVal;
+
+	// put Info inside the SGL...
+	rVal = copy_to_sgl(pqiDev, r->sg, ARRAY_SIZE(r->sg), buffer, len);
+
+	if (rVal != 0) {
+		SOP_LOG_ERR("%s(): bad rc 0x%x from copy_to_sgl", __func__, rVal);
+		sop_post_check_condition(pqiDev, qid, r->request_id);
+		return;
+	}
+	sop_post_success(pqiDev, qid, r->request_id);
+}
+
+void sop_cdb_inquiry(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r) {
 
-	uint32_t rVal = SUCCESS;
-	sopSuccessRsp inqRsp;
 	inquiryCDB * c = (inquiryCDB *)r->cdb;
 	uint16_t len = be16_to_cpu(c->alloc_len);
-	uint8_t buffer[len];
-	int i=0;
+	uint8_t buffer[MAX(len, 64)];
+	uint32_t lbs;
 
     SOP_LOG_NORM("%s(): called", __func__);
 
-    for(i=0;i<len;i++) {
-    	buffer[i]=0x00;
+    memset(buffer, 0, sizeof(buffer));
+
+    // peripheral qualifier 3, type 0x1f: no LUN here
+    if (disk == NULL) {
+        buffer[0] = 0x7f;
     }
 
-    // put Info inside the SGL...
-	rVal = copy_to_sgl(r->sg, (uint8_t*)buffer, len);
+    if (r->cdb[1] & 0x01) {
 
-	if (rVal != 0) {
-		SOP_LOG_NORM("%s(): bad rc 0x%x from admin_build_sgl", __func__, rVal);
-	}
+        // EVPD
+        buffer[1] = c->page_code;
 
-	inqRsp.header.type=0x90;
-	inqRsp.header.feat=0;
-	inqRsp.header.length=0x000c;
-	inqRsp.requestIdentifier=r->request_id;
-	inqRsp.qisd = qid;
+        switch (c->page_code) {
+        case SOP_VPD_SUPPORTED_PAGES:
+            buffer[3] = 2;
+            buffer[4] = SOP_VPD_SUPPORTED_PAGES;
+            buffer[5] = SOP_VPD_BLOCK_LIMITS;
+            break;
 
-	post_to_oq(pqiDev, qid, (void *)&inqRsp, sizeof(sopSuccessRsp));
+        case SOP_VPD_BLOCK_LIMITS:
+            // let the host issue transfers and unmaps as large as we take
+            lbs = pqiDev->conf.logical_block_size;
+            buffer[3] = 0x3c;
+            stl_be_p(&buffer[8], SOP_MAX_XFER_BYTES / lbs);
+            stl_be_p(&buffer[12], pqiDev->conf.opt_io_size / lbs);
+            stl_be_p(&buffer[20], 0xffffffff);
+            stl_be_p(&buffer[24], SOP_MAX_UNMAP_DESCS);
+            break;
 
-}
+        default:
+            SOP_LOG_ERR("%s(): unsupported VPD page 0x%x", __func__, c->page_code);
+            sop_post_check_condition(pqiDev, qid, r->request_id);
+            return;
+        }
+    } else if (c->page_code) {
 
-void sop_cdb_test_unit_ready(PQIState* pqiDev, uint32_t qid, sopLimitedCommandIU *r) {
+        sop_post_check_condition(pqiDev, qid, r->request_id);
+        return;
 
-	sopSuccessRsp turRsp;
-    SOP_LOG_NORM("%s(): called", __func__);
+    } else {
 
-    turRsp.header.type=0x90;
-    turRsp.header.feat=0;
-    turRsp.header.length=0x000c;
-    turRsp.requestIdentifier=r->request_id;
-    turRsp.qisd = qid;
+        // standard data, the fields after the additional length byte
+        // cover bytes 5 to 35
+        buffer[2] = SOP_INQ_VERSION_SPC4;
+        buffer[3] = SOP_INQ_HISUP | SOP_INQ_RESP_FORMAT;
+        buffer[4] = SOP_INQ_STD_LEN - 5;
+        buffer[7] = SOP_INQ_CMDQUE;
+        strpadcpy((char *)&buffer[8], 8, SOP_INQ_VENDOR, ' ');
+        strpadcpy((char *)&buffer[16], 16, SOP_INQ_PRODUCT, ' ');
+        strpadcpy((char *)&buffer[32], 4, SOP_INQ_REVISION, ' ');
+    }
 
-	post_to_oq(pqiDev, qid, (void *)&turRsp, sizeof(sopSuccessRsp));
+	sop_data_in_done(pqiDev, qid, r, buffer, len);
+}
+
+void sop_cdb_test_unit_ready(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r) {
 
+    SOP_LOG_NORM("%s(): called", __func__);
+
+	sop_post_success(pqiDev, qid, r->request_id);
 }
 
-void sop_cdb_read_capacity(PQIState* pqiDev, uint32_t qid, sopLimitedCommandIU *r) {
+void sop_cdb_read_capacity(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r) {
 
-	uint32_t rVal = SUCCESS;
 	uint32_t buffer[2];
-	sopSuccessRsp rsp;
     SOP_LOG_NORM("%s(): called", __func__);
 
-	buffer[0]=cpu_to_be32(pqiDev->lun_size-1); //last lba on device
-	buffer[1]=cpu_to_be32(512); // block size
+	// a LUN with more than 2^32 blocks reports 0xffffffff, the host then
+	// uses READ CAPACITY(16)
+	buffer[0]=cpu_to_be32(MIN(disk->nb_blocks - 1, 0xffffffff)); //last lba on device
+	buffer[1]=cpu_to_be32(1 << disk->block_shift); // block size
 
 	SOP_LOG_NORM("(%s(): --sgl type:0x%x sgl addr:0x%llx , sgl length:%x",
 			__func__,r->sg[0].type,
 			(unsigned long long)le64_to_cpu(r->sg[0].desc.std.address),
 			le32_to_cpu(r->sg[0].desc.std.length));
 
-    // put Info inside the SGL...
-	rVal = copy_to_sgl(r->sg, (uint8_t*)buffer, r->xfer_size);
+	sop_data_in_done(pqiDev, qid, r, (uint8_t*)buffer, sizeof(buffer));
+}
 
-	if (rVal != 0) {
-		SOP_LOG_NORM("%s(): bad rc 0x%x from admin_build_sgl", __func__, rVal);
+void sop_cdb_read_capacity_16(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r) {
+
+	readCapacity16CDB * c = (readCapacity16CDB *)r->cdb;
+	readCapacity16Data data;
+	uint32_t pbs = pqiDev->conf.physical_block_size;
+
+	SOP_LOG_NORM("%s(): called", __func__);
+
+	if ((c->service_action & 0x1f) != SAI_READ_CAPACITY_16) {
+		SOP_LOG_ERR("%s(): unsupported service action 0x%x", __func__, c->service_action);
+		sop_post_check_condition(pqiDev, qid, r->request_id);
+		return;
 	}
 
-	rsp.header.type=0x90;
-	rsp.header.feat=0;
-	rsp.header.length=0x000c;
-	rsp.requestIdentifier=r->request_id;
-	rsp.qisd = qid;
+	memset(&data, 0, sizeof(data));
+	data.last_lba = cpu_to_be64(disk->nb_blocks - 1);
+	data.block_len = cpu_to_be32(1 << disk->block_shift);
+	if (pbs > (1U << disk->block_shift)) {
+		data.lbppbe = ctz32(pbs) - disk->block_shift;
+	}
+	data.lowest_aligned = cpu_to_be16(SOP_RC16_LBPME);
 
-	post_to_oq(pqiDev, qid, (void *)&rsp, sizeof(sopSuccessRsp));
+	sop_data_in_done(pqiDev, qid, r, (uint8_t*)&data,
+			MIN(be32_to_cpu(c->alloc_len), sizeof(data)));
+}
+
+void sop_cdb_report_luns(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r) {
 
+	reportLunsCDB * c = (reportLunsCDB *)r->cdb;
+	uint32_t alloc_len = be32_to_cpu(c->alloc_len);
+	uint32_t len = 8 + 8 * pqiDev->num_luns;
+	uint8_t *buffer;
+	uint32_t i;
+
+	SOP_LOG_NORM("%s(): called", __func__);
+
+	if (alloc_len < 16) {
+		sop_post_check_condition(pqiDev, qid, r->request_id);
+		return;
+	}
+
+	// LUN numbers are below 256, so peripheral device addressing does
+	buffer = g_malloc0(len);
+	stl_be_p(buffer, 8 * pqiDev->num_luns);
+	for (i = 0; i < pqiDev->num_luns; i++) {
+		buffer[8 + 8 * i + 1] = i;
+	}
+
+	sop_data_in_done(pqiDev, qid, r, buffer, MIN(alloc_len, len));
+	g_free(buffer);
 }
 
-void sop_cdb_read_10(PQIState* pqiDev, uint32_t qid, sopLimitedCommandIU *r) {
+static inline int64_t sop_sector(DiskInfo *disk, uint64_t lba) {
+
+	return (disk->start_block + lba) << (disk->block_shift - BDRV_SECTOR_BITS);
+}
+
+static bool sop_lba_range_ok(DiskInfo *disk, uint64_t lba, uint64_t nlb) {
+
+	return nlb <= disk->nb_blocks && lba <= disk->nb_blocks - nlb;
+}
+
+static SopRequest *sop_new_request(PQIState* pqiDev, uint32_t qid, DiskInfo *disk,
+		sopLimitedCommandIU *r) {
+
+	SopRequest *req = g_new0(SopRequest, 1);
+
+	req->pqiDev = pqiDev;
+	req->disk = disk;
+	req->qid = qid;
+	req->request_id = r->request_id;
+	req->opcode = r->cdb[0];
+	return req;
+}
+
+// Posts the response of a media access command and frees it
+static void sop_req_complete(SopRequest *req, int ret) {
+
+	if (ret < 0) {
+		SOP_LOG_ERR("%s(): opcode 0x%x error %d, lun %d", __func__,
+				req->opcode, ret, req->disk->lunid);
+		sop_post_check_condition(req->pqiDev, req->qid, req->request_id);
+	} else {
+		sop_post_success(req->pqiDev, req->qid, req->request_id);
+	}
+
+	qemu_sglist_destroy(&req->qsg);
+	g_free(req->buf);
+	g_free(req);
+}
+
+// AIO completion of READ/WRITE and SYNCHRONIZE CACHE
+static void sop_req_cb(void *opaque, int ret) {
+
+	SopRequest *req = opaque;
+
+	bdrv_acct_done(req->pqiDev->conf.bs, &req->acct);
+	sop_req_complete(req, ret);
+}
+
+// Maps the IU's SGL and submits the transfer to the block layer; the
+// response is posted from sop_req_cb()
+static void sop_rw(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r,
+		uint64_t lba, uint32_t nlb, bool is_write) {
+
+	uint64_t bytes = (uint64_t)nlb << disk->block_shift;
+	SopRequest *req;
+
+	if (!sop_lba_range_ok(disk, lba, nlb)) {
+		SOP_LOG_ERR("%s(): lba %"PRIu64" + %u is past the end of lun %d", __func__,
+				lba, nlb, disk->lunid);
+		sop_post_check_condition(pqiDev, qid, r->request_id);
+		return;
+	}
+
+	if (bytes > SOP_MAX_XFER_BYTES) {
+		SOP_LOG_ERR("%s(): %u blocks exceed the maximum transfer length", __func__, nlb);
+		sop_post_check_condition(pqiDev, qid, r->request_id);
+		return;
+	}
+
+	if (nlb == 0) {
+		sop_post_success(pqiDev, qid, r->request_id);
+		return;
+	}
+
+	req = sop_new_request(pqiDev, qid, disk, r);
+	req->is_write = is_write;
+	req->lba = lba;
+	req->nlb = nlb;
+
+	if (map_sgl(pqiDev, &req->qsg, r->sg, ARRAY_SIZE(r->sg), bytes) != SUCCESS) {
+		SOP_LOG_ERR("%s(): bad sgl", __func__);
+		sop_req_complete(req, -EINVAL);
+		return;
+	}
+
+	dma_acct_start(pqiDev->conf.bs, &req->acct, &req->qsg,
+			is_write ? BDRV_ACCT_WRITE : BDRV_ACCT_READ);
+
+	if (is_write) {
+		dma_bdrv_write(pqiDev->conf.bs, &req->qsg, sop_sector(disk, lba),
+				sop_req_cb, req);
+	} else {
+		dma_bdrv_read(pqiDev->conf.bs, &req->qsg, sop_sector(disk, lba),
+				sop_req_cb, req);
+	}
+}
+
+void sop_cdb_read_10(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r) {
 
-	uint32_t rVal = SUCCESS;
 	read10CDB * c = (read10CDB *)r->cdb;
 	uint32_t lba = be32_to_cpu(c->lba);
-	sopSuccessRsp rsp;
 
 	SOP_LOG_DBG("%s(): called. op=0x%x length=0x%x", __func__,r->header.type,r->header.length);
-
-    //print_bytes("read10",r,r->header.length+4);
 	SOP_LOG_DBG("r xfer size=%d, partial=%x",r->xfer_size, (r->partial?1:0));
-
-    //print_cdb(r);
 	SOP_LOG_DBG("r cdb: lba=%d ", lba);
 	SOP_LOG_DBG("r cdb: xfer_len=%d ", be16_to_cpu(c->xfer_len));
 
+	sop_rw(pqiDev, qid, disk, r, lba, be16_to_cpu(c->xfer_len), false);
+}
 
-    DiskInfo *disk;
-    disk = &pqiDev->disk[0];
+void sop_cdb_write_10(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r) {
 
-    if (lba < pqiDev->lun_size) {
+	write10CDB * c = (write10CDB *)r->cdb;
+	uint32_t lba = be32_to_cpu(c->lba);
 
-    	// put Info inside the SGL...
-    	rVal = copy_to_sgl(r->sg, disk->mapping_addr+(lba*512), be16_to_cpu(c->xfer_len)*512);
+	SOP_LOG_DBG("%s(): called. op=0x%x length=0x%x", __func__,r->header.type,r->header.length);
+	SOP_LOG_DBG("w xfer size=%d, partial=%x",r->xfer_size, (r->partial?1:0));
+	SOP_LOG_DBG("w cdb: lba=%d ", lba);
+	SOP_LOG_DBG("w cdb: xfer_len=%d ", be16_to_cpu(c->xfer_len));
 
-    	if (rVal != 0) {
-    		SOP_LOG_ERR("%s(): bad rc 0x%x from admin_build_sgl", __func__, rVal);
-    		sopCommandRspIU ersp;
-    		ersp.header.type=SOP_CMD_RSP_IU;
-    		ersp.header.feat=0;
-    		ersp.header.length=0x0010;
-    		ersp.request_id=r->request_id;
-    		ersp.queue_id = qid;
-    		ersp.status = SOP_CHECK_CONDITION;
-    		ersp.qualifier = SOP_ILLEGAL_REQUEST;
+	sop_rw(pqiDev, qid, disk, r, lba, be16_to_cpu(c->xfer_len), true);
+}
 
-    		post_to_oq(pqiDev, qid, (void *)&ersp, sizeof(sopCommandRspIU));
-    		return;    	}
-    } else {
-    	SOP_LOG_ERR("%s(): lba %u", __func__, (uint32_t)lba);
-    }
+void sop_cdb_read_16(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r) {
 
-	rsp.header.type=0x90;
-	rsp.header.feat=0;
-	rsp.header.length=0x000c;
-	rsp.requestIdentifier=r->request_id;
-	rsp.qisd = qid;
+	rw16CDB * c = (rw16CDB *)r->cdb;
 
-	post_to_oq(pqiDev, qid, (void *)&rsp, sizeof(sopSuccessRsp));
+	SOP_LOG_DBG("%s(): lba=%"PRIu64" xfer_len=%u", __func__,
+			be64_to_cpu(c->lba), be32_to_cpu(c->xfer_len));
 
+	sop_rw(pqiDev, qid, disk, r, be64_to_cpu(c->lba), be32_to_cpu(c->xfer_len), false);
 }
 
-void sop_cdb_write_10(PQIState* pqiDev, uint32_t qid, sopLimitedCommandIU *r) {
+void sop_cdb_write_16(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r) {
 
-	uint32_t rVal = SUCCESS;
-	write10CDB * c = (write10CDB *)r->cdb;
-	uint32_t lba = be32_to_cpu(c->lba);
-	sopSuccessRsp rsp;
+	rw16CDB * c = (rw16CDB *)r->cdb;
 
-	SOP_LOG_DBG("%s(): called. op=0x%x length=0x%x", __func__,r->header.type,r->header.length);
+	SOP_LOG_DBG("%s(): lba=%"PRIu64" xfer_len=%u", __func__,
+			be64_to_cpu(c->lba), be32_to_cpu(c->xfer_len));
 
-    //print_bytes("write10",r,r->header.length+4);
-	SOP_LOG_DBG("w xfer size=%d, partial=%x",r->xfer_size, (r->partial?1:0));
-    SOP_LOG_DBG("wxfer size=%d, ",r->xfer_size);
-
-    //print_cdb(r);
-    SOP_LOG_DBG("w cdb: lba=%d ", lba);
-    SOP_LOG_DBG("w cdb: xfer_len=%d ", be16_to_cpu(c->xfer_len));
-
-
-    DiskInfo *disk;
-    disk = &pqiDev->disk[0];
-
-    if (lba < pqiDev->lun_size) {
-    	// put Info inside the SGL...
-    	rVal = copy_from_sgl(r->sg, disk->mapping_addr+(lba*512), be16_to_cpu(c->xfer_len)*512);
-
-    	if (rVal != 0) {
-    		SOP_LOG_ERR("%s(): bad rc 0x%x from admin_build_sgl", __func__, rVal);
-    		sopCommandRspIU ersp;
-    		ersp.header.type=SOP_CMD_RSP_IU;
-    		ersp.header.feat=0;
-    		ersp.header.length=0x0010;
-    		ersp.request_id=r->request_id;
-    		ersp.queue_id = qid;
-    		ersp.status = SOP_CHECK_CONDITION;
-    		ersp.qualifier = SOP_ILLEGAL_REQUEST;
-
-    		post_to_oq(pqiDev, qid, (void *)&ersp, sizeof(sopCommandRspIU));
-    		return;
-    	}
-    } else {
-    	SOP_LOG_ERR("%s(): lba %u", __func__, (uint32_t)lba);
-    }
+	sop_rw(pqiDev, qid, disk, r, be64_to_cpu(c->lba), be32_to_cpu(c->xfer_len), true);
+}
 
-	rsp.header.type=0x90;
-	rsp.header.feat=0;
-	rsp.header.length=0x000c;
-	rsp.requestIdentifier=r->request_id;
-	rsp.qisd = qid;
+// The whole drive cache is flushed, whatever range the CDB names
+void sop_cdb_synchronize_cache(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r) {
 
-	post_to_oq(pqiDev, qid, (void *)&rsp, sizeof(sopSuccessRsp));
+	SopRequest *req;
+
+	SOP_LOG_DBG("%s(): called", __func__);
+
+	req = sop_new_request(pqiDev, qid, disk, r);
+	bdrv_acct_start(pqiDev->conf.bs, &req->acct, 0, BDRV_ACCT_FLUSH);
+	bdrv_aio_flush(pqiDev->conf.bs, sop_req_cb, req);
+}
+
+// Zeroes (or discards) nlb blocks from lba, in chunks the block layer takes
+static int coroutine_fn sop_co_zero(SopRequest *req, uint64_t lba, uint64_t nlb,
+		bool discard) {
+
+	BlockDriverState *bs = req->pqiDev->conf.bs;
+	int64_t sector = sop_sector(req->disk, lba);
+	int64_t end = sop_sector(req->disk, lba + nlb);
+	int ret = 0;
+
+	while (!ret && sector < end) {
+		int chunk = MIN(end - sector,
+				discard ? SOP_DISCARD_SECTORS : SOP_ZERO_SECTORS);
+
+		ret = discard ? bdrv_co_discard(bs, sector, chunk) :
+				bdrv_co_write_zeroes(bs, sector, chunk);
+		sector += chunk;
+	}
+	return ret;
+}
+
+static void coroutine_fn sop_unmap_co(void *opaque) {
+
+	SopRequest *req = opaque;
+	unmapParamHdr *hdr = (unmapParamHdr *)req->buf;
+	unmapBlockDesc *desc = (unmapBlockDesc *)(hdr + 1);
+	uint32_t ndesc = req->nlb;
+	uint32_t i;
+	int ret = 0;
+
+	for (i = 0; !ret && i < ndesc; i++) {
+		ret = sop_co_zero(req, be64_to_cpu(desc[i].lba),
+				be32_to_cpu(desc[i].nlb), true);
+	}
+	sop_req_complete(req, ret);
+}
+
+void sop_cdb_unmap(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r) {
+
+	unmapCDB * c = (unmapCDB *)r->cdb;
+	uint16_t len = be16_to_cpu(c->param_len);
+	unmapParamHdr *hdr;
+	unmapBlockDesc *desc;
+	SopRequest *req;
+	Coroutine *co;
+	uint32_t ndesc;
+	uint32_t i;
+
+	SOP_LOG_DBG("%s(): param_len=%u", __func__, len);
+
+	if (len == 0) {
+		sop_post_success(pqiDev, qid, r->request_id);
+		return;
+	}
+	if (len < sizeof(unmapParamHdr)) {
+		sop_post_check_condition(pqiDev, qid, r->request_id);
+		return;
+	}
+
+	req = sop_new_request(pqiDev, qid, disk, r);
+	req->buf = g_malloc(len);
+	req->buf_len = len;
+
+	if (copy_from_sgl(pqiDev, r->sg, ARRAY_SIZE(r->sg), req->buf, len) != SUCCESS) {
+		sop_req_complete(req, -EINVAL);
+		return;
+	}
+
+	hdr = (unmapParamHdr *)req->buf;
+	desc = (unmapBlockDesc *)(hdr + 1);
+	ndesc = MIN(be16_to_cpu(hdr->desc_len), len - sizeof(*hdr)) / sizeof(*desc);
+	if (ndesc > SOP_MAX_UNMAP_DESCS) {
+		sop_req_complete(req, -EINVAL);
+		return;
+	}
+	for (i = 0; i < ndesc; i++) {
+		if (!sop_lba_range_ok(disk, be64_to_cpu(desc[i].lba), be32_to_cpu(desc[i].nlb))) {
+			SOP_LOG_ERR("%s(): descriptor %u is past the end of lun %d", __func__,
+					i, disk->lunid);
+			sop_req_complete(req, -EINVAL);
+			return;
+		}
+	}
+	req->nlb = ndesc;	// sop_unmap_co() walks this many descriptors
+
+	co = qemu_coroutine_create(sop_unmap_co);
+	qemu_coroutine_enter(co, req);
+}
+
+// Zero blocks become write zeroes, which the image format can record
+// without writing data; anything else is written from a bounce buffer
+// holding the block several times over
+static void coroutine_fn sop_write_same_co(void *opaque) {
+
+	SopRequest *req = opaque;
+	BlockDriverState *bs = req->pqiDev->conf.bs;
+	DiskInfo *disk = req->disk;
+	uint64_t lba = req->lba;
+	uint64_t end = req->lba + req->nlb;
+	uint32_t chunk_blocks;
+	uint8_t *pattern;
+	QEMUIOVector qiov;
+	struct iovec iov;
+	uint32_t i;
+	int ret;
+
+	if (buffer_is_zero(req->buf, req->buf_len)) {
+		ret = sop_co_zero(req, req->lba, req->nlb, false);
+	} else {
+		chunk_blocks = MAX(SOP_WRITE_SAME_BUF_SIZE >> disk->block_shift, 1);
+		pattern = qemu_blockalign(bs, (size_t)chunk_blocks << disk->block_shift);
+		for (i = 0; i < chunk_blocks; i++) {
+			memcpy(pattern + ((size_t)i << disk->block_shift), req->buf, req->buf_len);
+		}
+
+		ret = 0;
+		while (!ret && lba < end) {
+			uint32_t n = MIN(end - lba, chunk_blocks);
+
+			iov.iov_base = pattern;
+			iov.iov_len = (size_t)n << disk->block_shift;
+			qemu_iovec_init_external(&qiov, &iov, 1);
+			ret = bdrv_co_writev(bs, sop_sector(disk, lba),
+					iov.iov_len >> BDRV_SECTOR_BITS, &qiov);
+			lba += n;
+		}
+		qemu_vfree(pattern);
+	}
+
+	bdrv_acct_done(bs, &req->acct);
+	sop_req_complete(req, ret);
+}
+
+// The UNMAP bit is not honoured: the blocks must read back as the given
+// data, which a discard on the drive does not guarantee
+void sop_cdb_write_same(PQIState* pqiDev, uint32_t qid, DiskInfo *disk, sopLimitedCommandIU *r) {
+
+	uint64_t lba;
+	uint64_t nlb;
+	SopRequest *req;
+	Coroutine *co;
+
+	if (r->cdb[0] == OP_WRITE_SAME_16) {
+		writeSame16CDB * c = (writeSame16CDB *)r->cdb;
+		lba = be64_to_cpu(c->lba);
+		nlb = be32_to_cpu(c->xfer_len);
+	} else {
+		writeSame10CDB * c = (writeSame10CDB *)r->cdb;
+		lba = be32_to_cpu(c->lba);
+		nlb = be16_to_cpu(c->xfer_len);
+	}
+
+	SOP_LOG_DBG("%s(): lba=%"PRIu64" nlb=%"PRIu64, __func__, lba, nlb);
+
+	// zero blocks means up to the end of the LUN
+	if (nlb == 0 && lba < disk->nb_blocks) {
+		nlb = disk->nb_blocks - lba;
+	}
+	if (nlb == 0 || !sop_lba_range_ok(disk, lba, nlb)) {
+		sop_post_check_condition(pqiDev, qid, r->request_id);
+		return;
+	}
+
+	req = sop_new_request(pqiDev, qid, disk, r);
+	req->is_write = true;
+	req->lba = lba;
+	req->nlb = nlb;
+	req->buf_len = 1 << disk->block_shift;
+	req->buf = g_malloc(req->buf_len);
+
+	if (copy_from_sgl(pqiDev, r->sg, ARRAY_SIZE(r->sg), req->buf, req->buf_len) != SUCCESS) {
+		sop_req_complete(req, -EINVAL);
+		return;
+	}
 
+	bdrv_acct_start(pqiDev->conf.bs, &req->acct, nlb << disk->block_shift,
+			BDRV_ACCT_WRITE);
+	co = qemu_coroutine_create(sop_write_same_co);
+	qemu_coroutine_enter(co, req);
 }
@@ -26,9 +26,8 @@
  */
 
 #include "sop.h"
-#include <sys/mman.h>
-#include <assert.h>
 #include "qemu-common.h"
+#include "block/block.h"
 
 #define MASK_AD         0x4
 #define MASK_IDW        0x2
@@ -46,64 +45,34 @@ void pqi_dma_mem_write(hwaddr addr, uint8_t *buf, int len)
 
 /*********************************************************************
     Function     :    pqi_create_storage_disk
-    Description  :    Creates a PQI Storage Disk and the namespaces within
+    Description  :    Carves a LUN out of the device's drive
     Return Type  :    int (0:1 Success:Failure)
 
     Arguments    :    uint32_t : instance number of the sop device
-                      uint32_t : namespace id
-                      DiskInfo * : PQI disk to create storage for
+                      uint32_t : LUN number (0 based)
+                      DiskInfo * : PQI disk to set up
+                      PQIState * : Pointer to PQI device State
 *********************************************************************/
 int pqi_create_storage_disk(uint32_t instance, uint32_t lunid, DiskInfo *disk, PQIState *n)
 {
-    uint64_t size;
-    char str[64];
-
     SOP_LOG_NORM(" %s() instance: %d, lunid: %d, ", __func__, instance, lunid);
 
-    if (n->working_dir) {
-    	snprintf(str, sizeof(str), "%s/sop_disk%d_n%d.img", n->working_dir, instance, lunid);
-    } else {
-    	snprintf(str, sizeof(str), "sop_disk%d_n%d.img", instance, lunid);
-    }
-
-    SOP_LOG_NORM(" %s() backing file: %s, ", __func__, str);
-
     disk->lunid = lunid;
+    disk->block_shift = ctz32(n->conf.logical_block_size);
+    disk->start_block = (uint64_t)lunid * n->lun_size;
+    disk->nb_blocks = n->lun_size;
 
-//    disk->fd = open(str, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
-    disk->fd = open(str, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
-    if(disk->fd < 0)
-    {
-        SOP_LOG_ERR("  Error cannot open %s  code: 0x%x", str, disk->fd);
-        SOP_LOG_ERR("  errno: '%s'\n", strerror(errno));
-        return FAIL;
-    }
-
-    size = (n->lun_size * 512);
-
-    if(posix_fallocate(disk->fd, 0, size) != 0)
-    {
-        SOP_LOG_ERR("  Error while allocating space for LUN");
-        return FAIL;
-    }
-
-    disk->mapping_addr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, disk->fd, 0);
-    if(disk->mapping_addr == NULL)
-    {
-        SOP_LOG_ERR("  Error while mapping disk addr: %d", lunid);
-        return FAIL;
-    }
-    disk->mapping_size = size;
-    
-    SOP_LOG_NORM(" %s() LUN: %d  size: %d ", __func__, lunid, (int)size);
+    SOP_LOG_NORM(" %s() LUN: %d  start: %"PRIu64"  blocks: %"PRIu64, __func__,
+                 lunid, disk->start_block, disk->nb_blocks);
 
     return SUCCESS;
 }
 
 /*********************************************************************
     Function     :    pqi_create_storage_disks
-    Description  :    Creates a PQI Storage Disks and the
-                      namespaces within
+    Description  :    Splits the drive into num_luns LUNs of lun_size
+                      logical blocks. A lun_size of 0 gives every LUN
+                      an equal share of the drive.
     Return Type  :    int (0:1 Success:Failure)
 
     Arguments    :    PQIState * : Pointer to PQI device State
@@ -111,72 +80,52 @@ int pqi_create_storage_disk(uint32_t instance, uint32_t lunid, DiskInfo *disk, P
 int pqi_create_storage_disks(PQIState *n)
 {
     uint32_t i;
+    int64_t bs_size;
+    uint64_t nb_blocks;
     int ret = SUCCESS;
 
     SOP_LOG_NORM("%s(): instance: %d for NLUNS: %d", __func__, n->instance, n->num_luns);
 
-    for (i = 0; i < n->num_luns; i++) {
-        ret |= pqi_create_storage_disk(n->instance, i + 1, &n->disk[i], n);
+    bs_size = bdrv_getlength(n->conf.bs);
+    if (bs_size < 0) {
+        SOP_LOG_ERR("Error %s() could not get the drive size", __func__);
+        return FAIL;
     }
+    nb_blocks = bs_size / n->conf.logical_block_size;
 
-    SOP_LOG_NORM("%s():Backing store created for instance %d", __func__, n->instance);
-
-    return ret;
-}
-
-
-/*********************************************************************
-    Function     :    pqi_close_storage_disk
-    Description  :    Deletes PQI Storage Disk
-    Return Type  :    int (0:1 Success:Failure)
-
-    Arguments    :    DiskInfo * : Pointer to PQI disk
-*********************************************************************/
-int pqi_close_storage_disk(DiskInfo *disk)
-{
-
-    if (disk->mapping_addr != NULL) {
-
-        if (munmap(disk->mapping_addr, disk->mapping_size) < 0) {
-
-            SOP_LOG_ERR("Error while closing LUN: %d", disk->lunid);
-            return FAIL;
-
-        } else {
-
-            disk->mapping_addr = NULL;
-            disk->mapping_size = 0;
+    if (n->lun_size == 0) {
+        n->lun_size = nb_blocks / n->num_luns;
+    }
 
-            if (close(disk->fd) < 0) {
+    if (n->lun_size == 0 || n->lun_size > nb_blocks / n->num_luns) {
+        SOP_LOG_ERR("Error %s() drive has %"PRIu64" blocks, %u LUNs of %"PRIu64" blocks do not fit",
+                    __func__, nb_blocks, n->num_luns, n->lun_size);
+        return FAIL;
+    }
 
-                SOP_LOG_ERR("Unable to close the pqi disk");
-                return FAIL;
-            }
-        }
+    for (i = 0; i < n->num_luns; i++) {
+        ret |= pqi_create_storage_disk(n->instance, i, &n->disk[i], n);
     }
 
-    return SUCCESS;
+    SOP_LOG_NORM("%s():Backing store created for instance %d", __func__, n->instance);
+
+    return ret;
 }
 
 
 /*********************************************************************
     Function     :    pqi_close_storage_disks
-    Description  :    Closes the PQI Storage Disks and the
-                      associated namespaces
+    Description  :    Waits for the I/O still in flight on the
+                      LUNs to complete
     Return Type  :    int (0:1 Success:Failure)
 
     Arguments    :    PQIState * : Pointer to PQI device State
 *********************************************************************/
 int pqi_close_storage_disks(PQIState *n)
 {
-    uint32_t i;
-    int ret = SUCCESS;
+    SOP_LOG_NORM("%s(): instance: %d", __func__, n->instance);
 
-    for (i = 0; i < n->num_luns; i++) {
+    bdrv_drain_all();
 
-        ret = pqi_close_storage_disk(&n->disk[i]);
-    }
-
-    return ret;
+    return SUCCESS;
 }
-
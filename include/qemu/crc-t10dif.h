@@ -0,0 +1,39 @@
+/*
+ * T10 Data Integrity Field CRC16
+ *
+ * This code is licensed under the GNU GPL v2 or later.  See the COPYING
+ * file in the top-level directory.
+ */
+
+#ifndef QEMU_CRC_T10DIF_H
+#define QEMU_CRC_T10DIF_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* All implementations compute the non-reflected CRC16 with polynomial
+ * 0x8BB7 used for the guard tag of T10 protection information, continuing
+ * from @crc so that a block may be checksummed in several pieces.
+ */
+typedef uint16_t CrcT10DifFunc(uint16_t crc, const uint8_t *buf, size_t len);
+
+/* Byte-at-a-time, 256 entry table lookup. */
+CrcT10DifFunc crc_t10dif_generic;
+
+/* Eight bytes per iteration using eight 256 entry tables. */
+CrcT10DifFunc crc_t10dif_slice8;
+
+/* Carry-less multiply folding.  Returns NULL if the host CPU or the
+ * compiler lacks PCLMULQDQ support.
+ */
+CrcT10DifFunc *crc_t10dif_pclmul_fn(void);
+
+/* Fastest implementation available on this host, selected at startup. */
+uint16_t crc_t10dif_update(uint16_t crc, const uint8_t *buf, size_t len);
+
+static inline uint16_t crc_t10dif(const uint8_t *buf, size_t len)
+{
+    return crc_t10dif_update(0, buf, len);
+}
+
+#endif
@@ -0,0 +1,129 @@
+/*
+ * Sparse set of integer ranges
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_RANGE_SET_H
+#define QEMU_RANGE_SET_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* A set of items stored as disjoint, non-adjacent extents in a balanced
+ * search tree.  It behaves like a bitmap whose memory use is proportional to
+ * the number of runs of set bits rather than to its size, and every range
+ * operation costs O(log n) in the number of extents, plus the extents it
+ * merges or removes.
+ */
+typedef struct RangeSet RangeSet;
+
+/* Called for each extent in ascending order.  Returning non-zero stops the
+ * walk, and range_set_foreach returns that value.
+ */
+typedef int RangeSetFunc(uint64_t start, uint64_t count, void *opaque);
+
+/**
+ * range_set_new:
+ *
+ * Allocate a new, empty RangeSet.
+ */
+RangeSet *range_set_new(void);
+
+/**
+ * range_set_free:
+ * @rs: RangeSet to operate on.
+ *
+ * Free a RangeSet and all of its extents.
+ */
+void range_set_free(RangeSet *rs);
+
+/**
+ * range_set_clear:
+ * @rs: RangeSet to operate on.
+ *
+ * Remove every item from the set.
+ */
+void range_set_clear(RangeSet *rs);
+
+/**
+ * range_set_add:
+ * @rs: RangeSet to operate on.
+ * @start: First item to add.
+ * @count: Number of items to add.
+ *
+ * Add a consecutive range of items, merging it with any extent it overlaps
+ * or touches.
+ */
+void range_set_add(RangeSet *rs, uint64_t start, uint64_t count);
+
+/**
+ * range_set_remove:
+ * @rs: RangeSet to operate on.
+ * @start: First item to remove.
+ * @count: Number of items to remove.
+ *
+ * Remove a consecutive range of items, splitting an extent if needed.
+ */
+void range_set_remove(RangeSet *rs, uint64_t start, uint64_t count);
+
+/**
+ * range_set_test:
+ * @rs: RangeSet to operate on.
+ * @item: Item to query.
+ *
+ * Return whether @item is in the set.
+ */
+bool range_set_test(const RangeSet *rs, uint64_t item);
+
+/**
+ * range_set_intersects:
+ * @rs: RangeSet to operate on.
+ * @start: First item of the range to query.
+ * @count: Number of items in the range.
+ *
+ * Return whether any item of the range is in the set.
+ */
+bool range_set_intersects(const RangeSet *rs, uint64_t start, uint64_t count);
+
+/**
+ * range_set_run:
+ * @rs: RangeSet to operate on.
+ * @item: First item of the run.
+ * @max: Upper bound on the returned length.
+ * @in: Set to whether the run is inside the set.
+ *
+ * Return how many items starting at @item, up to @max, are either all in
+ * the set or all outside it.
+ */
+uint64_t range_set_run(const RangeSet *rs, uint64_t item, uint64_t max,
+                       bool *in);
+
+/**
+ * range_set_extents:
+ * @rs: RangeSet to operate on.
+ *
+ * Return the number of extents the set is made of.
+ */
+uint64_t range_set_extents(const RangeSet *rs);
+
+/**
+ * range_set_count:
+ * @rs: RangeSet to operate on.
+ *
+ * Return the number of items in the set.
+ */
+uint64_t range_set_count(const RangeSet *rs);
+
+/**
+ * range_set_foreach:
+ * @rs: RangeSet to operate on.
+ * @func: Function to call for each extent.
+ * @opaque: Passed to @func.
+ *
+ * Walk the extents in ascending order.
+ */
+int range_set_foreach(const RangeSet *rs, RangeSetFunc *func, void *opaque);
+
+#endif
@@ -1855,6 +1855,66 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_blockstats,
     },
 
+SQMP
+query-nvme-stats
+----------------
+
+Show NVMe controller statistics.
+
+Each controller is a json-object and the returned value is a json-array of
+all controllers. Latencies run from command fetch to completion entry post.
+
+Each json-object contains the following:
+
+- "id": the controller's device id, if it has one (json-string, optional)
+- "serial": serial number (json-string)
+- "doorbells": doorbell writes (json-int)
+- "interrupts": interrupts raised (json-int)
+- "depth-samples": commands fetched (json-int)
+- "depth-total": sum of the queue depth seen at each fetch (json-int)
+- "depth-max": highest queue depth seen (json-int)
+- "latency": json-array of json-objects, one per command type:
+    - "operation": "read", "write" or "flush" (json-string)
+    - "count": commands completed (json-int)
+    - "total-ns": sum of their latencies (json-int)
+    - "histogram": json-array of the non-empty buckets:
+        - "bucket": latencies of at least 2^bucket ns, and below
+                    2^(bucket+1) ns except for the last bucket (json-int)
+        - "count": commands in the bucket (json-int)
+- "queues": json-array of the submission queues:
+    - "sqid", "cqid": submission and completion queue ids (json-int)
+    - "sq-doorbells", "cq-doorbells": doorbell writes (json-int)
+    - "interrupts": interrupts raised for the completion queue (json-int)
+    - "depth-samples", "depth-total", "depth-max", "latency": as above
+- "namespaces": json-array of the namespaces:
+    - "nsid": namespace id (json-int)
+    - "latency": as above
+
+Example:
+
+-> { "execute": "query-nvme-stats" }
+<- { "return": [
+       { "id": "nvme0", "serial": "deadbeef", "doorbells": 2,
+         "interrupts": 1, "depth-samples": 1, "depth-total": 1,
+         "depth-max": 1,
+         "latency": [
+           { "operation": "read", "count": 1, "total-ns": 52000,
+             "histogram": [ { "bucket": 15, "count": 1 } ] },
+           { "operation": "write", "count": 0, "total-ns": 0,
+             "histogram": [] },
+           { "operation": "flush", "count": 0, "total-ns": 0,
+             "histogram": [] } ],
+         "queues": [ ... ],
+         "namespaces": [ ... ] } ] }
+
+EQMP
+
+    {
+        .name       = "query-nvme-stats",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_nvme_stats,
+    },
+
 SQMP
 query-cpus
 ----------
@@ -0,0 +1,506 @@
+/*
+ * libqos driver for the NVMe controller
+ *
+ * Copyright (C) 2013 HGST, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "libqtest.h"
+#include "libqos/nvme.h"
+
+#include "hw/pci/pci_regs.h"
+#include "hw/pci/pci_ids.h"
+
+#include "qemu-common.h"
+
+#include <glib.h>
+#include <string.h>
+
+/* Controller registers */
+#define NVME_REG_CAP  0x00
+#define NVME_REG_CC   0x14
+#define NVME_REG_CSTS 0x1c
+#define NVME_REG_AQA  0x24
+#define NVME_REG_ASQ  0x28
+#define NVME_REG_ACQ  0x30
+#define NVME_REG_DBS  0x1000
+
+#define NVME_CC_EN       (1 << 0)
+#define NVME_CC_AMS_WRR  (1 << 11)
+#define NVME_CC_IOSQES   (6 << 16)
+#define NVME_CC_IOCQES   (4 << 20)
+#define NVME_CSTS_RDY    (1 << 0)
+#define NVME_CSTS_CFS    (1 << 1)
+
+#define NVME_ADMIN_QUEUE_SIZE 32
+
+/* How long to wait for the device before failing the test */
+#define NVME_TIMEOUT_US (10 * 1000 * 1000)
+
+static void nvme_found(QPCIDevice *dev, int devfn, void *data)
+{
+    QPCIDevice **pdev = data;
+
+    *pdev = dev;
+}
+
+static void nvme_writeq(QNvmeDevice *d, int reg, uint64_t val)
+{
+    qpci_io_writel(d->pdev, d->bar + reg, (uint32_t)val);
+    qpci_io_writel(d->pdev, d->bar + reg + 4, (uint32_t)(val >> 32));
+}
+
+static void nvme_alloc_queue(QNvmeDevice *d, QNvmeQueue *q, uint16_t qid,
+                             uint16_t size, size_t entry_size, bool contig)
+{
+    size_t bytes = size * entry_size;
+    uint8_t *zero = g_malloc0(MAX(bytes, QNVME_PAGE_SIZE));
+    int npages = DIV_ROUND_UP(bytes, QNVME_PAGE_SIZE);
+    int i;
+
+    q->qid = qid;
+    q->size = size;
+    q->entry_size = entry_size;
+    q->contig = contig;
+    q->index = 0;
+    q->phase = 1;
+
+    if (contig) {
+        q->addr = guest_alloc(d->alloc, bytes);
+        memwrite(q->addr, zero, bytes);
+        g_free(zero);
+        return;
+    }
+
+    /* One PRP list page; every queue page is followed by an unused one */
+    g_assert(npages <= QNVME_PAGE_SIZE / sizeof(uint64_t));
+    q->pages = g_malloc0(npages * sizeof(*q->pages));
+    q->addr = guest_alloc(d->alloc, QNVME_PAGE_SIZE);
+    memwrite(q->addr, zero, QNVME_PAGE_SIZE);
+    for (i = 0; i < npages; i++) {
+        q->pages[i] = guest_alloc(d->alloc, 2 * QNVME_PAGE_SIZE);
+        memwrite(q->pages[i], zero, QNVME_PAGE_SIZE);
+        writeq(q->addr + i * sizeof(uint64_t), q->pages[i]);
+    }
+    g_free(zero);
+}
+
+static void nvme_free_queue(QNvmeQueue *q)
+{
+    g_free(q->pages);
+    g_free(q);
+}
+
+static uint64_t nvme_entry(QNvmeQueue *q, uint16_t index)
+{
+    uint64_t offset = (uint64_t)index * q->entry_size;
+
+    if (q->contig) {
+        return q->addr + offset;
+    }
+    return q->pages[offset / QNVME_PAGE_SIZE] + offset % QNVME_PAGE_SIZE;
+}
+
+static void *nvme_sq_db(QNvmeDevice *d, uint16_t qid)
+{
+    return d->bar + NVME_REG_DBS + (2 * qid) * (4 << d->db_stride);
+}
+
+static void *nvme_cq_db(QNvmeDevice *d, uint16_t qid)
+{
+    return d->bar + NVME_REG_DBS + (2 * qid + 1) * (4 << d->db_stride);
+}
+
+/* Shadow doorbells of the I/O queues mirror the registers' layout */
+static void nvme_shadow_write(QNvmeDevice *d, void *db, uint16_t qid,
+                              uint16_t value)
+{
+    if (d->dbbuf && qid) {
+        writel(d->dbbuf + (db - d->bar - NVME_REG_DBS), value);
+    }
+}
+
+static QNvmeDevice *nvme_init(QPCIBus *bus, QGuestAllocator *alloc,
+                              uint32_t ams)
+{
+    QNvmeDevice *d = g_malloc0(sizeof(*d));
+    int64_t deadline;
+    uint16_t cmd;
+    uint32_t cap_hi;
+
+    qpci_device_foreach(bus, PCI_VENDOR_ID_STEC, PCI_DEVICE_ID_GALLIANT_FOX,
+                        nvme_found, &d->pdev);
+    g_assert(d->pdev != NULL);
+
+    qpci_device_enable(d->pdev);
+    cmd = qpci_config_readw(d->pdev, PCI_COMMAND);
+    qpci_config_writew(d->pdev, PCI_COMMAND, cmd | PCI_COMMAND_MASTER);
+
+    d->bar = qpci_iomap(d->pdev, 0);
+    g_assert(d->bar != NULL);
+    d->alloc = alloc;
+
+    cap_hi = qpci_io_readl(d->pdev, d->bar + NVME_REG_CAP + 4);
+    d->db_stride = cap_hi & 0xf;
+
+    nvme_alloc_queue(d, &d->asq, 0, NVME_ADMIN_QUEUE_SIZE, QNVME_SQE_SIZE,
+                     true);
+    nvme_alloc_queue(d, &d->acq, 0, NVME_ADMIN_QUEUE_SIZE, QNVME_CQE_SIZE,
+                     true);
+    qpci_io_writel(d->pdev, d->bar + NVME_REG_AQA,
+                   (NVME_ADMIN_QUEUE_SIZE - 1) |
+                   ((NVME_ADMIN_QUEUE_SIZE - 1) << 16));
+    nvme_writeq(d, NVME_REG_ASQ, d->asq.addr);
+    nvme_writeq(d, NVME_REG_ACQ, d->acq.addr);
+    qpci_io_writel(d->pdev, d->bar + NVME_REG_CC,
+                   NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES | ams);
+
+    deadline = g_get_monotonic_time() + NVME_TIMEOUT_US;
+    while (!(qpci_io_readl(d->pdev, d->bar + NVME_REG_CSTS) & NVME_CSTS_RDY)) {
+        g_assert(g_get_monotonic_time() < deadline);
+    }
+    g_assert(!(qpci_io_readl(d->pdev, d->bar + NVME_REG_CSTS) &
+               NVME_CSTS_CFS));
+
+    return d;
+}
+
+QNvmeDevice *qnvme_init(QPCIBus *bus, QGuestAllocator *alloc)
+{
+    return nvme_init(bus, alloc, 0);
+}
+
+/* Enables the controller with weighted round robin arbitration */
+QNvmeDevice *qnvme_init_wrr(QPCIBus *bus, QGuestAllocator *alloc)
+{
+    return nvme_init(bus, alloc, NVME_CC_AMS_WRR);
+}
+
+void qnvme_uninit(QNvmeDevice *d)
+{
+    int i;
+
+    for (i = 0; i < QNVME_MAX_QUEUES; i++) {
+        if (d->sq[i]) {
+            nvme_free_queue(d->sq[i]);
+        }
+        if (d->cq[i]) {
+            nvme_free_queue(d->cq[i]);
+        }
+    }
+    qpci_iounmap(d->pdev, d->bar);
+    g_free(d->pdev);
+    g_free(d);
+}
+
+/*
+ * Turns MSI-X on. Every vector starts out masked; qnvme_msix_set_vector()
+ * points one at guest memory, where the test can watch for the message.
+ */
+void qnvme_msix_enable(QNvmeDevice *d)
+{
+    uint8_t cap = qpci_config_readb(d->pdev, PCI_CAPABILITY_LIST);
+    uint32_t table;
+    uint16_t ctrl;
+
+    while (cap && qpci_config_readb(d->pdev, cap) != PCI_CAP_ID_MSIX) {
+        cap = qpci_config_readb(d->pdev, cap + PCI_CAP_LIST_NEXT);
+    }
+    g_assert(cap != 0);
+    d->msix_cap = cap;
+
+    table = qpci_config_readl(d->pdev, cap + PCI_MSIX_TABLE);
+    d->msix_bar = qpci_iomap(d->pdev, table & PCI_MSIX_FLAGS_BIRMASK);
+    g_assert(d->msix_bar != NULL);
+    d->msix_bar += table & ~PCI_MSIX_FLAGS_BIRMASK;
+
+    ctrl = qpci_config_readw(d->pdev, cap + PCI_MSIX_FLAGS);
+    qpci_config_writew(d->pdev, cap + PCI_MSIX_FLAGS,
+                       ctrl | PCI_MSIX_FLAGS_ENABLE);
+}
+
+void qnvme_msix_set_vector(QNvmeDevice *d, uint16_t vector, uint64_t addr,
+                           uint32_t data)
+{
+    void *entry = d->msix_bar + vector * PCI_MSIX_ENTRY_SIZE;
+
+    g_assert(d->msix_bar != NULL);
+    qpci_io_writel(d->pdev, entry + PCI_MSIX_ENTRY_LOWER_ADDR, (uint32_t)addr);
+    qpci_io_writel(d->pdev, entry + PCI_MSIX_ENTRY_UPPER_ADDR,
+                   (uint32_t)(addr >> 32));
+    qpci_io_writel(d->pdev, entry + PCI_MSIX_ENTRY_DATA, data);
+    qpci_io_writel(d->pdev, entry + PCI_MSIX_ENTRY_VECTOR_CTRL, 0);
+}
+
+void qnvme_cmd(uint8_t *cmd, uint8_t opcode, uint32_t nsid)
+{
+    memset(cmd, 0, QNVME_SQE_SIZE);
+    cmd[0] = opcode;
+    stl_le_p(cmd + 4, nsid);
+}
+
+/*
+ * Copies a command to the SQ with the next command identifier, which is
+ * returned. The tail only reaches the device with qnvme_ring().
+ */
+uint16_t qnvme_submit(QNvmeDevice *d, QNvmeQueue *sq, uint8_t *cmd)
+{
+    uint16_t cid = d->cid++;
+
+    stw_le_p(cmd + 2, cid);
+    memwrite(nvme_entry(sq, sq->index), cmd, QNVME_SQE_SIZE);
+    sq->index = (sq->index + 1) % sq->size;
+
+    return cid;
+}
+
+void qnvme_ring(QNvmeDevice *d, QNvmeQueue *sq)
+{
+    nvme_shadow_write(d, nvme_sq_db(d, sq->qid), sq->qid, sq->index);
+    qpci_io_writel(d->pdev, nvme_sq_db(d, sq->qid), sq->index);
+}
+
+/* Takes the next entry off the CQ and releases it. False if there is none */
+bool qnvme_poll(QNvmeDevice *d, QNvmeQueue *cq, QNvmeCqe *cqe)
+{
+    uint8_t buf[QNVME_CQE_SIZE];
+    uint16_t status;
+
+    memread(nvme_entry(cq, cq->index), buf, sizeof(buf));
+    status = lduw_le_p(buf + 14);
+    if ((status & 1) != cq->phase) {
+        return false;
+    }
+
+    cqe->result = ldl_le_p(buf);
+    cqe->sq_head = lduw_le_p(buf + 8);
+    cqe->sq_id = lduw_le_p(buf + 10);
+    cqe->cid = lduw_le_p(buf + 12);
+    cqe->status = status >> 1;
+
+    cq->index++;
+    if (cq->index == cq->size) {
+        cq->index = 0;
+        cq->phase ^= 1;
+    }
+    nvme_shadow_write(d, nvme_cq_db(d, cq->qid), cq->qid, cq->index);
+    qpci_io_writel(d->pdev, nvme_cq_db(d, cq->qid), cq->index);
+
+    return true;
+}
+
+void qnvme_wait(QNvmeDevice *d, QNvmeQueue *cq, QNvmeCqe *cqe)
+{
+    int64_t deadline = g_get_monotonic_time() + NVME_TIMEOUT_US;
+
+    while (!qnvme_poll(d, cq, cqe)) {
+        g_assert(g_get_monotonic_time() < deadline);
+    }
+}
+
+/* Runs a command to completion on an I/O queue pair; returns its status */
+uint16_t qnvme_io(QNvmeDevice *d, QNvmeQueue *sq, QNvmeQueue *cq,
+                  uint8_t *cmd, QNvmeCqe *cqe)
+{
+    uint16_t cid;
+
+    cid = qnvme_submit(d, sq, cmd);
+    qnvme_ring(d, sq);
+    qnvme_wait(d, cq, cqe);
+    g_assert_cmpint(cqe->cid, ==, cid);
+    g_assert_cmpint(cqe->sq_id, ==, sq->qid);
+
+    return cqe->status;
+}
+
+/*
+ * Builds a command that addresses blocks through PRPs: @addr must be page
+ * aligned and @len at most two pages, so no PRP list is needed.
+ */
+void qnvme_rw_cmd(uint8_t *cmd, uint8_t opcode, uint32_t nsid, uint64_t slba,
+                  uint32_t nlb, uint64_t addr, uint32_t len)
+{
+    g_assert(nlb > 0 && nlb <= 0x10000);
+    g_assert(!(addr & (QNVME_PAGE_SIZE - 1)) && len <= 2 * QNVME_PAGE_SIZE);
+
+    qnvme_cmd(cmd, opcode, nsid);
+    if (len) {
+        stq_le_p(cmd + 24, addr);
+    }
+    if (len > QNVME_PAGE_SIZE) {
+        stq_le_p(cmd + 32, addr + QNVME_PAGE_SIZE);
+    }
+    stq_le_p(cmd + 40, slba);
+    stw_le_p(cmd + 48, nlb - 1);
+}
+
+/*
+ * Fills in an SGL descriptor, either in a host buffer that is then copied
+ * to guest memory or at byte 24 of a command with QNVME_CMD_PSDT_SGL set.
+ */
+void qnvme_sgl_desc(uint8_t *desc, uint8_t type, uint64_t addr, uint32_t len)
+{
+    memset(desc, 0, QNVME_SGL_DESC_SIZE);
+    stq_le_p(desc, addr);
+    stl_le_p(desc + 8, len);
+    desc[15] = type << 4;
+}
+
+/* Runs an admin command to completion; returns its status */
+uint16_t qnvme_admin(QNvmeDevice *d, uint8_t *cmd, uint32_t *result)
+{
+    QNvmeCqe cqe;
+    uint16_t cid;
+
+    cid = qnvme_submit(d, &d->asq, cmd);
+    qnvme_ring(d, &d->asq);
+    qnvme_wait(d, &d->acq, &cqe);
+    g_assert_cmpint(cqe.cid, ==, cid);
+
+    if (result) {
+        *result = cqe.result;
+    }
+    return cqe.status;
+}
+
+uint16_t qnvme_set_feature(QNvmeDevice *d, uint32_t fid, uint32_t value)
+{
+    uint8_t cmd[QNVME_SQE_SIZE];
+
+    qnvme_cmd(cmd, QNVME_ADM_SET_FEATURES, 0);
+    stl_le_p(cmd + 40, fid);
+    stl_le_p(cmd + 44, value);
+    return qnvme_admin(d, cmd, NULL);
+}
+
+uint16_t qnvme_get_feature(QNvmeDevice *d, uint32_t fid, uint32_t *value)
+{
+    uint8_t cmd[QNVME_SQE_SIZE];
+
+    qnvme_cmd(cmd, QNVME_ADM_GET_FEATURES, 0);
+    stl_le_p(cmd + 40, fid);
+    stl_le_p(cmd + 44, *value);
+    return qnvme_admin(d, cmd, value);
+}
+
+QNvmeQueue *qnvme_create_cq(QNvmeDevice *d, uint16_t qid, uint16_t size,
+                            bool contig, uint16_t vector, bool irq)
+{
+    QNvmeQueue *cq = g_malloc0(sizeof(*cq));
+    uint8_t cmd[QNVME_SQE_SIZE];
+
+    g_assert(qid > 0 && qid < QNVME_MAX_QUEUES && !d->cq[qid]);
+    nvme_alloc_queue(d, cq, qid, size, QNVME_CQE_SIZE, contig);
+
+    qnvme_cmd(cmd, QNVME_ADM_CREATE_CQ, 0);
+    stq_le_p(cmd + 24, cq->addr);
+    stw_le_p(cmd + 40, qid);
+    stw_le_p(cmd + 42, size - 1);
+    stw_le_p(cmd + 44, (contig ? 1 : 0) | (irq ? 2 : 0));
+    stw_le_p(cmd + 46, vector);
+    g_assert_cmpint(qnvme_admin(d, cmd, NULL), ==, 0);
+
+    d->cq[qid] = cq;
+    return cq;
+}
+
+static QNvmeQueue *nvme_create_sq(QNvmeDevice *d, uint16_t qid,
+                                  uint16_t cqid, uint16_t size, bool contig,
+                                  uint8_t prio)
+{
+    QNvmeQueue *sq = g_malloc0(sizeof(*sq));
+    uint8_t cmd[QNVME_SQE_SIZE];
+
+    g_assert(qid > 0 && qid < QNVME_MAX_QUEUES && !d->sq[qid]);
+    nvme_alloc_queue(d, sq, qid, size, QNVME_SQE_SIZE, contig);
+
+    qnvme_cmd(cmd, QNVME_ADM_CREATE_SQ, 0);
+    stq_le_p(cmd + 24, sq->addr);
+    stw_le_p(cmd + 40, qid);
+    stw_le_p(cmd + 42, size - 1);
+    stw_le_p(cmd + 44, (contig ? 1 : 0) | (prio << 1));
+    stw_le_p(cmd + 46, cqid);
+    g_assert_cmpint(qnvme_admin(d, cmd, NULL), ==, 0);
+
+    d->sq[qid] = sq;
+    return sq;
+}
+
+QNvmeQueue *qnvme_create_sq(QNvmeDevice *d, uint16_t qid, uint16_t cqid,
+                            uint16_t size, bool contig)
+{
+    return nvme_create_sq(d, qid, cqid, size, contig, QNVME_PRIO_URGENT);
+}
+
+/* Contiguous SQ with a queue priority for weighted round robin */
+QNvmeQueue *qnvme_create_sq_prio(QNvmeDevice *d, uint16_t qid, uint16_t cqid,
+                                 uint16_t size, uint8_t prio)
+{
+    return nvme_create_sq(d, qid, cqid, size, true, prio);
+}
+
+uint16_t qnvme_delete_sq(QNvmeDevice *d, uint16_t qid)
+{
+    uint8_t cmd[QNVME_SQE_SIZE];
+    uint16_t status;
+
+    g_assert(d->sq[qid] != NULL);
+
+    qnvme_cmd(cmd, QNVME_ADM_DELETE_SQ, 0);
+    stw_le_p(cmd + 40, qid);
+    status = qnvme_admin(d, cmd, NULL);
+    if (!status) {
+        nvme_free_queue(d->sq[qid]);
+        d->sq[qid] = NULL;
+    }
+    return status;
+}
+
+uint16_t qnvme_delete_cq(QNvmeDevice *d, uint16_t qid)
+{
+    uint8_t cmd[QNVME_SQE_SIZE];
+    uint16_t status;
+
+    g_assert(d->cq[qid] != NULL);
+
+    qnvme_cmd(cmd, QNVME_ADM_DELETE_CQ, 0);
+    stw_le_p(cmd + 40, qid);
+    status = qnvme_admin(d, cmd, NULL);
+    if (!status) {
+        nvme_free_queue(d->cq[qid]);
+        d->cq[qid] = NULL;
+    }
+    return status;
+}
+
+/*
+ * Hands the controller shadow doorbell buffers holding the current tail and
+ * head of every I/O queue; qnvme_ring() and qnvme_poll() keep them up to
+ * date from then on. The controller looks at every SQ once the command is
+ * processed, so commands queued without a doorbell write are picked up all
+ * at the same time.
+ */
+uint16_t qnvme_dbbuf_config(QNvmeDevice *d)
+{
+    uint8_t cmd[QNVME_SQE_SIZE];
+    uint64_t eis;
+    int i;
+
+    d->dbbuf = guest_alloc(d->alloc, QNVME_PAGE_SIZE);
+    eis = guest_alloc(d->alloc, QNVME_PAGE_SIZE);
+    for (i = 1; i < QNVME_MAX_QUEUES; i++) {
+        if (d->sq[i]) {
+            nvme_shadow_write(d, nvme_sq_db(d, i), i, d->sq[i]->index);
+        }
+        if (d->cq[i]) {
+            nvme_shadow_write(d, nvme_cq_db(d, i), i, d->cq[i]->index);
+        }
+    }
+
+    qnvme_cmd(cmd, QNVME_ADM_DBBUF_CONFIG, 0);
+    stq_le_p(cmd + 24, d->dbbuf);
+    stq_le_p(cmd + 32, eis);
+    return qnvme_admin(d, cmd, NULL);
+}
@@ -0,0 +1,166 @@
+/*
+ * libqos driver for the NVMe controller
+ *
+ * Copyright (C) 2013 HGST, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef LIBQOS_NVME_H
+#define LIBQOS_NVME_H
+
+#include "libqos/pci.h"
+#include "libqos/malloc.h"
+
+#include <stdbool.h>
+
+#define QNVME_SQE_SIZE 64
+#define QNVME_CQE_SIZE 16
+#define QNVME_MAX_QUEUES 64
+#define QNVME_PAGE_SIZE 4096
+
+/* Admin opcodes */
+#define QNVME_ADM_DELETE_SQ    0x00
+#define QNVME_ADM_CREATE_SQ    0x01
+#define QNVME_ADM_DELETE_CQ    0x04
+#define QNVME_ADM_CREATE_CQ    0x05
+#define QNVME_ADM_SET_FEATURES 0x09
+#define QNVME_ADM_GET_FEATURES 0x0a
+#define QNVME_ADM_DBBUF_CONFIG 0x7c
+#define QNVME_ADM_FORMAT_NVM   0x80
+
+/* NVM opcodes */
+#define QNVME_CMD_FLUSH 0x00
+#define QNVME_CMD_WRITE 0x01
+#define QNVME_CMD_READ  0x02
+#define QNVME_CMD_COMPARE 0x05
+#define QNVME_CMD_WRITE_ZEROES 0x08
+#define QNVME_CMD_DSM 0x09
+#define QNVME_CMD_ZONE_MGMT_SEND 0x79
+#define QNVME_CMD_ZONE_APPEND 0x7d
+
+/* Dataset Management attribute: deallocate the ranges */
+#define QNVME_DSM_AD (1 << 2)
+
+/* Zone Management Send actions */
+#define QNVME_ZONE_ACTION_FINISH 0x02
+#define QNVME_ZONE_ACTION_RESET  0x04
+
+/* Command flags: data pointer is an SGL with a contiguous meta-data buffer */
+#define QNVME_CMD_PSDT_SGL (1 << 6)
+
+/* SGL descriptor types */
+#define QNVME_SGL_DESC_SIZE     16
+#define QNVME_SGL_DATA_BLOCK    0x0
+#define QNVME_SGL_BIT_BUCKET    0x1
+#define QNVME_SGL_SEGMENT       0x2
+#define QNVME_SGL_LAST_SEGMENT  0x3
+
+/* Status codes */
+#define QNVME_SC_INVALID_FIELD   0x002
+#define QNVME_SC_ZONE_BOUNDARY   0x1b8
+#define QNVME_SC_ZONE_FULL       0x1b9
+#define QNVME_SC_GUARD_ERROR     0x282
+#define QNVME_SC_REF_TAG_ERROR   0x284
+#define QNVME_SC_COMPARE_FAILURE 0x285
+#define QNVME_SC_DNR             0x4000
+
+/* Read/write control field */
+#define QNVME_RW_PRACT       (1 << 13)
+#define QNVME_RW_PRCHK_GUARD (1 << 12)
+#define QNVME_RW_PRCHK_REF   (1 << 10)
+
+/* Queue priorities for weighted round robin */
+#define QNVME_PRIO_URGENT 0
+#define QNVME_PRIO_HIGH   1
+#define QNVME_PRIO_MEDIUM 2
+#define QNVME_PRIO_LOW    3
+
+/* Feature identifiers */
+#define QNVME_FEAT_ARBITRATION    0x01
+#define QNVME_FEAT_INT_COALESCING 0x08
+#define QNVME_FEAT_INT_VECTOR     0x09
+
+typedef struct QNvmeQueue
+{
+    uint16_t qid;
+    uint16_t size;
+    uint64_t addr;
+    size_t entry_size;
+
+    /*
+     * Non-contiguous queues: addr is the PRP list and pages[] the queue
+     * pages it lists, which the driver spaces apart in guest memory
+     */
+    bool contig;
+    uint64_t *pages;
+
+    /* SQ: the tail the host writes; CQ: the head and expected phase */
+    uint16_t index;
+    uint8_t phase;
+} QNvmeQueue;
+
+typedef struct QNvmeCqe
+{
+    uint32_t result;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    /* Status field without the phase tag, 0 is success */
+    uint16_t status;
+} QNvmeCqe;
+
+typedef struct QNvmeDevice
+{
+    QPCIDevice *pdev;
+    void *bar;
+    void *msix_bar;
+    uint8_t msix_cap;
+    QGuestAllocator *alloc;
+    uint32_t db_stride;
+
+    QNvmeQueue asq;
+    QNvmeQueue acq;
+    QNvmeQueue *sq[QNVME_MAX_QUEUES];
+    QNvmeQueue *cq[QNVME_MAX_QUEUES];
+    uint16_t cid;
+
+    /* Shadow doorbell buffer, once qnvme_dbbuf_config() set it up */
+    uint64_t dbbuf;
+} QNvmeDevice;
+
+QNvmeDevice *qnvme_init(QPCIBus *bus, QGuestAllocator *alloc);
+QNvmeDevice *qnvme_init_wrr(QPCIBus *bus, QGuestAllocator *alloc);
+void qnvme_uninit(QNvmeDevice *d);
+
+void qnvme_msix_enable(QNvmeDevice *d);
+void qnvme_msix_set_vector(QNvmeDevice *d, uint16_t vector, uint64_t addr,
+                           uint32_t data);
+
+void qnvme_cmd(uint8_t *cmd, uint8_t opcode, uint32_t nsid);
+uint16_t qnvme_admin(QNvmeDevice *d, uint8_t *cmd, uint32_t *result);
+uint16_t qnvme_set_feature(QNvmeDevice *d, uint32_t fid, uint32_t value);
+uint16_t qnvme_get_feature(QNvmeDevice *d, uint32_t fid, uint32_t *value);
+
+QNvmeQueue *qnvme_create_cq(QNvmeDevice *d, uint16_t qid, uint16_t size,
+                            bool contig, uint16_t vector, bool irq);
+QNvmeQueue *qnvme_create_sq(QNvmeDevice *d, uint16_t qid, uint16_t cqid,
+                            uint16_t size, bool contig);
+QNvmeQueue *qnvme_create_sq_prio(QNvmeDevice *d, uint16_t qid, uint16_t cqid,
+                                 uint16_t size, uint8_t prio);
+uint16_t qnvme_delete_sq(QNvmeDevice *d, uint16_t qid);
+uint16_t qnvme_delete_cq(QNvmeDevice *d, uint16_t qid);
+uint16_t qnvme_dbbuf_config(QNvmeDevice *d);
+
+uint16_t qnvme_submit(QNvmeDevice *d, QNvmeQueue *sq, uint8_t *cmd);
+void qnvme_ring(QNvmeDevice *d, QNvmeQueue *sq);
+bool qnvme_poll(QNvmeDevice *d, QNvmeQueue *cq, QNvmeCqe *cqe);
+void qnvme_wait(QNvmeDevice *d, QNvmeQueue *cq, QNvmeCqe *cqe);
+uint16_t qnvme_io(QNvmeDevice *d, QNvmeQueue *sq, QNvmeQueue *cq,
+                  uint8_t *cmd, QNvmeCqe *cqe);
+
+void qnvme_rw_cmd(uint8_t *cmd, uint8_t opcode, uint32_t nsid, uint64_t slba,
+                  uint32_t nlb, uint64_t addr, uint32_t len);
+void qnvme_sgl_desc(uint8_t *desc, uint8_t type, uint64_t addr, uint32_t len);
+
+#endif
@@ -187,6 +187,8 @@ static void *qpci_pc_iomap(QPCIBus *bus, QPCIDevice *dev, int barno)
     } else {
         uint64_t loc;
 
+        /* BARs are naturally aligned, or the low address bits get lost */
+        s->pci_hole_alloc = QEMU_ALIGN_UP(s->pci_hole_alloc, size);
         g_assert((s->pci_hole_alloc + size) <= s->pci_hole_size);
         loc = s->pci_hole_start + s->pci_hole_alloc;
         s->pci_hole_alloc += size;
@@ -0,0 +1,389 @@
+/*
+ * libqos driver for the PQI (SOP) storage device
+ *
+ * Copyright (C) 2013 HGST, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "libqtest.h"
+#include "libqos/pqi.h"
+
+#include "hw/pci/pci_regs.h"
+#include "hw/pci/pci_ids.h"
+
+#include "qemu-common.h"
+
+#include <glib.h>
+#include <string.h>
+
+#define PQI_DEV_ID 0x0100
+
+/* PQI device registers (T10/2240-D, 5.2) */
+#define PQI_AQ_CONFIG 0x0008
+#define PQI_STATUS    0x0040
+#define PQI_AIQ_EAA   0x0058
+#define PQI_AOQ_EAA   0x0060
+#define PQI_AIQ_CIA   0x0068
+#define PQI_AOQ_PIA   0x0070
+#define PQI_AQ_PARM   0x0078
+#define PQI_IQ_PI_REG(qid) (0x0100 + (qid) * 8)
+#define PQI_OQ_CI_REG(qid) (0x0300 + (qid) * 8)
+
+#define PQI_CREATE_ADMIN_QUEUE_PAIR 0x01
+#define PQI_STATE_ADMIN_READY       0x03
+
+/* Administrator functions */
+#define PQI_ADMIN_REQUEST   0x60
+#define PQI_CREATE_OP_IQ    0x10
+#define PQI_CREATE_OP_OQ    0x11
+#define PQI_CHANGE_OP_OQ    0x15
+
+#define PQI_ADMIN_QUEUE_SIZE 16
+
+/* How long to wait for the device before failing the test */
+#define PQI_TIMEOUT_US (10 * 1000 * 1000)
+
+static void pqi_found(QPCIDevice *dev, int devfn, void *data)
+{
+    QPCIDevice **pdev = data;
+
+    *pdev = dev;
+}
+
+static void pqi_writeq(QPQIDevice *d, int reg, uint64_t val)
+{
+    qpci_io_writel(d->pdev, d->bar + reg, (uint32_t)val);
+    qpci_io_writel(d->pdev, d->bar + reg + 4, (uint32_t)(val >> 32));
+}
+
+static void pqi_alloc_queue(QPQIDevice *d, QPQIQueue *q, uint16_t qid,
+                            uint16_t size)
+{
+    uint8_t *zero = g_malloc0(size * QPQI_ELEM_LEN);
+
+    q->qid = qid;
+    q->size = size;
+    q->pi = 0;
+    q->ci = 0;
+
+    /* The allocator hands out whole pages, which keeps the element
+     * arrays and the index locations 64 byte aligned */
+    q->iq_ea = guest_alloc(d->alloc, size * QPQI_ELEM_LEN);
+    q->oq_ea = guest_alloc(d->alloc, size * QPQI_ELEM_LEN);
+    q->iq_ci_addr = guest_alloc(d->alloc, 64);
+    q->oq_pi_addr = guest_alloc(d->alloc, 64);
+
+    memwrite(q->iq_ea, zero, size * QPQI_ELEM_LEN);
+    memwrite(q->oq_ea, zero, size * QPQI_ELEM_LEN);
+    memwrite(q->iq_ci_addr, zero, 64);
+    memwrite(q->oq_pi_addr, zero, 64);
+
+    g_free(zero);
+}
+
+QPQIDevice *qpqi_init(QPCIBus *bus, QGuestAllocator *alloc)
+{
+    QPQIDevice *d = g_malloc0(sizeof(*d));
+    uint16_t cmd;
+
+    qpci_device_foreach(bus, PCI_VENDOR_ID_HGST, PQI_DEV_ID,
+                        pqi_found, &d->pdev);
+    g_assert(d->pdev != NULL);
+
+    qpci_device_enable(d->pdev);
+    cmd = qpci_config_readw(d->pdev, PCI_COMMAND);
+    qpci_config_writew(d->pdev, PCI_COMMAND, cmd | PCI_COMMAND_MASTER);
+
+    d->bar = qpci_iomap(d->pdev, 0);
+    g_assert(d->bar != NULL);
+    d->alloc = alloc;
+
+    /* Administrator queue pair (4.2.3.2) */
+    pqi_alloc_queue(d, &d->admin, 0, PQI_ADMIN_QUEUE_SIZE);
+    pqi_writeq(d, PQI_AIQ_EAA, d->admin.iq_ea);
+    pqi_writeq(d, PQI_AOQ_EAA, d->admin.oq_ea);
+    pqi_writeq(d, PQI_AIQ_CIA, d->admin.iq_ci_addr);
+    pqi_writeq(d, PQI_AOQ_PIA, d->admin.oq_pi_addr);
+    qpci_io_writel(d->pdev, d->bar + PQI_AQ_PARM,
+                   PQI_ADMIN_QUEUE_SIZE | (PQI_ADMIN_QUEUE_SIZE << 8));
+    pqi_writeq(d, PQI_AQ_CONFIG, PQI_CREATE_ADMIN_QUEUE_PAIR);
+
+    g_assert_cmpint(qpci_io_readl(d->pdev, d->bar + PQI_STATUS), ==,
+                    PQI_STATE_ADMIN_READY);
+    g_assert_cmpint(qpci_io_readl(d->pdev, d->bar + PQI_AQ_CONFIG), ==, 0);
+
+    return d;
+}
+
+void qpqi_uninit(QPQIDevice *d)
+{
+    int i;
+
+    for (i = 0; i < QPQI_MAX_QUEUES; i++) {
+        g_free(d->queue[i]);
+    }
+    qpci_iounmap(d->pdev, d->bar);
+    g_free(d->pdev);
+    g_free(d);
+}
+
+/* Sends an administrator request; the header and the request identifier
+ * are filled in here */
+static uint8_t pqi_admin(QPQIDevice *d, uint8_t *iu, QPQIResponse *rsp)
+{
+    iu[0] = PQI_ADMIN_REQUEST;
+    stw_le_p(iu + 2, QPQI_ELEM_LEN - 4);
+    stw_le_p(iu + 8, d->admin_req_id++);
+
+    return qpqi_exec(d, &d->admin, iu, QPQI_ELEM_LEN, rsp);
+}
+
+/*
+ * Turns MSI-X on. Every vector starts out masked; qpqi_msix_set_vector()
+ * points one at guest memory, where the test can watch for the message.
+ */
+void qpqi_msix_enable(QPQIDevice *d)
+{
+    uint8_t cap = qpci_config_readb(d->pdev, PCI_CAPABILITY_LIST);
+    uint32_t table;
+    uint16_t ctrl;
+
+    while (cap && qpci_config_readb(d->pdev, cap) != PCI_CAP_ID_MSIX) {
+        cap = qpci_config_readb(d->pdev, cap + PCI_CAP_LIST_NEXT);
+    }
+    g_assert(cap != 0);
+
+    /* The table sits behind the registers in BAR 0, which is mapped
+     * already; mapping it a second time would move it */
+    table = qpci_config_readl(d->pdev, cap + PCI_MSIX_TABLE);
+    g_assert_cmpint(table & PCI_MSIX_FLAGS_BIRMASK, ==, 0);
+    d->msix_table = d->bar + table;
+
+    ctrl = qpci_config_readw(d->pdev, cap + PCI_MSIX_FLAGS);
+    qpci_config_writew(d->pdev, cap + PCI_MSIX_FLAGS,
+                       ctrl | PCI_MSIX_FLAGS_ENABLE);
+}
+
+void qpqi_msix_set_vector(QPQIDevice *d, uint16_t vector, uint64_t addr,
+                          uint32_t data)
+{
+    void *entry = d->msix_table + vector * PCI_MSIX_ENTRY_SIZE;
+
+    g_assert(d->msix_table != NULL);
+    qpci_io_writel(d->pdev, entry + PCI_MSIX_ENTRY_LOWER_ADDR, (uint32_t)addr);
+    qpci_io_writel(d->pdev, entry + PCI_MSIX_ENTRY_UPPER_ADDR,
+                   (uint32_t)(addr >> 32));
+    qpci_io_writel(d->pdev, entry + PCI_MSIX_ENTRY_DATA, data);
+    qpci_io_writel(d->pdev, entry + PCI_MSIX_ENTRY_VECTOR_CTRL, 0);
+}
+
+/*
+ * Creates the operational OQ and IQ with the given ID. The device posts
+ * the responses to an IQ's commands to the OQ of the same ID.
+ *
+ * The OQ signals MSI-X vector qid and its interrupts are not coalesced
+ * until qpqi_set_coalescing(); nothing in here waits for them.
+ */
+QPQIQueue *qpqi_create_queue(QPQIDevice *d, uint16_t qid, uint16_t size)
+{
+    QPQIQueue *q = g_malloc0(sizeof(*q));
+    QPQIResponse rsp;
+    uint8_t iu[QPQI_ELEM_LEN];
+
+    g_assert(qid > 0 && qid < QPQI_MAX_QUEUES && !d->queue[qid]);
+    pqi_alloc_queue(d, q, qid, size);
+
+    /* 9.2.5 */
+    memset(iu, 0, sizeof(iu));
+    iu[10] = PQI_CREATE_OP_OQ;
+    stw_le_p(iu + 12, qid);
+    stq_le_p(iu + 16, q->oq_ea);
+    stq_le_p(iu + 24, q->oq_pi_addr);
+    stw_le_p(iu + 32, size);
+    stw_le_p(iu + 34, QPQI_ELEM_LEN / 16);
+    stw_le_p(iu + 36, qid);
+    g_assert_cmpint(pqi_admin(d, iu, &rsp), ==, 0);
+
+    /* 9.2.4 */
+    memset(iu, 0, sizeof(iu));
+    iu[10] = PQI_CREATE_OP_IQ;
+    stw_le_p(iu + 12, qid);
+    stq_le_p(iu + 16, q->iq_ea);
+    stq_le_p(iu + 24, q->iq_ci_addr);
+    stw_le_p(iu + 32, size);
+    stw_le_p(iu + 34, QPQI_ELEM_LEN / 16);
+    g_assert_cmpint(pqi_admin(d, iu, &rsp), ==, 0);
+    g_assert_cmpint(ldq_le_p(rsp.iu + 16), ==, PQI_IQ_PI_REG(qid));
+
+    d->queue[qid] = q;
+    return q;
+}
+
+/* Interrupts once count responses wait on the OQ, or max_time_us after
+ * the first of them was posted (9.2.9) */
+void qpqi_set_coalescing(QPQIDevice *d, uint16_t qid, uint16_t count,
+                         uint16_t max_time_us)
+{
+    QPQIResponse rsp;
+    uint8_t iu[QPQI_ELEM_LEN];
+
+    g_assert(d->queue[qid] != NULL);
+
+    memset(iu, 0, sizeof(iu));
+    iu[10] = PQI_CHANGE_OP_OQ;
+    stw_le_p(iu + 12, qid);
+    stw_le_p(iu + 20, count);
+    stw_le_p(iu + 24, max_time_us);
+    g_assert_cmpint(pqi_admin(d, iu, &rsp), ==, 0);
+}
+
+/*
+ * Copies an IU into the IQ; IUs longer than an element take up several.
+ * The PI is only handed to the device by qpqi_kick(), so several IUs can
+ * go with one doorbell write. Waits for room if the IQ is full, which
+ * requires the IUs already in it to have been kicked.
+ */
+void qpqi_submit(QPQIDevice *d, QPQIQueue *q, const void *iu, size_t len)
+{
+    const uint8_t *p = iu;
+    uint16_t nelem = DIV_ROUND_UP(len, QPQI_ELEM_LEN);
+    int64_t deadline = g_get_monotonic_time() + PQI_TIMEOUT_US;
+    uint16_t ci;
+
+    g_assert(nelem > 0 && nelem < q->size);
+
+    for (;;) {
+        ci = readw(q->iq_ci_addr);
+        if ((q->pi + q->size - ci) % q->size + nelem < q->size) {
+            break;
+        }
+        g_assert(g_get_monotonic_time() < deadline);
+    }
+
+    while (len) {
+        size_t n = MIN(len, QPQI_ELEM_LEN);
+
+        memwrite(q->iq_ea + q->pi * QPQI_ELEM_LEN, p, n);
+        q->pi = (q->pi + 1) % q->size;
+        p += n;
+        len -= n;
+    }
+}
+
+void qpqi_kick(QPQIDevice *d, QPQIQueue *q)
+{
+    qpci_io_writel(d->pdev, d->bar + PQI_IQ_PI_REG(q->qid), q->pi);
+}
+
+/*
+ * Takes the next response off the OQ and hands its element back to the
+ * device. Returns false if there is none.
+ */
+bool qpqi_poll(QPQIDevice *d, QPQIQueue *q, QPQIResponse *rsp)
+{
+    if (readw(q->oq_pi_addr) == q->ci) {
+        return false;
+    }
+
+    memread(q->oq_ea + q->ci * QPQI_ELEM_LEN, rsp->iu, QPQI_ELEM_LEN);
+    q->ci = (q->ci + 1) % q->size;
+    qpci_io_writel(d->pdev, d->bar + PQI_OQ_CI_REG(q->qid), q->ci);
+
+    rsp->type = rsp->iu[0];
+    rsp->request_id = lduw_le_p(rsp->iu + 8);
+    switch (rsp->type) {
+    case QPQI_IU_ADMIN_RSP:
+        rsp->status = rsp->iu[11];
+        break;
+    case QPQI_IU_COMMAND_RSP:
+        rsp->status = rsp->iu[17];
+        break;
+    default:
+        rsp->status = 0;
+        break;
+    }
+
+    return true;
+}
+
+void qpqi_wait(QPQIDevice *d, QPQIQueue *q, QPQIResponse *rsp)
+{
+    int64_t deadline = g_get_monotonic_time() + PQI_TIMEOUT_US;
+
+    while (!qpqi_poll(d, q, rsp)) {
+        g_assert(g_get_monotonic_time() < deadline);
+    }
+}
+
+/* Runs a single IU to completion; returns the response's status */
+uint8_t qpqi_exec(QPQIDevice *d, QPQIQueue *q, const void *iu, size_t len,
+                  QPQIResponse *rsp)
+{
+    uint16_t request_id = lduw_le_p((const uint8_t *)iu + 8);
+
+    qpqi_submit(d, q, iu, len);
+    qpqi_kick(d, q);
+    qpqi_wait(d, q, rsp);
+    g_assert_cmpint(rsp->request_id, ==, request_id);
+
+    return rsp->status;
+}
+
+/* Fills in one SGL descriptor; the type goes in the upper nibble of the
+ * last byte. Segment descriptors take the length of the table they point
+ * to, a multiple of QPQI_SGL_DESC_LEN. */
+void qpqi_sgl_desc(uint8_t *desc, int type, uint64_t addr, uint32_t len)
+{
+    memset(desc, 0, QPQI_SGL_DESC_LEN);
+    stq_le_p(desc, addr);
+    stl_le_p(desc + 8, len);
+    desc[15] = type << 4;
+}
+
+static void pqi_cmd_sgl(uint8_t *sg, uint64_t addr, uint32_t len)
+{
+    /* A single data block descriptor; the second one stays zero */
+    if (len) {
+        qpqi_sgl_desc(sg, QPQI_SGL_DATA, addr, len);
+    }
+}
+
+/* Builds a limited command IU (8.5.2), which always addresses LUN 0 */
+void qpqi_limited_cmd(uint8_t *iu, uint16_t qid, uint16_t request_id,
+                      const uint8_t *cdb, int cdb_len, int dir,
+                      uint64_t addr, uint32_t len)
+{
+    g_assert(cdb_len <= 16);
+
+    memset(iu, 0, QPQI_LIMITED_CMD_LEN);
+    iu[0] = 0x10;
+    stw_le_p(iu + 2, QPQI_LIMITED_CMD_LEN - 4);
+    stw_le_p(iu + 4, qid);
+    stw_le_p(iu + 8, request_id);
+    iu[10] = dir;
+    stl_le_p(iu + 12, len);
+    memcpy(iu + 16, cdb, cdb_len);
+    pqi_cmd_sgl(iu + QPQI_LIMITED_SGL, addr, len);
+}
+
+/* Builds a SOP command IU (8.5.1) for a LUN in flat space addressing */
+void qpqi_lun_cmd(uint8_t *iu, uint16_t qid, uint16_t request_id, int lun,
+                  const uint8_t *cdb, int cdb_len, int dir,
+                  uint64_t addr, uint32_t len)
+{
+    g_assert(cdb_len <= 16 && lun < 0x4000);
+
+    memset(iu, 0, QPQI_CMD_LEN);
+    iu[0] = 0x11;
+    stw_le_p(iu + 2, QPQI_CMD_LEN - 4);
+    stw_le_p(iu + 4, qid);
+    stw_le_p(iu + 8, request_id);
+    stl_le_p(iu + 12, len);
+    iu[16] = 0x40 | (lun >> 8);
+    iu[17] = lun & 0xff;
+    iu[25] = dir;
+    memcpy(iu + 32, cdb, cdb_len);
+    pqi_cmd_sgl(iu + QPQI_CMD_SGL, addr, len);
+}
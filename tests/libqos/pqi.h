@@ -0,0 +1,109 @@
+/*
+ * libqos driver for the PQI (SOP) storage device
+ *
+ * Copyright (C) 2013 HGST, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef LIBQOS_PQI_H
+#define LIBQOS_PQI_H
+
+#include "libqos/pci.h"
+#include "libqos/malloc.h"
+
+#include <stdbool.h>
+
+/* Both the administrator and the operational queues use 64 byte elements */
+#define QPQI_ELEM_LEN 64
+
+#define QPQI_MAX_QUEUES 64
+
+/* Data direction of a command IU */
+#define QPQI_DIR_NONE        0x00
+#define QPQI_DIR_FROM_DEVICE 0x01
+#define QPQI_DIR_TO_DEVICE   0x02
+
+/* Response IU types */
+#define QPQI_IU_SUCCESS_RSP 0x90
+#define QPQI_IU_COMMAND_RSP 0x91
+#define QPQI_IU_ADMIN_RSP   0xE0
+
+/* Length of a limited command IU (LUN 0) and of a SOP command IU */
+#define QPQI_LIMITED_CMD_LEN 64
+#define QPQI_CMD_LEN         80
+
+/* Offset of the two SGL descriptors in either command IU */
+#define QPQI_LIMITED_SGL 32
+#define QPQI_CMD_SGL     48
+
+/* SGL descriptor types (7.3) */
+#define QPQI_SGL_DESC_LEN     16
+#define QPQI_SGL_DATA         0x0
+#define QPQI_SGL_BIT_BUCKET   0x1
+#define QPQI_SGL_SEGMENT      0x2
+#define QPQI_SGL_LAST_SEGMENT 0x3
+
+typedef struct QPQIQueue
+{
+    uint16_t qid;
+    uint16_t size;
+
+    uint64_t iq_ea;
+    uint64_t iq_ci_addr;
+    uint64_t oq_ea;
+    uint64_t oq_pi_addr;
+
+    /* Host side indices: the IQ PI and the OQ CI */
+    uint16_t pi;
+    uint16_t ci;
+} QPQIQueue;
+
+typedef struct QPQIDevice
+{
+    QPCIDevice *pdev;
+    void *bar;
+    void *msix_table;
+    QGuestAllocator *alloc;
+
+    QPQIQueue admin;
+    QPQIQueue *queue[QPQI_MAX_QUEUES];
+    uint16_t admin_req_id;
+} QPQIDevice;
+
+typedef struct QPQIResponse
+{
+    uint8_t type;
+    uint16_t request_id;
+    /* Administrator status or SCSI status, 0 is good */
+    uint8_t status;
+    uint8_t iu[QPQI_ELEM_LEN];
+} QPQIResponse;
+
+QPQIDevice *qpqi_init(QPCIBus *bus, QGuestAllocator *alloc);
+void qpqi_uninit(QPQIDevice *d);
+
+void qpqi_msix_enable(QPQIDevice *d);
+void qpqi_msix_set_vector(QPQIDevice *d, uint16_t vector, uint64_t addr,
+                          uint32_t data);
+
+QPQIQueue *qpqi_create_queue(QPQIDevice *d, uint16_t qid, uint16_t size);
+void qpqi_set_coalescing(QPQIDevice *d, uint16_t qid, uint16_t count,
+                         uint16_t max_time_us);
+
+void qpqi_submit(QPQIDevice *d, QPQIQueue *q, const void *iu, size_t len);
+void qpqi_kick(QPQIDevice *d, QPQIQueue *q);
+bool qpqi_poll(QPQIDevice *d, QPQIQueue *q, QPQIResponse *rsp);
+void qpqi_wait(QPQIDevice *d, QPQIQueue *q, QPQIResponse *rsp);
+uint8_t qpqi_exec(QPQIDevice *d, QPQIQueue *q, const void *iu, size_t len,
+                  QPQIResponse *rsp);
+
+void qpqi_sgl_desc(uint8_t *desc, int type, uint64_t addr, uint32_t len);
+void qpqi_limited_cmd(uint8_t *iu, uint16_t qid, uint16_t request_id,
+                      const uint8_t *cdb, int cdb_len, int dir,
+                      uint64_t addr, uint32_t len);
+void qpqi_lun_cmd(uint8_t *iu, uint16_t qid, uint16_t request_id, int lun,
+                  const uint8_t *cdb, int cdb_len, int dir,
+                  uint64_t addr, uint32_t len);
+
+#endif
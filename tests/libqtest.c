@@ -30,6 +30,8 @@
 
 #include "qemu/compiler.h"
 #include "qemu/osdep.h"
+#include "qapi/qmp/qjson.h"
+#include "qapi/qmp/qdict.h"
 
 #define MAX_IRQ 256
 
@@ -287,15 +289,29 @@ redo:
     return words;
 }
 
+/* An asynchronous event is a JSON object with an "event" member */
+static bool qmp_is_event(const char *json)
+{
+    QObject *obj = qobject_from_json(json);
+    bool event = false;
+
+    if (obj && qobject_type(obj) == QTYPE_QDICT) {
+        event = qdict_haskey(qobject_to_qdict(obj), "event");
+    }
+    qobject_decref(obj);
+    return event;
+}
+
 void qtest_qmpv(QTestState *s, const char *fmt, va_list ap)
 {
+    GString *reply = g_string_new("");
     bool has_reply = false;
     int nesting = 0;
 
     /* Send QMP request */
     socket_sendf(s->qmp_fd, fmt, ap);
 
-    /* Receive reply */
+    /* Receive reply, skipping any asynchronous events sent before it */
     while (!has_reply || nesting > 0) {
         ssize_t len;
         char c;
@@ -319,7 +335,16 @@ void qtest_qmpv(QTestState *s, const char *fmt, va_list ap)
             nesting--;
             break;
         }
+
+        if (has_reply) {
+            g_string_append_c(reply, c);
+        }
+        if (has_reply && nesting == 0 && qmp_is_event(reply->str)) {
+            g_string_truncate(reply, 0);
+            has_reply = false;
+        }
     }
+    g_string_free(reply, true);
 }
 
 void qtest_qmp(QTestState *s, const char *fmt, ...)
@@ -0,0 +1,889 @@
+/*
+ * qtest NVMe device test cases
+ *
+ * Copyright (C) 2013 HGST, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Every case starts its own QEMU, so each can pick the controller options
+ * it needs. The drive is opened with snapshot=on: every run starts from a
+ * zeroed image, and savevm has a qcow2 overlay to write the VM state to.
+ *
+ * Interrupts are observed by pointing the MSI-X table entry of the IO
+ * completion queue at guest memory: msix_notify() stores the message data
+ * there, so a non-zero word means the vector has fired. vm_clock only
+ * moves with clock_step(), which makes the coalescing timer deterministic.
+ */
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libqtest.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc-pc.h"
+#include "libqos/nvme.h"
+
+#include "qemu-common.h"
+
+#define TEST_IMAGE_SIZE (8 * 1024 * 1024)
+
+#define IO_QID 1
+#define IO_VECTOR 1
+#define IO_QUEUE_SIZE 16
+
+/* Queue pair deleted with commands in flight */
+#define DEL_QID 3
+
+/* Weighted round robin: a shared CQ and SQs of three priorities */
+#define WRR_QID 4
+
+/* Non-contiguous queues, two pages each */
+#define PC_QID 2
+#define PC_SQ_SIZE (2 * QNVME_PAGE_SIZE / QNVME_SQE_SIZE)
+#define PC_CQ_SIZE (2 * QNVME_PAGE_SIZE / QNVME_CQE_SIZE)
+
+#define MSI_DATA 0x4d5349
+
+/* Aggregation threshold of 4 completions, aggregation time of 1 ms */
+#define INTC_THR 3
+#define INTC_TIME 10
+#define INTC_TIME_NS (INTC_TIME * 100 * 1000)
+
+/* Extended 512 + 8 byte LBAs with type 1 protection information */
+#define PI_OPTS "nlbaf=2,lba_index=1,meta=8,mc=1,extended=1,dpc=9,dps=9"
+#define PI_LBA_SIZE (512 + 8)
+#define PI_CHECK (QNVME_RW_PRCHK_GUARD | QNVME_RW_PRCHK_REF)
+
+/* Writes are acknowledged once programmed, after 1 ms */
+#define FLASH_OPTS "flash_model=1,flash_wbuf_kb=0,flash_prog_us=1000," \
+                   "flash_read_us=200"
+
+/* 1 MB zones of 512-byte blocks */
+#define ZNS_OPTS "zoned=1,zone_size_mb=1"
+#define ZNS_ZONE_BLOCKS 2048
+
+static char test_image[] = "/tmp/qtest.XXXXXX";
+
+static QPCIBus *bus;
+static QGuestAllocator *alloc;
+static QNvmeDevice *nvme;
+static QNvmeQueue *iosq;
+static QNvmeQueue *iocq;
+static uint64_t msi_addr;
+
+static void nvme_boot(const char *opts, bool wrr)
+{
+    char *cmdline;
+
+    /* Doorbells are handled on the qtest thread, without ioeventfd */
+    cmdline = g_strdup_printf("-drive file=%s,if=none,id=drive0,format=raw,"
+                              "snapshot=on "
+                              "-device nvme,drive=drive0,serial=qtest,"
+                              "ioeventfd=0,cqr=0%s%s", test_image,
+                              opts ? "," : "", opts ? opts : "");
+    qtest_start(cmdline);
+    g_free(cmdline);
+
+    bus = qpci_init_pc();
+    alloc = pc_alloc_init();
+    nvme = wrr ? qnvme_init_wrr(bus, alloc) : qnvme_init(bus, alloc);
+
+    msi_addr = guest_alloc(alloc, 4);
+    writel(msi_addr, 0);
+    qnvme_msix_enable(nvme);
+    qnvme_msix_set_vector(nvme, IO_VECTOR, msi_addr, MSI_DATA);
+
+    iocq = qnvme_create_cq(nvme, IO_QID, IO_QUEUE_SIZE, true, IO_VECTOR,
+                           true);
+    iosq = qnvme_create_sq(nvme, IO_QID, IO_QID, IO_QUEUE_SIZE, true);
+}
+
+static void nvme_start(const char *opts)
+{
+    nvme_boot(opts, false);
+}
+
+static void nvme_start_wrr(const char *opts)
+{
+    nvme_boot(opts, true);
+}
+
+static void nvme_stop(void)
+{
+    qnvme_uninit(nvme);
+    qtest_quit(global_qtest);
+    g_free(alloc);
+    g_free(bus);
+}
+
+static void fill_pattern(uint64_t addr, uint32_t len, uint8_t seed)
+{
+    uint32_t i;
+
+    for (i = 0; i < len; i++) {
+        writeb(addr + i, (uint8_t)(seed + i));
+    }
+}
+
+/* Checks len bytes of guest memory against fill_pattern(skip bytes in) */
+static void check_pattern(uint64_t addr, uint32_t len, uint8_t seed,
+                          uint32_t skip)
+{
+    uint8_t *buf = g_malloc(len);
+    uint32_t i;
+
+    memread(addr, buf, len);
+    for (i = 0; i < len; i++) {
+        g_assert_cmphex(buf[i], ==, (uint8_t)(seed + skip + i));
+    }
+    g_free(buf);
+}
+
+static void check_zero(uint64_t addr, uint32_t len)
+{
+    uint8_t *buf = g_malloc(len);
+    uint32_t i;
+
+    memread(addr, buf, len);
+    for (i = 0; i < len; i++) {
+        g_assert_cmphex(buf[i], ==, 0);
+    }
+    g_free(buf);
+}
+
+/* Reads or writes nlb blocks of a namespace through the IO queue pair */
+static uint16_t io_rw_ns(uint32_t nsid, uint8_t opcode, uint64_t slba,
+                         uint32_t nlb, uint32_t len, uint16_t control,
+                         uint64_t buf)
+{
+    uint8_t cmd[QNVME_SQE_SIZE];
+    QNvmeCqe cqe;
+
+    qnvme_rw_cmd(cmd, opcode, nsid, slba, nlb, buf, len);
+    stw_le_p(cmd + 50, control);
+    return qnvme_io(nvme, iosq, iocq, cmd, &cqe);
+}
+
+static uint16_t io_rw(uint8_t opcode, uint64_t slba, uint32_t nlb,
+                      uint32_t len, uint16_t control, uint64_t buf)
+{
+    return io_rw_ns(1, opcode, slba, nlb, len, control, buf);
+}
+
+static bool irq_fired(void)
+{
+    return readl(msi_addr) == MSI_DATA;
+}
+
+static void irq_clear(void)
+{
+    writel(msi_addr, 0);
+}
+
+/* Submits count flushes with one doorbell write and reaps them all */
+static void flush_on(QNvmeQueue *sq, QNvmeQueue *cq, int count)
+{
+    uint8_t cmd[QNVME_SQE_SIZE];
+    QNvmeCqe cqe;
+    uint16_t cid = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        qnvme_cmd(cmd, QNVME_CMD_FLUSH, 1);
+        cid = qnvme_submit(nvme, sq, cmd);
+    }
+    qnvme_ring(nvme, sq);
+
+    for (i = 0; i < count; i++) {
+        qnvme_wait(nvme, cq, &cqe);
+        g_assert_cmpint(cqe.status, ==, 0);
+        g_assert_cmpint(cqe.sq_id, ==, sq->qid);
+        g_assert_cmpint(cqe.cid, ==, (uint16_t)(cid - count + 1 + i));
+    }
+}
+
+static void flush(int count)
+{
+    flush_on(iosq, iocq, count);
+}
+
+static void test_coalescing_feature(void)
+{
+    uint32_t value = 0;
+
+    nvme_start(NULL);
+
+    g_assert_cmpint(qnvme_set_feature(nvme, QNVME_FEAT_INT_COALESCING,
+                                      INTC_THR | (INTC_TIME << 8)), ==, 0);
+    g_assert_cmpint(qnvme_get_feature(nvme, QNVME_FEAT_INT_COALESCING,
+                                      &value), ==, 0);
+    g_assert_cmphex(value, ==, INTC_THR | (INTC_TIME << 8));
+
+    nvme_stop();
+}
+
+static void test_coalescing_off(void)
+{
+    nvme_start(NULL);
+
+    g_assert_cmpint(qnvme_set_feature(nvme, QNVME_FEAT_INT_COALESCING, 0),
+                    ==, 0);
+
+    irq_clear();
+    flush(1);
+    g_assert(irq_fired());
+
+    nvme_stop();
+}
+
+static void test_coalescing_time(void)
+{
+    nvme_start(NULL);
+
+    g_assert_cmpint(qnvme_set_feature(nvme, QNVME_FEAT_INT_COALESCING,
+                                      INTC_THR | (INTC_TIME << 8)), ==, 0);
+
+    /* A single completion is held back until the aggregation time ends */
+    irq_clear();
+    flush(1);
+    g_assert(!irq_fired());
+
+    clock_step(INTC_TIME_NS / 2);
+    g_assert(!irq_fired());
+
+    clock_step(INTC_TIME_NS);
+    g_assert(irq_fired());
+
+    nvme_stop();
+}
+
+static void test_coalescing_threshold(void)
+{
+    nvme_start(NULL);
+
+    g_assert_cmpint(qnvme_set_feature(nvme, QNVME_FEAT_INT_COALESCING,
+                                      INTC_THR | (INTC_TIME << 8)), ==, 0);
+
+    /* One completion short of the threshold stays pending... */
+    irq_clear();
+    flush(INTC_THR);
+    g_assert(!irq_fired());
+
+    /* ...and the next one signals the vector without the timer */
+    flush(1);
+    g_assert(irq_fired());
+
+    /* Nothing is left for the timer to signal */
+    irq_clear();
+    clock_step(INTC_TIME_NS * 2);
+    g_assert(!irq_fired());
+
+    nvme_stop();
+}
+
+/*
+ * Delete I/O SQ with writes still queued behind it: the deletion waits for
+ * the commands the controller already fetched, their completions reach the
+ * CQ before the admin command completes, and the queue IDs are free again
+ * afterwards.
+ */
+static void test_del_sq_inflight(void)
+{
+    uint8_t cmd[QNVME_SQE_SIZE];
+    QNvmeQueue *cq, *sq;
+    QNvmeCqe cqe;
+    uint64_t buf;
+    int i;
+
+    nvme_start(PI_OPTS);
+
+    buf = guest_alloc(alloc, 2 * QNVME_PAGE_SIZE);
+    fill_pattern(buf, 2 * QNVME_PAGE_SIZE, 0x5a);
+
+    cq = qnvme_create_cq(nvme, DEL_QID, IO_QUEUE_SIZE, true, 0, false);
+    sq = qnvme_create_sq(nvme, DEL_QID, DEL_QID, IO_QUEUE_SIZE, true);
+    for (i = 0; i < IO_QUEUE_SIZE - 1; i++) {
+        qnvme_rw_cmd(cmd, QNVME_CMD_WRITE, 1, i * 16, 16, buf,
+                     2 * QNVME_PAGE_SIZE);
+        stw_le_p(cmd + 50, QNVME_RW_PRACT);
+        qnvme_submit(nvme, sq, cmd);
+    }
+    qnvme_ring(nvme, sq);
+
+    g_assert_cmpint(qnvme_delete_sq(nvme, DEL_QID), ==, 0);
+
+    /* Whatever was fetched has completed successfully */
+    while (qnvme_poll(nvme, cq, &cqe)) {
+        g_assert_cmpint(cqe.status, ==, 0);
+        g_assert_cmpint(cqe.sq_id, ==, DEL_QID);
+    }
+    g_assert_cmpint(qnvme_delete_cq(nvme, DEL_QID), ==, 0);
+
+    cq = qnvme_create_cq(nvme, DEL_QID, IO_QUEUE_SIZE, true, 0, false);
+    sq = qnvme_create_sq(nvme, DEL_QID, DEL_QID, IO_QUEUE_SIZE, true);
+    flush_on(sq, cq, 4);
+    flush(1);
+
+    nvme_stop();
+}
+
+/*
+ * An SGL read through a chain of two segments: the first block goes to a
+ * data block, the second into a bit bucket and the other six to a data
+ * block right behind the first, so the guest gets the blocks on either
+ * side of the discarded one back to back and nothing past them.
+ */
+static void test_sgl_bit_bucket(void)
+{
+    uint8_t cmd[QNVME_SQE_SIZE];
+    uint8_t seg[2 * QNVME_SGL_DESC_SIZE];
+    uint64_t src, dst, seg0, seg1;
+    QNvmeCqe cqe;
+
+    nvme_start(NULL);
+
+    src = guest_alloc(alloc, QNVME_PAGE_SIZE);
+    dst = guest_alloc(alloc, QNVME_PAGE_SIZE);
+    seg0 = guest_alloc(alloc, QNVME_PAGE_SIZE);
+    seg1 = guest_alloc(alloc, QNVME_PAGE_SIZE);
+
+    fill_pattern(src, QNVME_PAGE_SIZE, 0x11);
+    qnvme_rw_cmd(cmd, QNVME_CMD_WRITE, 1, 0, 8, src, QNVME_PAGE_SIZE);
+    g_assert_cmpint(qnvme_io(nvme, iosq, iocq, cmd, &cqe), ==, 0);
+
+    fill_pattern(dst, QNVME_PAGE_SIZE, 0x80);
+
+    qnvme_sgl_desc(seg, QNVME_SGL_DATA_BLOCK, dst, 512);
+    qnvme_sgl_desc(seg + QNVME_SGL_DESC_SIZE, QNVME_SGL_LAST_SEGMENT, seg1,
+                   2 * QNVME_SGL_DESC_SIZE);
+    memwrite(seg0, seg, sizeof(seg));
+    qnvme_sgl_desc(seg, QNVME_SGL_BIT_BUCKET, 0, 512);
+    qnvme_sgl_desc(seg + QNVME_SGL_DESC_SIZE, QNVME_SGL_DATA_BLOCK,
+                   dst + 512, 6 * 512);
+    memwrite(seg1, seg, sizeof(seg));
+
+    qnvme_rw_cmd(cmd, QNVME_CMD_READ, 1, 0, 8, 0, 0);
+    cmd[1] |= QNVME_CMD_PSDT_SGL;
+    qnvme_sgl_desc(cmd + 24, QNVME_SGL_SEGMENT, seg0,
+                   2 * QNVME_SGL_DESC_SIZE);
+    g_assert_cmpint(qnvme_io(nvme, iosq, iocq, cmd, &cqe), ==, 0);
+
+    check_pattern(dst, 512, 0x11, 0);
+    check_pattern(dst + 512, 6 * 512, 0x11, 1024);
+    check_pattern(dst + 7 * 512, 512, 0x80, 7 * 512);
+
+    nvme_stop();
+}
+
+/* PRACT transfers carry data only; the controller handles the tuples */
+static uint16_t pi_io(uint8_t opcode, uint64_t slba, uint32_t nlb,
+                      uint64_t buf)
+{
+    return io_rw(opcode, slba, nlb, nlb * 512, QNVME_RW_PRACT, buf);
+}
+
+/*
+ * Compare on extended LBAs, with the controller stripping the protection
+ * information: the host buffer holds data only, a shifted range or a
+ * flipped byte fails, and never written blocks compare equal to zeroes.
+ */
+static void test_compare_pi(void)
+{
+    uint64_t buf, zero;
+
+    nvme_start(PI_OPTS);
+
+    buf = guest_alloc(alloc, 2 * QNVME_PAGE_SIZE);
+    zero = guest_alloc(alloc, 2 * QNVME_PAGE_SIZE);
+    fill_pattern(buf, 2 * QNVME_PAGE_SIZE, 0x33);
+
+    g_assert_cmpint(pi_io(QNVME_CMD_WRITE, 4, 16, buf), ==, 0);
+    g_assert_cmpint(pi_io(QNVME_CMD_COMPARE, 4, 16, buf), ==, 0);
+    g_assert_cmphex(pi_io(QNVME_CMD_COMPARE, 3, 16, buf), ==,
+                    QNVME_SC_COMPARE_FAILURE);
+
+    writeb(buf + 9 * 512 + 17, 0);
+    g_assert_cmphex(pi_io(QNVME_CMD_COMPARE, 4, 16, buf), ==,
+                    QNVME_SC_COMPARE_FAILURE);
+
+    g_assert_cmpint(pi_io(QNVME_CMD_COMPARE, 64, 16, zero), ==, 0);
+
+    nvme_stop();
+}
+
+/*
+ * Tuples the controller generated (PRACT) read back with the data's guard
+ * and the LBA as reference tag. Writes that carry their own tuples are
+ * checked against the data and the LBA they land at, and a failed check
+ * leaves the blocks alone.
+ */
+static void test_pi_check(void)
+{
+    uint64_t data, ext;
+    uint8_t tuple[8];
+    uint8_t byte;
+    int i;
+
+    nvme_start(PI_OPTS);
+
+    data = guest_alloc(alloc, QNVME_PAGE_SIZE);
+    ext = guest_alloc(alloc, QNVME_PAGE_SIZE);
+    fill_pattern(data, 4 * 512, 0x21);
+    g_assert_cmpint(pi_io(QNVME_CMD_WRITE, 8, 4, data), ==, 0);
+
+    /* Without PRACT every block is followed by its tuple */
+    g_assert_cmpint(io_rw(QNVME_CMD_READ, 8, 4, 4 * PI_LBA_SIZE, PI_CHECK,
+                          ext), ==, 0);
+    for (i = 0; i < 4; i++) {
+        check_pattern(ext + i * PI_LBA_SIZE, 512, 0x21, i * 512);
+        memread(ext + i * PI_LBA_SIZE + 512, tuple, sizeof(tuple));
+        g_assert_cmphex(lduw_be_p(tuple + 2), ==, 0);
+        g_assert_cmphex(ldl_be_p(tuple + 4), ==, 8 + i);
+    }
+
+    /* One LBA further on, the reference tags are off by one */
+    g_assert_cmphex(io_rw(QNVME_CMD_WRITE, 9, 4, 4 * PI_LBA_SIZE,
+                          QNVME_RW_PRCHK_REF, ext), ==,
+                    QNVME_SC_REF_TAG_ERROR);
+
+    /* A flipped data byte no longer matches its guard */
+    byte = readb(ext + PI_LBA_SIZE + 100);
+    writeb(ext + PI_LBA_SIZE + 100, byte ^ 0xff);
+    g_assert_cmphex(io_rw(QNVME_CMD_WRITE, 8, 4, 4 * PI_LBA_SIZE,
+                          QNVME_RW_PRCHK_GUARD, ext), ==,
+                    QNVME_SC_GUARD_ERROR);
+
+    fill_pattern(data, 4 * 512, 0);
+    g_assert_cmpint(pi_io(QNVME_CMD_READ, 8, 4, data), ==, 0);
+    check_pattern(data, 4 * 512, 0x21, 0);
+
+    nvme_stop();
+}
+
+/*
+ * Write Zeroes on extended LBAs zeroes exactly the blocks it is given:
+ * the data and tuples of the blocks around them still check out.
+ */
+static void test_write_zeroes(void)
+{
+    uint8_t cmd[QNVME_SQE_SIZE];
+    QNvmeCqe cqe;
+    uint64_t buf;
+
+    nvme_start(PI_OPTS);
+
+    buf = guest_alloc(alloc, 2 * QNVME_PAGE_SIZE);
+    fill_pattern(buf, 16 * 512, 0x42);
+    g_assert_cmpint(pi_io(QNVME_CMD_WRITE, 0, 16, buf), ==, 0);
+
+    qnvme_rw_cmd(cmd, QNVME_CMD_WRITE_ZEROES, 1, 4, 4, 0, 0);
+    g_assert_cmpint(qnvme_io(nvme, iosq, iocq, cmd, &cqe), ==, 0);
+
+    fill_pattern(buf, 16 * 512, 0x99);
+    g_assert_cmpint(io_rw(QNVME_CMD_READ, 0, 16, 16 * 512,
+                          QNVME_RW_PRACT | PI_CHECK, buf), ==, 0);
+    check_pattern(buf, 4 * 512, 0x42, 0);
+    check_zero(buf + 4 * 512, 4 * 512);
+    check_pattern(buf + 8 * 512, 8 * 512, 0x42, 8 * 512);
+
+    nvme_stop();
+}
+
+/*
+ * Deallocating blocks of an extended format with meta-data erases them
+ * whole: they read back as zeroes with tuples that check out, and the
+ * blocks on either side keep their data and tuples.
+ */
+static void test_dsm_deallocate(void)
+{
+    uint8_t cmd[QNVME_SQE_SIZE];
+    QNvmeCqe cqe;
+    uint64_t buf, range;
+
+    nvme_start(PI_OPTS);
+
+    buf = guest_alloc(alloc, 2 * QNVME_PAGE_SIZE);
+    range = guest_alloc(alloc, QNVME_PAGE_SIZE);
+    fill_pattern(buf, 16 * 512, 0x6d);
+    g_assert_cmpint(pi_io(QNVME_CMD_WRITE, 0, 16, buf), ==, 0);
+
+    /* One range, LBAs 5 to 7 */
+    writel(range, 0);
+    writel(range + 4, 3);
+    writeq(range + 8, 5);
+    qnvme_cmd(cmd, QNVME_CMD_DSM, 1);
+    stq_le_p(cmd + 24, range);
+    stl_le_p(cmd + 40, 0);
+    stl_le_p(cmd + 44, QNVME_DSM_AD);
+    g_assert_cmpint(qnvme_io(nvme, iosq, iocq, cmd, &cqe), ==, 0);
+
+    fill_pattern(buf, 16 * 512, 0x99);
+    g_assert_cmpint(io_rw(QNVME_CMD_READ, 0, 16, 16 * 512,
+                          QNVME_RW_PRACT | PI_CHECK, buf), ==, 0);
+    check_pattern(buf, 5 * 512, 0x6d, 0);
+    check_zero(buf + 5 * 512, 3 * 512);
+    check_pattern(buf + 8 * 512, 8 * 512, 0x6d, 8 * 512);
+
+    nvme_stop();
+}
+
+/* Appends nlb blocks to the zone at zslba, *lba is where they went */
+static uint16_t zone_append(uint64_t zslba, uint32_t nlb, uint64_t buf,
+                            uint64_t *lba)
+{
+    uint8_t cmd[QNVME_SQE_SIZE];
+    QNvmeCqe cqe;
+    uint16_t status;
+
+    qnvme_rw_cmd(cmd, QNVME_CMD_ZONE_APPEND, 1, zslba, nlb, buf,
+                 MIN(nlb * 512, 2 * QNVME_PAGE_SIZE));
+    status = qnvme_io(nvme, iosq, iocq, cmd, &cqe);
+    *lba = cqe.result;
+    return status;
+}
+
+static uint16_t zone_send(uint64_t zslba, uint8_t action)
+{
+    uint8_t cmd[QNVME_SQE_SIZE];
+    QNvmeCqe cqe;
+
+    qnvme_cmd(cmd, QNVME_CMD_ZONE_MGMT_SEND, 1);
+    stq_le_p(cmd + 40, zslba);
+    stl_le_p(cmd + 52, action);
+    return qnvme_io(nvme, iosq, iocq, cmd, &cqe);
+}
+
+/*
+ * Zone Append returns where each append went. It is refused when it would
+ * run past the zone's capacity or once the zone is full, and a reset zone
+ * reads back as zeroes and is appended to from its start again.
+ */
+static void test_zns_append_reset(void)
+{
+    uint64_t buf, lba;
+
+    nvme_start(ZNS_OPTS);
+
+    buf = guest_alloc(alloc, 2 * QNVME_PAGE_SIZE);
+    fill_pattern(buf, 16 * 512, 0x3c);
+    g_assert_cmpint(zone_append(0, 8, buf, &lba), ==, 0);
+    g_assert_cmpint(lba, ==, 0);
+    g_assert_cmpint(zone_append(0, 8, buf + 8 * 512, &lba), ==, 0);
+    g_assert_cmpint(lba, ==, 8);
+
+    fill_pattern(buf, 16 * 512, 0);
+    g_assert_cmpint(io_rw(QNVME_CMD_READ, 0, 16, 16 * 512, 0, buf), ==, 0);
+    check_pattern(buf, 16 * 512, 0x3c, 0);
+
+    g_assert_cmphex(zone_append(0, ZNS_ZONE_BLOCKS - 8, buf, &lba), ==,
+                    QNVME_SC_ZONE_BOUNDARY | QNVME_SC_DNR);
+
+    g_assert_cmpint(zone_send(0, QNVME_ZONE_ACTION_FINISH), ==, 0);
+    g_assert_cmphex(zone_append(0, 1, buf, &lba), ==,
+                    QNVME_SC_ZONE_FULL | QNVME_SC_DNR);
+
+    /* The next zone is untouched by all of this */
+    g_assert_cmpint(zone_append(ZNS_ZONE_BLOCKS, 1, buf, &lba), ==, 0);
+    g_assert_cmpint(lba, ==, ZNS_ZONE_BLOCKS);
+
+    g_assert_cmpint(zone_send(0, QNVME_ZONE_ACTION_RESET), ==, 0);
+    fill_pattern(buf, 16 * 512, 0x3c);
+    g_assert_cmpint(io_rw(QNVME_CMD_READ, 0, 16, 16 * 512, 0, buf), ==, 0);
+    check_zero(buf, 16 * 512);
+    g_assert_cmpint(zone_append(0, 1, buf, &lba), ==, 0);
+    g_assert_cmpint(lba, ==, 0);
+
+    nvme_stop();
+}
+
+static uint16_t format_nvm(uint32_t nsid, uint8_t ses)
+{
+    uint8_t cmd[QNVME_SQE_SIZE];
+
+    qnvme_cmd(cmd, QNVME_ADM_FORMAT_NVM, nsid);
+    stl_le_p(cmd + 40, ses << 9);
+    return qnvme_admin(nvme, cmd, NULL);
+}
+
+/*
+ * Format NVM with a secure erase setting completes once the namespace is
+ * erased: written blocks read back as zeroes after a user data erase and
+ * after a cryptographic erase alike.
+ */
+static void test_format_ses(void)
+{
+    uint64_t buf;
+    int ses;
+
+    nvme_start(NULL);
+
+    buf = guest_alloc(alloc, QNVME_PAGE_SIZE);
+    for (ses = 1; ses <= 2; ses++) {
+        fill_pattern(buf, QNVME_PAGE_SIZE, 0x5c);
+        g_assert_cmpint(io_rw(QNVME_CMD_WRITE, 16, 8, QNVME_PAGE_SIZE, 0,
+                              buf), ==, 0);
+        g_assert_cmpint(format_nvm(1, ses), ==, 0);
+        g_assert_cmpint(io_rw(QNVME_CMD_READ, 16, 8, QNVME_PAGE_SIZE, 0,
+                              buf), ==, 0);
+        check_zero(buf, QNVME_PAGE_SIZE);
+    }
+
+    g_assert_cmphex(format_nvm(1, 3), ==,
+                    QNVME_SC_INVALID_FIELD | QNVME_SC_DNR);
+
+    nvme_stop();
+}
+
+/* Data buffers in the controller memory buffer, on both sides of the copy */
+static void test_cmb_data(void)
+{
+    uint64_t cmb, buf;
+
+    nvme_start("cmb_size_mb=1");
+
+    cmb = (uintptr_t)qpci_iomap(nvme->pdev, 2);
+    g_assert(cmb != 0);
+    buf = guest_alloc(alloc, QNVME_PAGE_SIZE);
+
+    fill_pattern(cmb, QNVME_PAGE_SIZE, 0x6b);
+    g_assert_cmpint(io_rw(QNVME_CMD_WRITE, 0, 8, QNVME_PAGE_SIZE, 0, cmb),
+                    ==, 0);
+    g_assert_cmpint(io_rw(QNVME_CMD_READ, 0, 8, QNVME_PAGE_SIZE, 0, buf),
+                    ==, 0);
+    check_pattern(buf, QNVME_PAGE_SIZE, 0x6b, 0);
+
+    g_assert_cmpint(io_rw(QNVME_CMD_READ, 0, 8, QNVME_PAGE_SIZE, 0,
+                          cmb + QNVME_PAGE_SIZE), ==, 0);
+    check_pattern(cmb + QNVME_PAGE_SIZE, QNVME_PAGE_SIZE, 0x6b, 0);
+
+    nvme_stop();
+}
+
+/*
+ * Flushes queued on a low, a high and an urgent priority SQ are all picked
+ * up at once by Doorbell Buffer Config, and complete as they are fetched:
+ * urgent first, then high and low by their weights of four and one.
+ */
+static void test_wrr(void)
+{
+    static const uint16_t order[] = {
+        WRR_QID + 2, WRR_QID + 2,
+        WRR_QID + 1, WRR_QID + 1, WRR_QID + 1, WRR_QID + 1, WRR_QID,
+        WRR_QID + 1, WRR_QID + 1, WRR_QID + 1, WRR_QID + 1, WRR_QID,
+        WRR_QID, WRR_QID, WRR_QID, WRR_QID, WRR_QID, WRR_QID,
+    };
+    uint8_t cmd[QNVME_SQE_SIZE];
+    QNvmeQueue *cq, *low, *high, *urgent;
+    QNvmeCqe cqe;
+    int i;
+
+    nvme_start_wrr(NULL);
+
+    /* High priority weight 3 + 1, the others 0 + 1, one command a burst */
+    g_assert_cmpint(qnvme_set_feature(nvme, QNVME_FEAT_ARBITRATION,
+                                      3 << 24), ==, 0);
+
+    cq = qnvme_create_cq(nvme, WRR_QID, 2 * IO_QUEUE_SIZE, true, 0, false);
+    low = qnvme_create_sq_prio(nvme, WRR_QID, WRR_QID, IO_QUEUE_SIZE,
+                               QNVME_PRIO_LOW);
+    high = qnvme_create_sq_prio(nvme, WRR_QID + 1, WRR_QID, IO_QUEUE_SIZE,
+                                QNVME_PRIO_HIGH);
+    urgent = qnvme_create_sq_prio(nvme, WRR_QID + 2, WRR_QID, IO_QUEUE_SIZE,
+                                  QNVME_PRIO_URGENT);
+
+    qnvme_cmd(cmd, QNVME_CMD_FLUSH, 1);
+    for (i = 0; i < 8; i++) {
+        qnvme_submit(nvme, low, cmd);
+        qnvme_submit(nvme, high, cmd);
+    }
+    qnvme_submit(nvme, urgent, cmd);
+    qnvme_submit(nvme, urgent, cmd);
+    g_assert_cmpint(qnvme_dbbuf_config(nvme), ==, 0);
+
+    for (i = 0; i < ARRAY_SIZE(order); i++) {
+        qnvme_wait(nvme, cq, &cqe);
+        g_assert_cmpint(cqe.status, ==, 0);
+        g_assert_cmpint(cqe.sq_id, ==, order[i]);
+    }
+
+    /* The shadow doorbells keep the queues going */
+    flush_on(high, cq, 4);
+    flush(1);
+
+    nvme_stop();
+}
+
+/*
+ * With the flash model a write completes once its page is programmed, here
+ * 1 ms of vm_clock later, even though the drive is done long before: a
+ * flush queued behind it completes first. Reads of written blocks take the
+ * read latency, those of blocks never written none.
+ */
+static void test_flash_model(void)
+{
+    uint8_t cmd[QNVME_SQE_SIZE];
+    QNvmeCqe cqe;
+    uint64_t buf;
+    uint16_t cid;
+
+    nvme_start(FLASH_OPTS);
+
+    buf = guest_alloc(alloc, QNVME_PAGE_SIZE);
+    fill_pattern(buf, QNVME_PAGE_SIZE, 0x17);
+
+    qnvme_rw_cmd(cmd, QNVME_CMD_WRITE, 1, 0, 8, buf, QNVME_PAGE_SIZE);
+    cid = qnvme_submit(nvme, iosq, cmd);
+    qnvme_cmd(cmd, QNVME_CMD_FLUSH, 1);
+    qnvme_submit(nvme, iosq, cmd);
+    qnvme_ring(nvme, iosq);
+
+    qnvme_wait(nvme, iocq, &cqe);
+    g_assert_cmpint(cqe.cid, ==, (uint16_t)(cid + 1));
+    clock_step(500 * 1000);
+    g_assert(!qnvme_poll(nvme, iocq, &cqe));
+    clock_step(600 * 1000);
+    qnvme_wait(nvme, iocq, &cqe);
+    g_assert_cmpint(cqe.cid, ==, cid);
+    g_assert_cmpint(cqe.status, ==, 0);
+
+    g_assert_cmpint(io_rw(QNVME_CMD_READ, 64, 8, QNVME_PAGE_SIZE, 0, buf),
+                    ==, 0);
+
+    qnvme_rw_cmd(cmd, QNVME_CMD_READ, 1, 0, 8, buf, QNVME_PAGE_SIZE);
+    cid = qnvme_submit(nvme, iosq, cmd);
+    qnvme_ring(nvme, iosq);
+    clock_step(300 * 1000);
+    qnvme_wait(nvme, iocq, &cqe);
+    g_assert_cmpint(cqe.cid, ==, cid);
+    check_pattern(buf, QNVME_PAGE_SIZE, 0x17, 0);
+
+    nvme_stop();
+}
+
+/*
+ * Two namespaces with extended LBAs share the drive: the last blocks of the
+ * first and the first blocks of the second must not overlap on it.
+ */
+static void test_namespace_layout(void)
+{
+    const uint64_t last = TEST_IMAGE_SIZE / 2 / PI_LBA_SIZE - 8;
+    uint64_t buf;
+
+    nvme_start("namespaces=2," PI_OPTS);
+
+    buf = guest_alloc(alloc, QNVME_PAGE_SIZE);
+    fill_pattern(buf, QNVME_PAGE_SIZE, 0x71);
+    g_assert_cmpint(io_rw_ns(1, QNVME_CMD_WRITE, last, 8, QNVME_PAGE_SIZE,
+                             QNVME_RW_PRACT, buf), ==, 0);
+    fill_pattern(buf, QNVME_PAGE_SIZE, 0x72);
+    g_assert_cmpint(io_rw_ns(2, QNVME_CMD_WRITE, 0, 8, QNVME_PAGE_SIZE,
+                             QNVME_RW_PRACT, buf), ==, 0);
+
+    g_assert_cmpint(io_rw_ns(1, QNVME_CMD_READ, last, 8, QNVME_PAGE_SIZE,
+                             QNVME_RW_PRACT | PI_CHECK, buf), ==, 0);
+    check_pattern(buf, QNVME_PAGE_SIZE, 0x71, 0);
+    g_assert_cmpint(io_rw_ns(2, QNVME_CMD_READ, 0, 8, QNVME_PAGE_SIZE,
+                             QNVME_RW_PRACT | PI_CHECK, buf), ==, 0);
+    check_pattern(buf, QNVME_PAGE_SIZE, 0x72, 0);
+
+    nvme_stop();
+}
+
+static void hmp(const char *command)
+{
+    qmp("{ 'execute': 'human-monitor-command',"
+        "  'arguments': { 'command-line': '%s' } }", command);
+}
+
+/*
+ * A non-contiguous queue pair is saved halfway through its second pages
+ * and loaded back; the controller rebuilds the queues from the PRP lists
+ * in the restored guest memory, and the commands that follow wrap into
+ * the first pages of both queues.
+ */
+static void test_discontig_savevm(void)
+{
+    QNvmeQueue *cq, *sq;
+    uint64_t marker;
+    int i;
+
+    nvme_start(NULL);
+    cq = qnvme_create_cq(nvme, PC_QID, PC_CQ_SIZE, false, 0, false);
+    sq = qnvme_create_sq(nvme, PC_QID, PC_QID, PC_SQ_SIZE, false);
+    marker = guest_alloc(alloc, 4);
+
+    /* 352 commands leave the SQ at entry 96 and the CQ at entry 352 */
+    for (i = 0; i < 22; i++) {
+        flush_on(sq, cq, 16);
+    }
+    g_assert_cmpint(sq->index, >, PC_SQ_SIZE / 2);
+    g_assert_cmpint(cq->index, >, PC_CQ_SIZE / 2);
+
+    hmp("savevm nvme");
+
+    /* Only a successful loadvm brings the marker back to zero */
+    writel(marker, 1);
+    hmp("loadvm nvme");
+    g_assert_cmpint(readl(marker), ==, 0);
+
+    /* 192 more wrap both rings back into their first page */
+    for (i = 0; i < 12; i++) {
+        flush_on(sq, cq, 16);
+    }
+    g_assert_cmpint(sq->index, <, PC_SQ_SIZE / 2);
+    g_assert_cmpint(cq->index, <, PC_CQ_SIZE / 2);
+
+    nvme_stop();
+}
+
+int main(int argc, char **argv)
+{
+    const char *arch = qtest_get_arch();
+    int fd;
+    int ret;
+
+    /* The device is only built for x86_64 */
+    if (strcmp(arch, "x86_64")) {
+        g_test_message("Skipping test for non-x86_64\n");
+        return 0;
+    }
+
+    /* Create a temporary raw image */
+    fd = mkstemp(test_image);
+    g_assert(fd >= 0);
+    ret = ftruncate(fd, TEST_IMAGE_SIZE);
+    g_assert(ret == 0);
+    close(fd);
+
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/nvme/coalescing/feature", test_coalescing_feature);
+    qtest_add_func("/nvme/coalescing/off", test_coalescing_off);
+    qtest_add_func("/nvme/coalescing/time", test_coalescing_time);
+    qtest_add_func("/nvme/coalescing/threshold", test_coalescing_threshold);
+    qtest_add_func("/nvme/discontig/savevm", test_discontig_savevm);
+    qtest_add_func("/nvme/del_sq/inflight", test_del_sq_inflight);
+    qtest_add_func("/nvme/sgl/bit_bucket", test_sgl_bit_bucket);
+    qtest_add_func("/nvme/compare/pi", test_compare_pi);
+    qtest_add_func("/nvme/pi/check", test_pi_check);
+    qtest_add_func("/nvme/write_zeroes", test_write_zeroes);
+    qtest_add_func("/nvme/dsm/deallocate", test_dsm_deallocate);
+    qtest_add_func("/nvme/zns/append_reset", test_zns_append_reset);
+    qtest_add_func("/nvme/format/ses", test_format_ses);
+    qtest_add_func("/nvme/cmb/data", test_cmb_data);
+    qtest_add_func("/nvme/wrr", test_wrr);
+    qtest_add_func("/nvme/flash_model", test_flash_model);
+    qtest_add_func("/nvme/namespaces/layout", test_namespace_layout);
+
+    ret = g_test_run();
+
+    /* Cleanup */
+    unlink(test_image);
+
+    return ret;
+}
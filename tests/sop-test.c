@@ -0,0 +1,788 @@
+/*
+ * qtest SOP (SCSI over PCIe) device test cases
+ *
+ * Copyright (C) 2013 HGST, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The functional cases run with "make check-qtest-x86_64". Running the
+ * binary with "-m perf" adds throughput cases that keep a queue full of
+ * READ/WRITE IUs and report IOPS and the average latency. Responses are
+ * polled through qtest, so the numbers compare sop_io.c revisions with
+ * each other rather than with real hardware.
+ */
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libqtest.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc-pc.h"
+#include "libqos/pqi.h"
+
+#include "qemu-common.h"
+
+#define TEST_IMAGE_SIZE (8 * 1024 * 1024)
+#define TEST_LUNS 2
+#define BLOCK_SIZE 512
+#define LUN_BLOCKS (TEST_IMAGE_SIZE / BLOCK_SIZE / TEST_LUNS)
+
+#define IO_QID 1
+#define IO_QUEUE_SIZE 16
+
+/* Queues of their own for the OQ hold and the coalescing cases; an OQ
+ * signals the MSI-X vector with its ID */
+#define HOLD_QID 3
+#define COAL_QID 4
+#define COAL_COUNT 4
+#define COAL_TIME_US 1000
+
+#define MSI_DATA 0x50514d
+
+#define PERF_QID 2
+#define PERF_QUEUE_SIZE 64
+#define PERF_DEPTH 32
+#define PERF_IOS 4096
+
+#define STATUS_CHECK_CONDITION 0x02
+
+/* How long to wait for the device before failing the test */
+#define TIMEOUT_US (10 * 1000 * 1000)
+
+static char test_image[] = "/tmp/qtest.XXXXXX";
+
+static QGuestAllocator *alloc;
+static QPQIDevice *pqi;
+static QPQIQueue *ioq;
+static uint16_t next_id;
+
+static void wait_readw(uint64_t addr, uint16_t value)
+{
+    int64_t deadline = g_get_monotonic_time() + TIMEOUT_US;
+
+    while (readw(addr) != value) {
+        g_assert(g_get_monotonic_time() < deadline);
+    }
+}
+
+static int rw_cdb(uint8_t *cdb, bool write, bool cdb16, uint64_t lba,
+                  uint32_t nlb)
+{
+    memset(cdb, 0, 16);
+    if (cdb16) {
+        cdb[0] = write ? 0x8A : 0x88;
+        stq_be_p(cdb + 2, lba);
+        stl_be_p(cdb + 10, nlb);
+        return 16;
+    }
+
+    cdb[0] = write ? 0x2A : 0x28;
+    stl_be_p(cdb + 2, lba);
+    stw_be_p(cdb + 7, nlb);
+    return 10;
+}
+
+static uint8_t sop_cmd(int lun, const uint8_t *cdb, int cdb_len, int dir,
+                       uint64_t addr, uint32_t len, QPQIResponse *rsp)
+{
+    uint8_t iu[QPQI_CMD_LEN];
+
+    if (lun == 0) {
+        qpqi_limited_cmd(iu, IO_QID, next_id++, cdb, cdb_len, dir, addr, len);
+        return qpqi_exec(pqi, ioq, iu, QPQI_LIMITED_CMD_LEN, rsp);
+    }
+
+    qpqi_lun_cmd(iu, IO_QID, next_id++, lun, cdb, cdb_len, dir, addr, len);
+    return qpqi_exec(pqi, ioq, iu, QPQI_CMD_LEN, rsp);
+}
+
+static uint8_t sop_rw(int lun, bool write, bool cdb16, uint64_t lba,
+                      uint32_t nlb, uint64_t addr)
+{
+    QPQIResponse rsp;
+    uint8_t cdb[16];
+    int len = rw_cdb(cdb, write, cdb16, lba, nlb);
+
+    return sop_cmd(lun, cdb, len,
+                   write ? QPQI_DIR_TO_DEVICE : QPQI_DIR_FROM_DEVICE,
+                   addr, nlb * BLOCK_SIZE, &rsp);
+}
+
+static void fill_pattern(uint64_t addr, uint32_t nlb, uint8_t seed)
+{
+    uint8_t *buf = g_malloc(nlb * BLOCK_SIZE);
+    uint32_t i;
+
+    for (i = 0; i < nlb * BLOCK_SIZE; i++) {
+        buf[i] = seed + i / BLOCK_SIZE + i;
+    }
+    memwrite(addr, buf, nlb * BLOCK_SIZE);
+    g_free(buf);
+}
+
+static void check_pattern(uint64_t addr, uint32_t nlb, uint8_t seed)
+{
+    uint8_t *buf = g_malloc(nlb * BLOCK_SIZE);
+    uint32_t i;
+
+    memread(addr, buf, nlb * BLOCK_SIZE);
+    for (i = 0; i < nlb * BLOCK_SIZE; i++) {
+        g_assert_cmphex(buf[i], ==, (uint8_t)(seed + i / BLOCK_SIZE + i));
+    }
+    g_free(buf);
+}
+
+static void test_read_capacity(void)
+{
+    uint64_t addr = guest_alloc(alloc, 32);
+    QPQIResponse rsp;
+    uint8_t cdb[16] = { 0x9E, 0x10 };
+    uint8_t data[32];
+
+    stl_be_p(cdb + 10, sizeof(data));
+    g_assert_cmpint(sop_cmd(0, cdb, 16, QPQI_DIR_FROM_DEVICE, addr,
+                            sizeof(data), &rsp), ==, 0);
+    g_assert_cmphex(rsp.type, ==, QPQI_IU_SUCCESS_RSP);
+
+    memread(addr, data, sizeof(data));
+    g_assert_cmpint(ldq_be_p(data), ==, LUN_BLOCKS - 1);
+    g_assert_cmpint(ldl_be_p(data + 8), ==, BLOCK_SIZE);
+
+    guest_free(alloc, addr);
+}
+
+static void test_inquiry(void)
+{
+    uint64_t addr = guest_alloc(alloc, 36);
+    QPQIResponse rsp;
+    uint8_t cdb[6] = { 0x12 };
+    uint8_t data[36];
+
+    stw_be_p(cdb + 3, sizeof(data));
+    g_assert_cmpint(sop_cmd(0, cdb, 6, QPQI_DIR_FROM_DEVICE, addr,
+                            sizeof(data), &rsp), ==, 0);
+
+    memread(addr, data, sizeof(data));
+    g_assert_cmphex(data[0], ==, 0x00);
+    g_assert_cmphex(data[2], >=, 0x05);
+    g_assert_cmphex(data[3] & 0x0f, ==, 2);
+    g_assert_cmpint(data[4], ==, 31);
+    g_assert(memcmp(data + 8, "HGST    ", 8) == 0);
+    g_assert(memcmp(data + 16, "SOP-DEV-A       ", 16) == 0);
+    g_assert(memcmp(data + 32, "0.01", 4) == 0);
+
+    guest_free(alloc, addr);
+}
+
+static void test_report_luns(void)
+{
+    uint64_t addr = guest_alloc(alloc, 8 + 8 * TEST_LUNS);
+    QPQIResponse rsp;
+    uint8_t cdb[12] = { 0xA0 };
+    uint8_t data[8 + 8 * TEST_LUNS];
+    int i;
+
+    stl_be_p(cdb + 6, sizeof(data));
+    g_assert_cmpint(sop_cmd(0, cdb, 12, QPQI_DIR_FROM_DEVICE, addr,
+                            sizeof(data), &rsp), ==, 0);
+
+    memread(addr, data, sizeof(data));
+    g_assert_cmpint(ldl_be_p(data), ==, 8 * TEST_LUNS);
+    for (i = 0; i < TEST_LUNS; i++) {
+        g_assert_cmpint(data[8 + 8 * i + 1], ==, i);
+    }
+
+    guest_free(alloc, addr);
+}
+
+static void test_read_write(void)
+{
+    uint32_t nlb = 16;
+    uint64_t wbuf = guest_alloc(alloc, nlb * BLOCK_SIZE);
+    uint64_t rbuf = guest_alloc(alloc, nlb * BLOCK_SIZE);
+    int cdb16;
+
+    for (cdb16 = 0; cdb16 <= 1; cdb16++) {
+        uint64_t lba = 100 + cdb16 * nlb;
+
+        fill_pattern(wbuf, nlb, 0x10 + cdb16);
+        g_assert_cmpint(sop_rw(0, true, cdb16, lba, nlb, wbuf), ==, 0);
+
+        fill_pattern(rbuf, nlb, 0);
+        g_assert_cmpint(sop_rw(0, false, cdb16, lba, nlb, rbuf), ==, 0);
+        check_pattern(rbuf, nlb, 0x10 + cdb16);
+    }
+
+    /* The last block of the LUN is still in range */
+    g_assert_cmpint(sop_rw(0, true, true, LUN_BLOCKS - 1, 1, wbuf), ==, 0);
+
+    guest_free(alloc, wbuf);
+    guest_free(alloc, rbuf);
+}
+
+static void test_luns(void)
+{
+    uint64_t buf = guest_alloc(alloc, BLOCK_SIZE);
+    QPQIResponse rsp;
+    uint8_t cdb[16];
+    int len;
+
+    /* Same LBA on both LUNs, only the SOP command IU reaches LUN 1 */
+    fill_pattern(buf, 1, 0xA5);
+    g_assert_cmpint(sop_rw(1, true, false, 0, 1, buf), ==, 0);
+    fill_pattern(buf, 1, 0x5A);
+    g_assert_cmpint(sop_rw(0, true, false, 0, 1, buf), ==, 0);
+
+    g_assert_cmpint(sop_rw(1, false, false, 0, 1, buf), ==, 0);
+    check_pattern(buf, 1, 0xA5);
+    g_assert_cmpint(sop_rw(0, false, false, 0, 1, buf), ==, 0);
+    check_pattern(buf, 1, 0x5A);
+
+    len = rw_cdb(cdb, false, false, 0, 1);
+    g_assert_cmpint(sop_cmd(TEST_LUNS, cdb, len, QPQI_DIR_FROM_DEVICE, buf,
+                            BLOCK_SIZE, &rsp), ==, STATUS_CHECK_CONDITION);
+    g_assert_cmphex(rsp.type, ==, QPQI_IU_COMMAND_RSP);
+
+    guest_free(alloc, buf);
+}
+
+static void test_out_of_range(void)
+{
+    uint64_t buf = guest_alloc(alloc, 2 * BLOCK_SIZE);
+    QPQIResponse rsp;
+    uint8_t cdb[16] = { 0xFF };
+
+    g_assert_cmpint(sop_rw(0, false, false, LUN_BLOCKS - 1, 2, buf), ==,
+                    STATUS_CHECK_CONDITION);
+    g_assert_cmpint(sop_rw(0, true, true, LUN_BLOCKS, 1, buf), ==,
+                    STATUS_CHECK_CONDITION);
+
+    /* Unsupported opcode */
+    g_assert_cmpint(sop_cmd(0, cdb, 6, QPQI_DIR_NONE, 0, 0, &rsp), ==,
+                    STATUS_CHECK_CONDITION);
+
+    guest_free(alloc, buf);
+}
+
+/* A full queue of IUs behind one doorbell write, several times over so
+ * that both the IQ and the OQ wrap */
+static void test_batch(void)
+{
+    uint32_t depth = IO_QUEUE_SIZE - 1;
+    uint64_t buf = guest_alloc(alloc, depth * BLOCK_SIZE);
+    uint8_t iu[QPQI_LIMITED_CMD_LEN];
+    uint8_t cdb[16];
+    QPQIResponse rsp;
+    bool seen[IO_QUEUE_SIZE];
+    uint32_t round, i;
+    int len;
+
+    for (round = 0; round < 3; round++) {
+        fill_pattern(buf, depth, round);
+        for (i = 0; i < depth; i++) {
+            len = rw_cdb(cdb, true, false, 1000 + i, 1);
+            qpqi_limited_cmd(iu, IO_QID, i, cdb, len, QPQI_DIR_TO_DEVICE,
+                             buf + i * BLOCK_SIZE, BLOCK_SIZE);
+            qpqi_submit(pqi, ioq, iu, sizeof(iu));
+        }
+        qpqi_kick(pqi, ioq);
+
+        memset(seen, 0, sizeof(seen));
+        for (i = 0; i < depth; i++) {
+            qpqi_wait(pqi, ioq, &rsp);
+            g_assert_cmpint(rsp.status, ==, 0);
+            g_assert_cmpint(rsp.request_id, <, depth);
+            g_assert(!seen[rsp.request_id]);
+            seen[rsp.request_id] = true;
+        }
+        g_assert(!qpqi_poll(pqi, ioq, &rsp));
+
+        g_assert_cmpint(sop_rw(0, false, false, 1000, depth, buf), ==, 0);
+        check_pattern(buf, depth, round);
+    }
+
+    guest_free(alloc, buf);
+}
+
+static void test_sync_cache(void)
+{
+    QPQIResponse rsp;
+    uint8_t cdb[16];
+
+    memset(cdb, 0, sizeof(cdb));
+    cdb[0] = 0x35;
+    g_assert_cmpint(sop_cmd(0, cdb, 10, QPQI_DIR_NONE, 0, 0, &rsp), ==, 0);
+    g_assert_cmphex(rsp.type, ==, QPQI_IU_SUCCESS_RSP);
+
+    cdb[0] = 0x91;
+    g_assert_cmpint(sop_cmd(1, cdb, 16, QPQI_DIR_NONE, 0, 0, &rsp), ==, 0);
+    g_assert_cmphex(rsp.type, ==, QPQI_IU_SUCCESS_RSP);
+}
+
+/* Discarded blocks read back as anything, so only the statuses and the
+ * blocks next to the unmapped ranges are checked */
+static void test_unmap(void)
+{
+    uint64_t buf = guest_alloc(alloc, 4 * BLOCK_SIZE);
+    uint64_t param = guest_alloc(alloc, 64);
+    QPQIResponse rsp;
+    uint8_t cdb[16];
+    uint8_t list[8 + 2 * 16];
+
+    fill_pattern(buf, 4, 0x30);
+    g_assert_cmpint(sop_rw(0, true, false, 3000, 4, buf), ==, 0);
+
+    /* An empty parameter list unmaps nothing */
+    memset(cdb, 0, sizeof(cdb));
+    cdb[0] = 0x42;
+    g_assert_cmpint(sop_cmd(0, cdb, 10, QPQI_DIR_NONE, 0, 0, &rsp), ==, 0);
+
+    /* The blocks on either side of the written ones, and the last
+     * blocks of the LUN */
+    memset(list, 0, sizeof(list));
+    stw_be_p(list, sizeof(list) - 2);
+    stw_be_p(list + 2, sizeof(list) - 8);
+    stq_be_p(list + 8, 3000 - 64);
+    stl_be_p(list + 16, 64);
+    stq_be_p(list + 24, 3004);
+    stl_be_p(list + 32, LUN_BLOCKS - 3004);
+    memwrite(param, list, sizeof(list));
+
+    stw_be_p(cdb + 7, sizeof(list));
+    g_assert_cmpint(sop_cmd(0, cdb, 10, QPQI_DIR_TO_DEVICE, param,
+                            sizeof(list), &rsp), ==, 0);
+
+    g_assert_cmpint(sop_rw(0, false, false, 3000, 4, buf), ==, 0);
+    check_pattern(buf, 4, 0x30);
+
+    /* A descriptor one block past the end fails the whole command */
+    stl_be_p(list + 32, LUN_BLOCKS - 3004 + 1);
+    memwrite(param, list, sizeof(list));
+    g_assert_cmpint(sop_cmd(0, cdb, 10, QPQI_DIR_TO_DEVICE, param,
+                            sizeof(list), &rsp), ==, STATUS_CHECK_CONDITION);
+    g_assert_cmphex(rsp.type, ==, QPQI_IU_COMMAND_RSP);
+
+    guest_free(alloc, param);
+    guest_free(alloc, buf);
+}
+
+/* More blocks than the device writes from its bounce buffer at once */
+#define WS_BLOCKS 300
+#define WS_LBA 2000
+
+static void test_write_same(void)
+{
+    uint64_t buf = guest_alloc(alloc, WS_BLOCKS * BLOCK_SIZE);
+    uint8_t *data = g_malloc0(WS_BLOCKS * BLOCK_SIZE);
+    QPQIResponse rsp;
+    uint8_t cdb[16];
+    uint32_t i;
+
+    /* WRITE SAME (16) of a patterned block */
+    fill_pattern(buf, 1, 0x5a);
+    memset(cdb, 0, sizeof(cdb));
+    cdb[0] = 0x93;
+    stq_be_p(cdb + 2, WS_LBA);
+    stl_be_p(cdb + 10, WS_BLOCKS);
+    g_assert_cmpint(sop_cmd(0, cdb, 16, QPQI_DIR_TO_DEVICE, buf, BLOCK_SIZE,
+                            &rsp), ==, 0);
+
+    fill_pattern(buf, WS_BLOCKS, 0);
+    g_assert_cmpint(sop_rw(0, false, false, WS_LBA, WS_BLOCKS, buf), ==, 0);
+    for (i = 0; i < WS_BLOCKS; i++) {
+        check_pattern(buf + i * BLOCK_SIZE, 1, 0x5a);
+    }
+
+    /* WRITE SAME (10) of a zero block, inside the patterned range */
+    memwrite(buf, data, BLOCK_SIZE);
+    memset(cdb, 0, sizeof(cdb));
+    cdb[0] = 0x41;
+    stl_be_p(cdb + 2, WS_LBA + 1);
+    stw_be_p(cdb + 7, WS_BLOCKS - 2);
+    g_assert_cmpint(sop_cmd(0, cdb, 10, QPQI_DIR_TO_DEVICE, buf, BLOCK_SIZE,
+                            &rsp), ==, 0);
+
+    fill_pattern(buf, WS_BLOCKS, 0);
+    g_assert_cmpint(sop_rw(0, false, false, WS_LBA, WS_BLOCKS, buf), ==, 0);
+    check_pattern(buf, 1, 0x5a);
+    check_pattern(buf + (WS_BLOCKS - 1) * BLOCK_SIZE, 1, 0x5a);
+    memread(buf + BLOCK_SIZE, data, (WS_BLOCKS - 2) * BLOCK_SIZE);
+    for (i = 0; i < (WS_BLOCKS - 2) * BLOCK_SIZE; i++) {
+        g_assert_cmphex(data[i], ==, 0);
+    }
+
+    /* Past the end of the LUN */
+    stl_be_p(cdb + 2, LUN_BLOCKS - 1);
+    stw_be_p(cdb + 7, 2);
+    g_assert_cmpint(sop_cmd(0, cdb, 10, QPQI_DIR_TO_DEVICE, buf, BLOCK_SIZE,
+                            &rsp), ==, STATUS_CHECK_CONDITION);
+
+    g_free(data);
+    guest_free(alloc, buf);
+}
+
+/*
+ * Eight blocks split over a data descriptor in the IU, a segment with two
+ * data descriptors and a last segment with one:
+ *
+ *   IU:    data (1 block), segment -> seg1
+ *   seg1:  data (2 blocks), data (1 block), last segment -> seg2
+ *   seg2:  data (4 blocks)
+ *
+ * With bad_last, seg2 holds another segment descriptor instead.
+ */
+#define CHAIN_LBA 4000
+#define CHAIN_BLOCKS 8
+
+static const uint32_t chain_nlb[] = { 1, 2, 1, 4 };
+
+static uint8_t chained_rw(bool write, const uint64_t *buf, uint64_t seg1,
+                          uint64_t seg2, bool bad_last)
+{
+    uint8_t iu[QPQI_LIMITED_CMD_LEN];
+    uint8_t sgl[3 * QPQI_SGL_DESC_LEN];
+    uint8_t cdb[16];
+    QPQIResponse rsp;
+    int len;
+
+    qpqi_sgl_desc(sgl, QPQI_SGL_DATA, buf[1], chain_nlb[1] * BLOCK_SIZE);
+    qpqi_sgl_desc(sgl + QPQI_SGL_DESC_LEN, QPQI_SGL_DATA, buf[2],
+                  chain_nlb[2] * BLOCK_SIZE);
+    qpqi_sgl_desc(sgl + 2 * QPQI_SGL_DESC_LEN, QPQI_SGL_LAST_SEGMENT, seg2,
+                  QPQI_SGL_DESC_LEN);
+    memwrite(seg1, sgl, sizeof(sgl));
+
+    if (bad_last) {
+        qpqi_sgl_desc(sgl, QPQI_SGL_SEGMENT, seg1, sizeof(sgl));
+    } else {
+        qpqi_sgl_desc(sgl, QPQI_SGL_DATA, buf[3], chain_nlb[3] * BLOCK_SIZE);
+    }
+    memwrite(seg2, sgl, QPQI_SGL_DESC_LEN);
+
+    len = rw_cdb(cdb, write, false, CHAIN_LBA, CHAIN_BLOCKS);
+    qpqi_limited_cmd(iu, IO_QID, next_id++, cdb, len,
+                     write ? QPQI_DIR_TO_DEVICE : QPQI_DIR_FROM_DEVICE,
+                     buf[0], CHAIN_BLOCKS * BLOCK_SIZE);
+    qpqi_sgl_desc(iu + QPQI_LIMITED_SGL, QPQI_SGL_DATA, buf[0],
+                  chain_nlb[0] * BLOCK_SIZE);
+    qpqi_sgl_desc(iu + QPQI_LIMITED_SGL + QPQI_SGL_DESC_LEN,
+                  QPQI_SGL_SEGMENT, seg1, sizeof(sgl));
+
+    return qpqi_exec(pqi, ioq, iu, sizeof(iu), &rsp);
+}
+
+static void test_chained_sgl(void)
+{
+    uint64_t contig = guest_alloc(alloc, CHAIN_BLOCKS * BLOCK_SIZE);
+    uint64_t seg1 = guest_alloc(alloc, 3 * QPQI_SGL_DESC_LEN);
+    uint64_t seg2 = guest_alloc(alloc, QPQI_SGL_DESC_LEN);
+    uint64_t buf[ARRAY_SIZE(chain_nlb)];
+    uint8_t seed[ARRAY_SIZE(chain_nlb)];
+    uint32_t lba = 0;
+    int i;
+
+    /* Each piece carries the pattern of its place in the transfer */
+    for (i = 0; i < ARRAY_SIZE(chain_nlb); i++) {
+        buf[i] = guest_alloc(alloc, chain_nlb[i] * BLOCK_SIZE);
+        seed[i] = 0x70 + lba;
+        lba += chain_nlb[i];
+    }
+    g_assert_cmpint(lba, ==, CHAIN_BLOCKS);
+
+    for (i = 0; i < ARRAY_SIZE(chain_nlb); i++) {
+        fill_pattern(buf[i], chain_nlb[i], seed[i]);
+    }
+    g_assert_cmpint(chained_rw(true, buf, seg1, seg2, false), ==, 0);
+
+    g_assert_cmpint(sop_rw(0, false, false, CHAIN_LBA, CHAIN_BLOCKS, contig),
+                    ==, 0);
+    check_pattern(contig, CHAIN_BLOCKS, 0x70);
+
+    for (i = 0; i < ARRAY_SIZE(chain_nlb); i++) {
+        fill_pattern(buf[i], chain_nlb[i], 0);
+    }
+    g_assert_cmpint(chained_rw(false, buf, seg1, seg2, false), ==, 0);
+    for (i = 0; i < ARRAY_SIZE(chain_nlb); i++) {
+        check_pattern(buf[i], chain_nlb[i], seed[i]);
+    }
+
+    /* A segment descriptor in the last segment */
+    g_assert_cmpint(chained_rw(false, buf, seg1, seg2, true), ==,
+                    STATUS_CHECK_CONDITION);
+
+    for (i = 0; i < ARRAY_SIZE(chain_nlb); i++) {
+        guest_free(alloc, buf[i]);
+    }
+    guest_free(alloc, seg2);
+    guest_free(alloc, seg1);
+    guest_free(alloc, contig);
+}
+
+/* Queues count TEST UNIT READY IUs behind one doorbell write */
+static uint16_t submit_tur(QPQIQueue *q, uint32_t count)
+{
+    uint8_t iu[QPQI_LIMITED_CMD_LEN];
+    uint8_t cdb[16];
+    uint16_t first = next_id;
+    uint32_t i;
+
+    memset(cdb, 0, sizeof(cdb));
+    for (i = 0; i < count; i++) {
+        qpqi_limited_cmd(iu, q->qid, next_id++, cdb, 6, QPQI_DIR_NONE, 0, 0);
+        qpqi_submit(pqi, q, iu, sizeof(iu));
+    }
+    qpqi_kick(pqi, q);
+
+    return first;
+}
+
+static void reap_tur(QPQIQueue *q, uint16_t first, uint32_t count)
+{
+    QPQIResponse rsp;
+    uint32_t i;
+
+    for (i = 0; i < count; i++) {
+        qpqi_wait(pqi, q, &rsp);
+        g_assert_cmphex(rsp.type, ==, QPQI_IU_SUCCESS_RSP);
+        g_assert_cmpint(rsp.request_id, ==, (uint16_t)(first + i));
+    }
+}
+
+/*
+ * The host stops taking responses off the OQ. The device fills the OQ,
+ * keeps a queue's worth of responses back, and then stops fetching IUs
+ * until the host makes room; nothing is lost or reordered.
+ */
+static void test_oq_hold(void)
+{
+    QPQIQueue *q = qpqi_create_queue(pqi, HOLD_QID, IO_QUEUE_SIZE);
+    uint32_t depth = IO_QUEUE_SIZE - 1;
+    QPQIResponse rsp;
+    uint16_t first;
+    uint16_t held_ci;
+
+    /* Fills the OQ */
+    first = submit_tur(q, depth);
+    wait_readw(q->iq_ci_addr, q->pi);
+    wait_readw(q->oq_pi_addr, depth);
+
+    /* Fetched, but held back by the device */
+    submit_tur(q, depth);
+    wait_readw(q->iq_ci_addr, q->pi);
+    g_assert_cmpint(readw(q->oq_pi_addr), ==, depth);
+
+    /* One more makes a queue's worth waiting, and the IQ stops there; the
+     * sleep gives the device the time to fetch the rest if it would */
+    held_ci = (q->pi + 1) % IO_QUEUE_SIZE;
+    submit_tur(q, depth);
+    wait_readw(q->iq_ci_addr, held_ci);
+    g_usleep(10 * 1000);
+    g_assert_cmpint(readw(q->iq_ci_addr), ==, held_ci);
+    g_assert_cmpint(readw(q->oq_pi_addr), ==, depth);
+
+    /* Taking the responses lets everything through, in order */
+    reap_tur(q, first, 3 * depth);
+    g_assert(!qpqi_poll(pqi, q, &rsp));
+    g_assert_cmpint(readw(q->iq_ci_addr), ==, q->pi);
+}
+
+static void test_coalescing(void)
+{
+    uint64_t msi_addr = guest_alloc(alloc, 4);
+    QPQIQueue *q;
+    uint16_t first;
+
+    writel(msi_addr, 0);
+    qpqi_msix_set_vector(pqi, COAL_QID, msi_addr, MSI_DATA);
+    q = qpqi_create_queue(pqi, COAL_QID, IO_QUEUE_SIZE);
+
+    /* Not coalesced: every response interrupts */
+    reap_tur(q, submit_tur(q, 1), 1);
+    g_assert_cmphex(readl(msi_addr), ==, MSI_DATA);
+
+    qpqi_set_coalescing(pqi, COAL_QID, COAL_COUNT, COAL_TIME_US);
+
+    /* A single response waits for the coalescing time */
+    writel(msi_addr, 0);
+    reap_tur(q, submit_tur(q, 1), 1);
+    g_assert_cmphex(readl(msi_addr), ==, 0);
+    clock_step(COAL_TIME_US * 1000 / 2);
+    g_assert_cmphex(readl(msi_addr), ==, 0);
+    clock_step(COAL_TIME_US * 1000);
+    g_assert_cmphex(readl(msi_addr), ==, MSI_DATA);
+
+    /* One short of the count stays pending, the next one interrupts */
+    writel(msi_addr, 0);
+    first = submit_tur(q, COAL_COUNT - 1);
+    reap_tur(q, first, COAL_COUNT - 1);
+    g_assert_cmphex(readl(msi_addr), ==, 0);
+    reap_tur(q, submit_tur(q, 1), 1);
+    g_assert_cmphex(readl(msi_addr), ==, MSI_DATA);
+
+    /* Nothing is left for the timer */
+    writel(msi_addr, 0);
+    clock_step(COAL_TIME_US * 1000 * 2);
+    g_assert_cmphex(readl(msi_addr), ==, 0);
+
+    guest_free(alloc, msi_addr);
+}
+
+typedef struct PerfTest
+{
+    bool write;
+    uint32_t nlb;
+} PerfTest;
+
+static void test_perf(gconstpointer opaque)
+{
+    const PerfTest *t = opaque;
+    uint32_t bytes = t->nlb * BLOCK_SIZE;
+    uint64_t buf[PERF_DEPTH];
+    int64_t issued[PERF_DEPTH];
+    uint16_t free_ids[PERF_DEPTH];
+    uint32_t nr_free = PERF_DEPTH;
+    uint32_t submitted = 0, completed = 0;
+    int64_t start, elapsed, latency = 0;
+    uint8_t iu[QPQI_LIMITED_CMD_LEN];
+    uint8_t cdb[16];
+    QPQIResponse rsp;
+    QPQIQueue *q;
+    uint32_t i;
+    int len;
+
+    q = pqi->queue[PERF_QID];
+    if (!q) {
+        q = qpqi_create_queue(pqi, PERF_QID, PERF_QUEUE_SIZE);
+    }
+
+    for (i = 0; i < PERF_DEPTH; i++) {
+        buf[i] = guest_alloc(alloc, bytes);
+        free_ids[i] = i;
+    }
+
+    start = g_get_monotonic_time();
+    while (completed < PERF_IOS) {
+        if (nr_free && submitted < PERF_IOS) {
+            while (nr_free && submitted < PERF_IOS) {
+                uint16_t id = free_ids[--nr_free];
+                uint64_t lba = g_test_rand_int_range(0, LUN_BLOCKS / t->nlb);
+
+                len = rw_cdb(cdb, t->write, false, lba * t->nlb, t->nlb);
+                qpqi_limited_cmd(iu, PERF_QID, id, cdb, len,
+                                 t->write ? QPQI_DIR_TO_DEVICE
+                                          : QPQI_DIR_FROM_DEVICE,
+                                 buf[id], bytes);
+                qpqi_submit(pqi, q, iu, sizeof(iu));
+                issued[id] = g_get_monotonic_time();
+                submitted++;
+            }
+            qpqi_kick(pqi, q);
+        }
+
+        qpqi_wait(pqi, q, &rsp);
+        do {
+            g_assert_cmpint(rsp.status, ==, 0);
+            g_assert_cmpint(rsp.request_id, <, PERF_DEPTH);
+            latency += g_get_monotonic_time() - issued[rsp.request_id];
+            free_ids[nr_free++] = rsp.request_id;
+            completed++;
+        } while (qpqi_poll(pqi, q, &rsp));
+    }
+    elapsed = g_get_monotonic_time() - start;
+
+    g_test_maximized_result(PERF_IOS * 1e6 / elapsed,
+                            "%s %u bytes, depth %u: %.0f IOPS",
+                            t->write ? "write" : "read", bytes, PERF_DEPTH,
+                            PERF_IOS * 1e6 / elapsed);
+    g_test_minimized_result((double)latency / PERF_IOS,
+                            "%s %u bytes, depth %u: %.1f us average latency",
+                            t->write ? "write" : "read", bytes, PERF_DEPTH,
+                            (double)latency / PERF_IOS);
+
+    for (i = 0; i < PERF_DEPTH; i++) {
+        guest_free(alloc, buf[i]);
+    }
+}
+
+static const PerfTest perf_tests[] = {
+    { false, 8 },
+    { true, 8 },
+    { false, 128 },
+    { true, 128 },
+};
+
+int main(int argc, char **argv)
+{
+    const char *arch = qtest_get_arch();
+    QPCIBus *bus;
+    char *cmdline;
+    char *name;
+    int fd;
+    int ret;
+    int i;
+
+    /* The device is only built for x86_64 */
+    if (strcmp(arch, "x86_64")) {
+        g_test_message("Skipping test for non-x86_64\n");
+        return 0;
+    }
+
+    /* Create a temporary raw image */
+    fd = mkstemp(test_image);
+    g_assert(fd >= 0);
+    ret = ftruncate(fd, TEST_IMAGE_SIZE);
+    g_assert(ret == 0);
+    close(fd);
+
+    g_test_init(&argc, &argv, NULL);
+
+    cmdline = g_strdup_printf("-drive file=%s,if=none,id=drive0,format=raw "
+                              "-device soppqi,drive=drive0,luns=%d",
+                              test_image, TEST_LUNS);
+    qtest_start(cmdline);
+    g_free(cmdline);
+
+    bus = qpci_init_pc();
+    alloc = pc_alloc_init();
+    pqi = qpqi_init(bus, alloc);
+    qpqi_msix_enable(pqi);
+    ioq = qpqi_create_queue(pqi, IO_QID, IO_QUEUE_SIZE);
+
+    qtest_add_func("/sop/read_capacity", test_read_capacity);
+    qtest_add_func("/sop/inquiry", test_inquiry);
+    qtest_add_func("/sop/report_luns", test_report_luns);
+    qtest_add_func("/sop/read_write", test_read_write);
+    qtest_add_func("/sop/luns", test_luns);
+    qtest_add_func("/sop/out_of_range", test_out_of_range);
+    qtest_add_func("/sop/batch", test_batch);
+    qtest_add_func("/sop/sync_cache", test_sync_cache);
+    qtest_add_func("/sop/unmap", test_unmap);
+    qtest_add_func("/sop/write_same", test_write_same);
+    qtest_add_func("/sop/chained_sgl", test_chained_sgl);
+    qtest_add_func("/sop/oq_hold", test_oq_hold);
+    qtest_add_func("/sop/coalescing", test_coalescing);
+
+    if (g_test_perf()) {
+        for (i = 0; i < ARRAY_SIZE(perf_tests); i++) {
+            name = g_strdup_printf("/%s/sop/perf/%s_%u", arch,
+                                   perf_tests[i].write ? "write" : "read",
+                                   perf_tests[i].nlb * BLOCK_SIZE);
+            g_test_add_data_func(name, &perf_tests[i], test_perf);
+            g_free(name);
+        }
+    }
+
+    ret = g_test_run();
+
+    /* Cleanup */
+    qpqi_uninit(pqi);
+    qtest_quit(global_qtest);
+    unlink(test_image);
+
+    return ret;
+}
@@ -0,0 +1,152 @@
+/*
+ * T10-DIF CRC16 tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <stdint.h>
+#include <string.h>
+#include "qemu/crc-t10dif.h"
+#include "qemu/osdep.h"
+
+#define BUF_SIZE 65536
+
+static uint8_t buf[BUF_SIZE + 64];
+
+/* Bit at a time straight from the polynomial, independent of any table */
+static uint16_t crc_t10dif_bitwise(uint16_t crc, const uint8_t *p, size_t len)
+{
+    int i;
+
+    while (len--) {
+        crc ^= *p++ << 8;
+        for (i = 0; i < 8; i++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x8bb7 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+static void fill_buf(void)
+{
+    int i;
+
+    for (i = 0; i < sizeof(buf); i++) {
+        buf[i] = g_test_rand_int();
+    }
+}
+
+static void check_impl(CrcT10DifFunc *fn)
+{
+    int i;
+
+    g_assert_cmphex(fn(0, (const uint8_t *)"123456789", 9), ==, 0xd0db);
+
+    fill_buf();
+
+    /* every length across the size thresholds, at every alignment */
+    for (i = 0; i < 512 * 64; i++) {
+        size_t len = i / 64, off = i % 64;
+        uint16_t seed = g_test_rand_int();
+
+        g_assert_cmphex(fn(seed, buf + off, len), ==,
+                        crc_t10dif_bitwise(seed, buf + off, len));
+    }
+
+    /* large random buffers, including logical block sized ones */
+    for (i = 0; i < 64; i++) {
+        size_t len = g_test_rand_int_range(0, BUF_SIZE);
+        size_t off = g_test_rand_int_range(0, 64);
+        uint16_t seed = g_test_rand_int();
+
+        if (i < 8) {
+            len = 512 << (i % 4);
+        }
+        g_assert_cmphex(fn(seed, buf + off, len), ==,
+                        crc_t10dif_bitwise(seed, buf + off, len));
+    }
+
+    /* split updates must match a single pass */
+    for (i = 0; i < 64; i++) {
+        size_t len = g_test_rand_int_range(1, BUF_SIZE);
+        size_t split = g_test_rand_int_range(0, len);
+
+        g_assert_cmphex(fn(fn(0, buf, split), buf + split, len - split), ==,
+                        crc_t10dif_bitwise(0, buf, len));
+    }
+}
+
+static void test_generic(void)
+{
+    check_impl(crc_t10dif_generic);
+}
+
+static void test_slice8(void)
+{
+    check_impl(crc_t10dif_slice8);
+}
+
+static void test_pclmul(void)
+{
+    CrcT10DifFunc *fn = crc_t10dif_pclmul_fn();
+
+    if (!fn) {
+        g_test_message("PCLMULQDQ not available, skipping\n");
+        return;
+    }
+    check_impl(fn);
+}
+
+static void test_update(void)
+{
+    check_impl(crc_t10dif_update);
+}
+
+static void perf_impl(const char *name, CrcT10DifFunc *fn, size_t len)
+{
+    unsigned int i, max;
+    uint16_t crc = 0;
+    double duration;
+
+    max = (1 << 30) / len;
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        crc ^= fn(crc, buf, len);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("%s %zu byte blocks: %f s, %.0f MB/s (crc %04x)\n",
+        name, len, duration, (double)max * len / duration / 1e6, crc);
+}
+
+static void perf_crc(void)
+{
+    static const size_t sizes[] = { 512, 4096 };
+    CrcT10DifFunc *pclmul = crc_t10dif_pclmul_fn();
+    int i;
+
+    fill_buf();
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        perf_impl("generic", crc_t10dif_generic, sizes[i]);
+        perf_impl("slice8", crc_t10dif_slice8, sizes[i]);
+        if (pclmul) {
+            perf_impl("pclmul", pclmul, sizes[i]);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/crc-t10dif/generic", test_generic);
+    g_test_add_func("/crc-t10dif/slice8", test_slice8);
+    g_test_add_func("/crc-t10dif/pclmul", test_pclmul);
+    g_test_add_func("/crc-t10dif/update", test_update);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/crc-t10dif", perf_crc);
+    }
+    return g_test_run();
+}
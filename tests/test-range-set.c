@@ -0,0 +1,225 @@
+/*
+ * Range set unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "qemu/range-set.h"
+#include "qemu/bitmap.h"
+
+#define SHADOW_SIZE 4096
+
+typedef struct TestRangeSetData {
+    RangeSet      *rs;
+    unsigned long *bits;
+} TestRangeSetData;
+
+typedef struct TestRangeSetWalk {
+    TestRangeSetData *data;
+    uint64_t next;
+    uint64_t extents;
+    uint64_t count;
+} TestRangeSetWalk;
+
+static int range_set_test_walk(uint64_t start, uint64_t count, void *opaque)
+{
+    TestRangeSetWalk *walk = opaque;
+    uint64_t i;
+
+    /* extents are sorted, disjoint and never touch */
+    g_assert(count > 0);
+    g_assert(!walk->extents || start > walk->next);
+    for (i = start; i < start + count; i++) {
+        g_assert(test_bit(i, walk->data->bits));
+    }
+    walk->next = start + count;
+    walk->extents++;
+    walk->count += count;
+    return 0;
+}
+
+/* Check that the RangeSet and the shadow bitmap contain the same data */
+static void range_set_test_check(TestRangeSetData *data)
+{
+    TestRangeSetWalk walk = { .data = data };
+    uint64_t i, count = 0;
+
+    for (i = 0; i < SHADOW_SIZE; i++) {
+        g_assert_cmpint(range_set_test(data->rs, i), ==,
+                        test_bit(i, data->bits));
+        count += test_bit(i, data->bits);
+    }
+
+    range_set_foreach(data->rs, range_set_test_walk, &walk);
+    g_assert_cmpint(walk.count, ==, count);
+    g_assert_cmpint(walk.count, ==, range_set_count(data->rs));
+    g_assert_cmpint(walk.extents, ==, range_set_extents(data->rs));
+}
+
+static void range_set_test_add(TestRangeSetData *data,
+                               uint64_t start, uint64_t count)
+{
+    range_set_add(data->rs, start, count);
+    bitmap_set(data->bits, start, count);
+    range_set_test_check(data);
+}
+
+static void range_set_test_remove(TestRangeSetData *data,
+                                  uint64_t start, uint64_t count)
+{
+    range_set_remove(data->rs, start, count);
+    bitmap_clear(data->bits, start, count);
+    range_set_test_check(data);
+}
+
+static void range_set_test_init(TestRangeSetData *data, const void *unused)
+{
+    data->rs = range_set_new();
+    data->bits = bitmap_new(SHADOW_SIZE);
+}
+
+static void range_set_test_teardown(TestRangeSetData *data,
+                                    const void *unused)
+{
+    range_set_free(data->rs);
+    g_free(data->bits);
+}
+
+static void test_range_set_empty(TestRangeSetData *data, const void *unused)
+{
+    range_set_test_check(data);
+    g_assert(!range_set_intersects(data->rs, 0, SHADOW_SIZE));
+    range_set_test_add(data, 10, 0);
+    range_set_test_remove(data, 10, 10);
+}
+
+static void test_range_set_merge(TestRangeSetData *data, const void *unused)
+{
+    range_set_test_add(data, 100, 10);
+    range_set_test_add(data, 120, 10);
+    range_set_test_add(data, 90, 10);
+    g_assert_cmpint(range_set_extents(data->rs), ==, 2);
+
+    /* touching the gap on both sides joins everything */
+    range_set_test_add(data, 110, 10);
+    g_assert_cmpint(range_set_extents(data->rs), ==, 1);
+
+    range_set_test_add(data, 200, 10);
+    range_set_test_add(data, 300, 10);
+    range_set_test_add(data, 50, 400);
+    g_assert_cmpint(range_set_extents(data->rs), ==, 1);
+}
+
+static void test_range_set_split(TestRangeSetData *data, const void *unused)
+{
+    range_set_test_add(data, 0, 1000);
+    range_set_test_remove(data, 100, 10);
+    g_assert_cmpint(range_set_extents(data->rs), ==, 2);
+    range_set_test_remove(data, 0, 1);
+    range_set_test_remove(data, 999, 1);
+    range_set_test_remove(data, 500, 100);
+    g_assert_cmpint(range_set_extents(data->rs), ==, 3);
+    range_set_test_remove(data, 50, 900);
+    g_assert_cmpint(range_set_extents(data->rs), ==, 2);
+}
+
+static void test_range_set_intersects(TestRangeSetData *data,
+                                      const void *unused)
+{
+    range_set_test_add(data, 100, 10);
+    g_assert(!range_set_intersects(data->rs, 0, 100));
+    g_assert(range_set_intersects(data->rs, 0, 101));
+    g_assert(range_set_intersects(data->rs, 109, 1));
+    g_assert(!range_set_intersects(data->rs, 110, 100));
+    g_assert(range_set_intersects(data->rs, 105, 0) == false);
+}
+
+static void test_range_set_run(TestRangeSetData *data, const void *unused)
+{
+    uint64_t start, run;
+    bool in;
+    int i;
+
+    for (i = 0; i < 64; i++) {
+        start = g_test_rand_int_range(0, SHADOW_SIZE);
+        range_set_test_add(data, start, g_test_rand_int_range(0, 32));
+    }
+
+    /* walking by runs must visit every item with the right state */
+    for (start = 0; start < SHADOW_SIZE; start += run) {
+        run = range_set_run(data->rs, start, SHADOW_SIZE - start, &in);
+        g_assert(run > 0);
+        for (i = 0; i < run; i++) {
+            g_assert_cmpint(test_bit(start + i, data->bits), ==, in);
+        }
+        if (start + run < SHADOW_SIZE) {
+            g_assert_cmpint(test_bit(start + run, data->bits), !=, in);
+        }
+    }
+
+    g_assert_cmpint(range_set_run(data->rs, SHADOW_SIZE, 100, &in), ==, 100);
+    g_assert(!in);
+}
+
+static void test_range_set_random(TestRangeSetData *data, const void *unused)
+{
+    int i;
+
+    for (i = 0; i < 2000; i++) {
+        uint64_t start = g_test_rand_int_range(0, SHADOW_SIZE);
+        uint64_t count = g_test_rand_int_range(0, MIN(SHADOW_SIZE - start,
+                                                      64) + 1);
+
+        if (g_test_rand_int() & 1) {
+            range_set_test_add(data, start, count);
+        } else {
+            range_set_test_remove(data, start, count);
+        }
+    }
+}
+
+static void test_range_set_large(TestRangeSetData *data, const void *unused)
+{
+    RangeSet *rs = data->rs;
+    uint64_t base = 1ULL << 40;
+
+    /* a petabyte-scale namespace costs one node per run, not one bit per
+     * block
+     */
+    range_set_add(rs, base, 1ULL << 38);
+    range_set_remove(rs, base + 4096, 8);
+    g_assert_cmpint(range_set_extents(rs), ==, 2);
+    g_assert_cmpint(range_set_count(rs), ==, (1ULL << 38) - 8);
+    g_assert(range_set_test(rs, base + 4095));
+    g_assert(!range_set_test(rs, base + 4096));
+    g_assert(range_set_test(rs, base + 4104));
+    range_set_clear(rs);
+    g_assert_cmpint(range_set_extents(rs), ==, 0);
+}
+
+static void range_set_test_add_fn(const char *testpath,
+                                  void (*test_func)(TestRangeSetData *data,
+                                                    const void *user_data))
+{
+    g_test_add(testpath, TestRangeSetData, NULL, range_set_test_init,
+               test_func, range_set_test_teardown);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    range_set_test_add_fn("/range-set/empty", test_range_set_empty);
+    range_set_test_add_fn("/range-set/merge", test_range_set_merge);
+    range_set_test_add_fn("/range-set/split", test_range_set_split);
+    range_set_test_add_fn("/range-set/intersects",
+                          test_range_set_intersects);
+    range_set_test_add_fn("/range-set/run", test_range_set_run);
+    range_set_test_add_fn("/range-set/random", test_range_set_random);
+    range_set_test_add_fn("/range-set/large", test_range_set_large);
+    g_test_run();
+
+    return 0;
+}
@@ -0,0 +1,256 @@
+/*
+ * T10 Data Integrity Field CRC16
+ *
+ * This code is licensed under the GNU GPL v2 or later.  See the COPYING
+ * file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/crc-t10dif.h"
+
+#ifdef CONFIG_PCLMUL
+#include <cpuid.h>
+#include <tmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+/* Copied from Linux, lib/crc-t10dif.c */
+static const uint16_t t10_dif_crc_table[256] = {
+    0x0000, 0x8BB7, 0x9CD9, 0x176E, 0xB205, 0x39B2, 0x2EDC, 0xA56B,
+    0xEFBD, 0x640A, 0x7364, 0xF8D3, 0x5DB8, 0xD60F, 0xC161, 0x4AD6,
+    0x54CD, 0xDF7A, 0xC814, 0x43A3, 0xE6C8, 0x6D7F, 0x7A11, 0xF1A6,
+    0xBB70, 0x30C7, 0x27A9, 0xAC1E, 0x0975, 0x82C2, 0x95AC, 0x1E1B,
+    0xA99A, 0x222D, 0x3543, 0xBEF4, 0x1B9F, 0x9028, 0x8746, 0x0CF1,
+    0x4627, 0xCD90, 0xDAFE, 0x5149, 0xF422, 0x7F95, 0x68FB, 0xE34C,
+    0xFD57, 0x76E0, 0x618E, 0xEA39, 0x4F52, 0xC4E5, 0xD38B, 0x583C,
+    0x12EA, 0x995D, 0x8E33, 0x0584, 0xA0EF, 0x2B58, 0x3C36, 0xB781,
+    0xD883, 0x5334, 0x445A, 0xCFED, 0x6A86, 0xE131, 0xF65F, 0x7DE8,
+    0x373E, 0xBC89, 0xABE7, 0x2050, 0x853B, 0x0E8C, 0x19E2, 0x9255,
+    0x8C4E, 0x07F9, 0x1097, 0x9B20, 0x3E4B, 0xB5FC, 0xA292, 0x2925,
+    0x63F3, 0xE844, 0xFF2A, 0x749D, 0xD1F6, 0x5A41, 0x4D2F, 0xC698,
+    0x7119, 0xFAAE, 0xEDC0, 0x6677, 0xC31C, 0x48AB, 0x5FC5, 0xD472,
+    0x9EA4, 0x1513, 0x027D, 0x89CA, 0x2CA1, 0xA716, 0xB078, 0x3BCF,
+    0x25D4, 0xAE63, 0xB90D, 0x32BA, 0x97D1, 0x1C66, 0x0B08, 0x80BF,
+    0xCA69, 0x41DE, 0x56B0, 0xDD07, 0x786C, 0xF3DB, 0xE4B5, 0x6F02,
+    0x3AB1, 0xB106, 0xA668, 0x2DDF, 0x88B4, 0x0303, 0x146D, 0x9FDA,
+    0xD50C, 0x5EBB, 0x49D5, 0xC262, 0x6709, 0xECBE, 0xFBD0, 0x7067,
+    0x6E7C, 0xE5CB, 0xF2A5, 0x7912, 0xDC79, 0x57CE, 0x40A0, 0xCB17,
+    0x81C1, 0x0A76, 0x1D18, 0x96AF, 0x33C4, 0xB873, 0xAF1D, 0x24AA,
+    0x932B, 0x189C, 0x0FF2, 0x8445, 0x212E, 0xAA99, 0xBDF7, 0x3640,
+    0x7C96, 0xF721, 0xE04F, 0x6BF8, 0xCE93, 0x4524, 0x524A, 0xD9FD,
+    0xC7E6, 0x4C51, 0x5B3F, 0xD088, 0x75E3, 0xFE54, 0xE93A, 0x628D,
+    0x285B, 0xA3EC, 0xB482, 0x3F35, 0x9A5E, 0x11E9, 0x0687, 0x8D30,
+    0xE232, 0x6985, 0x7EEB, 0xF55C, 0x5037, 0xDB80, 0xCCEE, 0x4759,
+    0x0D8F, 0x8638, 0x9156, 0x1AE1, 0xBF8A, 0x343D, 0x2353, 0xA8E4,
+    0xB6FF, 0x3D48, 0x2A26, 0xA191, 0x04FA, 0x8F4D, 0x9823, 0x1394,
+    0x5942, 0xD2F5, 0xC59B, 0x4E2C, 0xEB47, 0x60F0, 0x779E, 0xFC29,
+    0x4BA8, 0xC01F, 0xD771, 0x5CC6, 0xF9AD, 0x721A, 0x6574, 0xEEC3,
+    0xA415, 0x2FA2, 0x38CC, 0xB37B, 0x1610, 0x9DA7, 0x8AC9, 0x017E,
+    0x1F65, 0x94D2, 0x83BC, 0x080B, 0xAD60, 0x26D7, 0x31B9, 0xBA0E,
+    0xF0D8, 0x7B6F, 0x6C01, 0xE7B6, 0x42DD, 0xC96A, 0xDE04, 0x55B3
+};
+
+uint16_t crc_t10dif_generic(uint16_t crc, const uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        crc = (crc << 8) ^ t10_dif_crc_table[((crc >> 8) ^ buf[i]) & 0xff];
+    }
+    return crc;
+}
+/* End lib/crc-t10dif.c */
+
+/* slice8_table[k][b] is the CRC of byte b followed by k zero bytes, so the
+ * contribution of the byte at offset i within an eight byte group is
+ * slice8_table[7 - i][b].
+ */
+static uint16_t slice8_table[8][256];
+
+static void crc_t10dif_slice8_init(void)
+{
+    int i, k;
+
+    for (i = 0; i < 256; i++) {
+        slice8_table[0][i] = t10_dif_crc_table[i];
+    }
+    for (k = 1; k < 8; k++) {
+        for (i = 0; i < 256; i++) {
+            uint16_t prev = slice8_table[k - 1][i];
+            slice8_table[k][i] = (prev << 8) ^ t10_dif_crc_table[prev >> 8];
+        }
+    }
+}
+
+uint16_t crc_t10dif_slice8(uint16_t crc, const uint8_t *buf, size_t len)
+{
+    while (len >= 8) {
+        crc = slice8_table[7][buf[0] ^ (crc >> 8)] ^
+              slice8_table[6][buf[1] ^ (crc & 0xff)] ^
+              slice8_table[5][buf[2]] ^
+              slice8_table[4][buf[3]] ^
+              slice8_table[3][buf[4]] ^
+              slice8_table[2][buf[5]] ^
+              slice8_table[1][buf[6]] ^
+              slice8_table[0][buf[7]];
+        buf += 8;
+        len -= 8;
+    }
+    return crc_t10dif_generic(crc, buf, len);
+}
+
+#ifdef CONFIG_PCLMUL
+/* The buffer is treated as a polynomial with the first byte holding the
+ * highest coefficients.  Each 16 byte block is loaded byte-reversed so that
+ * it becomes a 128 bit polynomial, and a block X followed F bits later by D
+ * is folded into X * x^F + D, which is congruent modulo P.  Splitting X into
+ * 64 bit halves, X * x^F = X_hi * (x^(F+64) mod P) + X_lo * (x^F mod P), two
+ * carry-less multiplies whose products are at most 80 bits wide.  Four
+ * lanes are folded 64 bytes at a time, then merged; the remaining 128 bit
+ * value is run through the table, which also applies the final x^16.
+ */
+#define CRC_T10DIF_POLY 0x18bb7
+
+/* x^(F+64) mod P and x^F mod P for fold distances of 512 and 128 bits */
+static uint64_t crc_t10dif_k512[2];
+static uint64_t crc_t10dif_k128[2];
+
+static uint64_t crc_t10dif_xpow_mod(unsigned n)
+{
+    uint32_t v = 1;
+
+    while (n--) {
+        v <<= 1;
+        if (v & 0x10000) {
+            v ^= CRC_T10DIF_POLY;
+        }
+    }
+    return v;
+}
+
+static void crc_t10dif_pclmul_init(void)
+{
+    crc_t10dif_k512[0] = crc_t10dif_xpow_mod(512 + 64);
+    crc_t10dif_k512[1] = crc_t10dif_xpow_mod(512);
+    crc_t10dif_k128[0] = crc_t10dif_xpow_mod(128 + 64);
+    crc_t10dif_k128[1] = crc_t10dif_xpow_mod(128);
+}
+
+static inline __attribute__((target("pclmul,ssse3")))
+__m128i crc_t10dif_load(const uint8_t *buf)
+{
+    const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                                       8, 9, 10, 11, 12, 13, 14, 15);
+
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)buf), bswap);
+}
+
+static inline __attribute__((target("pclmul,ssse3")))
+__m128i crc_t10dif_fold(__m128i x, __m128i k, __m128i d)
+{
+    return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11),
+                                       _mm_clmulepi64_si128(x, k, 0x00)), d);
+}
+
+static __attribute__((target("pclmul,ssse3")))
+uint16_t crc_t10dif_pclmul(uint16_t crc, const uint8_t *buf, size_t len)
+{
+    const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                                       8, 9, 10, 11, 12, 13, 14, 15);
+    const __m128i k512 = _mm_set_epi64x(crc_t10dif_k512[0],
+                                        crc_t10dif_k512[1]);
+    const __m128i k128 = _mm_set_epi64x(crc_t10dif_k128[0],
+                                        crc_t10dif_k128[1]);
+    __m128i x0, x1, x2, x3;
+    uint8_t tmp[16];
+
+    if (len < 16) {
+        return crc_t10dif_generic(crc, buf, len);
+    }
+
+    /* the incoming crc is equivalent to xor'ing it into the first 16 bits */
+    x0 = _mm_xor_si128(crc_t10dif_load(buf),
+                       _mm_set_epi64x((uint64_t)crc << 48, 0));
+    buf += 16;
+    len -= 16;
+
+    if (len >= 48) {
+        x1 = crc_t10dif_load(buf);
+        x2 = crc_t10dif_load(buf + 16);
+        x3 = crc_t10dif_load(buf + 32);
+        buf += 48;
+        len -= 48;
+
+        while (len >= 64) {
+            x0 = crc_t10dif_fold(x0, k512, crc_t10dif_load(buf));
+            x1 = crc_t10dif_fold(x1, k512, crc_t10dif_load(buf + 16));
+            x2 = crc_t10dif_fold(x2, k512, crc_t10dif_load(buf + 32));
+            x3 = crc_t10dif_fold(x3, k512, crc_t10dif_load(buf + 48));
+            buf += 64;
+            len -= 64;
+        }
+
+        x0 = crc_t10dif_fold(x0, k128, x1);
+        x0 = crc_t10dif_fold(x0, k128, x2);
+        x0 = crc_t10dif_fold(x0, k128, x3);
+    }
+
+    while (len >= 16) {
+        x0 = crc_t10dif_fold(x0, k128, crc_t10dif_load(buf));
+        buf += 16;
+        len -= 16;
+    }
+
+    _mm_storeu_si128((__m128i *)tmp, _mm_shuffle_epi8(x0, bswap));
+    crc = crc_t10dif_slice8(0, tmp, sizeof(tmp));
+    return crc_t10dif_slice8(crc, buf, len);
+}
+
+static bool crc_t10dif_has_pclmul(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    return (ecx & bit_PCLMUL) && (ecx & bit_SSSE3);
+}
+
+/* Below this the setup and the final 16 byte table pass outweigh the gain */
+#define CRC_T10DIF_PCLMUL_MIN 64
+
+static uint16_t crc_t10dif_accel(uint16_t crc, const uint8_t *buf, size_t len)
+{
+    if (len < CRC_T10DIF_PCLMUL_MIN) {
+        return crc_t10dif_slice8(crc, buf, len);
+    }
+    return crc_t10dif_pclmul(crc, buf, len);
+}
+#endif
+
+static CrcT10DifFunc *crc_t10dif_fn = crc_t10dif_generic;
+static CrcT10DifFunc *crc_t10dif_pclmul_impl;
+
+CrcT10DifFunc *crc_t10dif_pclmul_fn(void)
+{
+    return crc_t10dif_pclmul_impl;
+}
+
+uint16_t crc_t10dif_update(uint16_t crc, const uint8_t *buf, size_t len)
+{
+    return crc_t10dif_fn(crc, buf, len);
+}
+
+static void __attribute__((constructor)) crc_t10dif_init(void)
+{
+    crc_t10dif_slice8_init();
+    crc_t10dif_fn = crc_t10dif_slice8;
+
+#ifdef CONFIG_PCLMUL
+    if (crc_t10dif_has_pclmul()) {
+        crc_t10dif_pclmul_init();
+        crc_t10dif_pclmul_impl = crc_t10dif_pclmul;
+        crc_t10dif_fn = crc_t10dif_accel;
+    }
+#endif
+}
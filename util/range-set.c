@@ -0,0 +1,288 @@
+/*
+ * Sparse set of integer ranges
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu/range-set.h"
+#include "qemu/osdep.h"
+
+/* Extents live in a treap ordered by start; each node also carries a random
+ * priority that is never lower than its children's, which keeps the tree
+ * balanced in expectation.  Every update is expressed as splits and merges
+ * of whole subtrees, so it only walks a root-to-leaf path.
+ */
+typedef struct RangeNode RangeNode;
+
+struct RangeNode {
+    uint64_t start;
+    uint64_t end;               /* exclusive */
+    uint32_t prio;
+    RangeNode *left;
+    RangeNode *right;
+};
+
+struct RangeSet {
+    RangeNode *root;
+    uint64_t extents;
+    uint64_t count;
+    uint32_t seed;
+};
+
+static uint32_t range_set_rand(RangeSet *rs)
+{
+    /* xorshift32 */
+    rs->seed ^= rs->seed << 13;
+    rs->seed ^= rs->seed >> 17;
+    rs->seed ^= rs->seed << 5;
+    return rs->seed;
+}
+
+static RangeNode *range_node_new(RangeSet *rs, uint64_t start, uint64_t end)
+{
+    RangeNode *node = g_new0(RangeNode, 1);
+
+    node->start = start;
+    node->end = end;
+    node->prio = range_set_rand(rs);
+    rs->extents++;
+    rs->count += end - start;
+    return node;
+}
+
+static void range_node_free_all(RangeSet *rs, RangeNode *node)
+{
+    if (node) {
+        range_node_free_all(rs, node->left);
+        range_node_free_all(rs, node->right);
+        rs->extents--;
+        rs->count -= node->end - node->start;
+        g_free(node);
+    }
+}
+
+/* Split @node into the extents starting before @key and the rest */
+static void range_node_split(RangeNode *node, uint64_t key,
+                             RangeNode **lo, RangeNode **hi)
+{
+    if (!node) {
+        *lo = *hi = NULL;
+    } else if (node->start < key) {
+        range_node_split(node->right, key, &node->right, hi);
+        *lo = node;
+    } else {
+        range_node_split(node->left, key, lo, &node->left);
+        *hi = node;
+    }
+}
+
+/* Join two treaps where every extent of @lo precedes every extent of @hi */
+static RangeNode *range_node_merge(RangeNode *lo, RangeNode *hi)
+{
+    if (!lo) {
+        return hi;
+    }
+    if (!hi) {
+        return lo;
+    }
+    if (lo->prio >= hi->prio) {
+        lo->right = range_node_merge(lo->right, hi);
+        return lo;
+    }
+    hi->left = range_node_merge(lo, hi->left);
+    return hi;
+}
+
+static RangeNode *range_node_last(RangeNode *node)
+{
+    while (node && node->right) {
+        node = node->right;
+    }
+    return node;
+}
+
+/* The extent with the highest start not above @item, if any */
+static const RangeNode *range_node_floor(const RangeNode *node, uint64_t item)
+{
+    const RangeNode *found = NULL;
+
+    while (node) {
+        if (node->start <= item) {
+            found = node;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+    return found;
+}
+
+/* The extent with the lowest start above @item, if any */
+static const RangeNode *range_node_ceil(const RangeNode *node, uint64_t item)
+{
+    const RangeNode *found = NULL;
+
+    while (node) {
+        if (node->start > item) {
+            found = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    return found;
+}
+
+RangeSet *range_set_new(void)
+{
+    RangeSet *rs = g_new0(RangeSet, 1);
+
+    rs->seed = 2463534242u;
+    return rs;
+}
+
+void range_set_free(RangeSet *rs)
+{
+    if (rs) {
+        range_set_clear(rs);
+        g_free(rs);
+    }
+}
+
+void range_set_clear(RangeSet *rs)
+{
+    range_node_free_all(rs, rs->root);
+    rs->root = NULL;
+}
+
+void range_set_add(RangeSet *rs, uint64_t start, uint64_t count)
+{
+    uint64_t end = start + count;
+    RangeNode *lo, *mid, *hi, *last;
+
+    if (!count) {
+        return;
+    }
+
+    range_node_split(rs->root, start, &lo, &hi);
+
+    /* absorb the preceding extent if it reaches @start */
+    last = range_node_last(lo);
+    if (last && last->end >= start) {
+        start = last->start;
+        end = MAX(end, last->end);
+        range_node_split(lo, last->start, &lo, &mid);
+        range_node_free_all(rs, mid);
+    }
+
+    /* and every following extent that begins no later than @end */
+    range_node_split(hi, end + 1, &mid, &hi);
+    last = range_node_last(mid);
+    if (last) {
+        end = MAX(end, last->end);
+        range_node_free_all(rs, mid);
+    }
+
+    rs->root = range_node_merge(range_node_merge(lo,
+        range_node_new(rs, start, end)), hi);
+}
+
+void range_set_remove(RangeSet *rs, uint64_t start, uint64_t count)
+{
+    uint64_t end = start + count;
+    RangeNode *lo, *mid, *hi, *last;
+
+    if (!count) {
+        return;
+    }
+
+    range_node_split(rs->root, start, &lo, &hi);
+
+    /* trim the preceding extent, keeping whatever lies past @end */
+    last = range_node_last(lo);
+    if (last && last->end > start) {
+        uint64_t tail = last->end;
+
+        rs->count -= tail - start;
+        last->end = start;
+        if (tail > end) {
+            hi = range_node_merge(range_node_new(rs, end, tail), hi);
+        }
+    }
+
+    range_node_split(hi, end, &mid, &hi);
+    last = range_node_last(mid);
+    if (last && last->end > end) {
+        hi = range_node_merge(range_node_new(rs, end, last->end), hi);
+    }
+    range_node_free_all(rs, mid);
+
+    rs->root = range_node_merge(lo, hi);
+}
+
+bool range_set_test(const RangeSet *rs, uint64_t item)
+{
+    const RangeNode *node = range_node_floor(rs->root, item);
+
+    return node && item < node->end;
+}
+
+bool range_set_intersects(const RangeSet *rs, uint64_t start, uint64_t count)
+{
+    const RangeNode *node;
+
+    if (!count) {
+        return false;
+    }
+    node = range_node_floor(rs->root, start + count - 1);
+    return node && node->end > start;
+}
+
+uint64_t range_set_run(const RangeSet *rs, uint64_t item, uint64_t max,
+                       bool *in)
+{
+    const RangeNode *node = range_node_floor(rs->root, item);
+
+    if (node && item < node->end) {
+        *in = true;
+        return MIN(node->end - item, max);
+    }
+    *in = false;
+    node = range_node_ceil(rs->root, item);
+    return node ? MIN(node->start - item, max) : max;
+}
+
+uint64_t range_set_extents(const RangeSet *rs)
+{
+    return rs->extents;
+}
+
+uint64_t range_set_count(const RangeSet *rs)
+{
+    return rs->count;
+}
+
+static int range_node_foreach(const RangeNode *node, RangeSetFunc *func,
+                              void *opaque)
+{
+    int ret;
+
+    if (!node) {
+        return 0;
+    }
+    ret = range_node_foreach(node->left, func, opaque);
+    if (!ret) {
+        ret = func(node->start, node->end - node->start, opaque);
+    }
+    if (!ret) {
+        ret = range_node_foreach(node->right, func, opaque);
+    }
+    return ret;
+}
+
+int range_set_foreach(const RangeSet *rs, RangeSetFunc *func, void *opaque)
+{
+    return range_node_foreach(rs->root, func, opaque);
+}